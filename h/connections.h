@@ -15,8 +15,12 @@ void v_poll_daemon( void* pv_parameters );
 void v_connections_daemon( void* pv_parameters );
 void v_handle_local_connection( void* pv_parameters );
 int d_attach_or_connection( uint32_t address, uint16_t port, OnionCircuit* circuit );
-int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port );
+int d_connect_local_backend( LocalBackend* backend, int timeout_ms );
+int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, LocalBackend* backend, bool* tried );
 int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t* data, uint32_t length );
+int d_flush_local_connection( uint32_t circ_id, uint32_t stream_id );
+void v_end_local_connection( uint32_t circ_id, uint32_t stream_id );
+LocalBackend* px_fail_local_connection( uint32_t circ_id, uint32_t stream_id, bool* tried );
 void v_cleanup_local_connection( uint32_t circ_id, uint32_t stream_id );
 void v_cleanup_local_connections_by_circ_id( uint32_t circ_id );
 bool b_verify_or_connection( uint32_t id );
@@ -23,10 +23,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 extern MinitorMutex fastest_cache_mutex;
 
+void v_handle_consensus_refresh( void* pv_parameters );
 void v_handle_relay_fetch( void* pv_parameters );
-void v_handle_crypto_and_insert( void* pv_parameters );
+void v_handle_relay_hash( void* pv_parameters );
+void v_handle_relay_insert( void* pv_parameters );
 int d_get_hs_time_period( time_t fresh_until, time_t valid_after, int hsdir_interval );
 int d_set_next_consenus();
-int d_fetch_consensus_info();
+int d_fetch_consensus_info( bool allow_stale );
+int d_start_consensus_refresh( bool allow_stale );
+void v_start_bootstrap();
+void v_publish_bootstrap_milestones( int milestones );
+bool b_bootstrap_reached( int milestones );
+void v_wait_for_bootstrap( int milestones );
+ConsensusSnapshot* px_acquire_consensus_snapshot();
+void v_release_consensus_snapshot( ConsensusSnapshot* snapshot );
+int d_publish_consensus_snapshot( NetworkConsensus* consensus, RelaySelectionTable* selection_table, HsDirRing* hsdir_ring );
 
 #endif
@@ -0,0 +1,49 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_CONSENSUS_PARSER_H
+#define MINITOR_CONSENSUS_PARSER_H
+
+#include "./structures/consensus.h"
+#include "./tokenizer.h"
+
+// consensus keywords, the index d_match_keyword returns against the table
+// from d_init_consensus_keyword_table
+enum
+{
+  CONSENSUS_KEYWORD_METHOD,
+  CONSENSUS_KEYWORD_VALID_AFTER,
+  CONSENSUS_KEYWORD_FRESH_UNTIL,
+  CONSENSUS_KEYWORD_VALID_UNTIL,
+  CONSENSUS_KEYWORD_SHARED_RAND_CURRENT,
+  CONSENSUS_KEYWORD_SHARED_RAND_PREVIOUS,
+  CONSENSUS_KEYWORD_DIR_SOURCE,
+  CONSENSUS_KEYWORD_R,
+  CONSENSUS_KEYWORD_S,
+  CONSENSUS_KEYWORD_PR,
+  CONSENSUS_KEYWORD_W,
+  CONSENSUS_KEYWORD_BANDWIDTH_WEIGHTS,
+  CONSENSUS_KEYWORD_COUNT,
+};
+
+int d_init_consensus_keyword_table( KeywordTable* table );
+int d_parse_line_to_consensus( NetworkConsensus* consensus, int keyword, TokenSlice* arguments );
+int d_parse_line_to_relay( OnionRelay* relay, int keyword, TokenSlice* arguments );
+void v_parse_bandwidth_weights( BandwidthWeights* weights, TokenSlice* arguments );
+
+#endif
@@ -30,6 +30,54 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define HSDIR_N_REPLICAS_DEFAULT 2
 #define HSDIR_SPREAD_STORE_DEFAULT 4
 
+#define RELAY_SELECTION_ATTEMPTS 8
+#define BANDWIDTH_WEIGHT_SCALE 10000
+
+#define BUFFERED_FILE_BLOCK_SIZE 16384
+
+#define RELAY_BATCH_SIZE 8
+#define HASH_WORKER_MAX 4
+
+#define BOOTSTRAP_MIN_GUARDS 20
+#define BOOTSTRAP_MIN_MIDDLES 60
+#define BOOTSTRAP_MILESTONE_COUNT 4
+#define BOOTSTRAP_HSDIR_RETRY_MS 5000
+
+#define RELAY_DB_MAGIC 0x6d726462
+#define RELAY_DB_VERSION 2
+#define RELAY_DB_POLL_MS 5000
+
+#define RELAY_TABLE_MAGIC 0x6d726c74
+#define HSDIR_INDEX_MAGIC 0x6d686978
+#define RELAY_TABLE_VERSION 1
+#define RELAY_TABLE_HEADER_SIZE 24
+#define RELAY_TABLE_VALID_UNTIL_OFFSET 16
+#define RELAY_RECORD_SIZE 181
+#define RELAY_COLD_RECORD_SIZE 92
+
+#define DIR_STREAM_MAX 8
+#define DIR_STREAM_WINDOW 500
+#define DIR_STREAM_SENDME_INCREMENT 50
+#define DIR_CIRCUIT_SENDME_INCREMENT 100
+#define DIR_STREAM_POLL_MS 10
+
+#define STREAM_WINDOW_START 500
+#define STREAM_SENDME_INCREMENT 50
+// most queued slices handed to one sendmsg
+#define LOCAL_FLUSH_IOV 16
+// how long a stream handler waits on its socket before checking for queued output
+#define LOCAL_FLUSH_POLL_MS 50
+// how long an ended stream gets to write its queue and see the backend close
+#define LOCAL_END_LINGER_MS 10000
+#define HS_MAX_BACKENDS 16
+#define LOCAL_BACKEND_PATH_LENGTH 108
+#define LOCAL_BACKEND_CONNECT_TIMEOUT_MS 1000
+
+#define TOKENIZER_BLOCK_SIZE 4096
+#define TOKENIZER_LINE_LIMIT 512
+#define KEYWORD_TABLE_SLOTS 32
+#define KEYWORD_TABLE_SEED_ATTEMPTS 4096
+
 #define SERVER_STR "Server"
 #define SERVER_STR_LENGTH 6
 
@@ -62,6 +110,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define HS_ED_BASEPOINT_LENGTH 158
 #define HS_DESC_SIG_PREFIX "Tor onion service descriptor sig v3"
 #define HS_DESC_SIG_PREFIX_LENGTH 35
+#define HS_DESC_ARENA_SIZE 8192
+#define HSDIR_UPLOAD_MAX_ATTEMPTS 3
+#define HS_MAX_INTRO_POINTS 20
+// guard and middle, a rendezvous extends them to the rendezvous point
+#define REND_STEM_LENGTH 2
+// single onion services build intro and rendezvous circuits straight to the relay
+#define SINGLE_ONION_CIRCUIT_LENGTH 1
+// the pool covers the introductions expected while a stem is being built
+#define REND_POOL_REFILL_SECONDS 10
+#define REND_LATENCY_SAMPLES 128
+// signed descriptors are reused this long, the certs in them last 3 hours
+#define HS_DESC_REUSE_SECONDS 3600
+// extends are RELAY_EARLY cells and a circuit only gets 8, the build uses 2
+#define HSDIR_STEM_MAX_TRUNCATES 6
+// replay entries live between one and REPLAY_CACHE_BUCKETS buckets, a bucket
+// is also rotated early once it is 3/4 full, slots must be a power of two
+#define REPLAY_CACHE_BUCKETS 2
+#define REPLAY_CACHE_BUCKET_SECONDS 300
+#define REPLAY_CACHE_SLOTS 128
+#define REPLAY_DIGEST_LENGTH 16
 
 #define HSDIR_TREE_ROOT 0
 
@@ -69,5 +137,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define SHARED_RANDOM_N_PHASES 2
 
 #define WATCHDOG_TIMEOUT_PERIOD 30
+// timed out circuits rebuilt per pass of the watchdog scan
+#define WATCHDOG_TIMEOUT_BATCH 20
 
 #endif
@@ -9,9 +9,10 @@ void v_send_init_circuit_internal( int length, CircuitStatus target_status, Onio
 void v_send_init_circuit_external( int length, CircuitStatus target_status, OnionService* service, OnionClient* client, int desc_index, int target_relay_index, OnionRelay* start_relay, OnionRelay* end_relay, HsCrypto* hs_crypto, IntroCrypto* intro_crypto );
 void v_circuit_rebuild_or_destroy( OnionCircuit* circuit, DlConnection* or_connection );
 void v_circuit_remove_destroy( OnionCircuit* circuit, DlConnection* or_connection );
+void v_retire_intro_circuit( OnionCircuit* circuit );
 void v_minitor_daemon( void* pv_parameters );
 void v_set_hsdir_timer( MinitorTimer hsdir_timer );
-int d_get_standby_count();
+void v_fill_rend_pool( OnionService* service );
 
 extern MinitorTimer keepalive_timer;
 extern MinitorTimer timeout_timer;
@@ -0,0 +1,38 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_DIR_CLIENT_H
+#define MINITOR_DIR_CLIENT_H
+
+#include "./structures/dir_client.h"
+#include "./structures/connections.h"
+#include "./structures/circuit.h"
+#include "./structures/cell.h"
+
+DirClient* px_create_dir_client();
+void v_destroy_dir_client( DirClient* dir_client );
+int d_open_dir_stream( DirClient* dir_client );
+int d_write_dir_stream( DirClient* dir_client, int stream_id, const uint8_t* write_buf, int length );
+int d_read_dir_stream( DirClient* dir_client, int stream_id, uint8_t* read_buf, int length );
+bool b_dir_stream_readable( DirClient* dir_client, int stream_id );
+void v_close_dir_stream( DirClient* dir_client, int stream_id );
+void v_dir_client_ready( OnionCircuit* circuit );
+void v_dir_client_closed( DirClient* dir_client );
+void v_dir_client_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* cell );
+
+#endif
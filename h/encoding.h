@@ -19,7 +19,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef ENCODING_H
 #define ENCODING_H
 
+#include <stdint.h>
+
+#define ENCODING_INVALID 0xff
+
+// carries a partial base64 group between chunks of a streamed decode
+typedef struct Base64Decoder
+{
+  uint32_t bits;
+  int bit_count;
+} Base64Decoder;
+
 int d_base_64_decode( uint8_t* destination, char* source, int source_length );
+void v_init_base_64_decoder( Base64Decoder* decoder );
+int d_base_64_decode_update( Base64Decoder* decoder, uint8_t* destination, char* source, int source_length );
 void v_base_64_encode( char* destination, unsigned char* source, int source_length );
 void v_base_32_decode( uint8_t* destination, char* source, int source_length );
 void v_base_32_encode( char* destination, unsigned char* source, int source_length );
@@ -0,0 +1,45 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_MODELS_BUFFERED_FILE_H
+#define MINITOR_MODELS_BUFFERED_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// long lived writer that batches small records into BUFFERED_FILE_BLOCK_SIZE
+// writes, flushed_length is how much of the file has actually hit the fd
+typedef struct BufferedFile
+{
+  int fd;
+  const char* filename;
+  uint8_t* buffer;
+  int length;
+  off_t flushed_length;
+} BufferedFile;
+
+#define BUFFERED_FILE_INITIALIZER { .fd = -1, .filename = NULL, .buffer = NULL, .length = 0, .flushed_length = 0 }
+
+int d_open_buffered_file( BufferedFile* file, const char* filename );
+int d_write_buffered_file( BufferedFile* file, const void* data, int length );
+int d_write_buffered_file_at( BufferedFile* file, const void* data, int length, off_t offset );
+int d_flush_buffered_file( BufferedFile* file );
+int d_close_buffered_file( BufferedFile* file );
+int d_commit_buffered_file( BufferedFile* file, const char* final_filename );
+
+#endif
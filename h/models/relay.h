@@ -2,6 +2,7 @@
 #define MINITOR_MODELS_RELAY_H
 
 #include "../structures/consensus.h"
+#include "relay_table.h"
 
 typedef struct AvlBlock
 {
@@ -17,10 +18,91 @@ typedef struct BinaryRelay
   OnionRelay relay;
 } BinaryRelay;
 
+// entry in the sorted on disk hsdir ring, relay_index points into hsdir_list
+typedef struct HsDirIndexEntry
+{
+  uint8_t hash[H_LENGTH];
+  uint32_t relay_index;
+} HsDirIndexEntry;
+
+// leads each on disk hsdir ring index, an index is only used with the ring
+// and the hsdir_list it was sorted from
+typedef struct HsDirIndexHeader
+{
+  uint32_t magic;
+  uint32_t current;
+  uint32_t count;
+  uint32_t reserved;
+  int64_t valid_until;
+} HsDirIndexHeader;
+
+typedef enum RelayPosition
+{
+  RELAY_POSITION_GUARD,
+  RELAY_POSITION_MIDDLE,
+  RELAY_POSITION_DIR,
+} RelayPosition;
+
+// walker alias table over the relays eligible for one position, indexes
+// points into the relay array the table was built from
+typedef struct RelayAliasTable
+{
+  uint32_t count;
+  uint32_t* indexes;
+  double* probabilities;
+  uint32_t* aliases;
+} RelayAliasTable;
+
+// in memory copy of the live fast and cache lists used for path selection,
+// each position samples its own bandwidth weighted alias table
+struct RelaySelectionTable
+{
+  atomic_int references;
+  OnionRelay* fast_relays;
+  uint32_t fast_count;
+  OnionRelay* cache_relays;
+  uint32_t cache_count;
+  RelayAliasTable guard_table;
+  RelayAliasTable middle_table;
+  RelayAliasTable cache_table;
+};
+
+// the mapped hsdir table and its two sorted ring indexes, indexes point past
+// the header of index_maps and are indexed by current, 0 is sorted by
+// id_hash_previous, 1 by id_hash
+struct HsDirRing
+{
+  atomic_int references;
+  RelayTable list;
+  uint32_t count;
+  uint8_t* index_maps[2];
+  size_t index_map_sizes[2];
+  const HsDirIndexEntry* indexes[2];
+};
+
+// the parts of a server descriptor we keep, persisted by descriptor digest
+// so a refresh only fetches descriptors that changed
+typedef struct DescriptorCacheEntry
+{
+  uint8_t digest[ID_LENGTH];
+  uint8_t identity[ID_LENGTH];
+  uint8_t master_key[H_LENGTH];
+  uint8_t ntor_onion_key[H_LENGTH];
+} DescriptorCacheEntry;
+
+// open addressed index over the cache entries, slots hold index plus one
+typedef struct DescriptorCache
+{
+  DescriptorCacheEntry* entries;
+  uint32_t count;
+  uint32_t* slots;
+  uint32_t slot_mask;
+} DescriptorCache;
+
 int d_create_hsdir_relay( OnionRelay* onion_relay );
 int d_create_cache_relay( OnionRelay* onion_relay );
 int d_create_fast_relay( OnionRelay* onion_relay );
-DoublyLinkedOnionRelayList* px_get_responsible_hsdir_relays_by_hs_index( uint8_t* hs_index, int desired_count, int current, DoublyLinkedOnionRelayList* used_relays );
+DoublyLinkedOnionRelayList* px_get_responsible_hsdir_relays_by_hs_index( HsDirRing* hsdir_ring, uint8_t* hs_index, int desired_count, int current, DoublyLinkedOnionRelayList* used_relays );
 OnionRelay* px_get_random_cache_relay( bool staging );
 OnionRelay* px_get_random_fast_relay( bool want_guard, DoublyLinkedOnionRelayList* relay_list, uint8_t* exclude_start, uint8_t* exclude_end );
 OnionRelay* px_get_cache_relay_by_identity( uint8_t* identity, bool staging );
@@ -39,9 +121,19 @@ int d_get_fast_relay_valid_until();
 int d_set_staging_hsdir_relay_valid_until( time_t valid_until );
 int d_set_staging_cache_relay_valid_until( time_t valid_until );
 int d_set_staging_fast_relay_valid_until( time_t valid_until );
+int d_set_staging_bandwidth_weights( BandwidthWeights* weights );
 int d_load_hsdir_relay_count();
 int d_load_cache_relay_count();
 int d_load_fast_relay_count();
-int d_finalize_staged_relay_lists();
+int d_finalize_staged_relay_lists( NetworkConsensus* consensus );
+int d_load_relay_tables( NetworkConsensus* consensus );
+int d_load_descriptor_cache( DescriptorCache* cache );
+bool b_resolve_relay_descriptor( DescriptorCache* cache, OnionRelay* onion_relay );
+void v_free_descriptor_cache( DescriptorCache* cache );
+int d_load_provisional_relay_selection_table( OnionRelay* fast_relays, uint32_t fast_count );
+void v_retain_relay_selection_table( RelaySelectionTable* table );
+void v_release_relay_selection_table( RelaySelectionTable* table );
+void v_retain_hsdir_ring( HsDirRing* hsdir_ring );
+void v_release_hsdir_ring( HsDirRing* hsdir_ring );
 
 #endif
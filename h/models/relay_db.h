@@ -0,0 +1,45 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_MODELS_RELAY_DB_H
+#define MINITOR_MODELS_RELAY_DB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// header of the host wide relay database, the consensus and relay lists next
+// to it are shared by every process using the same FILESYSTEM_PREFIX, one
+// owner refreshes them and bumps generation, the others only read them
+typedef struct RelayDbHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t relay_size;
+  uint32_t generation;
+} RelayDbHeader;
+
+bool b_relay_db_owner();
+bool b_relay_db_compatible();
+uint32_t ul_get_relay_db_generation();
+bool b_relay_db_changed();
+int d_begin_relay_db_read();
+void v_end_relay_db_read( bool loaded );
+int d_begin_relay_db_commit();
+int d_end_relay_db_commit( bool committed );
+
+#endif
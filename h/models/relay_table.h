@@ -0,0 +1,83 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_MODELS_RELAY_TABLE_H
+#define MINITOR_MODELS_RELAY_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../structures/consensus.h"
+
+// relay lists are staged as packed rows while a consensus streams in and
+// committed as columns, both start with the same big endian header so they
+// don't depend on the compiler that wrote them
+typedef enum RelayTableLayout
+{
+  RELAY_TABLE_ROWS = 1,
+  RELAY_TABLE_COLUMNS = 2,
+} RelayTableLayout;
+
+typedef enum RelayFlag
+{
+  RELAY_FLAG_SUITABLE,
+  RELAY_FLAG_HSDIR,
+  RELAY_FLAG_DIR_CACHE,
+  RELAY_FLAG_CAN_GUARD,
+  RELAY_FLAG_CAN_EXIT,
+  RELAY_FLAG_COUNT,
+} RelayFlag;
+
+typedef struct RelayTableHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t layout;
+  uint32_t count;
+  time_t valid_until;
+} RelayTableHeader;
+
+// a mapped column table, ring scans only walk the dense hash and identity
+// columns, the keys and addresses a circuit needs are in the cold records
+typedef struct RelayTable
+{
+  uint8_t* map;
+  size_t map_size;
+  uint32_t count;
+  time_t valid_until;
+  const uint8_t* id_hashes;
+  const uint8_t* id_hashes_previous;
+  const uint8_t* identities;
+  const uint8_t* flags[RELAY_FLAG_COUNT];
+  const uint8_t* bandwidths;
+  const uint8_t* cold_records;
+} RelayTable;
+
+void v_pack_relay_table_header( uint8_t* buffer, RelayTableLayout layout, uint32_t count, time_t valid_until );
+int d_unpack_relay_table_header( RelayTableHeader* header, const uint8_t* buffer );
+int d_read_relay_table_header( const char* filename, RelayTableHeader* header );
+void v_pack_relay_record( uint8_t* record, OnionRelay* onion_relay );
+void v_unpack_relay_record( OnionRelay* onion_relay, const uint8_t* record );
+int d_write_relay_table( const char* rows_filename, const char* table_filename );
+int d_map_relay_table( RelayTable* table, const char* filename );
+void v_unmap_relay_table( RelayTable* table );
+bool b_relay_table_flag( RelayTable* table, RelayFlag flag, uint32_t index );
+void v_get_relay_table_row( RelayTable* table, uint32_t index, OnionRelay* onion_relay );
+
+#endif
@@ -30,6 +30,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 //void v_handle_onion_service( void* pv_parameters );
 void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection* or_connection, ServiceTcpTraffic* tcp_traffic );
+void v_check_service_backends( void* pv_parameters );
+void v_onion_service_handle_local_writable( OnionCircuit* circuit, DlConnection* or_connection, ServiceTcpTraffic* tcp_traffic );
+void v_onion_service_handle_local_connected( OnionCircuit* circuit, ServiceTcpTraffic* tcp_traffic );
 void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell );
 int d_onion_service_handle_relay_data( OnionService* onion_service, Cell* unpacked_cell );
 int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* begin_cell );
@@ -38,15 +41,21 @@ int d_onion_service_handle_relay_truncated( OnionCircuit* rend_circuit, DlConnec
 void v_handle_local( void* pv_parameters );
 int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* unpacked_cell );
 int d_router_join_rendezvous( OnionCircuit* rend_circuit, DlConnection* or_connection, unsigned char* rendezvous_cookie, unsigned char* hs_pub_key, unsigned char* auth_input_mac );
+void v_record_rend_latency( OnionService* service, uint32_t latency_ms );
+void v_log_rend_latency( OnionService* service );
 int d_verify_and_decrypt_introduce_2( OnionService* onion_service, Cell* introduce_cell, uint8_t num_extensions, uint8_t* client_pk, uint8_t* encrypted_data, OnionCircuit* intro_circuit, curve25519_key* client_handshake_key );
 int d_hs_ntor_handshake_finish( uint8_t* auth_pub_key, curve25519_key* encrypt_key, curve25519_key* hs_handshake_key, curve25519_key* client_handshake_key, HsCrypto* hs_crypto, uint8_t* auth_input_mac, bool is_client );
-DoublyLinkedOnionRelayList* px_get_target_relays( unsigned int hsdir_n_replicas, unsigned char* blinded_pub_key, int time_period, unsigned int hsdir_interval, unsigned int hsdir_spread_store, int next );
+DoublyLinkedOnionRelayList* px_get_target_relays( HsDirRing* hsdir_ring, unsigned int hsdir_n_replicas, unsigned char* blinded_pub_key, int time_period, unsigned int hsdir_interval, unsigned int hsdir_spread_store, int next );
 //int d_send_descriptors( unsigned char* descriptor_text, int descriptor_length, DoublyLinkedOnionRelayList* target_relays );
 //int d_post_descriptor( unsigned char* descriptor_text, int descriptor_length, OnionCircuit* publish_circuit );
-int d_generate_outer_descriptor( char* filename, ed25519_key* descriptor_signing_key, long int valid_after, ed25519_key* blinded_key, int revision_counter );
-int d_generate_first_plaintext( char* filename );
-int d_encrypt_descriptor_plaintext( char* filename, unsigned char* secret_data, int secret_data_length, const char* string_constant, int string_constant_length, unsigned char* sub_credential, int64_t revision_counter );
-int d_generate_second_plaintext( char* filename, OnionCircuit** intro_circuits, long int valid_after, ed25519_key* descriptor_signing_key );
+void v_retain_hs_descriptor( HsDescriptor* hs_desc );
+void v_release_hs_descriptor( HsDescriptor* hs_desc );
+void v_free_hs_desc_arena( HsDescArena* arena );
+HsDescriptor* px_finish_hs_descriptor( HsDescArena* arena, int offset );
+int d_generate_outer_descriptor( HsDescArena* arena, int cipher_offset, ed25519_key* descriptor_signing_key, long int valid_after, ed25519_key* blinded_key, int revision_counter );
+int d_generate_first_plaintext( HsDescArena* arena, int cipher_offset );
+int d_encrypt_descriptor_plaintext( HsDescArena* arena, int offset, unsigned char* secret_data, int secret_data_length, const char* string_constant, int string_constant_length, unsigned char* sub_credential, int64_t revision_counter );
+int d_generate_second_plaintext( HsDescArena* arena, OnionCircuit** intro_circuits, int intro_count, bool single_onion, long int valid_after, ed25519_key* descriptor_signing_key );
 void v_generate_packed_link_specifiers( OnionRelay* relay, unsigned char* packed_link_specifiers );
 int d_generate_packed_crosscert( char* destination, unsigned char* certified_key, ed25519_key* signing_key, unsigned char cert_type, uint8_t cert_key_type, long int valid_after );
 void v_ed_pubkey_from_curve_pubkey( unsigned char* output, const unsigned char* input, int sign_bit );
@@ -56,6 +65,9 @@ int d_generate_hs_keys( OnionService* onion_service, const char* onion_service_d
 int d_begin_hsdir( OnionCircuit* publish_circuit, DlConnection* or_connection );
 int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection );
 int d_push_hsdir();
-void v_cleanup_service_hs_data( OnionService* service, int desc_index );
+HsDirUpload* px_claim_hsdir_upload( OnionService* service, int* desc_index, int* upload_index );
+void v_start_hsdir_uploads( OnionService* service );
+bool b_finish_hsdir_upload( OnionService* service, int desc_index, int upload_index, OnionRelay* retry_relay );
+void v_cleanup_service_hs_data( OnionService* service );
 
 #endif
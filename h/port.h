@@ -12,6 +12,8 @@
 #include "fcntl.h"
 #include "unistd.h"
 #include "sys/socket.h"
+#include "sys/uio.h"
+#include "sys/un.h"
 #include "sys/ioctl.h"
 #include "sys/stat.h"
 #include "netinet/in.h"
@@ -29,7 +31,10 @@ bool b_create_core_task( MinitorTask* handle );
 bool b_create_connections_task( MinitorTask* handle );
 bool b_create_poll_task( MinitorTask* handle );
 bool b_create_local_connection_handler( MinitorTask* handle, void* local_connection );
+bool b_create_backend_check_task( MinitorTask* handle, void* service );
+bool b_create_consensus_task( MinitorTask* handle );
 bool b_create_fetch_task( MinitorTask* handle, void* consensus );
+bool b_create_hash_task( MinitorTask* handle, void* consensus );
 bool b_create_insert_task( MinitorTask* handle, void* consensus );
 void port_task_delete( MinitorTask task );
 
@@ -46,7 +51,9 @@ bool port_queue_dequeue_nonblocking( MinitorQueue queue, void** pointer );
 int port_messages_waiting( MinitorQueue queue );
 void port_queue_delete( MinitorQueue queue );
 
+int port_core_count();
 int port_random();
+uint32_t port_time_ms();
 void port_fill_random( uint8_t* dest, int length );
 
 #define MINITOR_MUTEX_CREATE() port_mutex_create()
@@ -71,10 +78,12 @@ void port_fill_random( uint8_t* dest, int length );
 
 #define MINITOR_TASK_DELETE( task ) port_task_delete( task )
 
+#define MINITOR_CORE_COUNT() port_core_count()
 #define MINITOR_RANDOM() port_random()
 #define MINITOR_FILL_RANDOM( dest, length ) port_fill_random( dest, length )
 
 #define MINITOR_GET_TIME() time( NULL )
+#define MINITOR_GET_TIME_MS() port_time_ms()
 
 #define MINITOR_GET_READABLE( sockfd, readable ) ioctl( sockfd, FIONREAD, readable )
 
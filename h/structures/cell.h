@@ -458,6 +458,13 @@ typedef union __attribute__((__packed__)) CellPayload
         uint8_t extensions[];
       } intro_ack;
 
+      struct __attribute__((__packed__))
+      {
+        uint8_t version;
+        uint16_t data_length;
+        uint8_t digest[20];
+      } sendme;
+
       uint8_t destroy_code;
 
       uint8_t data[RELAY_PAYLOAD_LEN];
@@ -56,12 +56,26 @@ typedef enum CircuitStatus
   CIRCUIT_CLIENT_RENDEZVOUS,
   CIRCUIT_CILENT_RENDEZVOUS_ESTABLISHED,
   CIRCUIT_CLIENT_RENDEZVOUS_LIVE,
+  CIRCUIT_DIR,
+  CIRCUIT_DIR_LIVE,
 } CircuitStatus;
 
+// a retiring intro is still listed in the published descriptor, once a
+// descriptor without it goes out it is unlisted and can be closed
+typedef enum IntroState
+{
+  INTRO_ACTIVE,
+  INTRO_RETIRING,
+  INTRO_UNLISTED,
+} IntroState;
+
 typedef struct IntroCrypto
 {
   ed25519_key auth_key;
   curve25519_key encrypt_key;
+  IntroState state;
+  int introductions;
+  time_t live_since;
 } IntroCrypto;
 
 typedef struct HsCrypto
@@ -73,6 +87,7 @@ typedef struct HsCrypto
   uint8_t rendezvous_cookie[20];
   uint8_t point[PK_PUBKEY_LEN];
   uint8_t auth_input_mac[MAC_LEN];
+  uint32_t intro_ms;
 } HsCrypto;
 
 typedef struct OnionCircuit
@@ -91,6 +106,7 @@ typedef struct OnionCircuit
   IntroCrypto* intro_crypto;
   OnionService* service;
   struct OnionClient* client;
+  struct DirClient* dir_client;
   int desc_index;
   int target_relay_index;
   int relay_early_count;
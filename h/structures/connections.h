@@ -24,7 +24,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "wolfssl/ssl.h"
 #include "wolfssl/wolfcrypt/rsa.h"
 
+#include <stdatomic.h>
+
 #include "../port.h"
+#include "../constants.h"
 
 typedef enum ConnectionStatus
 {
@@ -37,6 +40,29 @@ typedef enum ConnectionStatus
 
 #define RING_BUF_LEN 30
 
+// where an onion service sends its streams, address is in network order,
+// active_streams is dropped by whichever task cleans up the stream and
+// healthy is written by both the core task and the health check task
+typedef struct LocalBackend
+{
+  bool is_unix;
+  uint32_t address;
+  uint16_t port;
+  char path[LOCAL_BACKEND_PATH_LENGTH];
+  atomic_int active_streams;
+  atomic_bool healthy;
+} LocalBackend;
+
+// a RELAY_DATA payload waiting for a local backend, offset is how much of it
+// has already been written
+typedef struct LocalSlice
+{
+  struct LocalSlice* next;
+  int length;
+  int offset;
+  uint8_t data[];
+} LocalSlice;
+
 typedef struct DlConnection
 {
   uint32_t conn_id;
@@ -65,6 +91,26 @@ typedef struct DlConnection
   uint32_t cell_ring_end;
   uint8_t* cell_ring_buf[RING_BUF_LEN];
   uint8_t master_secret[48];
+  // local streams only, output is written by the core task and the handler
+  // task asks for a flush once the socket is writable, the handler only
+  // reads the atomics
+  LocalSlice* out_head;
+  LocalSlice* out_tail;
+  atomic_int out_bytes;
+  // RELAY_DATA cells taken since the last stream SENDME we sent
+  int unacked_cells;
+  atomic_bool flush_pending;
+  LocalBackend* backend;
+  // backends this stream already tried, only the core task touches it
+  bool tried_backends[HS_MAX_BACKENDS];
+  // set until the handler task finishes the connect to the backend
+  atomic_bool connecting;
+  // held by the connection list and the handler task, the last one closes
+  // the socket and frees the connection
+  atomic_int refs;
+  atomic_bool closing;
+  // the client ended the stream, the handler task writes out the queue
+  atomic_bool ending;
 } DlConnection;
 
 void v_add_connection_to_list( DlConnection* connection, DlConnection** list );
@@ -19,6 +19,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef MINITOR_STRUCTURES_CONSENSUS_H
 #define MINITOR_STRUCTURES_CONSENSUS_H
 
+#include <stdatomic.h>
+
 #include "wolfssl/options.h"
 
 #include "wolfssl/wolfcrypt/sha.h"
@@ -29,6 +31,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../constants.h"
 
 typedef struct DoublyLinkedOnionRelay DoublyLinkedOnionRelay;
+typedef struct RelaySelectionTable RelaySelectionTable;
+typedef struct HsDirRing HsDirRing;
+
+// consensus bandwidth-weights for the positions we build, scaled by
+// BANDWIDTH_WEIGHT_SCALE, g is guard, m is middle and b is begindir
+typedef struct BandwidthWeights {
+  int32_t wgg;
+  int32_t wgd;
+  int32_t wmg;
+  int32_t wmm;
+  int32_t wme;
+  int32_t wmd;
+  int32_t wbg;
+  int32_t wbm;
+  int32_t wbe;
+  int32_t wbd;
+} BandwidthWeights;
 
 typedef struct NetworkConsensus {
   unsigned int method;
@@ -41,8 +60,19 @@ typedef struct NetworkConsensus {
   unsigned int hsdir_n_replicas;
   unsigned int hsdir_spread_store;
   int time_period;
+  BandwidthWeights bandwidth_weights;
 } NetworkConsensus;
 
+// an immutable view of one consensus and the relay tables built from it,
+// readers take a reference with px_acquire_consensus_snapshot and the last
+// release frees it, a refresh publishes a whole new snapshot
+typedef struct ConsensusSnapshot {
+  atomic_int references;
+  NetworkConsensus consensus;
+  RelaySelectionTable* selection_table;
+  HsDirRing* hsdir_ring;
+} ConsensusSnapshot;
+
 typedef struct OnionRelay {
   unsigned char identity[ID_LENGTH];
   unsigned char digest[ID_LENGTH];
@@ -58,8 +88,27 @@ typedef struct OnionRelay {
   bool dir_cache;
   bool can_guard;
   bool can_exit;
+  uint32_t bandwidth;
 } OnionRelay;
 
+// relays travel from the fetch tasks through the hash workers to the insert
+// task in groups, one queue operation per hop per batch
+typedef struct RelayBatch {
+  int count;
+  OnionRelay* relays[RELAY_BATCH_SIZE];
+} RelayBatch;
+
+// bootstrap milestones, published once each as the first consensus comes in
+typedef enum BootstrapMilestone {
+  BOOTSTRAP_ENOUGH_GUARDS = 1 << 0,
+  BOOTSTRAP_ENOUGH_MIDDLES = 1 << 1,
+  BOOTSTRAP_HSDIR_RING = 1 << 2,
+  BOOTSTRAP_FIRST_INTRO = 1 << 3,
+} BootstrapMilestone;
+
+#define BOOTSTRAP_PATH_SELECTION ( BOOTSTRAP_ENOUGH_GUARDS | BOOTSTRAP_ENOUGH_MIDDLES )
+#define BOOTSTRAP_ALL ( BOOTSTRAP_PATH_SELECTION | BOOTSTRAP_HSDIR_RING )
+
 typedef struct RelayCrypto {
   wc_Sha running_sha_forward;
   wc_Sha running_sha_backward;
@@ -85,11 +134,17 @@ typedef struct DoublyLinkedOnionRelayList {
 void v_add_relay_to_list( DoublyLinkedOnionRelay* node, DoublyLinkedOnionRelayList* list );
 void v_pop_relay_from_list_back( DoublyLinkedOnionRelayList* list );
 OnionRelay* px_get_relay_by_index( DoublyLinkedOnionRelayList* list, int index );
+void v_set_default_bandwidth_weights( BandwidthWeights* weights );
 
-// shared state must be protected by mutex
-extern NetworkConsensus network_consensus;
+extern const NetworkConsensus default_network_consensus;
+// serializes snapshot publishers and the refresh task, readers never take it
 extern MinitorMutex network_consensus_mutex;
+// held only to load current_snapshot and take a reference, or to swap it
+extern MinitorMutex snapshot_mutex;
 extern MinitorMutex crypto_insert_finish;
+extern MinitorMutex relay_batch_mutex;
+extern MinitorMutex bootstrap_mutex;
+extern MinitorQueue bootstrap_queue;
 extern MinitorTimer consensus_timer;
 extern MinitorTimer consensus_valid_timer;
 
@@ -0,0 +1,47 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_STRUCTURES_DIR_CLIENT_H
+#define MINITOR_STRUCTURES_DIR_CLIENT_H
+
+#include <stdbool.h>
+
+#include "./consensus.h"
+#include "./circuit.h"
+
+typedef struct DirStream
+{
+  MinitorQueue queue;
+  bool ended;
+  int data_cells;
+  uint8_t* leftover;
+  int leftover_offset;
+  int leftover_length;
+} DirStream;
+
+// one hop circuit to a directory cache that carries BEGIN_DIR streams, tor
+// never uses stream 0 so its queue carries the circuit events instead
+typedef struct DirClient
+{
+  struct OnionCircuit* circuit;
+  uint32_t address;
+  int data_cells;
+  DirStream streams[DIR_STREAM_MAX];
+} DirClient;
+
+#endif
@@ -26,6 +26,8 @@ typedef enum OnionMessageType
 {
   TOR_CELL,
   SERVICE_TCP_DATA,
+  SERVICE_TCP_WRITABLE,
+  SERVICE_TCP_CONNECTED,
   CONN_HANDSHAKE,
   CONN_READY,
   CONN_CLOSE,
@@ -40,6 +42,7 @@ typedef enum OnionMessageType
   CLIENT_RELAY_DATA,
   CLIENT_RELAY_END,
   CLIENT_CLOSED,
+  DIR_CIRCUIT_READY,
 } OnionMessageType;
 
 typedef struct OnionMessage
@@ -72,6 +75,7 @@ typedef struct CreateCircuitRequest
   char* onion_address;
   uint16_t onion_port;
   MinitorQueue client_queue;
+  struct DirClient* dir_client;
 } CreateCircuitRequest;
 
 #endif
@@ -25,18 +25,71 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "wolfssl/wolfcrypt/ed25519.h"
 
 #include "./consensus.h"
+#include "./connections.h"
 
-typedef struct DoublyLinkedRendezvousCookie {
-  unsigned char rendezvous_cookie[20];
-  struct DoublyLinkedRendezvousCookie* next;
-  struct DoublyLinkedRendezvousCookie* previous;
-} DoublyLinkedRendezvousCookie;
+// open addressed sets of keyed digests, one per time bucket, current is
+// the bucket being filled and the oldest is wiped when it rotates, an all
+// zero digest marks an empty slot
+typedef struct ReplayCache
+{
+  uint8_t key[REPLAY_DIGEST_LENGTH];
+  time_t bucket_start;
+  int current;
+  int counts[REPLAY_CACHE_BUCKETS];
+  uint8_t slots[REPLAY_CACHE_BUCKETS][REPLAY_CACHE_SLOTS][REPLAY_DIGEST_LENGTH];
+} ReplayCache;
+
+// a descriptor is built layer by layer in one growable buffer, layers are
+// addressed by offset since growing can move it
+typedef struct HsDescArena
+{
+  uint8_t* data;
+  int length;
+  int capacity;
+} HsDescArena;
 
-typedef struct DoublyLinkedRendezvousCookieList {
+// a signed descriptor ready to upload, starting with HS_DESC_SIG_PREFIX,
+// the service and every upload in flight hold a reference
+typedef struct HsDescriptor
+{
+  atomic_int references;
+  uint8_t* data;
   int length;
-  DoublyLinkedRendezvousCookie* head;
-  DoublyLinkedRendezvousCookie* tail;
-} DoublyLinkedRendezvousCookieList;
+} HsDescriptor;
+
+typedef enum HsDirUploadStatus
+{
+  HSDIR_UPLOAD_PENDING,
+  HSDIR_UPLOAD_IN_FLIGHT,
+  HSDIR_UPLOAD_DONE,
+  HSDIR_UPLOAD_FAILED,
+} HsDirUploadStatus;
+
+// one slot per target hsdir, relay is handed to the next upload circuit and
+// is NULL while one is in flight
+typedef struct HsDirUpload
+{
+  OnionRelay* relay;
+  uint8_t identity[ID_LENGTH];
+  uint8_t status;
+  uint8_t attempts;
+} HsDirUpload;
+
+// what the current descriptors were built from, keys cover time_period and
+// the period after it, uploaded_ids holds ID_LENGTH per hsdir that took them
+typedef struct HsDescCache
+{
+  bool keys_ready;
+  int time_period;
+  ed25519_key blinded_keys[2];
+  unsigned char blinded_pub_keys[2][ED25519_PUB_KEY_SIZE];
+  ed25519_key descriptor_signing_key;
+  int built_period;
+  time_t built_at;
+  unsigned char intro_digest[WC_SHA3_256_DIGEST_SIZE];
+  uint8_t* uploaded_ids[2];
+  int uploaded_counts[2];
+} HsDescCache;
 
 typedef struct OnionService
 {
@@ -44,22 +97,55 @@ typedef struct OnionService
   struct OnionService* previous;
   unsigned short exit_port;
   unsigned short local_port;
+  bool single_onion;
+  LocalBackend* backends;
+  int backend_count;
+  // where the next search starts so ties and round robin rotate
+  int backend_next;
+  uint8_t backend_policy;
+  // set while a health check task is probing the backends
+  atomic_bool backends_checking;
   ed25519_key master_key;
   unsigned char current_sub_credential[WC_SHA3_256_DIGEST_SIZE];
   unsigned char previous_sub_credential[WC_SHA3_256_DIGEST_SIZE];
-  DoublyLinkedRendezvousCookieList rendezvous_cookies;
+  // encrypted sections of accepted INTRODUCE2 cells and their rendezvous cookies
+  ReplayCache intro_replays;
+  ReplayCache cookie_replays;
   time_t rend_timestamp;
   MinitorTimer hsdir_timer;
+  int intro_count;
+  int intro_max_introductions;
+  int intro_max_lifetime;
+  // live intros that are not being rotated out
   int intro_live_count;
+  // intros whose replacement has been started but are still listed
+  int intro_retiring;
+  int rend_pool_min;
+  int rend_pool_max;
+  // stem requests queued but not yet in the circuit list
+  int rend_pool_building;
+  // INTRODUCE2 cells since intro_window_start and the smoothed rate per minute
+  int intro_window_count;
+  time_t intro_window_start;
+  int intro_rate;
+  // intro to rendezvous latencies in ms, a ring of the most recent
+  uint32_t rend_latencies[REND_LATENCY_SAMPLES];
+  int rend_latency_next;
+  int rend_latency_count;
   int hsdir_sent;
   int hsdir_to_send;
+  int hsdir_failed;
+  int hsdir_in_flight;
+  bool hsdir_stale;
+  time_t hsdir_publish_start;
   DoublyLinkedOnionRelayList* target_relays[2];
+  HsDirUpload* hsdir_uploads[2];
   char hostname[63];
-  char hs_descs[2][50];
+  HsDescriptor* hs_descs[2];
+  HsDescCache hs_desc_cache;
 } OnionService;
 
 void v_add_service_to_list( OnionService* service, OnionService** list );
-void v_add_rendezvous_cookie_to_list( DoublyLinkedRendezvousCookie* node, DoublyLinkedRendezvousCookieList* list );
 //void v_add_local_stream_to_list( DoublyLinkedLocalStream* node, DoublyLinkedLocalStreamList* list );
 
 #endif
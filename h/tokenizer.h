@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_TOKENIZER_H
+#define MINITOR_TOKENIZER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "./constants.h"
+
+// view into a buffer owned by someone else, not NULL terminated
+typedef struct TokenSlice
+{
+  const char* data;
+  int length;
+} TokenSlice;
+
+// splits a byte stream into lines, lines that fall inside the current input
+// are returned in place, only a line that straddles two inputs is copied
+// into carry, the returned slice is valid until the next call
+typedef struct LineTokenizer
+{
+  int fd;
+  const char* input;
+  int input_length;
+  int offset;
+  char* block;
+  char* carry;
+  int carry_length;
+  int carry_capacity;
+  bool carry_overflow;
+  bool carry_returned;
+} LineTokenizer;
+
+// perfect hash over a small fixed keyword set, the seed is searched for
+// when the table is built so every keyword lands in its own slot
+typedef struct KeywordTable
+{
+  const char** keywords;
+  int count;
+  uint32_t seed;
+  int8_t slots[KEYWORD_TABLE_SLOTS];
+} KeywordTable;
+
+int d_init_line_tokenizer( LineTokenizer* tokenizer, int fd );
+void v_init_memory_tokenizer( LineTokenizer* tokenizer, const char* data, int length );
+void v_feed_line_tokenizer( LineTokenizer* tokenizer, const char* data, int length );
+void v_free_line_tokenizer( LineTokenizer* tokenizer );
+int d_next_line( LineTokenizer* tokenizer, TokenSlice* line );
+int d_next_object( LineTokenizer* tokenizer, TokenSlice* object );
+int d_init_keyword_table( KeywordTable* table, const char** keywords, int count );
+int d_match_keyword( KeywordTable* table, TokenSlice* line, TokenSlice* arguments );
+bool b_next_token( TokenSlice* arguments, TokenSlice* token );
+bool b_token_equals( TokenSlice* token, const char* string );
+bool b_token_starts_with( TokenSlice* token, const char* prefix );
+uint64_t ul_token_to_number( TokenSlice* token );
+
+#endif
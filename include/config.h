@@ -21,6 +21,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define DEBUG_MINITOR
 #define MINITOR_RELAY_MAX 60
+// how many hsdir upload circuits a service builds at once
+#define MINITOR_HSDIR_UPLOAD_PARALLELISM 4
+// intro point defaults for services set up without options
+#define MINITOR_INTRO_POINTS 3
+#define MINITOR_INTRO_MAX_INTRODUCTIONS 16384
+#define MINITOR_INTRO_MAX_LIFETIME ( 60 * 60 * 18 )
+// bounds of the pre-built rendezvous stem pool
+#define MINITOR_REND_POOL_MIN 2
+#define MINITOR_REND_POOL_MAX 8
+// stream SENDMEs are withheld while more than this is queued for a local backend
+#define MINITOR_LOCAL_STREAM_QUEUE_BYTES ( 16 * 1024 )
 #define MINITOR_DIR_ADDR 0x76a40dcc
 #define MINITOR_DIR_ADDR_STR "204.13.164.118"
 #define MINITOR_DIR_PORT 80
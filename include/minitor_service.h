@@ -23,7 +23,37 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 extern "C" {
 #endif
 
+typedef enum MinitorBackendPolicy
+{
+  MINITOR_BACKEND_LEAST_CONNECTIONS,
+  MINITOR_BACKEND_ROUND_ROBIN,
+} MinitorBackendPolicy;
+
+// per service settings, fields left at 0 take the defaults from config.h
+typedef struct MinitorServiceOptions
+{
+  // number of introduction points listed in the descriptor, at most 20
+  int intro_count;
+  // an intro point is rotated after this many INTRODUCE2 cells
+  int intro_max_introductions;
+  // or after being live this many seconds
+  int intro_max_lifetime;
+  // pre-built rendezvous stems kept ready, grows toward max with intro load
+  int rend_pool_min;
+  int rend_pool_max;
+  // non zero makes this a single onion service, intro and rendezvous circuits
+  // are one hop and the service's location is not hidden
+  int single_onion;
+  // streams are spread over these instead of 127.0.0.1:local_port, each is
+  // "address:port" or "unix:/path/to/socket", at most 16
+  const char* const* backends;
+  int backend_count;
+  // a MinitorBackendPolicy, least connections by default
+  int backend_policy;
+} MinitorServiceOptions;
+
 int d_setup_onion_service( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory );
+int d_setup_onion_service_with_options( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory, const MinitorServiceOptions* options );
 
 #ifdef __cplusplus
 }
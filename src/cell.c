@@ -278,6 +278,14 @@ void v_networkize_cell( Cell* cell )
           // auth key length needs to be hostized before the signature is created, and before this function is called
           //cell->payload.relay.establish_intro.auth_key_length = htons( cell->payload.relay.establish_intro.auth_key_length );
 
+          break;
+        case RELAY_SENDME:
+          // stream level sendmes have no body
+          if ( cell->payload.relay.sendme.version == SENDME_AUTH )
+          {
+            cell->payload.relay.sendme.data_length = htons( cell->payload.relay.sendme.data_length );
+          }
+
           break;
         case RELAY_COMMAND_INTRODUCE1:
           //cell->payload.relay.introduce2.auth_key_length = htons( cell->payload.relay.introduce2.auth_key_length );
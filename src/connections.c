@@ -73,6 +73,32 @@ static int conn_secrects_cb( WOLFSSL* ssl, void* secret, int* secretSz, void* ct
   return 0;
 }
 
+// drops a reference to a local connection, the socket stays open until the
+// handler task is done with it so its fd can't be reused under the poll
+static void v_release_local_connection( DlConnection* local_connection )
+{
+  LocalSlice* slice;
+
+  if ( atomic_fetch_sub( &local_connection->refs, 1 ) == 1 )
+  {
+    if ( local_connection->backend != NULL )
+    {
+      atomic_fetch_sub( &local_connection->backend->active_streams, 1 );
+    }
+
+    while ( local_connection->out_head != NULL )
+    {
+      slice = local_connection->out_head;
+      local_connection->out_head = slice->next;
+
+      free( slice );
+    }
+
+    close( local_connection->sock_fd );
+    free( local_connection );
+  }
+}
+
 static void v_cleanup_connection_in_lock( DlConnection* dl_connection )
 {
   int i;
@@ -115,16 +141,28 @@ static void v_cleanup_connection_in_lock( DlConnection* dl_connection )
     }
 
     MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
-  }
 
-  connections_poll[dl_connection->poll_index].fd = -1;
+    connections_poll[dl_connection->poll_index].fd = -1;
 
-  shutdown( dl_connection->sock_fd, 0 );
-  close( dl_connection->sock_fd );
+    shutdown( dl_connection->sock_fd, 0 );
+    close( dl_connection->sock_fd );
 
-  v_remove_connection_from_list( dl_connection, &connections );
+    v_remove_connection_from_list( dl_connection, &connections );
 
-  free( dl_connection );
+    free( dl_connection );
+  }
+  else
+  {
+    atomic_store( &dl_connection->out_bytes, 0 );
+
+    // wake the handler out of poll or recv, it exits once it sees closing
+    atomic_store( &dl_connection->closing, true );
+    shutdown( dl_connection->sock_fd, SHUT_RDWR );
+
+    v_remove_connection_from_list( dl_connection, &connections );
+
+    v_release_local_connection( dl_connection );
+  }
 }
 
 void v_cleanup_connection( DlConnection* dl_connection )
@@ -627,65 +665,399 @@ int d_attach_or_connection( uint32_t address, uint16_t port, OnionCircuit* circu
   return 0;
 }
 
-void v_handle_local_connection( void* pv_parameters )
+// starts a non-blocking connect to a backend, returns the socket or -1 if the
+// backend refused outright
+static int d_start_local_backend_connect( LocalBackend* backend )
+{
+  int succ;
+  int flags;
+  int sock_fd;
+  struct sockaddr_in dest_addr;
+  struct sockaddr_un unix_addr;
+
+  if ( backend->is_unix == true )
+  {
+    memset( &unix_addr, 0, sizeof( unix_addr ) );
+    unix_addr.sun_family = AF_UNIX;
+    strncpy( unix_addr.sun_path, backend->path, sizeof( unix_addr.sun_path ) - 1 );
+
+    sock_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  }
+  else
+  {
+    dest_addr.sin_addr.s_addr = backend->address;
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons( backend->port );
+
+    sock_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+  }
+
+  if ( sock_fd < 0 )
+  {
+    MINITOR_LOG( CONN_TAG, "couldn't create a socket to the local port, err: %d, errno: %d", sock_fd, errno );
+
+    return -1;
+  }
+
+  flags = fcntl( sock_fd, F_GETFL, 0 );
+  fcntl( sock_fd, F_SETFL, flags | O_NONBLOCK );
+
+  if ( backend->is_unix == true )
+  {
+    succ = connect( sock_fd, (struct sockaddr*)&unix_addr, sizeof( unix_addr ) );
+  }
+  else
+  {
+    succ = connect( sock_fd, (struct sockaddr*)&dest_addr, sizeof( dest_addr ) );
+  }
+
+  // a unix socket with a full backlog fails with EAGAIN, only EINPROGRESS is
+  // still going
+  if ( succ != 0 && errno != EINPROGRESS )
+  {
+    close( sock_fd );
+
+    return -1;
+  }
+
+  return sock_fd;
+}
+
+// waits up to timeout_ms for a started connect, returns 1 once connected with
+// the socket back in blocking mode, 0 if it's still going and -1 if it failed
+static int d_finish_local_backend_connect( int sock_fd, int timeout_ms )
+{
+  int succ;
+  int sock_err = 0;
+  socklen_t sock_err_length = sizeof( sock_err );
+  struct pollfd connect_poll;
+
+  connect_poll.fd = sock_fd;
+  connect_poll.events = POLLOUT;
+
+  succ = poll( &connect_poll, 1, timeout_ms );
+
+  if ( succ == 0 )
+  {
+    return 0;
+  }
+
+  if (
+    succ < 0 ||
+    getsockopt( sock_fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_length ) != 0 ||
+    sock_err != 0
+  )
+  {
+    return -1;
+  }
+
+  fcntl( sock_fd, F_SETFL, fcntl( sock_fd, F_GETFL, 0 ) & ~O_NONBLOCK );
+
+  return 1;
+}
+
+// connects to a backend without blocking past timeout_ms, the returned socket
+// is in blocking mode
+int d_connect_local_backend( LocalBackend* backend, int timeout_ms )
+{
+  int sock_fd;
+
+  sock_fd = d_start_local_backend_connect( backend );
+
+  if ( sock_fd < 0 )
+  {
+    return -1;
+  }
+
+  if ( d_finish_local_backend_connect( sock_fd, timeout_ms ) != 1 )
+  {
+    close( sock_fd );
+
+    return -1;
+  }
+
+  return sock_fd;
+}
+
+// tells the core task about a stream, length carries the connect result for
+// SERVICE_TCP_CONNECTED
+static void v_send_local_event( DlConnection* local_connection, OnionMessageType type, int length )
 {
-  int len;
-  uint8_t data_buf[RELAY_PAYLOAD_LEN];
-  DlConnection* local_connection = pv_parameters;
   OnionMessage* onion_message;
 
-  while ( 1 )
+  onion_message = malloc( sizeof( OnionMessage ) );
+
+  onion_message->type = type;
+  onion_message->data = malloc( sizeof( ServiceTcpTraffic ) );
+  ( (ServiceTcpTraffic*)onion_message->data )->circ_id = local_connection->circ_id;
+  ( (ServiceTcpTraffic*)onion_message->data )->stream_id = local_connection->stream_id;
+  ( (ServiceTcpTraffic*)onion_message->data )->length = length;
+  ( (ServiceTcpTraffic*)onion_message->data )->data = NULL;
+
+  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+}
+
+// finishes the connect RELAY_BEGIN started, gives up early if the stream
+// is torn down meanwhile
+static bool b_finish_local_connect( DlConnection* local_connection )
+{
+  int succ = 0;
+  uint32_t start;
+
+  start = MINITOR_GET_TIME_MS();
+
+  while ( succ == 0 && atomic_load( &local_connection->closing ) == false && MINITOR_GET_TIME_MS() - start < LOCAL_BACKEND_CONNECT_TIMEOUT_MS )
   {
-    onion_message = px_recv_on_local_connection( local_connection );
+    succ = d_finish_local_backend_connect( local_connection->sock_fd, LOCAL_FLUSH_POLL_MS );
+  }
+
+  if ( succ != 1 || atomic_load( &local_connection->closing ) == true )
+  {
+    return false;
+  }
+
+  atomic_store( &local_connection->backend->healthy, true );
+  atomic_store( &local_connection->connecting, false );
+
+  return true;
+}
 
-    if ( onion_message == NULL )
+// write as much queued output as the socket takes without blocking
+static int d_write_local_slices( DlConnection* local_connection )
+{
+  int i;
+  int written;
+  struct iovec iov[LOCAL_FLUSH_IOV];
+  struct msghdr msg;
+  LocalSlice* slice;
+
+  // data the client sent ahead of RELAY_CONNECTED waits for the connect
+  if ( atomic_load( &local_connection->connecting ) == true )
+  {
+    return 0;
+  }
+
+  while ( local_connection->out_head != NULL )
+  {
+    slice = local_connection->out_head;
+
+    for ( i = 0; i < LOCAL_FLUSH_IOV && slice != NULL; i++ )
     {
-      MINITOR_TASK_DELETE( NULL );
+      iov[i].iov_base = slice->data + slice->offset;
+      iov[i].iov_len = slice->length - slice->offset;
+
+      slice = slice->next;
     }
 
-    MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = i;
 
-    if ( ( (ServiceTcpTraffic*)onion_message->data )->length == 0 )
+    written = sendmsg( local_connection->sock_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+    if ( written < 0 )
     {
-      MINITOR_TASK_DELETE( NULL );
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      {
+        return 0;
+      }
+
+      MINITOR_LOG( CONN_TAG, "Failed to write to the local port, errno: %d", errno );
+
+      return -1;
+    }
+
+    atomic_fetch_sub( &local_connection->out_bytes, written );
+
+    while ( written > 0 )
+    {
+      slice = local_connection->out_head;
+
+      if ( written < slice->length - slice->offset )
+      {
+        slice->offset += written;
+
+        // the socket is full
+        return 0;
+      }
+
+      written -= slice->length - slice->offset;
+      local_connection->out_head = slice->next;
+
+      free( slice );
+    }
+
+    if ( local_connection->out_head == NULL )
+    {
+      local_connection->out_tail = NULL;
     }
   }
+
+  return 0;
 }
 
-int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port )
+// the client ended the stream with output still queued, the connection is
+// off the list so the queue is ours, write it out and close our side so the
+// backend gets everything the client sent before it sees the end
+static void v_finish_ended_local_connection( DlConnection* local_connection )
 {
-  int i;
   int succ;
-  bool ready;
-  int sock_fd;
-  struct sockaddr_in dest_addr;
-  DlConnection* local_connection;
-  MinitorTask* dummy_handle;
+  uint32_t start;
+  uint8_t discard[RELAY_PAYLOAD_LEN];
+  struct pollfd local_poll;
 
-  // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+  start = MINITOR_GET_TIME_MS();
 
-  // set the address of the directory server
-  dest_addr.sin_addr.s_addr = inet_addr( "127.0.0.1" );
-  dest_addr.sin_family = AF_INET;
-  dest_addr.sin_port = htons( port );
+  local_poll.fd = local_connection->sock_fd;
+  local_poll.events = POLLOUT;
 
-  sock_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+  while ( local_connection->out_head != NULL && MINITOR_GET_TIME_MS() - start < LOCAL_END_LINGER_MS )
+  {
+    if ( poll( &local_poll, 1, LOCAL_FLUSH_POLL_MS ) < 0 || ( local_poll.revents & ( POLLERR | POLLHUP | POLLNVAL ) ) != 0 )
+    {
+      break;
+    }
 
-  if ( sock_fd < 0 )
+    if ( ( local_poll.revents & POLLOUT ) != 0 && d_write_local_slices( local_connection ) < 0 )
+    {
+      break;
+    }
+  }
+
+  shutdown( local_connection->sock_fd, SHUT_WR );
+
+  // read off whatever the backend still sends until it closes, closing with
+  // unread input would reset the connection and drop what we just wrote
+  local_poll.events = POLLIN;
+
+  while ( MINITOR_GET_TIME_MS() - start < LOCAL_END_LINGER_MS )
   {
-    MINITOR_LOG( CONN_TAG, "couldn't create a socket to the local port, err: %d, errno: %d", sock_fd, errno );
+    succ = poll( &local_poll, 1, LOCAL_FLUSH_POLL_MS );
+
+    if ( succ < 0 )
+    {
+      break;
+    }
+
+    if ( succ == 0 )
+    {
+      continue;
+    }
+
+    if ( recv( local_connection->sock_fd, discard, sizeof( discard ), 0 ) <= 0 )
+    {
+      break;
+    }
+  }
+}
+
+void v_handle_local_connection( void* pv_parameters )
+{
+  bool closed;
+  bool connected;
+  DlConnection* local_connection = pv_parameters;
+  OnionMessage* onion_message;
+  struct pollfd local_poll;
+
+  local_poll.fd = local_connection->sock_fd;
+
+  connected = b_finish_local_connect( local_connection );
+
+  // an ended stream still gets its queue written if the connect made it
+  if ( atomic_load( &local_connection->closing ) == false && atomic_load( &local_connection->ending ) == false )
+  {
+    v_send_local_event( local_connection, SERVICE_TCP_CONNECTED, connected == true ? 1 : 0 );
+  }
+
+  while ( connected == true && atomic_load( &local_connection->closing ) == false )
+  {
+    if ( atomic_load( &local_connection->ending ) == true )
+    {
+      v_finish_ended_local_connection( local_connection );
+
+      break;
+    }
+
+    local_poll.events = POLLIN;
+
+    // only the core task writes, we just tell it when the backend can take more
+    if ( atomic_load( &local_connection->out_bytes ) > 0 && atomic_load( &local_connection->flush_pending ) == false )
+    {
+      local_poll.events |= POLLOUT;
+    }
+
+    if (
+      poll( &local_poll, 1, LOCAL_FLUSH_POLL_MS ) <= 0 ||
+      atomic_load( &local_connection->closing ) == true ||
+      atomic_load( &local_connection->ending ) == true
+    )
+    {
+      continue;
+    }
+
+    if ( ( local_poll.revents & POLLOUT ) != 0 )
+    {
+      atomic_store( &local_connection->flush_pending, true );
+
+      v_send_local_event( local_connection, SERVICE_TCP_WRITABLE, 0 );
+    }
+
+    // POLLNVAL reads as a failed recv so the stream closes instead of spinning
+    if ( ( local_poll.revents & ( POLLIN | POLLHUP | POLLERR | POLLNVAL ) ) == 0 )
+    {
+      continue;
+    }
+
+    onion_message = px_recv_on_local_connection( local_connection );
 
-    goto fail;
+    closed = ( (ServiceTcpTraffic*)onion_message->data )->length == 0;
+
+    // the core task already tore the stream down or the client ended it,
+    // don't report anything more
+    if ( atomic_load( &local_connection->closing ) == true || atomic_load( &local_connection->ending ) == true )
+    {
+      if ( closed == false )
+      {
+        free( ( (ServiceTcpTraffic*)onion_message->data )->data );
+      }
+
+      free( onion_message->data );
+      free( onion_message );
+
+      continue;
+    }
+
+    // the core task frees the message and drops the list's reference once it
+    // sees the close
+    MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+
+    if ( closed == true )
+    {
+      break;
+    }
   }
 
-  succ = connect( sock_fd, (struct sockaddr*) &dest_addr, sizeof( dest_addr ) );
+  v_release_local_connection( local_connection );
+
+  MINITOR_TASK_DELETE( NULL );
+}
+
+// starts connecting a stream to a backend, its handler task finishes the
+// connect and reports back with SERVICE_TCP_CONNECTED, tried is kept so a
+// failed connect can move on to the backends not tried yet
+int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, LocalBackend* backend, bool* tried )
+{
+  int sock_fd;
+  DlConnection* local_connection;
+  MinitorTask* dummy_handle;
+
+  sock_fd = d_start_local_backend_connect( backend );
 
-  if ( succ != 0 )
+  if ( sock_fd < 0 )
   {
     MINITOR_LOG( CONN_TAG, "couldn't connect to the local port" );
 
-    goto clean_socket;
+    return -1;
   }
 
   local_connection = malloc( sizeof( DlConnection ) );
@@ -696,32 +1068,45 @@ int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t po
   local_connection->stream_id = stream_id;
   local_connection->sock_fd = sock_fd;
   local_connection->is_or = 0;
+  local_connection->backend = backend;
+  memcpy( local_connection->tried_backends, tried, sizeof( local_connection->tried_backends ) );
+  atomic_init( &local_connection->connecting, true );
   // set last action to uint max so it isn't killed before it can read (no one should be killed before they can read)
   local_connection->last_action = INT_MAX;
+
+  // one for the list and one for the handler task
+  atomic_init( &local_connection->refs, 2 );
+
+  atomic_fetch_add( &backend->active_streams, 1 );
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
   local_connection->conn_id = conn_id++;
 
   v_add_connection_to_list( local_connection, &connections );
 
-  b_create_local_connection_handler( &dummy_handle, local_connection );
+  if ( b_create_local_connection_handler( &dummy_handle, local_connection ) == false )
+  {
+    MINITOR_LOG( CONN_TAG, "couldn't create the local connection handler" );
 
-  MINITOR_MUTEX_GIVE( connections_mutex );
-  // MUTEX GIVE
+    atomic_store( &local_connection->refs, 1 );
+    v_cleanup_connection_in_lock( local_connection );
 
-  return 0;
+    MINITOR_MUTEX_GIVE( connections_mutex );
+    // MUTEX GIVE
+
+    return -1;
+  }
 
-clean_socket:
-  shutdown( sock_fd, 0 );
-  close( sock_fd );
-fail:
   MINITOR_MUTEX_GIVE( connections_mutex );
   // MUTEX GIVE
 
-  return -1;
+  return 0;
 }
 
-int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t* data, uint32_t length )
+static DlConnection* px_get_local_connection( uint32_t circ_id, uint32_t stream_id )
 {
-  int ret = 0;
   DlConnection* local_connection;
 
   local_connection = connections;
@@ -730,20 +1115,163 @@ int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t
   {
     if ( local_connection->is_or == 0 && local_connection->circ_id == circ_id && local_connection->stream_id == stream_id )
     {
-      ret = send( local_connection->sock_fd, data, length, 0 );
-
       break;
     }
 
     local_connection = local_connection->next;
   }
 
+  return local_connection;
+}
+
+// stream SENDMEs are only released while the backend keeps up
+static int d_take_stream_sendmes( DlConnection* local_connection )
+{
+  int sendmes = 0;
+
+  while ( local_connection->unacked_cells >= STREAM_SENDME_INCREMENT && atomic_load( &local_connection->out_bytes ) <= MINITOR_LOCAL_STREAM_QUEUE_BYTES )
+  {
+    local_connection->unacked_cells -= STREAM_SENDME_INCREMENT;
+    sendmes++;
+  }
+
+  return sendmes;
+}
+
+// returns how many stream SENDMEs are owed to the client
+int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t* data, uint32_t length )
+{
+  DlConnection* local_connection;
+  LocalSlice* slice;
+
+  local_connection = px_get_local_connection( circ_id, stream_id );
+
   if ( local_connection == NULL )
   {
-    ret = -1;
+    return -1;
   }
 
-  return ret;
+  local_connection->unacked_cells++;
+
+  // the client sent past the window we gave it
+  if ( local_connection->unacked_cells > STREAM_WINDOW_START )
+  {
+    MINITOR_LOG( CONN_TAG, "Stream %d overran its window", stream_id );
+
+    return -1;
+  }
+
+  if ( length == 0 )
+  {
+    return d_take_stream_sendmes( local_connection );
+  }
+
+  slice = malloc( sizeof( LocalSlice ) + length );
+
+  slice->next = NULL;
+  slice->length = length;
+  slice->offset = 0;
+  memcpy( slice->data, data, length );
+
+  if ( local_connection->out_tail == NULL )
+  {
+    local_connection->out_head = slice;
+  }
+  else
+  {
+    local_connection->out_tail->next = slice;
+  }
+
+  local_connection->out_tail = slice;
+  atomic_fetch_add( &local_connection->out_bytes, length );
+
+  if ( d_write_local_slices( local_connection ) < 0 )
+  {
+    return -1;
+  }
+
+  return d_take_stream_sendmes( local_connection );
+}
+
+// the handler task saw the socket writable, returns how many stream SENDMEs
+// are owed to the client
+int d_flush_local_connection( uint32_t circ_id, uint32_t stream_id )
+{
+  DlConnection* local_connection;
+
+  local_connection = px_get_local_connection( circ_id, stream_id );
+
+  if ( local_connection == NULL )
+  {
+    return 0;
+  }
+
+  atomic_store( &local_connection->flush_pending, false );
+
+  if ( d_write_local_slices( local_connection ) < 0 )
+  {
+    return -1;
+  }
+
+  return d_take_stream_sendmes( local_connection );
+}
+
+// the client sent RELAY_END, output still queued for the backend goes to the
+// handler task to finish, otherwise the stream closes now
+void v_end_local_connection( uint32_t circ_id, uint32_t stream_id )
+{
+  DlConnection* local_connection;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
+  local_connection = px_get_local_connection( circ_id, stream_id );
+
+  if ( local_connection != NULL )
+  {
+    if ( local_connection->out_head == NULL )
+    {
+      v_cleanup_connection_in_lock( local_connection );
+    }
+    else
+    {
+      // a new stream may reuse the id, the ended one must not be found
+      v_remove_connection_from_list( local_connection, &connections );
+
+      atomic_store( &local_connection->ending, true );
+
+      v_release_local_connection( local_connection );
+    }
+  }
+
+  MINITOR_MUTEX_GIVE( connections_mutex );
+  // MUTEX GIVE
+}
+
+// drops a stream whose connect failed, returns the backend that failed and
+// fills tried with the backends already tried, NULL if the stream is gone
+LocalBackend* px_fail_local_connection( uint32_t circ_id, uint32_t stream_id, bool* tried )
+{
+  DlConnection* local_connection;
+  LocalBackend* backend = NULL;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
+  local_connection = px_get_local_connection( circ_id, stream_id );
+
+  if ( local_connection != NULL )
+  {
+    backend = local_connection->backend;
+    memcpy( tried, local_connection->tried_backends, sizeof( local_connection->tried_backends ) );
+
+    v_cleanup_connection_in_lock( local_connection );
+  }
+
+  MINITOR_MUTEX_GIVE( connections_mutex );
+  // MUTEX GIVE
+
+  return backend;
 }
 
 void v_cleanup_local_connection( uint32_t circ_id, uint32_t stream_id )
@@ -30,8 +30,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../h/constants.h"
 #include "../h/consensus.h"
+#include "../h/consensus_parser.h"
 #include "../h/encoding.h"
+#include "../h/models/buffered_file.h"
 #include "../h/models/relay.h"
+#include "../h/models/relay_db.h"
+#include "../h/dir_client.h"
+#include "../h/tokenizer.h"
 
 // TODO change back to 0 when issi ram is operating in quad mode
 int hsdir_tree_occupied = 1;
@@ -43,77 +48,200 @@ uint8_t previous_fastest_identity[ID_LENGTH];
 
 MinitorMutex fastest_cache_mutex;
 MinitorQueue insert_relays_queue;
+MinitorQueue hash_relays_queue;
 MinitorQueue fetch_relays_queue;
+static int hash_worker_count;
+static int fetch_tasks_running;
+static ConsensusSnapshot* _Atomic current_snapshot = NULL;
+static bool consensus_refreshing = false;
+static bool consensus_refresh_allow_stale = false;
+static int bootstrap_status = 0;
+static time_t bootstrap_start;
+static MinitorTask consensus_refresh_task;
+static DirClient* download_dir_client = NULL;
+static BufferedFile consensus_file = BUFFERED_FILE_INITIALIZER;
+
+enum
+{
+  DESCRIPTOR_KEYWORD_MASTER_KEY,
+  DESCRIPTOR_KEYWORD_NTOR_ONION_KEY,
+  DESCRIPTOR_KEYWORD_SIGNING_KEY,
+  DESCRIPTOR_KEYWORD_COUNT,
+};
+
+static const char* descriptor_keywords[] = {
+  "master-key-ed25519",
+  "ntor-onion-key",
+  "signing-key",
+};
+
+// a request to a directory cache, stream_id is set when it's tunnelled over
+// the download's dir circuit instead of its own tcp connection
+typedef struct DirRequest
+{
+  int sock_fd;
+  int stream_id;
+} DirRequest;
 
 typedef struct FetchDescriptorState
 {
   OnionRelay* relays[3];
   int num_relays;
-  int sock_fd;
+  DirRequest request;
   int using_cache_relay;
   uint8_t cache_identity[ID_LENGTH];
   uint64_t start;
 } FetchDescriptorState;
 
-static void v_get_id_hash( uint8_t* identity, uint8_t* id_hash, int time_period, int hsdir_interval, uint8_t* srv )
+// "node-idx" | identity | srv | period_num | period_length
+#define ID_HASH_MESSAGE_LENGTH ( 8 + H_LENGTH + 32 + 8 + 8 )
+
+static void v_fill_id_hash_message( uint8_t* message, int time_period, int hsdir_interval, uint8_t* srv )
+{
+  int i;
+
+  memcpy( message, "node-idx", 8 );
+  memcpy( message + 8 + H_LENGTH, srv, 32 );
+
+  for ( i = 0; i < 8; i++ )
+  {
+    message[8 + H_LENGTH + 32 + i] = (unsigned char)( ( (uint64_t)( time_period ) ) >> ( 56 - 8 * i ) );
+    message[8 + H_LENGTH + 32 + 8 + i] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> ( 56 - 8 * i ) );
+  }
+}
+
+// the whole message fits in one sha3 block and only the identity changes
+// between relays, so the message is built once per period and each hash
+// is a single update and final on one reused context
+static void v_get_id_hash_batch( RelayBatch* batch, NetworkConsensus* working_consensus )
 {
-  uint8_t tmp_64_buffer[8];
+  int i;
+  OnionRelay* onion_relay;
+  uint8_t message_previous[ID_HASH_MESSAGE_LENGTH];
+  uint8_t message_current[ID_HASH_MESSAGE_LENGTH];
   wc_Sha3 reusable_sha3;
 
+  v_fill_id_hash_message( message_previous, working_consensus->time_period, working_consensus->hsdir_interval, working_consensus->previous_shared_rand );
+  v_fill_id_hash_message( message_current, working_consensus->time_period + 1, working_consensus->hsdir_interval, working_consensus->shared_rand );
+
   wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
 
-  wc_Sha3_256_Update( &reusable_sha3, (unsigned char*)"node-idx", strlen( "node-idx" ) );
-  wc_Sha3_256_Update( &reusable_sha3, identity, H_LENGTH );
+  for ( i = 0; i < batch->count; i++ )
+  {
+    onion_relay = batch->relays[i];
+
+    if ( onion_relay->hsdir == false )
+    {
+      continue;
+    }
+
+    memcpy( message_previous + 8, onion_relay->master_key, H_LENGTH );
+    memcpy( message_current + 8, onion_relay->master_key, H_LENGTH );
 
-  wc_Sha3_256_Update( &reusable_sha3, srv, 32 );
+    // final resets the context for the next hash
+    wc_Sha3_256_Update( &reusable_sha3, message_previous, ID_HASH_MESSAGE_LENGTH );
+    wc_Sha3_256_Final( &reusable_sha3, onion_relay->id_hash_previous );
 
-  tmp_64_buffer[0] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 56 );
-  tmp_64_buffer[1] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 48 );
-  tmp_64_buffer[2] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 40 );
-  tmp_64_buffer[3] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 32 );
-  tmp_64_buffer[4] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 24 );
-  tmp_64_buffer[5] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 16 );
-  tmp_64_buffer[6] = (unsigned char)( ( (uint64_t)( time_period ) ) >> 8 );
-  tmp_64_buffer[7] = (unsigned char)( (uint64_t)( time_period ) );
+    wc_Sha3_256_Update( &reusable_sha3, message_current, ID_HASH_MESSAGE_LENGTH );
+    wc_Sha3_256_Final( &reusable_sha3, onion_relay->id_hash );
+  }
 
-  wc_Sha3_256_Update( &reusable_sha3, tmp_64_buffer, 8 );
+  wc_Sha3_256_Free( &reusable_sha3 );
+}
 
-  tmp_64_buffer[0] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 56 );
-  tmp_64_buffer[1] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 48 );
-  tmp_64_buffer[2] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 40 );
-  tmp_64_buffer[3] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 32 );
-  tmp_64_buffer[4] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 24 );
-  tmp_64_buffer[5] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 16 );
-  tmp_64_buffer[6] = (unsigned char)( ( (uint64_t)( hsdir_interval ) ) >> 8 );
-  tmp_64_buffer[7] = (unsigned char)( (uint64_t)( hsdir_interval ) );
+void v_handle_relay_hash( void* pv_parameters )
+{
+  RelayBatch* batch;
+  NetworkConsensus* working_consensus = (NetworkConsensus*)pv_parameters;
 
-  wc_Sha3_256_Update( &reusable_sha3, tmp_64_buffer, 8 );
+  while ( MINITOR_DEQUEUE_BLOCKING( hash_relays_queue, (void*)(&batch) ) )
+  {
+    if ( batch != NULL )
+    {
+      v_get_id_hash_batch( batch, working_consensus );
+    }
 
-  wc_Sha3_256_Final( &reusable_sha3, id_hash );
+    // pass the batch, or our shutdown null, on to the insert task
+    MINITOR_ENQUEUE_BLOCKING( insert_relays_queue, (void*)(&batch) );
 
-  wc_Sha3_256_Free( &reusable_sha3 );
+    if ( batch == NULL )
+    {
+      break;
+    }
+  }
+
+  MINITOR_TASK_DELETE( NULL );
+}
+
+// hold on to the fast relays of a cold bootstrap until there are enough to
+// build paths from, then install them so circuits don't wait on the rest
+static void v_collect_provisional_relay( OnionRelay* onion_relay, OnionRelay** provisional_relays, uint32_t* provisional_count, uint32_t* guard_count )
+{
+  int milestones = 0;
+
+  if ( *provisional_count % RELAY_BATCH_SIZE == 0 )
+  {
+    *provisional_relays = realloc( *provisional_relays, sizeof( OnionRelay ) * ( *provisional_count + RELAY_BATCH_SIZE ) );
+  }
+
+  memcpy( &( *provisional_relays )[*provisional_count], onion_relay, sizeof( OnionRelay ) );
+  ( *provisional_count )++;
+
+  if ( onion_relay->can_guard == true )
+  {
+    ( *guard_count )++;
+  }
+
+  if ( *guard_count < BOOTSTRAP_MIN_GUARDS || *provisional_count < BOOTSTRAP_MIN_MIDDLES )
+  {
+    return;
+  }
+
+  if ( d_load_provisional_relay_selection_table( *provisional_relays, *provisional_count ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to load provisional relay selection table" );
+  }
+  else
+  {
+    milestones = BOOTSTRAP_PATH_SELECTION;
+  }
+
+  // the table owns the relays now, or freed them on failure
+  *provisional_relays = NULL;
+  *provisional_count = 0;
+  *guard_count = 0;
+
+  v_publish_bootstrap_milestones( milestones );
 }
 
-void v_handle_crypto_and_insert( void* pv_parameters )
+void v_handle_relay_insert( void* pv_parameters )
 {
+  int i;
   int process_count = 0;
   int shutdown_count = 0;
+  bool provisional = !b_bootstrap_reached( BOOTSTRAP_PATH_SELECTION );
+  uint32_t provisional_count = 0;
+  uint32_t guard_count = 0;
+  OnionRelay* provisional_relays = NULL;
+  RelayBatch* batch;
   OnionRelay* onion_relay;
-  NetworkConsensus* working_consensus = (NetworkConsensus*)pv_parameters;
 
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( crypto_insert_finish );
 
-  while ( MINITOR_DEQUEUE_BLOCKING( insert_relays_queue, &onion_relay ) )
+  while ( MINITOR_DEQUEUE_BLOCKING( insert_relays_queue, (void*)(&batch) ) )
   {
-    if ( onion_relay == NULL )
+    if ( batch == NULL )
     {
       shutdown_count++;
 
-      if ( shutdown_count >= 2 )
+      // every hash worker sends one null on its way out
+      if ( shutdown_count >= hash_worker_count )
       {
         MINITOR_LOG( MINITOR_TAG, "%d total relays processed", process_count );
 
+        free( provisional_relays );
+
         MINITOR_MUTEX_GIVE( crypto_insert_finish );
         // MUTEX GIVE
         MINITOR_TASK_DELETE( NULL );
@@ -122,55 +250,62 @@ void v_handle_crypto_and_insert( void* pv_parameters )
       continue;
     }
 
+    for ( i = 0; i < batch->count; i++ )
+    {
+      onion_relay = batch->relays[i];
+
 #ifdef DEBUG_MINITOR
 #ifdef MINITOR_CHUTNEY
-    MINITOR_LOG( MINITOR_TAG, "%d relays processed so far", process_count );
-#else
-    if ( process_count % 50 == 0 )
-    {
       MINITOR_LOG( MINITOR_TAG, "%d relays processed so far", process_count );
-    }
+#else
+      if ( process_count % 50 == 0 )
+      {
+        MINITOR_LOG( MINITOR_TAG, "%d relays processed so far", process_count );
+      }
 #endif
 
-    process_count++;
+      process_count++;
 #endif
 
-    if ( onion_relay->hsdir == true )
-    {
-      v_get_id_hash( onion_relay->master_key, onion_relay->id_hash_previous, working_consensus->time_period, working_consensus->hsdir_interval, working_consensus->previous_shared_rand );
-      v_get_id_hash( onion_relay->master_key, onion_relay->id_hash, working_consensus->time_period + 1, working_consensus->hsdir_interval, working_consensus->shared_rand );
-
-      while ( d_create_hsdir_relay( onion_relay ) < 0 )
+      if ( onion_relay->hsdir == true )
       {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_hsdir_relay, retrying" );
+        while ( d_create_hsdir_relay( onion_relay ) < 0 )
+        {
+          MINITOR_LOG( MINITOR_TAG, "Failed to d_create_hsdir_relay, retrying" );
+        }
       }
-    }
 
-    if (
-      onion_relay->dir_cache == true &&
-      onion_relay->dir_port != 0 &&
-      d_get_staging_cache_relay_count() < 100
-    )
-    {
-      while ( d_create_cache_relay( onion_relay ) < 0 )
+      if (
+        onion_relay->dir_cache == true &&
+        onion_relay->dir_port != 0
+      )
       {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_cache_relay, retrying" );
+        while ( d_create_cache_relay( onion_relay ) < 0 )
+        {
+          MINITOR_LOG( MINITOR_TAG, "Failed to d_create_cache_relay, retrying" );
+        }
       }
-    }
 
-    // some hsdir relays are not suitable and this will exclude them
-    if (
-      onion_relay->suitable == true &&
-      d_get_staging_fast_relay_count() < 100
-    )
-    {
-      while ( d_create_fast_relay( onion_relay ) < 0 )
+      // some hsdir relays are not suitable and this will exclude them
+      if ( onion_relay->suitable == true )
       {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_fast_relay, retrying" );
+        while ( d_create_fast_relay( onion_relay ) < 0 )
+        {
+          MINITOR_LOG( MINITOR_TAG, "Failed to d_create_fast_relay, retrying" );
+        }
+
+        if ( provisional == true )
+        {
+          v_collect_provisional_relay( onion_relay, &provisional_relays, &provisional_count, &guard_count );
+
+          provisional = !b_bootstrap_reached( BOOTSTRAP_PATH_SELECTION );
+        }
       }
+
+      free( onion_relay );
     }
 
-    free( onion_relay );
+    free( batch );
   }
 }
 
@@ -299,6 +434,112 @@ static int d_get_suitable_dir_addr( struct sockaddr_in* dest_addr, char* ip_addr
   return ret;
 }
 
+// tunnels the request over a BEGIN_DIR stream when the download has a dir
+// circuit, a cache without a circuit or a dead circuit falls back to tcp
+static int d_send_dir_request( DirRequest* dir_request, struct sockaddr_in* dest_addr, const char* request )
+{
+  int err;
+
+  dir_request->sock_fd = -1;
+  dir_request->stream_id = 0;
+
+  if ( download_dir_client != NULL )
+  {
+    dir_request->stream_id = d_open_dir_stream( download_dir_client );
+
+    if ( dir_request->stream_id > 0 )
+    {
+      if ( d_write_dir_stream( download_dir_client, dir_request->stream_id, (const uint8_t*)request, strlen( request ) ) < 0 )
+      {
+        MINITOR_LOG( MINITOR_TAG, "couldn't send to dir stream" );
+
+        v_close_dir_stream( download_dir_client, dir_request->stream_id );
+        dir_request->stream_id = 0;
+
+        return -1;
+      }
+
+      return 0;
+    }
+
+    dir_request->stream_id = 0;
+  }
+
+  // create a socket to access the dir server
+  dir_request->sock_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+
+  if ( dir_request->sock_fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "couldn't create a socket to http server" );
+
+    return -1;
+  }
+
+  // connect the socket to the dir server address
+  err = connect( dir_request->sock_fd, (struct sockaddr*)dest_addr, sizeof( struct sockaddr_in ) );
+
+  if ( err != 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "couldn't connect to http server" );
+
+    goto fail;
+  }
+
+  // send the http request to the dir server
+  err = send( dir_request->sock_fd, request, strlen( request ), 0 );
+
+  if ( err < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "couldn't send to http server" );
+
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  shutdown( dir_request->sock_fd, 0 );
+  close( dir_request->sock_fd );
+  dir_request->sock_fd = -1;
+
+  return -1;
+}
+
+static int d_recv_dir_response( DirRequest* dir_request, char* rx_buffer, int length )
+{
+  if ( dir_request->stream_id > 0 )
+  {
+    return d_read_dir_stream( download_dir_client, dir_request->stream_id, (uint8_t*)rx_buffer, length );
+  }
+
+  return recv( dir_request->sock_fd, rx_buffer, length, 0 );
+}
+
+static void v_close_dir_request( DirRequest* dir_request )
+{
+  if ( dir_request->stream_id > 0 )
+  {
+    v_close_dir_stream( download_dir_client, dir_request->stream_id );
+  }
+  else if ( dir_request->sock_fd >= 0 )
+  {
+    shutdown( dir_request->sock_fd, 0 );
+    close( dir_request->sock_fd );
+  }
+
+  dir_request->sock_fd = -1;
+  dir_request->stream_id = 0;
+}
+
+static void v_free_download_dir_client()
+{
+  if ( download_dir_client != NULL )
+  {
+    v_destroy_dir_client( download_dir_client );
+    download_dir_client = NULL;
+  }
+}
+
 // split up the fetch task, start should make the request and then peace out,
 // let d_finish_descriptor_fetch actually recv the descriptors
 static int d_start_descriptor_fetch( FetchDescriptorState* fetch_state )
@@ -314,7 +555,6 @@ static int d_start_descriptor_fetch( FetchDescriptorState* fetch_state )
 
   int i;
   int j;
-  int err;
 
   fetch_state->using_cache_relay = d_get_suitable_dir_addr( &dest_addr, ip_addr_str, fetch_state->cache_identity );
 
@@ -362,70 +602,44 @@ static int d_start_descriptor_fetch( FetchDescriptorState* fetch_state )
 
   fetch_state->start = MINITOR_GET_TIME();
 
-  // create a socket to access the descriptor
-  fetch_state->sock_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
-
-  if ( fetch_state->sock_fd < 0 )
+  if ( d_send_dir_request( &fetch_state->request, &dest_addr, REQUEST ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "couldn't create a socket to http server" );
-
     return -1;
   }
 
-  // connect the socket to the dir server address
-  err = connect( fetch_state->sock_fd, (struct sockaddr*) &dest_addr, sizeof( dest_addr ) );
-
-  if ( err != 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "couldn't connect to http server %s", ip_addr_str );
-
-    goto fail;
-  }
-
-  // send the http request to the dir server
-  err = send( fetch_state->sock_fd, REQUEST, strlen( REQUEST ), 0 );
-
-  if ( err < 0 )
+  // every tunnelled fetch goes to the same cache, there's nothing to sample
+  if ( fetch_state->request.stream_id > 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "couldn't send to http server" );
-
-    goto fail;
+    fetch_state->using_cache_relay = 0;
   }
 
   return 0;
-
-fail:
-  shutdown( fetch_state->sock_fd, 0 );
-  close( fetch_state->sock_fd );
-
-  return -1;
 }
 
 static int d_finish_descriptor_fetch( FetchDescriptorState* fetch_state )
 {
-  int i;
   int j;
   int ret = 0;
   int rx_length = 0;
   char rx_buffer[512];
   int end_header = 0;
   int relays_set = 0;
-  int matched_relay = 0;
+  int matched_relay = -1;
   uint64_t end;
+  LineTokenizer tokenizer;
+  KeywordTable descriptor_table;
+  TokenSlice line;
+  TokenSlice arguments;
 
-  const char* master_key = "\nmaster-key-ed25519 ";
-  int master_key_found = 0;
-  char master_key_64[43] = { 0 };
-  int master_key_64_length = 0;
+  bool master_key_found = false;
+  char master_key_64[43];
 
-  const char* ntor_onion_key = "\nntor-onion-key ";
-  int ntor_onion_key_found = 0;
-  char ntor_onion_key_64[43] = { 0 };
-  int ntor_onion_key_64_length = 0;
+  bool ntor_onion_key_found = false;
+  char ntor_onion_key_64[43];
 
-  const char* signing_key = "\nsigning-key\n-----BEGIN RSA PUBLIC KEY-----\n";
-  int signing_key_found = 0;
-  char signing_key_64[187] = { 0 };
+  bool in_signing_key = false;
+  bool signing_key_found = false;
+  char signing_key_64[187];
   int signing_key_64_length = 0;
   uint8_t der[141];
   uint8_t identity_digest[ID_LENGTH];
@@ -433,11 +647,20 @@ static int d_finish_descriptor_fetch( FetchDescriptorState* fetch_state )
 
   wc_InitSha( &tmp_sha );
 
+  if (
+    d_init_line_tokenizer( &tokenizer, -1 ) < 0 ||
+    d_init_keyword_table( &descriptor_table, descriptor_keywords, DESCRIPTOR_KEYWORD_COUNT ) < 0
+  )
+  {
+    ret = -1;
+    goto finish;
+  }
+
   // keep reading forever, we will break inside when the transfer is over
   while ( relays_set < fetch_state->num_relays )
   {
     // recv data from the destination and fill the rx_buffer with the data
-    rx_length = recv( fetch_state->sock_fd, rx_buffer, sizeof( rx_buffer ), 0 );
+    rx_length = d_recv_dir_response( &fetch_state->request, rx_buffer, sizeof( rx_buffer ) );
 
     // if we got less than 0 we encoutered an error
     if ( rx_length < 0 )
@@ -454,132 +677,117 @@ static int d_finish_descriptor_fetch( FetchDescriptorState* fetch_state )
       break;
     }
 
-    // iterate over each byte we got back from the socket recv
-    // NOTE that we can't rely on all the data being there, we
-    // have to treat each byte as though we only have that byte
-    for ( i = 0; i < rx_length && relays_set < fetch_state->num_relays; i++ )
+    v_feed_line_tokenizer( &tokenizer, rx_buffer, rx_length );
+
+    while ( relays_set < fetch_state->num_relays && d_next_line( &tokenizer, &line ) == 1 )
     {
-      // skip over the http header, when we get two \r\n s in a row we
-      // know we're at the end
-      if ( end_header < 4 )
+      // skip over the http header, it ends with an empty line
+      if ( end_header == 0 )
       {
-        // increment end_header whenever we get part of a carrage retrun
-        if ( rx_buffer[i] == '\r' || rx_buffer[i] == '\n' )
-        {
-          end_header++;
-        // otherwise reset the count
-        }
-        else
+        if ( line.length == 0 )
         {
-          end_header = 0;
+          end_header = 1;
         }
-      // if we have 4 end_header we're onto the actual data
+
+        continue;
       }
-      else
+
+      // the signing key object, the sha1 of its der is the relay identity
+      if ( in_signing_key == true )
       {
-        if ( ntor_onion_key_found != -1 )
+        if ( b_token_starts_with( &line, "-----BEGIN " ) )
         {
-          if ( ntor_onion_key_found == strlen( ntor_onion_key ) )
-          {
-            ntor_onion_key_64[ntor_onion_key_64_length] = rx_buffer[i];
-            ntor_onion_key_64_length++;
+          continue;
+        }
 
-            if ( ntor_onion_key_64_length == 43 )
-            {
-              ntor_onion_key_found = -1;
-            }
-          }
-          else if ( rx_buffer[i] == ntor_onion_key[ntor_onion_key_found] )
-          {
-            ntor_onion_key_found++;
-          }
-          else
+        if ( b_token_starts_with( &line, "-----END " ) == false )
+        {
+          j = line.length;
+
+          if ( j > sizeof( signing_key_64 ) - signing_key_64_length )
           {
-            ntor_onion_key_found = 0;
+            j = sizeof( signing_key_64 ) - signing_key_64_length;
           }
+
+          memcpy( signing_key_64 + signing_key_64_length, line.data, j );
+          signing_key_64_length += j;
+
+          continue;
         }
 
-        if ( master_key_found != -1 )
+        in_signing_key = false;
+
+        if ( signing_key_64_length == sizeof( signing_key_64 ) )
         {
-          if ( master_key_found == strlen( master_key ) )
-          {
-            master_key_64[master_key_64_length] = rx_buffer[i];
-            master_key_64_length++;
+          d_base_64_decode( der, signing_key_64, sizeof( signing_key_64 ) );
+          wc_ShaUpdate( &tmp_sha, der, 140 );
+          wc_ShaFinal( &tmp_sha, identity_digest );
 
-            if ( master_key_64_length == 43 )
+          for ( j = 0; j < fetch_state->num_relays; j++ )
+          {
+            if ( memcmp( identity_digest, fetch_state->relays[j]->identity, ID_LENGTH ) == 0 )
             {
-              master_key_found = -1;
+              matched_relay = j;
+              break;
             }
           }
-          else if ( rx_buffer[i] == master_key[master_key_found] )
-          {
-            master_key_found++;
-          }
-          else
-          {
-            master_key_found = 0;
-          }
-        }
 
-        if ( signing_key_found != -1 )
+          signing_key_found = true;
+        }
+      }
+      else
+      {
+        switch ( d_match_keyword( &descriptor_table, &line, &arguments ) )
         {
-          if ( signing_key_found == strlen( signing_key ) )
-          {
-            if ( rx_buffer[i] != '\n' )
+          case DESCRIPTOR_KEYWORD_MASTER_KEY:
+            if ( arguments.length >= sizeof( master_key_64 ) )
             {
-              signing_key_64[signing_key_64_length] = rx_buffer[i];
-              signing_key_64_length++;
+              memcpy( master_key_64, arguments.data, sizeof( master_key_64 ) );
+              master_key_found = true;
             }
 
-            if ( signing_key_64_length == 187 )
+            break;
+          case DESCRIPTOR_KEYWORD_NTOR_ONION_KEY:
+            if ( arguments.length >= sizeof( ntor_onion_key_64 ) )
             {
-              d_base_64_decode( der, signing_key_64, 187 );
-              wc_ShaUpdate( &tmp_sha, der, 140 );
-              wc_ShaFinal( &tmp_sha, identity_digest );
-
-              for ( j = 0; j < fetch_state->num_relays; j++ )
-              {
-                if ( memcmp( identity_digest, fetch_state->relays[j]->identity, ID_LENGTH ) == 0 )
-                {
-                  matched_relay = j;
-                  break;
-                }
-              }
-              signing_key_found = -1;
+              memcpy( ntor_onion_key_64, arguments.data, sizeof( ntor_onion_key_64 ) );
+              ntor_onion_key_found = true;
             }
-          }
-          else if ( rx_buffer[i] == signing_key[signing_key_found] )
-          {
-            signing_key_found++;
-          }
-          else
-          {
-            signing_key_found = 0;
-          }
+
+            break;
+          case DESCRIPTOR_KEYWORD_SIGNING_KEY:
+            in_signing_key = true;
+            signing_key_64_length = 0;
+
+            break;
+          default:
+            break;
         }
+      }
 
-        if ( master_key_found == -1 && ntor_onion_key_found == -1 && signing_key_found == -1 )
+      if ( master_key_found == true && ntor_onion_key_found == true && signing_key_found == true )
+      {
+        // a descriptor we didn't ask for still counts against the response
+        if ( matched_relay >= 0 )
         {
           d_base_64_decode( fetch_state->relays[matched_relay]->ntor_onion_key, ntor_onion_key_64, 43 );
           d_base_64_decode( fetch_state->relays[matched_relay]->master_key, master_key_64, 43 );
-
-          relays_set++;
-          master_key_64_length = 0;
-          master_key_found = 0;
-          ntor_onion_key_64_length = 0;
-          ntor_onion_key_found = 0;
-          signing_key_64_length = 0;
-          signing_key_found = 0;
         }
+
+        relays_set++;
+        matched_relay = -1;
+        master_key_found = false;
+        ntor_onion_key_found = false;
+        signing_key_found = false;
       }
     }
   }
 
 finish:
+  v_free_line_tokenizer( &tokenizer );
   wc_ShaFree( &tmp_sha );
 
-  shutdown( fetch_state->sock_fd, 0 );
-  close( fetch_state->sock_fd );
+  v_close_dir_request( &fetch_state->request );
 
   end = MINITOR_GET_TIME();
 
@@ -621,6 +829,8 @@ void v_handle_relay_fetch( void* pv_parameters )
   int final_relay_hit = 0;
   int waiting_relay = 0;
   int relays_fetched = 0;
+  bool tunnelled;
+  RelayBatch* batch = NULL;
 
   memset( fetch_states, 0, sizeof( fetch_states ) );
 
@@ -658,7 +868,7 @@ void v_handle_relay_fetch( void* pv_parameters )
               MINITOR_LOG( MINITOR_TAG, "Failed to start fetch of relay descriptors, retrying: %d", fetch_states[i].num_relays );
             }
 
-            fetch_poll[i].fd = fetch_states[i].sock_fd;
+            fetch_poll[i].fd = fetch_states[i].request.sock_fd;
             fetch_poll[i].events = POLLIN;
             running_fetches++;
           }
@@ -681,7 +891,7 @@ void v_handle_relay_fetch( void* pv_parameters )
                 MINITOR_LOG( MINITOR_TAG, "Failed to start fetch of relay descriptors, retrying: %d", fetch_states[i].num_relays );
               }
 
-              fetch_poll[i].fd = fetch_states[i].sock_fd;
+              fetch_poll[i].fd = fetch_states[i].request.sock_fd;
               fetch_poll[i].events = POLLIN;
               running_fetches++;
             }
@@ -701,20 +911,27 @@ void v_handle_relay_fetch( void* pv_parameters )
 
     if ( running_fetches > 0 )
     {
+      tunnelled = fetch_states[0].request.stream_id > 0 || fetch_states[1].request.stream_id > 0;
+
+      // tunnelled fetches have no fd, only wait on the sockets for a moment
+      // so their streams get checked too
       if ( final_relay_hit == 1 )
       {
-        succ = poll( fetch_poll, 2, -1 );
+        succ = poll( fetch_poll, 2, tunnelled == true ? DIR_STREAM_POLL_MS : -1 );
       }
       else
       {
         succ = poll( fetch_poll, 2, 0 );
       }
 
-      if ( succ > 0 )
+      if ( succ >= 0 )
       {
         for ( i = 0; i < 2; i++ )
         {
-          if ( ( fetch_poll[i].revents & POLLIN ) == POLLIN )
+          if (
+            ( fetch_poll[i].revents & POLLIN ) == POLLIN ||
+            ( fetch_states[i].request.stream_id > 0 && b_dir_stream_readable( download_dir_client, fetch_states[i].request.stream_id ) )
+          )
           {
             // we're going to assume that once a socket is ready to read, we can read the entire thing
             if ( d_finish_descriptor_fetch( &fetch_states[i] ) < 0 )
@@ -726,16 +943,29 @@ void v_handle_relay_fetch( void* pv_parameters )
                 MINITOR_LOG( MINITOR_TAG, "Failed to start fetch of relay descriptors, retrying: %d", fetch_states[i].num_relays );
               }
 
-              fetch_poll[i].fd = fetch_states[i].sock_fd;
+              fetch_poll[i].fd = fetch_states[i].request.sock_fd;
               fetch_poll[i].events = POLLIN;
             }
             else
             {
-              // send the fetched relays off to the insert task
+              // batch the fetched relays up for the hash workers
               for ( j = 0; j < fetch_states[i].num_relays; j++ )
               {
-                MINITOR_ENQUEUE_BLOCKING( insert_relays_queue, (void*)(&fetch_states[i].relays[j]) );
+                if ( batch == NULL )
+                {
+                  batch = malloc( sizeof( RelayBatch ) );
+                  batch->count = 0;
+                }
+
+                batch->relays[batch->count] = fetch_states[i].relays[j];
+                batch->count++;
                 relays_fetched++;
+
+                if ( batch->count == RELAY_BATCH_SIZE )
+                {
+                  MINITOR_ENQUEUE_BLOCKING( hash_relays_queue, (void*)(&batch) );
+                  batch = NULL;
+                }
               }
 
               fetch_poll[i].fd = -1;
@@ -748,251 +978,163 @@ void v_handle_relay_fetch( void* pv_parameters )
     }
   }
 
-  // send null, the insert task receives 2 before shutting down
-  onion_relay = NULL;
-  MINITOR_ENQUEUE_BLOCKING( insert_relays_queue, (void*)(&onion_relay) );
+  if ( batch != NULL )
+  {
+    MINITOR_ENQUEUE_BLOCKING( hash_relays_queue, (void*)(&batch) );
+  }
 
-  MINITOR_LOG( MINITOR_TAG, "This task fetched %d relays", relays_fetched );
-  MINITOR_TASK_DELETE( NULL );
-}
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( relay_batch_mutex );
 
-static int d_parse_date_string( char* date_string )
-{
-  struct tm tmp_time;
+  fetch_tasks_running--;
 
-  tmp_time.tm_year = atoi( date_string ) - 1900;
-  tmp_time.tm_mon = atoi( date_string + 5 ) - 1;
-  tmp_time.tm_mday = atoi( date_string + 8 );
-  tmp_time.tm_hour = atoi( date_string + 11 );
-  tmp_time.tm_min = atoi( date_string + 14 );
-  tmp_time.tm_sec = atoi( date_string + 17 );
+  // the last fetch task out sends each hash worker its shutdown null
+  if ( fetch_tasks_running == 0 )
+  {
+    batch = NULL;
 
-  return timegm( &tmp_time );
-}
+    for ( i = 0; i < hash_worker_count; i++ )
+    {
+      MINITOR_ENQUEUE_BLOCKING( hash_relays_queue, (void*)(&batch) );
+    }
+  }
 
-static int d_parse_line( int fd, char* line, int limit )
-{
-  int ret;
-  char out_char;
-  int length = 0;
-
-  while ( 1 )
-  {
-    ret = read( fd, &out_char, sizeof( char ) );
-
-    if ( ret < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read consensus line, errno: %d", errno );
-
-      return -1;
-    }
-
-    if ( ret == 0 || out_char == '\n' || length == limit )
-    {
-      line[length] = 0;
-      return length;
-    }
+  MINITOR_MUTEX_GIVE( relay_batch_mutex );
+  // MUTEX GIVE
 
-    line[length] = out_char;
-    length++;
-  }
+  MINITOR_LOG( MINITOR_TAG, "This task fetched %d relays", relays_fetched );
+  MINITOR_TASK_DELETE( NULL );
 }
 
 static int d_parse_network_consensus_from_file( int fd, NetworkConsensus* result_network_consensus )
 {
-  char line[200];
+  int ret;
+  LineTokenizer tokenizer;
+  KeywordTable consensus_table;
+  TokenSlice line;
+  TokenSlice arguments;
 
-  while ( 1 )
+  if ( d_init_consensus_keyword_table( &consensus_table ) < 0 )
   {
-    if ( d_parse_line( fd, line, sizeof( line ) ) < 0 )
-    {
-      return -1;
-    }
-
-    if ( result_network_consensus->method == 0 && memcmp( line, "consensus-method ", strlen( "consensus-method " ) ) == 0 )
-    {
-      result_network_consensus->method = atoi( line + strlen( "consensus-method " ) );
-    }
-    else if ( result_network_consensus->valid_after == 0 && memcmp( line, "valid-after ", strlen( "valid-after " ) ) == 0 )
-    {
-      result_network_consensus->valid_after = d_parse_date_string( line + strlen( "valid-after " ) );
-    }
-    else if ( result_network_consensus->fresh_until == 0 && memcmp( line, "fresh-until ", strlen( "fresh-until " ) ) == 0 )
-    {
-      result_network_consensus->fresh_until = d_parse_date_string( line + strlen( "fresh-until " ) );
-    }
-    else if ( result_network_consensus->valid_until == 0 && memcmp( line, "valid-until ", strlen( "valid-until " ) ) == 0 )
-    {
-      result_network_consensus->valid_until = d_parse_date_string( line + strlen( "valid-until " ) );
-    }
-    else if ( memcmp( line, "shared-rand-current-value ", strlen( "shared-rand-current-value " ) ) == 0 )
-    {
-      d_base_64_decode( result_network_consensus->shared_rand, line + strlen( line ) - 44, 43 );
-    }
-    else if ( memcmp( line, "shared-rand-previous-value ", strlen( "shared-rand-previous-value " ) ) == 0 )
-    {
-      d_base_64_decode( result_network_consensus->previous_shared_rand, line + strlen( line ) - 44, 43 );
-    }
-    else if ( memcmp( line, "dir-source", strlen( "dir-source" ) ) == 0 )
-    {
-      return 0;
-    }
+    return -1;
   }
-}
 
-static int d_parse_line_to_consensus( NetworkConsensus* consensus, char* line )
-{
-  if ( consensus->method == 0 && memcmp( line, "consensus-method ", strlen( "consensus-method " ) ) == 0 )
-  {
-    consensus->method = atoi( line + strlen( "consensus-method " ) );
-  }
-  else if ( consensus->valid_after == 0 && memcmp( line, "valid-after ", strlen( "valid-after " ) ) == 0 )
-  {
-    consensus->valid_after = d_parse_date_string( line + strlen( "valid-after " ) );
-  }
-  else if ( consensus->fresh_until == 0 && memcmp( line, "fresh-until ", strlen( "fresh-until " ) ) == 0 )
-  {
-    consensus->fresh_until = d_parse_date_string( line + strlen( "fresh-until " ) );
-  }
-  else if ( consensus->valid_until == 0 && memcmp( line, "valid-until ", strlen( "valid-until " ) ) == 0 )
-  {
-    consensus->valid_until = d_parse_date_string( line + strlen( "valid-until " ) );
-  }
-  else if ( memcmp( line, "shared-rand-current-value ", strlen( "shared-rand-current-value " ) ) == 0 )
+  if ( d_init_line_tokenizer( &tokenizer, fd ) < 0 )
   {
-    d_base_64_decode( consensus->shared_rand, line + strlen( line ) - 44, 43 );
+    return -1;
   }
-  else if ( memcmp( line, "shared-rand-previous-value ", strlen( "shared-rand-previous-value " ) ) == 0 )
+
+  while ( ( ret = d_next_line( &tokenizer, &line ) ) == 1 )
   {
-    d_base_64_decode( consensus->previous_shared_rand, line + strlen( line ) - 44, 43 );
+    if ( d_parse_line_to_consensus( result_network_consensus, d_match_keyword( &consensus_table, &line, &arguments ), &arguments ) == 1 )
+    {
+      break;
+    }
   }
-  else if ( memcmp( line, "dir-source", strlen( "dir-source" ) ) == 0 )
+
+  v_free_line_tokenizer( &tokenizer );
+
+  // ran out of file before the header finished
+  if ( ret != 1 )
   {
-    return 1;
+    MINITOR_LOG( MINITOR_TAG, "Failed to find the end of the consensus header" );
+
+    return -1;
   }
 
   return 0;
 }
 
-static void v_parse_r_tag( OnionRelay* canidate_relay, char* line )
+// loads the persisted consensus and the lists that go with it, allow_stale
+// reuses them until valid_until, otherwise only while they're still fresh
+static int d_load_persisted_consensus( bool allow_stale )
 {
-  int i;
-  int space_count = 1;
-
-  for ( i = 2; i < strlen( line ); i++ ) {
-    switch ( space_count ) {
-      case 2:
-        d_base_64_decode( canidate_relay->identity, line + i, 27 );
-        i += 27;
-        break;
-      case 3:
-        d_base_64_decode( canidate_relay->digest, line + i, 27 );
-        i += 27;
-        break;
-      case 6:
-        canidate_relay->address = inet_addr( line + i );
-        break;
-      case 7:
-        canidate_relay->or_port = atoi( line + i );
-        break;
-      case 8:
-        canidate_relay->dir_port = atoi( line + i );
-        break;
-      default:
-        break;
-    }
+  int fd;
+  int err;
+  time_t now;
+  NetworkConsensus file_consensus;
 
-    while ( line[i] != ' ' && i < strlen( line ) ) {
-      i++;
-    }
+  fd = open( FILESYSTEM_PREFIX "consensus", O_RDONLY );
 
-    space_count++;
+  if ( fd < 0 )
+  {
+    return -1;
   }
-}
 
-static void v_parse_s_tag( OnionRelay* canidate_relay, char* line )
-{
-  int i;
-  int j;
-  const char* tags[] = {
-    "Exit",
-    "Fast",
-    "Guard",
-    "HSDir",
-    "Stable",
-  };
-  bool found_vals[5] = { false, false, false, false, false };
-
-  for ( i = 2; i < strlen( line ); i++ )
-  {
-    for ( j = 0; j < 5; j++ )
-    {
-      if ( found_vals[j] == 0 && strlen( tags[j] ) + i <= strlen( line ) && memcmp( line + i, tags[j], strlen( tags[j] ) ) == 0 )
-      {
-        found_vals[j] = true;
-      }
-    }
+  memset( &file_consensus, 0, sizeof( NetworkConsensus ) );
 
-    while ( line[i] != ' ' && i < strlen( line ) )
-    {
-      i++;
-    }
-  }
+  err = d_parse_network_consensus_from_file( fd, &file_consensus );
 
-  if ( found_vals[1] && found_vals[4] ) {
-    canidate_relay->suitable = true;
-  }
+  close( fd );
 
-  canidate_relay->can_exit = found_vals[0];
-  canidate_relay->can_guard = found_vals[2];
-  canidate_relay->hsdir = found_vals[3];
-}
+  time( &now );
 
-static void v_parse_pr_tag( OnionRelay* canidate_relay, char* line )
-{
-  int i;
-  int found_index = 0;
-  const char* dir_cache = "DirCache";
-  bool dir_cache_found = 0;
+#ifdef MINITOR_CHUTNEY
+  file_consensus.hsdir_interval = 8;
+#else
+  file_consensus.hsdir_interval = HSDIR_INTERVAL_DEFAULT;
+#endif
 
-  for ( i = 3; i < strlen( line ); i++ )
-  {
-    if ( found_index <= 0 && i + strlen( dir_cache ) <= strlen( line ) && memcmp( line + i, dir_cache, strlen( dir_cache ) ) )
-    {
-      dir_cache_found = true;
-      found_index = 1;
-      break;
-    }
+  file_consensus.hsdir_n_replicas = HSDIR_N_REPLICAS_DEFAULT;
+  file_consensus.hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT;
 
-    while ( line[i] != ' ' && i < strlen( line ) )
-    {
-      i++;
-    }
+  v_set_default_bandwidth_weights( &file_consensus.bandwidth_weights );
+
+  // consensus is still valid, or still fresh if we're revalidating
+  if (
+    err == 0 &&
+    now < ( allow_stale ? file_consensus.valid_until : file_consensus.fresh_until ) &&
+    file_consensus.valid_until == d_get_hsdir_relay_valid_until() &&
+    d_load_hsdir_relay_count() >= 0 &&
+    file_consensus.valid_until == d_get_cache_relay_valid_until() &&
+    d_load_cache_relay_count() >= 0 &&
+    file_consensus.valid_until == d_get_fast_relay_valid_until() &&
+    d_load_fast_relay_count() >= 0 &&
+    d_load_relay_tables( &file_consensus ) >= 0
+  )
+  {
+    return 0;
   }
 
-  canidate_relay->dir_cache = dir_cache_found;
+  return -1;
 }
 
-static int d_parse_line_to_relay( OnionRelay* relay, char* line )
+// picks up the lists the owner of the relay database committed, returns 1
+// if there is nothing newer than what we already have
+static int d_attach_relay_db()
 {
-  if ( line[0] == 'r' && line[1] == ' ' )
+  int ret;
+
+  if ( b_relay_db_changed() == false )
   {
-    v_parse_r_tag( relay, line );
+    return 1;
   }
-  else if ( line[0] == 's' && line[1] == ' ' )
+
+  if ( d_begin_relay_db_read() < 0 )
   {
-    v_parse_s_tag( relay, line );
+    return -1;
   }
-  else if ( line[0] == 'p' && line[1] == 'r' && line[2] == ' ' )
+
+  // the owner refreshes before valid_until, anything older is left for it
+  ret = d_load_persisted_consensus( true );
+
+  v_end_relay_db_read( ret == 0 );
+
+  if ( ret < 0 )
   {
-    v_parse_pr_tag( relay, line );
     return 1;
   }
 
+  MINITOR_LOG( MINITOR_TAG, "Attached to relay database generation %u", ul_get_relay_db_generation() );
+
+  v_publish_bootstrap_milestones( BOOTSTRAP_ALL );
+
   return 0;
 }
 
-static int d_download_consensus()
+// allow_stale reuses the persisted consensus until valid_until, otherwise
+// it is only reused while it is still fresh
+static int d_download_consensus( bool allow_stale )
 {
   int ret = 0;
   const char* REQUEST_FMT = "GET /tor/status-vote/current/consensus HTTP/1.0\r\n"
@@ -1001,30 +1143,29 @@ static int d_download_consensus()
       "\r\n";
   char REQUEST[120];
   char ip_addr_str[16];
-  char date_str[20];
-  char line[200];
-  int line_length = 0;
-  char* authority_string;
+  LineTokenizer tokenizer;
+  KeywordTable consensus_table;
+  TokenSlice line;
+  TokenSlice arguments;
+  int keyword;
   int i;
   char* rx_buffer;
   struct sockaddr_in dest_addr;
-  int sock_fd;
-  int fd;
-  int err;
+  DirRequest consensus_request;
   int rx_length;
   int rx_total = 0;
   char end_header = 0;
-  const char* valid_until_str = "valid-until ";
-  int valid_until_found = 0;
-  time_t now;
-  time_t valid_until_time;
   OnionRelay parse_relay;
   OnionRelay* tmp_relay;
   int finished_consensus = 0;
   NetworkConsensus* consensus;
   int found_hsdir = 0;
+  int resolved_hsdir = 0;
+  DescriptorCache descriptor_cache;
+  RelayBatch* resolved_batch = NULL;
   bool insert_finished = false;
   MinitorTask fetch_handles[2];
+  MinitorTask hash_handles[HASH_WORKER_MAX];
   MinitorTask crypto_insert_handle;
   struct stat st;
 
@@ -1038,109 +1179,23 @@ static int d_download_consensus()
     }
   }
 
+  // another process owns the shared relay database, read its lists
+  // instead of downloading our own
+  if ( b_relay_db_owner() == false )
+  {
+    return d_attach_relay_db();
+  }
+
 #ifndef MINITOR_CHUTNEY
   // check if our current consensus is still fresh, no need to re-download
-  fd = open( FILESYSTEM_PREFIX "consensus", O_RDONLY );
-
-  if ( fd >= 0 )
+  if ( b_relay_db_compatible() == true && d_load_persisted_consensus( allow_stale ) == 0 )
   {
-    i = 0;
-
-    while ( valid_until_found < strlen( valid_until_str ) )
-    {
-      rx_length = read( fd, date_str, sizeof( char ) );
-
-      i++;
-
-      if ( rx_length != sizeof( char ) || i > 500 )
-      {
-        MINITOR_LOG( MINITOR_TAG, "Failed to find valid-until value" );
-
-        break;
-      }
-
-      if ( date_str[0] == valid_until_str[valid_until_found] )
-      {
-        valid_until_found++;
-
-        if ( valid_until_found == strlen( valid_until_str ) )
-        {
-          rx_length = read( fd, date_str, sizeof( date_str ) );
-          date_str[19] = 0;
-
-          if ( rx_length == sizeof( date_str ) )
-          {
-            time( &now );
-            valid_until_time = d_parse_date_string( date_str );
-
-            // consensus is still valid
-            if (
-              now < valid_until_time &&
-              valid_until_time == d_get_hsdir_relay_valid_until() &&
-              d_load_hsdir_relay_count() >= 0 &&
-              valid_until_time == d_get_cache_relay_valid_until() &&
-              d_load_cache_relay_count() >= 0 &&
-              valid_until_time == d_get_fast_relay_valid_until() &&
-              d_load_fast_relay_count() >= 0
-            )
-            {
-              MINITOR_LOG( MINITOR_TAG, "Using valid consensus already downloaded" );
+    MINITOR_LOG( MINITOR_TAG, "Using valid consensus already downloaded" );
 
-              err = lseek( fd, 0, SEEK_SET );
+    v_publish_bootstrap_milestones( BOOTSTRAP_ALL );
 
-              if ( err < 0 )
-              {
-                MINITOR_LOG( MINITOR_TAG, "Failed to lseek " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
-
-                close( fd );
-
-                return -1;
-              }
-
-              // BEGIN mutex for the network consensus
-              MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
-
-              network_consensus.method = 0;
-              network_consensus.valid_after = 0;
-              network_consensus.fresh_until = 0;
-              network_consensus.valid_until = 0;
-
-#ifdef MINITOR_CHUTNEY
-              network_consensus.hsdir_interval = 8;
-#else
-              network_consensus.hsdir_interval = HSDIR_INTERVAL_DEFAULT;
-#endif
-
-              network_consensus.hsdir_n_replicas = HSDIR_N_REPLICAS_DEFAULT;
-              network_consensus.hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT;
-
-              if ( d_parse_network_consensus_from_file( fd, &network_consensus ) )
-              {
-                MINITOR_LOG( MINITOR_TAG, "Failed to parse network consensus from file" );
-
-                close( fd );
-
-                return -1;
-              }
-
-              MINITOR_MUTEX_GIVE( network_consensus_mutex );
-              // END mutex for the network consensus
-
-              return 0;
-            }
-          }
-
-          break;
-        }
-      }
-      else
-      {
-        valid_until_found = 0;
-      }
-    }
+    return 0;
   }
-
-  close( fd );
 #endif
 
   if ( d_reset_staging_hsdir_relays() < 0 )
@@ -1173,53 +1228,43 @@ static int d_download_consensus()
 
   dest_addr.sin_family = AF_INET;
 
-  // create a socket to access the consensus
-  sock_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
-
-  if ( sock_fd < 0 )
+  // a refresh already knows caches to build a circuit to, the consensus and
+  // all the descriptor fetches share BEGIN_DIR streams on it, a cold start
+  // has to use plain connections
+  if ( d_get_cache_relay_count() > 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "couldn't create a socket to http server" );
-
-    return -1;
+    download_dir_client = px_create_dir_client();
   }
 
-  // connect the socket to the dir server address
-  err = connect( sock_fd, (struct sockaddr*) &dest_addr, sizeof( dest_addr ) );
-
-  if ( err != 0 )
+  if ( d_send_dir_request( &consensus_request, &dest_addr, REQUEST ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "couldn't connect to http server" );
-
-    close( sock_fd );
+    v_free_download_dir_client();
 
     return -1;
   }
 
-  // send the http request to the dir server
-  err = send( sock_fd, REQUEST, strlen( REQUEST ), 0 );
-
-  if ( err < 0 )
+  // the consensus is staged next to the relay lists and committed with them
+  if ( d_open_buffered_file( &consensus_file, FILESYSTEM_PREFIX "consensus_stg" ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "couldn't send to http server" );
-
-    shutdown( sock_fd, 0 );
-    close( sock_fd );
+    v_close_dir_request( &consensus_request );
+    v_free_download_dir_client();
 
     return -1;
   }
 
-  if ( ( fd = open( FILESYSTEM_PREFIX "consensus", O_CREAT | O_TRUNC, 0600 ) ) < 0 )
+  if (
+    d_init_line_tokenizer( &tokenizer, -1 ) < 0 ||
+    d_init_consensus_keyword_table( &consensus_table ) < 0
+  )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
-
-    shutdown( sock_fd, 0 );
-    close( sock_fd );
+    v_free_line_tokenizer( &tokenizer );
+    d_close_buffered_file( &consensus_file );
+    v_close_dir_request( &consensus_request );
+    v_free_download_dir_client();
 
     return -1;
   }
 
-  close( fd );
-
   memset( &parse_relay, 0, sizeof( OnionRelay ) );
 
   consensus = malloc( sizeof( NetworkConsensus ) );
@@ -1239,10 +1284,15 @@ static int d_download_consensus()
   consensus->hsdir_n_replicas = HSDIR_N_REPLICAS_DEFAULT;
   consensus->hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT;
 
+  v_set_default_bandwidth_weights( &consensus->bandwidth_weights );
+
+  // descriptors whose digest is already cached don't get fetched
+  d_load_descriptor_cache( &descriptor_cache );
+
   while ( 1 )
   {
     // recv data from the destination and fill the rx_buffer with the data
-    rx_length = recv( sock_fd, rx_buffer, 4092, 0 );
+    rx_length = d_recv_dir_response( &consensus_request, rx_buffer, 4092 );
 
     // if we got less than 0 we encoutered an error
     if ( rx_length < 0 )
@@ -1267,105 +1317,111 @@ static int d_download_consensus()
       break;
     }
 
+    v_feed_line_tokenizer( &tokenizer, rx_buffer, rx_length );
+
     i = 0;
 
-    if ( end_header < 4 )
+    // skip over the http header, it ends with an empty line
+    if ( end_header == 0 )
     {
-      for ( i = 0; i < rx_length; i++ ) {
-        // skip over the http header, when we get two \r\n s in a row we
-        // know we're at the end
-        // increment end_header whenever we get part of a carrage retrun
-        if ( rx_buffer[i] == '\r' || rx_buffer[i] == '\n' )
+      while ( d_next_line( &tokenizer, &line ) == 1 )
+      {
+        if ( line.length == 0 )
         {
-          end_header++;
+          end_header = 1;
+          i = tokenizer.offset;
 
-          if ( end_header >= 4 )
-          {
-            break;
-          }
-        // otherwise reset the count
-        }
-        else
-        {
-          end_header = 0;
+          break;
         }
       }
     }
 
-    if ( end_header >= 4 )
+    if ( end_header == 1 )
     {
       // first write chunck to consensus to file
-      do
+      if ( d_write_buffered_file( &consensus_file, rx_buffer + i, rx_length - i ) < 0 )
       {
-        if ( ( fd = open( FILESYSTEM_PREFIX "consensus", O_WRONLY | O_APPEND ) ) < 0 )
-        {
-          MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
+        ret = -1;
+        goto finish;
+      }
 
-          continue;
-        }
+      // then parse out the relays line by line and send them off for processing
+      while ( d_next_line( &tokenizer, &line ) == 1 )
+      {
+        keyword = d_match_keyword( &consensus_table, &line, &arguments );
 
-        err = write( fd, rx_buffer + i, ( rx_length - i ) );
+        if ( finished_consensus == 0 && d_parse_line_to_consensus( consensus, keyword, &arguments ) == 1 )
+        {
+          finished_consensus = 1;
 
-        if ( err != ( rx_length - i ) ) {
-          MINITOR_LOG( MINITOR_TAG, "Failed to write " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
+          consensus->time_period = d_get_hs_time_period( consensus->fresh_until, consensus->valid_after, consensus->hsdir_interval );
 
-          close( fd );
-        }
-      } while ( err != ( rx_length - i ) );
+          // sizeof pointer, not the actual struct
+          insert_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( RelayBatch* ) );
+          hash_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( RelayBatch* ) );
+          fetch_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
 
-      close( fd );
+          fetch_tasks_running = 2;
+          hash_worker_count = MINITOR_CORE_COUNT();
 
-      // then parse out the relays line by line and send them off for processing
-      // i is already set to be after the header or 0 if the header was passed
-      for ( ; i < rx_length; i++ )
-      {
-        if ( rx_buffer[i] != '\n' )
-        {
-          line[line_length] = rx_buffer[i];
-          line_length++;
+          if ( hash_worker_count > HASH_WORKER_MAX )
+          {
+            hash_worker_count = HASH_WORKER_MAX;
+          }
+
+          // create two v_handle_relay_fetch to increase throughput
+          b_create_fetch_task( &fetch_handles[0], consensus );
+          b_create_fetch_task( &fetch_handles[1], consensus );
 
-          // wrap around, we actually don't care about lines that are too long
-          if ( line_length >= sizeof( line ) )
+          // node index hashing is spread over the cores, file writes stay
+          // on the single insert task
+          for ( i = 0; i < hash_worker_count; i++ )
           {
-            line_length = 0;
+            b_create_hash_task( &hash_handles[i], consensus );
           }
+
+          b_create_insert_task( &crypto_insert_handle, consensus );
         }
-        else
+        else if ( finished_consensus == 1 && keyword == CONSENSUS_KEYWORD_BANDWIDTH_WEIGHTS )
         {
-          // NULL terminator
-          line[line_length] = 0;
-
-          if ( finished_consensus == 0 && d_parse_line_to_consensus( consensus, line ) == 1 )
+          v_parse_bandwidth_weights( &consensus->bandwidth_weights, &arguments );
+        }
+        // 1 means the relay is ready to have its descriptors fetched
+        else if ( finished_consensus == 1 && d_parse_line_to_relay( &parse_relay, keyword, &arguments ) == 1 )
+        {
+          if ( parse_relay.hsdir == 1 )
           {
-            finished_consensus = 1;
+            found_hsdir++;
+            tmp_relay = malloc( sizeof( OnionRelay ) );
+            memcpy( tmp_relay, &parse_relay, sizeof( OnionRelay ) );
 
-            consensus->time_period = d_get_hs_time_period( consensus->fresh_until, consensus->valid_after, consensus->hsdir_interval );
+            if ( b_resolve_relay_descriptor( &descriptor_cache, tmp_relay ) == true )
+            {
+              resolved_hsdir++;
 
-            // sizeof pointer, not the actual struct
-            insert_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
-            fetch_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
+              if ( resolved_batch == NULL )
+              {
+                resolved_batch = malloc( sizeof( RelayBatch ) );
+                resolved_batch->count = 0;
+              }
 
-            // create two v_handle_relay_fetch to increase throughput
-            b_create_fetch_task( &fetch_handles[0], consensus );
-            b_create_fetch_task( &fetch_handles[1], consensus );
+              resolved_batch->relays[resolved_batch->count] = tmp_relay;
+              resolved_batch->count++;
 
-            b_create_insert_task( &crypto_insert_handle, consensus );
-          }
-          // 1 means the relay is ready to have its descriptors fetched
-          else if ( finished_consensus == 1 && d_parse_line_to_relay( &parse_relay, line ) == 1 )
-          {
-            if ( parse_relay.hsdir == 1 )
+              // already resolved, straight on to the hash workers
+              if ( resolved_batch->count == RELAY_BATCH_SIZE )
+              {
+                MINITOR_ENQUEUE_BLOCKING( hash_relays_queue, (void*)(&resolved_batch) );
+                resolved_batch = NULL;
+              }
+            }
+            else
             {
-              found_hsdir++;
-              tmp_relay = malloc( sizeof( OnionRelay ) );
-              memcpy( tmp_relay, &parse_relay, sizeof( OnionRelay ) );
               MINITOR_ENQUEUE_BLOCKING( fetch_relays_queue, (void*)(&tmp_relay) );
             }
-
-            memset( &parse_relay, 0, sizeof( OnionRelay ) );
           }
 
-          line_length = 0;
+          memset( &parse_relay, 0, sizeof( OnionRelay ) );
         }
       }
     }
@@ -1373,10 +1429,16 @@ static int d_download_consensus()
     rx_total += rx_length;
   }
 
-  MINITOR_LOG( MINITOR_TAG, "Found %d hsdir relays in the consensus", found_hsdir );
+  MINITOR_LOG( MINITOR_TAG, "Found %d hsdir relays in the consensus, %d descriptors cached, %d evicted", found_hsdir, resolved_hsdir, (int)descriptor_cache.count - resolved_hsdir );
 
-  // send two nulls, each fetch task will forward it to the insert task which
-  // will wait for 2 before quitting
+  if ( resolved_batch != NULL )
+  {
+    MINITOR_ENQUEUE_BLOCKING( hash_relays_queue, (void*)(&resolved_batch) );
+    resolved_batch = NULL;
+  }
+
+  // send two nulls, one per fetch task, the last fetch task to finish shuts
+  // down the hash workers which in turn shut down the insert task
   tmp_relay = NULL;
   MINITOR_ENQUEUE_BLOCKING( fetch_relays_queue, (void*)(&tmp_relay) );
   MINITOR_ENQUEUE_BLOCKING( fetch_relays_queue, (void*)(&tmp_relay) );
@@ -1397,33 +1459,42 @@ static int d_download_consensus()
   if (
     d_set_staging_hsdir_relay_valid_until( consensus->valid_until ) < 0 ||
     d_set_staging_cache_relay_valid_until( consensus->valid_until ) < 0 ||
-    d_set_staging_fast_relay_valid_until( consensus->valid_until ) < 0
+    d_set_staging_fast_relay_valid_until( consensus->valid_until ) < 0 ||
+    d_set_staging_bandwidth_weights( &consensus->bandwidth_weights ) < 0
   )
   {
     ret = -1;
     goto finish;
   }
 
-  // BEGIN mutex for the network consensus
-  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
-
-  network_consensus.method = consensus->method;
-  network_consensus.valid_after = consensus->valid_after;
-  network_consensus.fresh_until = consensus->fresh_until;
-  network_consensus.valid_until = consensus->valid_until;
-
-  memcpy( network_consensus.previous_shared_rand, consensus->previous_shared_rand, 32 );
-  memcpy( network_consensus.shared_rand, consensus->shared_rand, 32 );
+  if ( d_begin_relay_db_commit() < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
 
-  if ( d_finalize_staged_relay_lists() < 0 )
+  // the new tables are built on the side and published in one swap, circuits
+  // keep using the snapshot they hold in the meantime
+  if (
+    d_commit_buffered_file( &consensus_file, FILESYSTEM_PREFIX "consensus" ) < 0 ||
+    d_finalize_staged_relay_lists( consensus ) < 0
+  )
   {
     ret = -1;
 
     MINITOR_LOG( MINITOR_TAG, "Failed to finalize staged relay lists" );
   }
 
-  MINITOR_MUTEX_GIVE( network_consensus_mutex );
-  // END mutex for the network consensus
+  // other processes attached to the relay database pick it up from here
+  if ( d_end_relay_db_commit( ret == 0 ) < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( ret == 0 )
+  {
+    v_publish_bootstrap_milestones( BOOTSTRAP_ALL );
+  }
 
 finish:
   if ( finished_consensus == 1 )
@@ -1432,73 +1503,44 @@ finish:
     {
       MINITOR_TASK_DELETE( fetch_handles[0] );
       MINITOR_TASK_DELETE( fetch_handles[1] );
+
+      for ( i = 0; i < hash_worker_count; i++ )
+      {
+        MINITOR_TASK_DELETE( hash_handles[i] );
+      }
+
       MINITOR_TASK_DELETE( crypto_insert_handle );
     }
 
     MINITOR_QUEUE_DELETE( fetch_relays_queue );
+    MINITOR_QUEUE_DELETE( hash_relays_queue );
     MINITOR_QUEUE_DELETE( insert_relays_queue );
   }
 
-  free( rx_buffer );
-  free( consensus );
-
-  // we're done reading data from the directory server, shutdown and close the socket
-  shutdown( sock_fd, 0 );
-  close( sock_fd );
-
-  return ret;
-}
-
-static int d_parse_single_relay( int fd, OnionRelay* canidate_relay ) {
-  int ret;
-  int done = 0;
-  char line[512];
-
-  do 
+  if ( resolved_batch != NULL )
   {
-    ret = d_parse_line( fd, line, sizeof( line ) );
-
-    if ( ret == 0 )
+    for ( i = 0; i < resolved_batch->count; i++ )
     {
-      return 1;
+      free( resolved_batch->relays[i] );
     }
 
-    if ( ret < 0 )
-    {
-      return -1;
-    }
-  } while ( line[0] != 'r' || line[1] != ' ' );
+    free( resolved_batch );
+  }
 
-  while ( !done )
-  {
-    switch ( line[0] )
-    {
-      case 'r':
-        v_parse_r_tag( canidate_relay, line );
-        break;
-      case 's':
-        v_parse_s_tag( canidate_relay, line );
-        break;
-      case 'v':
-        break;
-      case 'w':
-        break;
-      case 'p':
-        if ( line[1] == 'r' )
-        {
-          v_parse_pr_tag( canidate_relay, line );
-          done = 1;
-        }
-        break;
-    }
+  // only still open if we failed before committing it
+  d_close_buffered_file( &consensus_file );
+  v_free_line_tokenizer( &tokenizer );
+  v_free_descriptor_cache( &descriptor_cache );
 
-    if ( d_parse_line( fd, line, sizeof( line ) ) < 0 )
-    {
-      return -1;
-    }
-  }
+  free( rx_buffer );
+  free( consensus );
 
-  return 0;
+  // we're done reading data from the directory server, the fetch tasks are
+  // done with the dir circuit too
+  v_close_dir_request( &consensus_request );
+  v_free_download_dir_client();
+
+  return ret;
 }
 
 int d_get_hs_time_period( time_t fresh_until, time_t valid_after, int hsdir_interval )
@@ -1527,29 +1569,44 @@ int d_get_hs_time_period( time_t fresh_until, time_t valid_after, int hsdir_inte
 }
 
 // fetch the network consensus so we can correctly create circuits
-int d_fetch_consensus_info()
+int d_fetch_consensus_info( bool allow_stale )
 {
   int ret = 0;
   //NetworkConsensus* result_network_consensus;
   time_t now = 0;
   int voting_interval;
   time_t next_srv_time;
+  time_t refresh_time;
+  ConsensusSnapshot* snapshot;
+
+  ret = d_download_consensus( allow_stale );
 
-  if ( d_download_consensus() < 0 )
+  if ( ret < 0 )
   {
-    ret = -1;
+    goto finish;
+  }
+
+  // waiting on the owner of the relay database to commit something newer
+  if ( ret == 1 )
+  {
+    ret = 0;
+
+    MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, RELAY_DB_POLL_MS );
+
     goto finish;
   }
 
   time( &now );
 
+  snapshot = px_acquire_consensus_snapshot();
+
 #ifdef MINITOR_CHUTNEY
   // in chutney we want to update when a new shared rand is expected, not when we lose freshness
-  voting_interval = network_consensus.fresh_until - network_consensus.valid_after;
+  voting_interval = snapshot->consensus.fresh_until - snapshot->consensus.valid_after;
 
   // 24 is SHARED_RANDOM_N_ROUNDS * SHARED_RANDOM_N_PHASES
   // get it on voting interval after, just to be careful
-  next_srv_time = network_consensus.valid_after + ( ( 24 - ( ( ( network_consensus.valid_after / voting_interval ) ) % 24 ) + 1 ) * voting_interval );
+  next_srv_time = snapshot->consensus.valid_after + ( ( 24 - ( ( ( snapshot->consensus.valid_after / voting_interval ) ) % 24 ) + 1 ) * voting_interval );
 
   if ( next_srv_time <= now )
   {
@@ -1560,12 +1617,276 @@ int d_fetch_consensus_info()
 
   MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, 1000 * ( next_srv_time - now ) );
 #else
-  MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, 1000 * ( network_consensus.valid_until - now ) );
+  // stale while revalidate, refresh at a random point in the first half of
+  // the window between fresh_until and valid_until, the current lists keep
+  // serving circuits until the new ones are finalized
+  refresh_time = snapshot->consensus.fresh_until;
+
+  if ( snapshot->consensus.valid_until > snapshot->consensus.fresh_until )
+  {
+    refresh_time += MINITOR_RANDOM() % ( ( snapshot->consensus.valid_until - snapshot->consensus.fresh_until ) / 2 + 1 );
+  }
+
+  // already stale, probably a warm start, refresh straight away
+  if ( refresh_time <= now )
+  {
+    refresh_time = now + 1;
+  }
+
+  MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, 1000 * ( refresh_time - now ) );
 #endif
 
+  v_release_consensus_snapshot( snapshot );
+
   MINITOR_LOG( MINITOR_TAG, "finished fetching consensus" );
 
 finish:
   // return 0 for no errors
   return ret;
 }
+
+void v_handle_consensus_refresh( void* pv_parameters )
+{
+  bool allow_stale;
+
+  // BEGIN mutex for the network consensus
+  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+
+  allow_stale = consensus_refresh_allow_stale;
+
+  MINITOR_MUTEX_GIVE( network_consensus_mutex );
+  // END mutex for the network consensus
+
+  if ( d_fetch_consensus_info( allow_stale ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to refresh consensus, retrying" );
+
+    MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, 500 );
+  }
+
+  // BEGIN mutex for the network consensus
+  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+
+  consensus_refreshing = false;
+
+  MINITOR_MUTEX_GIVE( network_consensus_mutex );
+  // END mutex for the network consensus
+
+  MINITOR_TASK_DELETE( NULL );
+}
+
+// kick off a background download, a refresh that is already running is left
+// to finish on its own
+int d_start_consensus_refresh( bool allow_stale )
+{
+  int ret = 0;
+
+  // BEGIN mutex for the network consensus
+  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+
+  if ( consensus_refreshing == false )
+  {
+    consensus_refresh_allow_stale = allow_stale;
+
+    if ( b_create_consensus_task( &consensus_refresh_task ) == true )
+    {
+      consensus_refreshing = true;
+    }
+    else
+    {
+      ret = -1;
+    }
+  }
+
+  MINITOR_MUTEX_GIVE( network_consensus_mutex );
+  // END mutex for the network consensus
+
+  return ret;
+}
+
+void v_start_bootstrap()
+{
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( bootstrap_mutex );
+
+  bootstrap_start = MINITOR_GET_TIME();
+
+  MINITOR_MUTEX_GIVE( bootstrap_mutex );
+  // MUTEX GIVE
+}
+
+// marks milestones as reached, each one is logged with the time it took the
+// first time it is published and wakes anyone in v_wait_for_bootstrap
+void v_publish_bootstrap_milestones( int milestones )
+{
+  int reached;
+  time_t elapsed;
+  void* token = NULL;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( bootstrap_mutex );
+
+  reached = milestones & ~bootstrap_status;
+  bootstrap_status |= reached;
+  elapsed = MINITOR_GET_TIME() - bootstrap_start;
+
+  MINITOR_MUTEX_GIVE( bootstrap_mutex );
+  // MUTEX GIVE
+
+  if ( reached == 0 )
+  {
+    return;
+  }
+
+  if ( ( reached & BOOTSTRAP_ENOUGH_GUARDS ) != 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Bootstrap: enough guards after %ld seconds", (long)elapsed );
+  }
+
+  if ( ( reached & BOOTSTRAP_ENOUGH_MIDDLES ) != 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Bootstrap: enough middles after %ld seconds", (long)elapsed );
+  }
+
+  if ( ( reached & BOOTSTRAP_HSDIR_RING ) != 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Bootstrap: hsdir ring complete after %ld seconds", (long)elapsed );
+  }
+
+  if ( ( reached & BOOTSTRAP_FIRST_INTRO ) != 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Bootstrap: first intro circuit after %ld seconds", (long)elapsed );
+  }
+
+  MINITOR_ENQUEUE_BLOCKING( bootstrap_queue, (void*)(&token) );
+}
+
+bool b_bootstrap_reached( int milestones )
+{
+  bool ret;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( bootstrap_mutex );
+
+  ret = ( bootstrap_status & milestones ) == milestones;
+
+  MINITOR_MUTEX_GIVE( bootstrap_mutex );
+  // MUTEX GIVE
+
+  return ret;
+}
+
+// block until all of milestones are reached, only d_minitor_INIT waits here,
+// every publish leaves one token so the queue never fills
+void v_wait_for_bootstrap( int milestones )
+{
+  void* token;
+
+  while ( b_bootstrap_reached( milestones ) == false )
+  {
+    MINITOR_DEQUEUE_BLOCKING( bootstrap_queue, (void*)(&token) );
+  }
+}
+
+// the pointer load and the reference are taken together under snapshot_mutex
+// so a publisher can drop the snapshot it replaced without waiting on anyone,
+// the mutex is only held for those two steps
+ConsensusSnapshot* px_acquire_consensus_snapshot()
+{
+  ConsensusSnapshot* snapshot;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( snapshot_mutex );
+
+  snapshot = atomic_load( &current_snapshot );
+  atomic_fetch_add( &snapshot->references, 1 );
+
+  MINITOR_MUTEX_GIVE( snapshot_mutex );
+  // MUTEX GIVE
+
+  return snapshot;
+}
+
+void v_release_consensus_snapshot( ConsensusSnapshot* snapshot )
+{
+  if ( atomic_fetch_sub( &snapshot->references, 1 ) == 1 )
+  {
+    v_release_relay_selection_table( snapshot->selection_table );
+    v_release_hsdir_ring( snapshot->hsdir_ring );
+    free( snapshot );
+  }
+}
+
+// takes over the references passed in, anything left NULL carries over from
+// the current snapshot
+int d_publish_consensus_snapshot( NetworkConsensus* consensus, RelaySelectionTable* selection_table, HsDirRing* hsdir_ring )
+{
+  ConsensusSnapshot* snapshot;
+  ConsensusSnapshot* old_snapshot;
+
+  snapshot = malloc( sizeof( ConsensusSnapshot ) );
+
+  if ( snapshot == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate consensus snapshot" );
+
+    v_release_relay_selection_table( selection_table );
+    v_release_hsdir_ring( hsdir_ring );
+
+    return -1;
+  }
+
+  atomic_init( &snapshot->references, 1 );
+
+  // BEGIN mutex for the network consensus
+  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+
+  old_snapshot = atomic_load( &current_snapshot );
+
+  if ( consensus != NULL )
+  {
+    memcpy( &snapshot->consensus, consensus, sizeof( NetworkConsensus ) );
+  }
+  else if ( old_snapshot != NULL )
+  {
+    memcpy( &snapshot->consensus, &old_snapshot->consensus, sizeof( NetworkConsensus ) );
+  }
+  else
+  {
+    memcpy( &snapshot->consensus, &default_network_consensus, sizeof( NetworkConsensus ) );
+  }
+
+  if ( selection_table == NULL && old_snapshot != NULL )
+  {
+    selection_table = old_snapshot->selection_table;
+    v_retain_relay_selection_table( selection_table );
+  }
+
+  if ( hsdir_ring == NULL && old_snapshot != NULL )
+  {
+    hsdir_ring = old_snapshot->hsdir_ring;
+    v_retain_hsdir_ring( hsdir_ring );
+  }
+
+  snapshot->selection_table = selection_table;
+  snapshot->hsdir_ring = hsdir_ring;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( snapshot_mutex );
+
+  atomic_store( &current_snapshot, snapshot );
+
+  MINITOR_MUTEX_GIVE( snapshot_mutex );
+  // MUTEX GIVE
+
+  MINITOR_MUTEX_GIVE( network_consensus_mutex );
+  // END mutex for the network consensus
+
+  // every reader that saw the old pointer already holds its reference
+  if ( old_snapshot != NULL )
+  {
+    v_release_consensus_snapshot( old_snapshot );
+  }
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../h/constants.h"
+#include "../h/encoding.h"
+#include "../h/consensus_parser.h"
+
+// indexed by the keyword enum in consensus_parser.h
+static const char* consensus_keywords[] = {
+  "consensus-method",
+  "valid-after",
+  "fresh-until",
+  "valid-until",
+  "shared-rand-current-value",
+  "shared-rand-previous-value",
+  "dir-source",
+  "r",
+  "s",
+  "pr",
+  "w",
+  "bandwidth-weights",
+};
+
+int d_init_consensus_keyword_table( KeywordTable* table )
+{
+  return d_init_keyword_table( table, consensus_keywords, CONSENSUS_KEYWORD_COUNT );
+}
+
+static int d_parse_date_string( TokenSlice* date )
+{
+  struct tm tmp_time;
+  const char* date_string = date->data;
+
+  // YYYY-MM-DD HH:MM:SS
+  if ( date->length < 19 )
+  {
+    return 0;
+  }
+
+  tmp_time.tm_year = atoi( date_string ) - 1900;
+  tmp_time.tm_mon = atoi( date_string + 5 ) - 1;
+  tmp_time.tm_mday = atoi( date_string + 8 );
+  tmp_time.tm_hour = atoi( date_string + 11 );
+  tmp_time.tm_min = atoi( date_string + 14 );
+  tmp_time.tm_sec = atoi( date_string + 17 );
+
+  return timegm( &tmp_time );
+}
+
+static void v_parse_shared_rand( uint8_t* shared_rand, TokenSlice* arguments )
+{
+  TokenSlice reveals;
+  TokenSlice value;
+
+  if ( b_next_token( arguments, &reveals ) && b_next_token( arguments, &value ) && value.length >= 43 )
+  {
+    d_base_64_decode( shared_rand, (char*)value.data, 43 );
+  }
+}
+
+int d_parse_line_to_consensus( NetworkConsensus* consensus, int keyword, TokenSlice* arguments )
+{
+  switch ( keyword )
+  {
+    case CONSENSUS_KEYWORD_METHOD:
+      if ( consensus->method == 0 )
+      {
+        consensus->method = ul_token_to_number( arguments );
+      }
+
+      break;
+    case CONSENSUS_KEYWORD_VALID_AFTER:
+      if ( consensus->valid_after == 0 )
+      {
+        consensus->valid_after = d_parse_date_string( arguments );
+      }
+
+      break;
+    case CONSENSUS_KEYWORD_FRESH_UNTIL:
+      if ( consensus->fresh_until == 0 )
+      {
+        consensus->fresh_until = d_parse_date_string( arguments );
+      }
+
+      break;
+    case CONSENSUS_KEYWORD_VALID_UNTIL:
+      if ( consensus->valid_until == 0 )
+      {
+        consensus->valid_until = d_parse_date_string( arguments );
+      }
+
+      break;
+    case CONSENSUS_KEYWORD_SHARED_RAND_CURRENT:
+      v_parse_shared_rand( consensus->shared_rand, arguments );
+
+      break;
+    case CONSENSUS_KEYWORD_SHARED_RAND_PREVIOUS:
+      v_parse_shared_rand( consensus->previous_shared_rand, arguments );
+
+      break;
+    // the header is over once the authorities start
+    case CONSENSUS_KEYWORD_DIR_SOURCE:
+      return 1;
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+static void v_parse_r_tag( OnionRelay* canidate_relay, TokenSlice* arguments )
+{
+  int field = 0;
+  char address[16];
+  TokenSlice token;
+
+  // nickname identity digest date time address or_port dir_port
+  while ( b_next_token( arguments, &token ) )
+  {
+    switch ( field )
+    {
+      case 1:
+        if ( token.length >= 27 )
+        {
+          d_base_64_decode( canidate_relay->identity, (char*)token.data, 27 );
+        }
+
+        break;
+      case 2:
+        if ( token.length >= 27 )
+        {
+          d_base_64_decode( canidate_relay->digest, (char*)token.data, 27 );
+        }
+
+        break;
+      case 5:
+        if ( token.length < sizeof( address ) )
+        {
+          memcpy( address, token.data, token.length );
+          address[token.length] = 0;
+
+          canidate_relay->address = inet_addr( address );
+        }
+
+        break;
+      case 6:
+        canidate_relay->or_port = ul_token_to_number( &token );
+        break;
+      case 7:
+        canidate_relay->dir_port = ul_token_to_number( &token );
+        break;
+      default:
+        break;
+    }
+
+    field++;
+  }
+}
+
+static void v_parse_s_tag( OnionRelay* canidate_relay, TokenSlice* arguments )
+{
+  int j;
+  const char* tags[] = {
+    "Exit",
+    "Fast",
+    "Guard",
+    "HSDir",
+    "Stable",
+  };
+  bool found_vals[5] = { false, false, false, false, false };
+  TokenSlice token;
+
+  while ( b_next_token( arguments, &token ) )
+  {
+    for ( j = 0; j < 5; j++ )
+    {
+      if ( b_token_equals( &token, tags[j] ) )
+      {
+        found_vals[j] = true;
+        break;
+      }
+    }
+  }
+
+  if ( found_vals[1] && found_vals[4] ) {
+    canidate_relay->suitable = true;
+  }
+
+  canidate_relay->can_exit = found_vals[0];
+  canidate_relay->can_guard = found_vals[2];
+  canidate_relay->hsdir = found_vals[3];
+}
+
+static void v_parse_pr_tag( OnionRelay* canidate_relay, TokenSlice* arguments )
+{
+  TokenSlice token;
+
+  canidate_relay->dir_cache = false;
+
+  while ( b_next_token( arguments, &token ) )
+  {
+    if ( b_token_starts_with( &token, "DirCache=" ) )
+    {
+      canidate_relay->dir_cache = true;
+      break;
+    }
+  }
+}
+
+static void v_parse_w_tag( OnionRelay* canidate_relay, TokenSlice* arguments )
+{
+  TokenSlice token;
+
+  while ( b_next_token( arguments, &token ) )
+  {
+    if ( b_token_starts_with( &token, "Bandwidth=" ) )
+    {
+      token.data += strlen( "Bandwidth=" );
+      token.length -= strlen( "Bandwidth=" );
+
+      canidate_relay->bandwidth = ul_token_to_number( &token );
+      break;
+    }
+  }
+}
+
+void v_parse_bandwidth_weights( BandwidthWeights* weights, TokenSlice* arguments )
+{
+  int j;
+  const char* keys[] = {
+    "Wgg=",
+    "Wgd=",
+    "Wmg=",
+    "Wmm=",
+    "Wme=",
+    "Wmd=",
+    "Wbg=",
+    "Wbm=",
+    "Wbe=",
+    "Wbd=",
+  };
+  int32_t* values[] = {
+    &weights->wgg,
+    &weights->wgd,
+    &weights->wmg,
+    &weights->wmm,
+    &weights->wme,
+    &weights->wmd,
+    &weights->wbg,
+    &weights->wbm,
+    &weights->wbe,
+    &weights->wbd,
+  };
+  TokenSlice token;
+
+  while ( b_next_token( arguments, &token ) )
+  {
+    for ( j = 0; j < 10; j++ )
+    {
+      if ( b_token_starts_with( &token, keys[j] ) )
+      {
+        token.data += 4;
+        token.length -= 4;
+
+        *values[j] = ul_token_to_number( &token );
+        break;
+      }
+    }
+  }
+}
+
+int d_parse_line_to_relay( OnionRelay* relay, int keyword, TokenSlice* arguments )
+{
+  switch ( keyword )
+  {
+    case CONSENSUS_KEYWORD_R:
+      v_parse_r_tag( relay, arguments );
+      break;
+    case CONSENSUS_KEYWORD_S:
+      v_parse_s_tag( relay, arguments );
+      break;
+    case CONSENSUS_KEYWORD_PR:
+      v_parse_pr_tag( relay, arguments );
+      break;
+    // w is the last line we need, after it the relay is complete
+    case CONSENSUS_KEYWORD_W:
+      v_parse_w_tag( relay, arguments );
+      return 1;
+    default:
+      break;
+  }
+
+  return 0;
+}
@@ -28,6 +28,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/circuit.h"
 #include "../h/onion_service.h"
 #include "../h/onion_client.h"
+#include "../h/dir_client.h"
 #include "../h/connections.h"
 
 static const char* CORE_TAG = "MINITOR DAEMON";
@@ -139,12 +140,18 @@ void v_set_hsdir_timer( MinitorTimer hsdir_timer )
   time_t srv_start_time;
 
 #ifdef MINITOR_CHUTNEY
+  ConsensusSnapshot* snapshot;
+
   time( &now );
 
-  voting_interval = network_consensus.fresh_until - network_consensus.valid_after;
+  snapshot = px_acquire_consensus_snapshot();
+
+  voting_interval = snapshot->consensus.fresh_until - snapshot->consensus.valid_after;
 
   // 24 is SHARED_RANDOM_N_ROUNDS * SHARED_RANDOM_N_PHASES
-  srv_start_time = network_consensus.valid_after - ( ( ( ( network_consensus.valid_after / voting_interval ) ) % ( SHARED_RANDOM_N_ROUNDS * SHARED_RANDOM_N_PHASES ) ) * voting_interval );
+  srv_start_time = snapshot->consensus.valid_after - ( ( ( ( snapshot->consensus.valid_after / voting_interval ) ) % ( SHARED_RANDOM_N_ROUNDS * SHARED_RANDOM_N_PHASES ) ) * voting_interval );
+
+  v_release_consensus_snapshot( snapshot );
 
   // start the update timer a half second after the consensus update
   if ( now > ( srv_start_time + ( 25 * voting_interval ) ) )
@@ -163,11 +170,20 @@ void v_set_hsdir_timer( MinitorTimer hsdir_timer )
 #endif
 }
 
-int d_get_standby_count()
+// queue standby stems for a service until its pool matches the recent intro
+// rate, a rendezvous then only has to extend one to the rendezvous point
+void v_fill_rend_pool( OnionService* service )
 {
-  int count = 0;
+  int count = service->rend_pool_building;
+  int target;
   OnionCircuit* circuit;
 
+  // rendezvous circuits go straight to the rendezvous point, there's no stem
+  if ( service->single_onion == true )
+  {
+    return;
+  }
+
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
@@ -175,7 +191,7 @@ int d_get_standby_count()
 
   while ( circuit != NULL )
   {
-    if ( circuit->status == CIRCUIT_STANDBY )
+    if ( circuit->target_status == CIRCUIT_STANDBY && circuit->service == service )
     {
       count++;
     }
@@ -186,7 +202,30 @@ int d_get_standby_count()
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
-  return count;
+  target = service->rend_pool_min + ( service->intro_rate * REND_POOL_REFILL_SECONDS + 59 ) / 60;
+
+  if ( target > service->rend_pool_max )
+  {
+    target = service->rend_pool_max;
+  }
+
+  for ( ; count < target; count++ )
+  {
+    service->rend_pool_building++;
+
+    v_send_init_circuit_internal(
+      REND_STEM_LENGTH,
+      CIRCUIT_STANDBY,
+      service,
+      NULL,
+      0,
+      0,
+      NULL,
+      NULL,
+      NULL,
+      NULL
+    );
+  }
 }
 
 static void v_send_init_circuit_intro( OnionService* service )
@@ -200,7 +239,15 @@ static void v_send_init_circuit_intro( OnionService* service )
 
   memset( onion_message->data, 0, sizeof( CreateCircuitRequest ) );
 
-  ((CreateCircuitRequest*)onion_message->data)->length = 3;
+  if ( service->single_onion == true )
+  {
+    ((CreateCircuitRequest*)onion_message->data)->length = SINGLE_ONION_CIRCUIT_LENGTH;
+  }
+  else
+  {
+    ((CreateCircuitRequest*)onion_message->data)->length = 3;
+  }
+
   ((CreateCircuitRequest*)onion_message->data)->target_status = CIRCUIT_ESTABLISH_INTRO;
   ((CreateCircuitRequest*)onion_message->data)->service = service;
   ((CreateCircuitRequest*)onion_message->data)->end_relay = NULL;
@@ -248,62 +295,63 @@ void v_circuit_rebuild_or_destroy( OnionCircuit* circuit, DlConnection* or_conne
   int i;
   int retry_length;
   OnionRelay* retry_end_relay = NULL;
-  OnionRelay* start_relay;
   OnionMessage* onion_message;
   IntroCrypto* intro_crypto = NULL;
+  HsDirUpload* upload;
 
   // if a fully built rend circuit is destroyed, it's up to the client to restart
   if ( circuit->status != CIRCUIT_RENDEZVOUS && circuit->status != CIRCUIT_CLIENT_RENDEZVOUS )
   {
     if ( circuit->target_status == CIRCUIT_ESTABLISH_INTRO )
     {
-      v_send_init_circuit_intro(
-        circuit->service
-      );
+      // a rotated out intro already has its replacement
+      if ( circuit->status != CIRCUIT_INTRO_LIVE || circuit->intro_crypto->state == INTRO_ACTIVE )
+      {
+        if ( circuit->status == CIRCUIT_INTRO_LIVE )
+        {
+          circuit->service->intro_live_count--;
+        }
+
+        v_send_init_circuit_intro(
+          circuit->service
+        );
+      }
+      else if ( circuit->intro_crypto->state == INTRO_RETIRING )
+      {
+        circuit->service->intro_retiring--;
+      }
+    }
+    // the dir client falls back to plain connections, nothing to rebuild
+    else if ( circuit->target_status == CIRCUIT_DIR )
+    {
+      v_dir_client_closed( circuit->dir_client );
     }
     else
     {
       if ( circuit->target_status == CIRCUIT_HSDIR_BEGIN_DIR )
       {
-        if ( circuit->relay_list.built_length >= 2 )
-        {
-          circuit->target_relay_index++;
-          circuit->service->hsdir_sent++;
-
-          if ( circuit->target_relay_index == circuit->service->target_relays[circuit->desc_index]->length )
-          {
-            v_cleanup_service_hs_data( circuit->service, circuit->desc_index );
+        upload = &circuit->service->hsdir_uploads[circuit->desc_index][circuit->target_relay_index];
 
-            if ( circuit->service->hsdir_sent != circuit->service->hsdir_to_send )
-            {
-              start_relay = px_get_random_fast_relay( 1, circuit->service->target_relays[circuit->desc_index + 1], NULL, NULL );
-
-              v_send_init_circuit_internal(
-                3,
-                CIRCUIT_HSDIR_BEGIN_DIR,
-                circuit->service,
-                NULL,
-                circuit->desc_index + 1,
-                0,
-                start_relay,
-                circuit->service->target_relays[circuit->desc_index + 1]->head->relay,
-                NULL,
-                NULL
-              );
-            }
-
-            goto circuit_destroy;
-          }
-
-          retry_length = 3;
-          retry_end_relay = px_get_relay_by_index( circuit->service->target_relays[circuit->desc_index], circuit->target_relay_index );
+        // a stem that failed before extending still holds the slot's relay,
+        // otherwise the hsdir is our tail
+        if ( upload->relay != NULL )
+        {
+          retry_end_relay = upload->relay;
+          upload->relay = NULL;
         }
         else
         {
-          retry_length = 3;
           retry_end_relay = malloc( sizeof( OnionRelay ) );
           memcpy( retry_end_relay, circuit->relay_list.tail->relay, sizeof( OnionRelay ) );
         }
+
+        // the slot decides whether to try that hsdir again on a fresh circuit
+        if ( b_finish_hsdir_upload( circuit->service, circuit->desc_index, circuit->target_relay_index, retry_end_relay ) == false )
+        {
+          v_start_hsdir_uploads( circuit->service );
+        }
+
+        goto circuit_destroy;
       }
       else if ( circuit->target_status == CIRCUIT_CLIENT_HSDIR )
       {
@@ -359,7 +407,15 @@ void v_circuit_rebuild_or_destroy( OnionCircuit* circuit, DlConnection* or_conne
       }
       else if ( circuit->target_status == CIRCUIT_RENDEZVOUS )
       {
-        retry_length = 2;
+        if ( circuit->service->single_onion == true )
+        {
+          retry_length = SINGLE_ONION_CIRCUIT_LENGTH;
+        }
+        else
+        {
+          retry_length = REND_STEM_LENGTH + 1;
+        }
+
         retry_end_relay = malloc( sizeof( OnionRelay ) );
         memcpy( retry_end_relay, circuit->relay_list.tail->relay, sizeof( OnionRelay ) );
       }
@@ -367,6 +423,11 @@ void v_circuit_rebuild_or_destroy( OnionCircuit* circuit, DlConnection* or_conne
       {
         retry_length = circuit->relay_list.length;
         retry_end_relay = NULL;
+
+        if ( circuit->target_status == CIRCUIT_STANDBY && circuit->service != NULL )
+        {
+          circuit->service->rend_pool_building++;
+        }
       }
 
       v_send_init_circuit_internal(
@@ -420,6 +481,11 @@ void v_circuit_remove_destroy( OnionCircuit* circuit, DlConnection* or_connectio
     }
   }
 
+  if ( circuit->dir_client != NULL && circuit->dir_client->circuit == circuit )
+  {
+    circuit->dir_client->circuit = NULL;
+  }
+
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
@@ -429,6 +495,85 @@ void v_circuit_remove_destroy( OnionCircuit* circuit, DlConnection* or_connectio
   free( circuit );
 }
 
+// the last hop answered, start whatever the circuit was built for
+static int d_handle_circuit_built( OnionCircuit* working_circuit, DlConnection* or_connection )
+{
+  switch ( working_circuit->target_status )
+  {
+    case CIRCUIT_HSDIR_BEGIN_DIR:
+    case CIRCUIT_CLIENT_HSDIR:
+      if ( d_begin_hsdir( working_circuit, or_connection ) < 0 )
+      {
+        return -1;
+      }
+
+      working_circuit->status = CIRCUIT_HSDIR_CONNECTED;
+
+      break;
+    case CIRCUIT_ESTABLISH_INTRO:
+      if ( d_router_establish_intro( working_circuit, or_connection ) < 0 )
+      {
+        return -1;
+      }
+
+      working_circuit->status = CIRCUIT_INTRO_ESTABLISHED;
+
+      break;
+    case CIRCUIT_RENDEZVOUS:
+      if ( d_router_join_rendezvous( working_circuit, or_connection, working_circuit->hs_crypto->rendezvous_cookie, working_circuit->hs_crypto->point, working_circuit->hs_crypto->auth_input_mac ) < 0 )
+      {
+        MINITOR_LOG( CORE_TAG, "Failed to join rend" );
+
+        return -1;
+      }
+
+      working_circuit->status = CIRCUIT_RENDEZVOUS;
+
+      v_record_rend_latency( working_circuit->service, MINITOR_GET_TIME_MS() - working_circuit->hs_crypto->intro_ms );
+
+      break;
+    case CIRCUIT_CLIENT_INTRO:
+      working_circuit->client->intro_built = true;
+
+      if ( working_circuit->client->rendezvous_ready == true )
+      {
+        if ( d_client_send_intro( working_circuit, or_connection ) < 0 )
+        {
+          MINITOR_LOG( CORE_TAG, "Failed to send intro" );
+
+          return -1;
+        }
+
+        working_circuit->status = CIRCUIT_CLIENT_INTRO_ACK;
+      }
+
+      break;
+    case CIRCUIT_CLIENT_RENDEZVOUS:
+      if ( d_client_establish_rendezvous( working_circuit, or_connection ) < 0 )
+      {
+        MINITOR_LOG( CORE_TAG, "Failed to establish rend" );
+
+        return -1;
+      }
+
+      working_circuit->status = CIRCUIT_CILENT_RENDEZVOUS_ESTABLISHED;
+
+      break;
+    case CIRCUIT_DIR:
+      v_dir_client_ready( working_circuit );
+
+      working_circuit->status = CIRCUIT_DIR_LIVE;
+
+      break;
+    default:
+      working_circuit->status = working_circuit->target_status;
+
+      break;
+  }
+
+  return 0;
+}
+
 static void v_handle_tor_cell( uint32_t conn_id )
 {
   int succ;
@@ -440,8 +585,8 @@ static void v_handle_tor_cell( uint32_t conn_id )
   OnionService* working_service;
   OnionMessage* onion_message;
   OnionRelay* target_relay;
-  OnionRelay* start_relay;
   DoublyLinkedOnionRelay* dl_relay;
+  HsDirUpload* upload;
   MinitorMutex access_mutex = NULL;
 
   // MUTEX TAKE
@@ -554,9 +699,9 @@ static void v_handle_tor_cell( uint32_t conn_id )
 
         working_circuit->status = CIRCUIT_EXTENDED;
       }
-      else
+      else if ( d_handle_circuit_built( working_circuit, or_connection ) < 0 )
       {
-        working_circuit->status = working_circuit->target_status;
+        goto circuit_rebuild;
       }
 
       break;
@@ -586,70 +731,9 @@ static void v_handle_tor_cell( uint32_t conn_id )
           goto circuit_rebuild;
         }
       }
-      else
+      else if ( d_handle_circuit_built( working_circuit, or_connection ) < 0 )
       {
-        switch ( working_circuit->target_status )
-        {
-          case CIRCUIT_HSDIR_BEGIN_DIR:
-          case CIRCUIT_CLIENT_HSDIR:
-            if ( d_begin_hsdir( working_circuit, or_connection ) < 0 )
-            {
-              goto circuit_rebuild;
-            }
-
-            working_circuit->status = CIRCUIT_HSDIR_CONNECTED;
-
-            break;
-          case CIRCUIT_ESTABLISH_INTRO:
-            if ( d_router_establish_intro( working_circuit, or_connection ) < 0 )
-            {
-              goto circuit_rebuild;
-            }
-
-            working_circuit->status = CIRCUIT_INTRO_ESTABLISHED;
-
-            break;
-          case CIRCUIT_RENDEZVOUS:
-            if ( d_router_join_rendezvous( working_circuit, or_connection, working_circuit->hs_crypto->rendezvous_cookie, working_circuit->hs_crypto->point, working_circuit->hs_crypto->auth_input_mac ) < 0 )
-            {
-              MINITOR_LOG( CORE_TAG, "Failed to join rend" );
-
-              goto circuit_rebuild;
-            }
-
-            working_circuit->status = CIRCUIT_RENDEZVOUS;
-
-            break;
-          case CIRCUIT_CLIENT_INTRO:
-            working_circuit->client->intro_built = true;
-
-            if ( working_circuit->client->rendezvous_ready == true )
-            {
-              if ( d_client_send_intro( working_circuit, or_connection ) < 0 )
-              {
-                MINITOR_LOG( CORE_TAG, "Failed to send intro" );
-
-                goto circuit_rebuild;
-              }
-
-              working_circuit->status = CIRCUIT_CLIENT_INTRO_ACK;
-            }
-
-            break;
-          case CIRCUIT_CLIENT_RENDEZVOUS:
-            if ( d_client_establish_rendezvous( working_circuit, or_connection ) < 0 )
-            {
-              MINITOR_LOG( CORE_TAG, "Failed to establish rend" );
-
-              goto circuit_rebuild;
-            }
-
-            working_circuit->status = CIRCUIT_CILENT_RENDEZVOUS_ESTABLISHED;
-
-            break;
-          default:
-            break;
-        }
+        goto circuit_rebuild;
       }
 
       break;
@@ -667,7 +751,10 @@ static void v_handle_tor_cell( uint32_t conn_id )
       {
         if ( working_circuit->target_status == CIRCUIT_HSDIR_BEGIN_DIR )
         {
-          target_relay = px_get_relay_by_index( working_circuit->service->target_relays[working_circuit->desc_index], working_circuit->target_relay_index );
+          // the stem takes the relay of the slot it claimed
+          upload = &working_circuit->service->hsdir_uploads[working_circuit->desc_index][working_circuit->target_relay_index];
+          target_relay = upload->relay;
+          upload->relay = NULL;
         }
         else
         {
@@ -738,12 +825,23 @@ static void v_handle_tor_cell( uint32_t conn_id )
       }
 
       working_circuit->status = CIRCUIT_INTRO_LIVE;
+      working_circuit->intro_crypto->live_since = MINITOR_GET_TIME();
 
       working_circuit->service->intro_live_count++;
 
-      if ( working_circuit->service->intro_live_count == 3 && working_circuit->service->hsdir_sent == 0 )
+      v_publish_bootstrap_milestones( BOOTSTRAP_FIRST_INTRO );
+
+      // the intro set is complete again, either for the first time or after
+      // a replacement came up, so the descriptor has to list it
+      if ( working_circuit->service->intro_live_count == working_circuit->service->intro_count )
       {
-        if ( d_push_hsdir( working_circuit->service ) < 0 )
+        // intro circuits can come up on a provisional relay table, the
+        // descriptor has to wait for the hsdir ring
+        if ( b_bootstrap_reached( BOOTSTRAP_HSDIR_RING ) == false )
+        {
+          MINITOR_TIMER_SET_MS_BLOCKING( working_circuit->service->hsdir_timer, BOOTSTRAP_HSDIR_RETRY_MS );
+        }
+        else if ( d_push_hsdir( working_circuit->service ) < 0 )
         {
           MINITOR_LOG( CORE_TAG, "Failed to start hsdir push" );
           v_set_hsdir_timer( working_circuit->service->hsdir_timer );
@@ -821,63 +919,13 @@ static void v_handle_tor_cell( uint32_t conn_id )
       else
       {
         // TODO check actual response for success
-
-        working_circuit->service->hsdir_sent++;
-        working_circuit->target_relay_index++;
-
-        if ( working_circuit->target_relay_index == working_circuit->service->target_relays[working_circuit->desc_index]->length)
+        if ( b_finish_hsdir_upload( working_circuit->service, working_circuit->desc_index, working_circuit->target_relay_index, NULL ) == false )
         {
-          v_cleanup_service_hs_data( working_circuit->service, working_circuit->desc_index );
-
-          if ( working_circuit->service->hsdir_sent != working_circuit->service->hsdir_to_send )
-          {
-            start_relay = px_get_random_fast_relay( 1, working_circuit->service->target_relays[working_circuit->desc_index + 1], NULL, NULL );
-
-            v_send_init_circuit_internal(
-              3,
-              CIRCUIT_HSDIR_BEGIN_DIR,
-              working_circuit->service,
-              NULL,
-              working_circuit->desc_index + 1,
-              0,
-              start_relay,
-              working_circuit->service->target_relays[working_circuit->desc_index + 1]->head->relay,
-              NULL,
-              NULL
-            );
-          }
-
-          // TODO need to overhaul circuits to use the same mutexing as connections, this won't be safe if more than one core thread is running
-          v_circuit_remove_destroy( working_circuit, or_connection );
-          // MUTEX GIVE
-
-          access_mutex = NULL;
-          working_circuit = NULL;
-        }
-        else
-        {
-          if ( working_circuit->relay_early_count == 6 )
-          {
-            v_circuit_remove_destroy( working_circuit, or_connection );
-            // MUTEX GIVE
-
-            v_send_init_circuit_internal(
-              3,
-              CIRCUIT_HSDIR_BEGIN_DIR,
-              working_circuit->service,
-              NULL,
-              working_circuit->desc_index,
-              working_circuit->target_relay_index,
-              NULL,
-              px_get_relay_by_index( working_circuit->service->target_relays[working_circuit->desc_index], working_circuit->target_relay_index ),
-              NULL,
-              NULL
-            );
-
-            access_mutex = NULL;
-            working_circuit = NULL;
-          }
-          else
+          // keep the guard and middle as a stem and extend it to the next hsdir
+          if (
+            working_circuit->relay_early_count < HSDIR_STEM_MAX_TRUNCATES &&
+            px_claim_hsdir_upload( working_circuit->service, &working_circuit->desc_index, &working_circuit->target_relay_index ) != NULL
+          )
           {
             if ( d_router_truncate( working_circuit, or_connection, working_circuit->relay_list.built_length - 1 ) < 0 )
             {
@@ -885,8 +933,19 @@ static void v_handle_tor_cell( uint32_t conn_id )
             }
 
             working_circuit->status = CIRCUIT_TRUNCATED;
+
+            break;
           }
+
+          v_start_hsdir_uploads( working_circuit->service );
         }
+
+        // TODO need to overhaul circuits to use the same mutexing as connections, this won't be safe if more than one core thread is running
+        v_circuit_remove_destroy( working_circuit, or_connection );
+        // MUTEX GIVE
+
+        access_mutex = NULL;
+        working_circuit = NULL;
       }
 
       break;
@@ -963,6 +1022,12 @@ static void v_handle_tor_cell( uint32_t conn_id )
 
       access_mutex = NULL;
 
+      break;
+    case CIRCUIT_DIR_LIVE:
+      v_dir_client_handle_cell( working_circuit, or_connection, cell );
+
+      access_mutex = NULL;
+
       break;
     default:
       MINITOR_LOG( CORE_TAG, "Got an unknown circuit status in v_handle_tor_cell" );
@@ -975,7 +1040,8 @@ static void v_handle_tor_cell( uint32_t conn_id )
     if (
       working_circuit->status != CIRCUIT_INTRO_LIVE &&
       working_circuit->status != CIRCUIT_RENDEZVOUS &&
-      working_circuit->status != CIRCUIT_STANDBY
+      working_circuit->status != CIRCUIT_STANDBY &&
+      working_circuit->status != CIRCUIT_DIR_LIVE
     )
     {
       // update the timeout struct to have current step
@@ -1034,6 +1100,66 @@ static void v_handle_service_tcp_data( ServiceTcpTraffic* tcp_traffic )
     free( tcp_traffic->data );
   }
 
+  // the backend closed, its handler is gone and the RELAY_END is sent
+  if ( tcp_traffic->length == 0 )
+  {
+    v_cleanup_local_connection( tcp_traffic->circ_id, tcp_traffic->stream_id );
+  }
+
+  free( tcp_traffic );
+}
+
+static void v_handle_service_tcp_writable( ServiceTcpTraffic* tcp_traffic )
+{
+  OnionCircuit* rend_circuit;
+  DlConnection* or_connection;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  rend_circuit = px_get_circuit_by_circ_id( onion_circuits, tcp_traffic->circ_id );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  if ( rend_circuit != NULL )
+  {
+    // MUTEX TAKE
+    or_connection = px_get_conn_by_id_and_lock( rend_circuit->conn_id );
+
+    if ( or_connection != NULL )
+    {
+      v_onion_service_handle_local_writable( rend_circuit, or_connection, tcp_traffic );
+
+      MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+      // MUTEX GIVE
+    }
+  }
+
+  free( tcp_traffic );
+}
+
+static void v_handle_service_tcp_connected( ServiceTcpTraffic* tcp_traffic )
+{
+  OnionCircuit* rend_circuit;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  rend_circuit = px_get_circuit_by_circ_id( onion_circuits, tcp_traffic->circ_id );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  if ( rend_circuit != NULL )
+  {
+    v_onion_service_handle_local_connected( rend_circuit, tcp_traffic );
+  }
+  else
+  {
+    v_cleanup_local_connection( tcp_traffic->circ_id, tcp_traffic->stream_id );
+  }
+
   free( tcp_traffic );
 }
 
@@ -1088,6 +1214,7 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
   new_circuit->target_status = create_request->target_status;
   new_circuit->service = create_request->service;
   new_circuit->client = create_request->client;
+  new_circuit->dir_client = create_request->dir_client;
   new_circuit->desc_index = create_request->desc_index;
   new_circuit->target_relay_index = create_request->target_relay_index;
   new_circuit->hs_crypto = create_request->hs_crypto;
@@ -1106,6 +1233,17 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
     }
   }
 
+  if ( new_circuit->dir_client != NULL )
+  {
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+    new_circuit->dir_client->circuit = new_circuit;
+
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
+  }
+
   if ( d_prepare_onion_circuit( new_circuit, create_request->length, create_request->start_relay, create_request->end_relay ) < 0 )
   {
     goto fail;
@@ -1146,6 +1284,12 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
+  // the pool counts it from the list now
+  if ( new_circuit->target_status == CIRCUIT_STANDBY && new_circuit->service != NULL )
+  {
+    new_circuit->service->rend_pool_building--;
+  }
+
   free( create_request );
 
   return;
@@ -1171,6 +1315,21 @@ fail:
   d_destroy_onion_circuit( new_circuit, or_connection );
   // MUTEX GIVE
 
+  // the dir client would rather fall back to plain connections than wait
+  if ( create_request->dir_client != NULL )
+  {
+    create_request->dir_client->circuit = NULL;
+
+    v_dir_client_closed( create_request->dir_client );
+
+    free( start_relay );
+    free( end_relay );
+    free( create_request );
+    free( new_circuit );
+
+    return;
+  }
+
   v_send_init_circuit_internal(
     create_request->length,
     create_request->target_status,
@@ -1254,16 +1413,152 @@ static void v_handle_conn_ready( uint32_t conn_id )
   }
 }
 
+// the download runs on its own task, circuits keep using the current relay
+// lists until the new ones are finalized
 static void v_handle_scheduled_consensus()
 {
-  if ( d_fetch_consensus_info() < 0 )
+  if ( d_start_consensus_refresh( false ) < 0 )
   {
-    MINITOR_LOG( CORE_TAG, "Failed to fetch consensus" );
+    MINITOR_LOG( CORE_TAG, "Failed to start consensus refresh" );
 
     MINITOR_TIMER_SET_MS_BLOCKING( consensus_timer, 500 );
   }
 }
 
+// start the replacement first, the old intro keeps serving until a
+// descriptor without it has been published
+void v_retire_intro_circuit( OnionCircuit* circuit )
+{
+  if ( circuit->intro_crypto->state != INTRO_ACTIVE )
+  {
+    return;
+  }
+
+  MINITOR_LOG( CORE_TAG, "Rotating intro circuit after %d introductions and %ld seconds", circuit->intro_crypto->introductions, (long)( MINITOR_GET_TIME() - circuit->intro_crypto->live_since ) );
+
+  circuit->intro_crypto->state = INTRO_RETIRING;
+  circuit->service->intro_live_count--;
+  circuit->service->intro_retiring++;
+
+  v_send_init_circuit_intro( circuit->service );
+}
+
+// rotate intros that outlived their lifetime and close the ones no published
+// descriptor lists anymore
+static void v_rotate_intro_circuits()
+{
+  int i;
+  bool full;
+  time_t now;
+  OnionCircuit* unlisted_circuits[HS_MAX_INTRO_POINTS];
+  OnionCircuit* working_circuit;
+  DlConnection* or_connection;
+
+  now = MINITOR_GET_TIME();
+
+  // unlisted intros from every service go through the batch, keep going until
+  // a pass comes back short
+  do
+  {
+    i = 0;
+    full = false;
+
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+    working_circuit = onion_circuits;
+
+    while ( working_circuit != NULL )
+    {
+      if ( working_circuit->status == CIRCUIT_INTRO_LIVE )
+      {
+        if ( working_circuit->intro_crypto->state == INTRO_ACTIVE && now - working_circuit->intro_crypto->live_since >= working_circuit->service->intro_max_lifetime )
+        {
+          v_retire_intro_circuit( working_circuit );
+        }
+        // wait for the upload of the descriptor that dropped it to finish
+        else if ( working_circuit->intro_crypto->state == INTRO_UNLISTED && working_circuit->service->hsdir_in_flight == 0 )
+        {
+          if ( i == HS_MAX_INTRO_POINTS )
+          {
+            full = true;
+            break;
+          }
+
+          unlisted_circuits[i] = working_circuit;
+          i++;
+        }
+      }
+
+      working_circuit = working_circuit->next;
+    }
+
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
+
+    for ( i = i - 1; i >= 0; i-- )
+    {
+      // MUTEX TAKE
+      or_connection = px_get_conn_by_id_and_lock( unlisted_circuits[i]->conn_id );
+
+      v_circuit_remove_destroy( unlisted_circuits[i], or_connection );
+      // MUTEX GIVE
+    }
+  } while ( full == true );
+}
+
+// fold the last window of introductions into each service's rate and resize
+// its rendezvous pool to match
+static void v_update_rend_pools()
+{
+  time_t now;
+  time_t elapsed;
+  OnionService* service;
+
+  now = MINITOR_GET_TIME();
+
+  for ( service = onion_services; service != NULL; service = service->next )
+  {
+    elapsed = now - service->intro_window_start;
+
+    if ( elapsed <= 0 )
+    {
+      continue;
+    }
+
+    service->intro_rate = ( service->intro_rate * 3 + (int)( service->intro_window_count * 60 / elapsed ) ) / 4;
+    service->intro_window_count = 0;
+    service->intro_window_start = now;
+
+    v_fill_rend_pool( service );
+    v_log_rend_latency( service );
+  }
+}
+
+// the probes can block for a while so each service gets its own task, one at
+// a time
+static void v_check_backends()
+{
+  OnionService* service;
+  MinitorTask dummy_handle;
+
+  for ( service = onion_services; service != NULL; service = service->next )
+  {
+    // a lone backend gets every stream either way
+    if ( service->backend_count < 2 || atomic_exchange( &service->backends_checking, true ) == true )
+    {
+      continue;
+    }
+
+    if ( b_create_backend_check_task( &dummy_handle, service ) == false )
+    {
+      MINITOR_LOG( CORE_TAG, "couldn't create the backend health check task" );
+
+      atomic_store( &service->backends_checking, false );
+    }
+  }
+}
+
 static void v_keep_circuitlist_alive()
 {
   Cell* padding_cell;
@@ -1312,6 +1607,13 @@ static void v_keep_circuitlist_alive()
 
 static void v_handle_scheduled_hsdir( OnionService* service )
 {
+  if ( b_bootstrap_reached( BOOTSTRAP_HSDIR_RING ) == false )
+  {
+    MINITOR_TIMER_SET_MS_BLOCKING( service->hsdir_timer, BOOTSTRAP_HSDIR_RETRY_MS );
+
+    return;
+  }
+
   if ( d_push_hsdir( service ) < 0 )
   {
     MINITOR_LOG( CORE_TAG, "Failed to push hsdir for service on port: %d", service->local_port );
@@ -1326,10 +1628,11 @@ static void v_init_service( OnionService* service )
   int j;
   OnionMessage* onion_message;
   OnionRelay* start_relay;
-  uint8_t final_identities[2][ID_LENGTH];
+  uint8_t final_identities[HS_MAX_INTRO_POINTS][ID_LENGTH];
   int duplicate;
 
   service->intro_live_count = 0;
+  service->intro_retiring = 0;
 
   v_add_service_to_list( service, &onion_services );
 
@@ -1340,24 +1643,11 @@ static void v_init_service( OnionService* service )
     return;
   }
 
-  i = d_get_standby_count();
+  service->intro_window_start = MINITOR_GET_TIME();
 
-  for ( ; i < 2; i++ )
-  {
-    onion_message = malloc( sizeof( OnionMessage ) );
-    onion_message->type = INIT_CIRCUIT;
-    onion_message->data = malloc( sizeof( CreateCircuitRequest ) );
-
-    memset( onion_message->data, 0, sizeof( CreateCircuitRequest ) );
+  v_fill_rend_pool( service );
 
-    ((CreateCircuitRequest*)onion_message->data)->length = 1;
-    ((CreateCircuitRequest*)onion_message->data)->target_status = CIRCUIT_STANDBY;
-    ((CreateCircuitRequest*)onion_message->data)->service = service;
-
-    MINITOR_ENQUEUE_BLOCKING( core_internal_queue, (void*)(&onion_message) );
-  }
-
-  for ( i = 0; i < 3; i++ )
+  for ( i = 0; i < service->intro_count; i++ )
   {
     onion_message = malloc( sizeof( OnionMessage ) );
     onion_message->type = INIT_CIRCUIT;
@@ -1365,18 +1655,27 @@ static void v_init_service( OnionService* service )
 
     memset( onion_message->data, 0, sizeof( CreateCircuitRequest ) );
 
-    ((CreateCircuitRequest*)onion_message->data)->length = 3;
     ((CreateCircuitRequest*)onion_message->data)->target_status = CIRCUIT_ESTABLISH_INTRO;
     ((CreateCircuitRequest*)onion_message->data)->service = service;
 
-    if ( i == 2 )
+    // single onion intros connect straight to the intro point, no guard
+    if ( service->single_onion == true )
     {
-      ((CreateCircuitRequest*)onion_message->data)->start_relay = start_relay;
+      ((CreateCircuitRequest*)onion_message->data)->length = SINGLE_ONION_CIRCUIT_LENGTH;
     }
     else
     {
-      ((CreateCircuitRequest*)onion_message->data)->start_relay = malloc( sizeof( OnionRelay ) );
-      memcpy( ((CreateCircuitRequest*)onion_message->data)->start_relay, start_relay, sizeof( OnionRelay ) );
+      ((CreateCircuitRequest*)onion_message->data)->length = 3;
+
+      if ( i == service->intro_count - 1 )
+      {
+        ((CreateCircuitRequest*)onion_message->data)->start_relay = start_relay;
+      }
+      else
+      {
+        ((CreateCircuitRequest*)onion_message->data)->start_relay = malloc( sizeof( OnionRelay ) );
+        memcpy( ((CreateCircuitRequest*)onion_message->data)->start_relay, start_relay, sizeof( OnionRelay ) );
+      }
     }
 
     do
@@ -1396,13 +1695,15 @@ static void v_init_service( OnionService* service )
       }
     } while ( duplicate == 1 );
 
-    if ( i < 2 )
-    {
-      memcpy( final_identities[i], ((CreateCircuitRequest*)onion_message->data)->end_relay->identity, ID_LENGTH );
-    }
+    memcpy( final_identities[i], ((CreateCircuitRequest*)onion_message->data)->end_relay->identity, ID_LENGTH );
 
     MINITOR_ENQUEUE_BLOCKING( core_internal_queue, (void*)(&onion_message) );
   }
+
+  if ( service->single_onion == true )
+  {
+    free( start_relay );
+  }
 }
 
 void v_handle_circuit_timeout()
@@ -1416,67 +1717,86 @@ void v_handle_circuit_timeout()
   */
 
   int i = 0;
+  int rebuilt;
+  bool full;
   time_t now;
   time_t elapsed;
   time_t min_left = 30;
   OnionCircuit* circuit;
-  OnionCircuit* timed_out_circuits[20];
+  OnionCircuit* timed_out_circuits[WATCHDOG_TIMEOUT_BATCH];
   DlConnection* dl_connection;
   /*
   struct CircIdStreamId timed_out_local[20];
   OnionMessage* onion_message;
   */
 
-  // first get all the circuits protected by the mutex
-  // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+  // a stalled guard can time out more circuits than fit in the batch, keep
+  // scanning until a pass comes back short or rebuilds nothing
+  do
+  {
+    i = 0;
+    rebuilt = 0;
+    full = false;
 
-  time( &now );
+    // first get all the circuits protected by the mutex
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
-  circuit = onion_circuits;
+    time( &now );
 
-  while ( circuit != NULL )
-  {
-    if ( circuit->want_action == true )
-    {
-      elapsed = now - circuit->last_action;
+    circuit = onion_circuits;
 
-      if ( elapsed >= WATCHDOG_TIMEOUT_PERIOD )
+    while ( circuit != NULL )
+    {
+      if ( circuit->want_action == true )
       {
-        MINITOR_LOG( CORE_TAG, "timeout status: %d target_status: %d", circuit->status, circuit->target_status );
+        elapsed = now - circuit->last_action;
 
-        timed_out_circuits[i] = circuit;
-        i++;
-      }
-      else
-      {
-        if ( WATCHDOG_TIMEOUT_PERIOD - elapsed < min_left )
+        if ( elapsed >= WATCHDOG_TIMEOUT_PERIOD )
         {
-          min_left = WATCHDOG_TIMEOUT_PERIOD - elapsed;
+          if ( i == WATCHDOG_TIMEOUT_BATCH )
+          {
+            full = true;
+            break;
+          }
+
+          MINITOR_LOG( CORE_TAG, "timeout status: %d target_status: %d", circuit->status, circuit->target_status );
+
+          timed_out_circuits[i] = circuit;
+          i++;
+        }
+        else
+        {
+          if ( WATCHDOG_TIMEOUT_PERIOD - elapsed < min_left )
+          {
+            min_left = WATCHDOG_TIMEOUT_PERIOD - elapsed;
+          }
         }
       }
+
+      circuit = circuit->next;
     }
 
-    circuit = circuit->next;
-  }
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
 
-  MINITOR_MUTEX_GIVE( circuits_mutex );
-  // MUTEX GIVE
+    // now rebuild the timed out circuits found out of the mutex
+    for ( i = i - 1; i >= 0; i-- )
+    {
+      // MUTEX TAKE
+      dl_connection = px_get_conn_by_id_and_lock( timed_out_circuits[i]->conn_id );
 
-  // now rebuild the timed out circuits found out of the mutex
-  for ( i = i - 1; i >= 0; i-- )
-  {
-    // MUTEX TAKE
-    dl_connection = px_get_conn_by_id_and_lock( timed_out_circuits[i]->conn_id );
+      if ( dl_connection == NULL )
+      {
+        continue;
+      }
 
-    if ( dl_connection == NULL )
-    {
-      continue;
-    }
+      v_circuit_rebuild_or_destroy( timed_out_circuits[i], dl_connection );
+      // MUTEX GIVE
 
-    v_circuit_rebuild_or_destroy( timed_out_circuits[i], dl_connection );
-    // MUTEX GIVE
-  }
+      rebuilt++;
+    }
+  } while ( full == true && rebuilt > 0 );
 
   /*
   i = 0;
@@ -1696,6 +2016,9 @@ void v_minitor_daemon( void* pv_parameters )
         break;
       case TIMER_KEEPALIVE:
         v_keep_circuitlist_alive();
+        v_rotate_intro_circuits();
+        v_update_rend_pools();
+        v_check_backends();
         break;
       case TIMER_HSDIR:
         v_handle_scheduled_hsdir( onion_message->data );
@@ -1715,6 +2038,12 @@ void v_minitor_daemon( void* pv_parameters )
       case SERVICE_TCP_DATA:
         v_handle_service_tcp_data( onion_message->data );
         break;
+      case SERVICE_TCP_WRITABLE:
+        v_handle_service_tcp_writable( onion_message->data );
+        break;
+      case SERVICE_TCP_CONNECTED:
+        v_handle_service_tcp_connected( onion_message->data );
+        break;
       case CONN_HANDSHAKE:
         v_handle_conn_handshake( onion_message->data, onion_message->length );
         break;
@@ -0,0 +1,671 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/constants.h"
+#include "../h/dir_client.h"
+#include "../h/core.h"
+#include "../h/cell.h"
+#include "../h/connections.h"
+#include "../h/models/relay.h"
+
+static const char* DIR_TAG = "MINITOR DIR";
+
+// prefer a cache we already have an or connection to, the circuit then
+// rides on it instead of opening a new one
+static OnionRelay* px_get_dir_relay()
+{
+  OnionCircuit* circuit;
+  OnionRelay* dir_relay = NULL;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  circuit = onion_circuits;
+
+  while ( circuit != NULL && dir_relay == NULL )
+  {
+    if ( circuit->relay_list.head != NULL )
+    {
+      dir_relay = px_get_cache_relay_by_identity( circuit->relay_list.head->relay->identity, false );
+    }
+
+    circuit = circuit->next;
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  if ( dir_relay == NULL )
+  {
+    dir_relay = px_get_random_cache_relay( false );
+  }
+
+  return dir_relay;
+}
+
+static void v_free_dir_message( OnionMessage* onion_message )
+{
+  if ( onion_message == NULL )
+  {
+    return;
+  }
+
+  if ( onion_message->type == CLIENT_RELAY_DATA )
+  {
+    free( onion_message->data );
+  }
+
+  free( onion_message );
+}
+
+static void v_drain_dir_queue( MinitorQueue queue )
+{
+  OnionMessage* onion_message;
+
+  while ( MINITOR_DEQUEUE_NONBLOCKING( queue, (void*)(&onion_message) ) == true )
+  {
+    v_free_dir_message( onion_message );
+  }
+}
+
+// locks the connection the dir circuit runs on, NULL once the circuit is gone
+static DlConnection* px_lock_dir_connection( DirClient* dir_client )
+{
+  uint32_t conn_id;
+  DlConnection* or_connection;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  if ( dir_client->circuit == NULL )
+  {
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
+
+    return NULL;
+  }
+
+  conn_id = dir_client->circuit->conn_id;
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( conn_id );
+
+  // the core destroys circuits while holding their connection
+  if ( or_connection != NULL && dir_client->circuit == NULL )
+  {
+    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+    // MUTEX GIVE
+
+    return NULL;
+  }
+
+  return or_connection;
+}
+
+static int d_send_dir_relay_cell( DirClient* dir_client, DlConnection* or_connection, RelayCommand relay_command, int stream_id, const uint8_t* data, int length )
+{
+  Cell* relay_cell;
+
+  relay_cell = malloc( MINITOR_CELL_LEN );
+
+  relay_cell->command = RELAY;
+  relay_cell->circ_id = dir_client->circuit->circ_id;
+
+  relay_cell->payload.relay.relay_command = relay_command;
+  relay_cell->payload.relay.recognized = 0;
+  relay_cell->payload.relay.stream_id = stream_id;
+  relay_cell->payload.relay.digest = 0;
+  relay_cell->payload.relay.length = length;
+
+  if ( length > 0 )
+  {
+    memcpy( relay_cell->payload.relay.data, data, length );
+  }
+  else
+  {
+    relay_cell->payload.relay.data[0] = 0;
+  }
+
+  relay_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + length;
+
+  if ( d_send_relay_cell_and_free( or_connection, relay_cell, &dir_client->circuit->relay_list, NULL ) < 0 )
+  {
+    MINITOR_LOG( DIR_TAG, "Failed to send relay command %d on dir circuit", relay_command );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// builds a one hop circuit to a directory cache and waits for it to come up
+DirClient* px_create_dir_client()
+{
+  OnionRelay* dir_relay;
+  DirClient* dir_client;
+  OnionMessage* onion_message;
+
+  dir_relay = px_get_dir_relay();
+
+  if ( dir_relay == NULL )
+  {
+    return NULL;
+  }
+
+  dir_client = malloc( sizeof( DirClient ) );
+
+  memset( dir_client, 0, sizeof( DirClient ) );
+
+  dir_client->address = dir_relay->address;
+  dir_client->streams[0].queue = MINITOR_QUEUE_CREATE( DIR_STREAM_MAX + 1, sizeof( OnionMessage* ) );
+
+  onion_message = malloc( sizeof( OnionMessage ) );
+  onion_message->type = INIT_CIRCUIT;
+  onion_message->data = malloc( sizeof( CreateCircuitRequest ) );
+
+  memset( onion_message->data, 0, sizeof( CreateCircuitRequest ) );
+
+  ((CreateCircuitRequest*)onion_message->data)->length = 1;
+  ((CreateCircuitRequest*)onion_message->data)->target_status = CIRCUIT_DIR;
+  ((CreateCircuitRequest*)onion_message->data)->end_relay = dir_relay;
+  ((CreateCircuitRequest*)onion_message->data)->dir_client = dir_client;
+
+  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+
+  // wait for the ready or failed response
+  MINITOR_DEQUEUE_BLOCKING( dir_client->streams[0].queue, (void*)(&onion_message) );
+
+  if ( onion_message == NULL || onion_message->type != DIR_CIRCUIT_READY )
+  {
+    MINITOR_LOG( DIR_TAG, "Failed to build dir circuit" );
+
+    v_free_dir_message( onion_message );
+    v_destroy_dir_client( dir_client );
+
+    return NULL;
+  }
+
+  free( onion_message );
+
+  return dir_client;
+}
+
+void v_destroy_dir_client( DirClient* dir_client )
+{
+  int i;
+  DlConnection* or_connection;
+
+  for ( i = 1; i < DIR_STREAM_MAX; i++ )
+  {
+    if ( dir_client->streams[i].queue != NULL )
+    {
+      v_close_dir_stream( dir_client, i );
+    }
+  }
+
+  // MUTEX TAKE
+  or_connection = px_lock_dir_connection( dir_client );
+
+  if ( or_connection != NULL )
+  {
+    v_circuit_remove_destroy( dir_client->circuit, or_connection );
+    // MUTEX GIVE
+  }
+
+  v_drain_dir_queue( dir_client->streams[0].queue );
+  MINITOR_QUEUE_DELETE( dir_client->streams[0].queue );
+
+  free( dir_client );
+}
+
+// opens a BEGIN_DIR stream on the circuit and waits for it to connect,
+// returns the stream id
+int d_open_dir_stream( DirClient* dir_client )
+{
+  int stream_id;
+  int succ;
+  DlConnection* or_connection;
+  OnionMessage* onion_message;
+
+  // MUTEX TAKE
+  or_connection = px_lock_dir_connection( dir_client );
+
+  if ( or_connection == NULL )
+  {
+    return -1;
+  }
+
+  for ( stream_id = 1; stream_id < DIR_STREAM_MAX; stream_id++ )
+  {
+    if ( dir_client->streams[stream_id].queue == NULL )
+    {
+      break;
+    }
+  }
+
+  if ( stream_id == DIR_STREAM_MAX )
+  {
+    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+    // MUTEX GIVE
+
+    return -1;
+  }
+
+  memset( &dir_client->streams[stream_id], 0, sizeof( DirStream ) );
+
+  // a full window plus the end and close never blocks the core
+  dir_client->streams[stream_id].queue = MINITOR_QUEUE_CREATE( DIR_STREAM_WINDOW + 2, sizeof( OnionMessage* ) );
+
+  succ = d_send_dir_relay_cell( dir_client, or_connection, RELAY_BEGIN_DIR, stream_id, NULL, 0 );
+
+  MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+  // MUTEX GIVE
+
+  if ( succ < 0 )
+  {
+    v_close_dir_stream( dir_client, stream_id );
+
+    return -1;
+  }
+
+  MINITOR_DEQUEUE_BLOCKING( dir_client->streams[stream_id].queue, (void*)(&onion_message) );
+
+  if ( onion_message == NULL || onion_message->type != CLIENT_RELAY_CONNECTED )
+  {
+    if ( onion_message != NULL && onion_message->type == CLIENT_RELAY_END )
+    {
+      dir_client->streams[stream_id].ended = true;
+    }
+
+    v_free_dir_message( onion_message );
+    v_close_dir_stream( dir_client, stream_id );
+
+    return -1;
+  }
+
+  free( onion_message );
+
+  return stream_id;
+}
+
+int d_write_dir_stream( DirClient* dir_client, int stream_id, const uint8_t* write_buf, int length )
+{
+  int i = 0;
+  int cell_length;
+  DlConnection* or_connection;
+
+  // MUTEX TAKE
+  or_connection = px_lock_dir_connection( dir_client );
+
+  if ( or_connection == NULL )
+  {
+    return -1;
+  }
+
+  while ( i < length )
+  {
+    cell_length = length - i;
+
+    if ( cell_length > RELAY_PAYLOAD_LEN )
+    {
+      cell_length = RELAY_PAYLOAD_LEN;
+    }
+
+    if ( d_send_dir_relay_cell( dir_client, or_connection, RELAY_DATA, stream_id, write_buf + i, cell_length ) < 0 )
+    {
+      i = -1;
+      break;
+    }
+
+    i += cell_length;
+  }
+
+  MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+  // MUTEX GIVE
+
+  return i;
+}
+
+// reads whatever the next data cell holds, like recv this returns 0 once the
+// cache ends the stream and -1 if the circuit went away
+int d_read_dir_stream( DirClient* dir_client, int stream_id, uint8_t* read_buf, int length )
+{
+  int ret;
+  DirStream* stream = &dir_client->streams[stream_id];
+  DlConnection* or_connection;
+  OnionMessage* onion_message;
+
+  if ( stream->leftover == NULL )
+  {
+    if ( stream->ended == true )
+    {
+      return 0;
+    }
+
+    MINITOR_DEQUEUE_BLOCKING( stream->queue, (void*)(&onion_message) );
+
+    if ( onion_message == NULL )
+    {
+      return -1;
+    }
+
+    if ( onion_message->type == CLIENT_RELAY_END )
+    {
+      stream->ended = true;
+
+      free( onion_message );
+
+      return 0;
+    }
+
+    stream->leftover = onion_message->data;
+    stream->leftover_offset = 0;
+    stream->leftover_length = onion_message->length;
+
+    free( onion_message );
+
+    // the window only opens back up as we consume, so a slow reader holds
+    // at most DIR_STREAM_WINDOW cells
+    stream->data_cells++;
+
+    if ( stream->data_cells == DIR_STREAM_SENDME_INCREMENT )
+    {
+      stream->data_cells = 0;
+
+      // MUTEX TAKE
+      or_connection = px_lock_dir_connection( dir_client );
+
+      if ( or_connection == NULL )
+      {
+        return -1;
+      }
+
+      ret = d_send_dir_relay_cell( dir_client, or_connection, RELAY_SENDME, stream_id, NULL, 0 );
+
+      MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+      // MUTEX GIVE
+
+      if ( ret < 0 )
+      {
+        return -1;
+      }
+    }
+  }
+
+  ret = stream->leftover_length - stream->leftover_offset;
+
+  if ( ret > length )
+  {
+    ret = length;
+  }
+
+  memcpy( read_buf, stream->leftover + stream->leftover_offset, ret );
+
+  stream->leftover_offset += ret;
+
+  if ( stream->leftover_offset == stream->leftover_length )
+  {
+    free( stream->leftover );
+    stream->leftover = NULL;
+  }
+
+  return ret;
+}
+
+bool b_dir_stream_readable( DirClient* dir_client, int stream_id )
+{
+  DirStream* stream = &dir_client->streams[stream_id];
+
+  return stream->leftover != NULL || stream->ended == true || MINITOR_QUEUE_MESSAGES_WAITING( stream->queue ) > 0;
+}
+
+void v_close_dir_stream( DirClient* dir_client, int stream_id )
+{
+  uint8_t reason = REASON_DONE;
+  DirStream* stream = &dir_client->streams[stream_id];
+  DlConnection* or_connection;
+
+  // MUTEX TAKE
+  or_connection = px_lock_dir_connection( dir_client );
+
+  if ( or_connection != NULL )
+  {
+    if ( stream->ended == false )
+    {
+      d_send_dir_relay_cell( dir_client, or_connection, RELAY_END, stream_id, &reason, 1 );
+    }
+
+    // the core only delivers while holding the connection
+    v_drain_dir_queue( stream->queue );
+    MINITOR_QUEUE_DELETE( stream->queue );
+    stream->queue = NULL;
+
+    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+    // MUTEX GIVE
+  }
+  else
+  {
+    v_drain_dir_queue( stream->queue );
+    MINITOR_QUEUE_DELETE( stream->queue );
+    stream->queue = NULL;
+  }
+
+  if ( stream->leftover != NULL )
+  {
+    free( stream->leftover );
+    stream->leftover = NULL;
+  }
+}
+
+// called by the core task once the circuit is built
+void v_dir_client_ready( OnionCircuit* circuit )
+{
+  OnionMessage* onion_message;
+
+  onion_message = malloc( sizeof( OnionMessage ) );
+  onion_message->type = DIR_CIRCUIT_READY;
+
+  MINITOR_ENQUEUE_BLOCKING( circuit->dir_client->streams[0].queue, (void*)(&onion_message) );
+}
+
+// called by the core task when the circuit goes away, every waiting reader
+// gets a NULL
+void v_dir_client_closed( DirClient* dir_client )
+{
+  int i;
+  OnionMessage* onion_message = NULL;
+
+  for ( i = 0; i < DIR_STREAM_MAX; i++ )
+  {
+    if ( dir_client->streams[i].queue != NULL )
+    {
+      MINITOR_ENQUEUE_BLOCKING( dir_client->streams[i].queue, (void*)(&onion_message) );
+    }
+  }
+}
+
+// circuit level sendmes are authenticated with the digest of the cell that
+// used up the increment
+static int d_send_dir_circuit_sendme( OnionCircuit* circuit, DlConnection* or_connection )
+{
+  Cell* sendme_cell;
+
+  sendme_cell = malloc( MINITOR_CELL_LEN );
+
+  sendme_cell->command = RELAY;
+  sendme_cell->circ_id = circuit->circ_id;
+
+  sendme_cell->payload.relay.relay_command = RELAY_SENDME;
+  sendme_cell->payload.relay.recognized = 0;
+  sendme_cell->payload.relay.stream_id = 0;
+  sendme_cell->payload.relay.digest = 0;
+  sendme_cell->payload.relay.length = 3 + WC_SHA_DIGEST_SIZE;
+  sendme_cell->payload.relay.sendme.version = SENDME_AUTH;
+  sendme_cell->payload.relay.sendme.data_length = WC_SHA_DIGEST_SIZE;
+
+  wc_ShaGetHash( &circuit->relay_list.tail->relay_crypto->running_sha_backward, sendme_cell->payload.relay.sendme.digest );
+
+  sendme_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + sendme_cell->payload.relay.length;
+
+  if ( d_send_relay_cell_and_free( or_connection, sendme_cell, &circuit->relay_list, NULL ) < 0 )
+  {
+    MINITOR_LOG( DIR_TAG, "Failed to send circuit RELAY_SENDME" );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static int d_dir_client_relay_data( OnionCircuit* circuit, DlConnection* or_connection, Cell* data_cell )
+{
+  DirClient* dir_client = circuit->dir_client;
+  DirStream* stream;
+  OnionMessage* onion_message;
+
+  dir_client->data_cells++;
+
+  if ( dir_client->data_cells == DIR_CIRCUIT_SENDME_INCREMENT )
+  {
+    dir_client->data_cells = 0;
+
+    if ( d_send_dir_circuit_sendme( circuit, or_connection ) < 0 )
+    {
+      return -1;
+    }
+  }
+
+  if ( data_cell->payload.relay.stream_id <= 0 || data_cell->payload.relay.stream_id >= DIR_STREAM_MAX )
+  {
+    return -1;
+  }
+
+  stream = &dir_client->streams[data_cell->payload.relay.stream_id];
+
+  // a stream we already closed, the cache hasn't seen our end yet
+  if ( stream->queue != NULL )
+  {
+    onion_message = malloc( sizeof( OnionMessage ) );
+    onion_message->type = CLIENT_RELAY_DATA;
+    onion_message->length = data_cell->payload.relay.length;
+    onion_message->data = malloc( onion_message->length );
+
+    memcpy( onion_message->data, data_cell->payload.relay.data, onion_message->length );
+
+    MINITOR_ENQUEUE_BLOCKING( stream->queue, (void*)(&onion_message) );
+  }
+
+  return 0;
+}
+
+// connected and end both just get passed on to the stream's reader
+static int d_dir_client_relay_event( OnionCircuit* circuit, Cell* cell, OnionMessageType type )
+{
+  DirStream* stream;
+  OnionMessage* onion_message;
+
+  if ( cell->payload.relay.stream_id <= 0 || cell->payload.relay.stream_id >= DIR_STREAM_MAX )
+  {
+    return -1;
+  }
+
+  stream = &circuit->dir_client->streams[cell->payload.relay.stream_id];
+
+  if ( stream->queue != NULL )
+  {
+    onion_message = malloc( sizeof( OnionMessage ) );
+    onion_message->type = type;
+
+    MINITOR_ENQUEUE_BLOCKING( stream->queue, (void*)(&onion_message) );
+  }
+
+  return 0;
+}
+
+void v_dir_client_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* cell )
+{
+  MinitorMutex access_mutex;
+
+  access_mutex = connection_access_mutex[or_connection->mutex_index];
+
+  if ( cell->command != RELAY )
+  {
+    MINITOR_LOG( DIR_TAG, "Invalid cell command %d", cell->command );
+
+    goto circuit_destroy;
+  }
+
+  switch ( cell->payload.relay.relay_command )
+  {
+    case RELAY_DATA:
+      if ( d_dir_client_relay_data( circuit, or_connection, cell ) < 0 )
+      {
+        MINITOR_LOG( DIR_TAG, "Failed to d_dir_client_relay_data" );
+
+        goto circuit_destroy;
+      }
+
+      break;
+    case RELAY_CONNECTED:
+      if ( d_dir_client_relay_event( circuit, cell, CLIENT_RELAY_CONNECTED ) < 0 )
+      {
+        MINITOR_LOG( DIR_TAG, "Failed to pass on RELAY_CONNECTED" );
+
+        goto circuit_destroy;
+      }
+
+      break;
+    case RELAY_END:
+      if ( d_dir_client_relay_event( circuit, cell, CLIENT_RELAY_END ) < 0 )
+      {
+        MINITOR_LOG( DIR_TAG, "Failed to pass on RELAY_END" );
+
+        goto circuit_destroy;
+      }
+
+      break;
+    case RELAY_TRUNCATED:
+      goto circuit_destroy;
+    // we never send enough for the cache's sendmes to matter
+    case RELAY_SENDME:
+    case RELAY_DROP:
+      break;
+    default:
+      MINITOR_LOG( DIR_TAG, "Got an unknown relay command from dir circuit cell: %d", cell->payload.relay.relay_command );
+      break;
+  }
+
+  MINITOR_MUTEX_GIVE( access_mutex );
+  // MUTEX GIVE
+
+  return;
+
+circuit_destroy:
+  // this will give the mutex
+  v_circuit_rebuild_or_destroy( circuit, or_connection );
+  // MUTEX GIVE
+}
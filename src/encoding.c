@@ -20,282 +20,308 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "stdio.h"
 #include "stdlib.h"
 
+#include "../h/encoding.h"
+
 static const char* base64_table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char* base32_table = "abcdefghijklmnopqrstuvwxyz234567";
 
+// reverse lookups from a character to its value, anything that isn't part
+// of the alphabet is ENCODING_INVALID and gets skipped
+static const uint8_t base64_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static const uint8_t base32_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
 // decode a base64 string and put it into the destination byte buffer
 // NOTE it is up to the coller to make sure the destination can fit the
 // bytes being put into it
 int d_base_64_decode( uint8_t* destination, char* source, int source_length )
 {
-  // index variables
-  int i;
-  int j;
-  // byte to store the value between characters
-  uint8_t tmp_byte = 0;
-  // how many bits of the tmp_byte are full
-  int tmp_byte_length = 0;
-  // the src byte which always has the last 6 bits filled
-  uint8_t src_byte = 0;
+  Base64Decoder decoder;
+
+  v_init_base_64_decoder( &decoder );
+
+  return d_base_64_decode_update( &decoder, destination, source, source_length );
+}
+
+void v_init_base_64_decoder( Base64Decoder* decoder )
+{
+  decoder->bits = 0;
+  decoder->bit_count = 0;
+}
+
+// decode the next chunk of a base64 stream, newlines and anything else
+// outside the alphabet are skipped and a partial group carries over to the
+// next call, returns how many bytes were written
+int d_base_64_decode_update( Base64Decoder* decoder, uint8_t* destination, char* source, int source_length )
+{
+  int i = 0;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  uint8_t d;
+  uint8_t value;
+  uint32_t group;
+  const uint8_t* input = (const uint8_t*)source;
   uint8_t* destination_start = destination;
 
-  // for each character in the base64 string
-  for ( i = 0; i < source_length; i++ )
+  while ( i < source_length )
   {
-    // find the value of the base64 character by matching it to the table, the index
-    // of the table is the value of that character
-    for ( j = 0; j < 64; j++ )
+    // whole groups of four characters go straight to three bytes until we
+    // hit something to skip
+    if ( decoder->bit_count == 0 )
     {
-      if ( base64_table[j] == source[i] )
+      while ( i + 4 <= source_length )
+      {
+        a = base64_values[input[i]];
+        b = base64_values[input[i + 1]];
+        c = base64_values[input[i + 2]];
+        d = base64_values[input[i + 3]];
+
+        if ( ( ( a | b | c | d ) & 0xc0 ) != 0 )
+        {
+          break;
+        }
+
+        group = ( (uint32_t)a << 18 ) | ( (uint32_t)b << 12 ) | ( (uint32_t)c << 6 ) | d;
+
+        destination[0] = (uint8_t)( group >> 16 );
+        destination[1] = (uint8_t)( group >> 8 );
+        destination[2] = (uint8_t)group;
+        destination += 3;
+        i += 4;
+      }
+
+      if ( i >= source_length )
       {
-        src_byte = (uint8_t)j;
         break;
       }
     }
 
-    if ( j == 64 )
+    value = base64_values[input[i]];
+    i++;
+
+    if ( value == ENCODING_INVALID )
     {
       continue;
     }
 
-    // if we have a fresh byte, just move the src byte over 2, store it set the length
-    // to 6
-    if ( tmp_byte_length == 0 )
-    {
-      tmp_byte = src_byte << 2;
-      tmp_byte_length = 6;
-    // if our length is 6
-    }
-    else if ( tmp_byte_length == 6 )
-    {
-      // we only want the first two bits of the src byte, shift the last 4 off and
-      // add the first two to the temp_byte
-      tmp_byte |= src_byte >> 4;
-      // the tmp byte is full, add it to the destination buffer
-      *destination = tmp_byte;
-      destination++;
-      // store the last 4 bits of the src_byte into the tmp byte and set the length
-      // to 4
-      tmp_byte = src_byte << 4;
-      tmp_byte_length = 4;
-    // if our length is 4
-    }
-    else if ( tmp_byte_length == 4 )
-    {
-      // we only want the first four bits of the src byte, shift the last 2 off and
-      // add the first 4 to the tmp_byte
-      tmp_byte |= src_byte >> 2;
-      // the tmp byte is full, add it to the destination buffer
-      *destination = tmp_byte;
-      destination++;
-      // store the last 2 bits of the src_byte into the tmp byte and set the length
-      // to 2
-      tmp_byte = src_byte << 6;
-      tmp_byte_length = 2;
-    // if our length is 2
-    }
-    else if ( tmp_byte_length == 2 )
+    decoder->bits = ( decoder->bits << 6 ) | value;
+    decoder->bit_count += 6;
+
+    if ( decoder->bit_count >= 8 )
     {
-      // we can just add 6 bits of our src byte to the tmp byte and add that to the
-      // destination buffer, we now have a fresh temp byte so set length to 0
-      tmp_byte |= src_byte;
-      *destination = tmp_byte;
+      decoder->bit_count -= 8;
+      *destination = (uint8_t)( decoder->bits >> decoder->bit_count );
       destination++;
-      tmp_byte_length = 0;
     }
+
+    decoder->bits &= ( 1 << decoder->bit_count ) - 1;
   }
 
   return destination - destination_start;
 }
 
-void v_base_64_encode( char* destination, unsigned char* source, int source_length ) {
+void v_base_64_encode( char* destination, unsigned char* source, int source_length )
+{
   int i;
-  unsigned char tmp_byte = 0;
-  int tmp_byte_length = 0;
+  uint32_t group;
+  uint32_t bits = 0;
+  int bit_count = 0;
 
-  for ( i = 0; i < source_length; i++ ) {
-    if ( tmp_byte_length == 0 ) {
-      *destination = base64_table[(int)( source[i] >> 2 )];
-      destination++;
-      tmp_byte = ( source[i] & 0x03 ) << 4;
-      tmp_byte_length = 2;
-    } else if ( tmp_byte_length == 2 ) {
-      tmp_byte |= source[i] >> 4;
-      *destination = base64_table[(int)tmp_byte];
-      destination++;
-      tmp_byte = ( source[i] & 0x0f ) << 2;
-      tmp_byte_length = 4;
-    } else if ( tmp_byte_length == 4 ) {
-      tmp_byte |= source[i] >> 6;
-      *destination = base64_table[(int)tmp_byte];
-      destination++;
-      *destination = base64_table[(int)( source[i] & ( 0x3f ) )];
+  for ( i = 0; i + 3 <= source_length; i += 3 )
+  {
+    group = ( (uint32_t)source[i] << 16 ) | ( (uint32_t)source[i + 1] << 8 ) | source[i + 2];
+
+    destination[0] = base64_table[( group >> 18 ) & 0x3f];
+    destination[1] = base64_table[( group >> 12 ) & 0x3f];
+    destination[2] = base64_table[( group >> 6 ) & 0x3f];
+    destination[3] = base64_table[group & 0x3f];
+    destination += 4;
+  }
+
+  // the last one or two bytes, unpadded
+  for ( ; i < source_length; i++ )
+  {
+    bits = ( bits << 8 ) | source[i];
+    bit_count += 8;
+
+    while ( bit_count >= 6 )
+    {
+      bit_count -= 6;
+      *destination = base64_table[( bits >> bit_count ) & 0x3f];
       destination++;
-      tmp_byte_length = 0;
     }
   }
 
-  if ( tmp_byte_length != 0 ) {
-    *destination = base64_table[(int)tmp_byte];
+  if ( bit_count != 0 )
+  {
+    *destination = base64_table[( bits << ( 6 - bit_count ) ) & 0x3f];
   }
 }
 
 void v_base_32_decode( uint8_t* destination, char* source, int source_length )
 {
-  // index variables
-  int i;
+  int i = 0;
   int j;
-  // byte to store the value between characters
-  uint8_t tmp_byte = 0;
-  // how many bits of the tmp_byte are full
-  int tmp_byte_length = 0;
-  // the src byte which always has the last 6 bits filled
-  uint8_t src_byte = 0;
-
-  // for each character in the base64 string
-  for ( i = 0; i < source_length; i++ )
+  uint8_t value;
+  uint8_t values[8];
+  uint8_t combined;
+  uint64_t group;
+  uint32_t bits = 0;
+  int bit_count = 0;
+  const uint8_t* input = (const uint8_t*)source;
+
+  while ( i < source_length )
   {
-    if ( source[i] == '=' )
+    // whole groups of eight characters go straight to five bytes
+    if ( bit_count == 0 )
     {
-      if ( tmp_byte_length > 0 )
+      while ( i + 8 <= source_length )
       {
-        *destination = tmp_byte;
+        combined = 0;
+
+        for ( j = 0; j < 8; j++ )
+        {
+          values[j] = base32_values[input[i + j]];
+          combined |= values[j];
+        }
+
+        if ( ( combined & 0xe0 ) != 0 )
+        {
+          break;
+        }
+
+        group = 0;
+
+        for ( j = 0; j < 8; j++ )
+        {
+          group = ( group << 5 ) | values[j];
+        }
+
+        destination[0] = (uint8_t)( group >> 32 );
+        destination[1] = (uint8_t)( group >> 24 );
+        destination[2] = (uint8_t)( group >> 16 );
+        destination[3] = (uint8_t)( group >> 8 );
+        destination[4] = (uint8_t)group;
+        destination += 5;
+        i += 8;
       }
 
-      break;
+      if ( i >= source_length )
+      {
+        break;
+      }
     }
 
-    // find the value of the base64 character by matching it to the table, the index
-    // of the table is the value of that character
-    for ( j = 0; j < 32; j++ )
+    // padding ends the string, flush whatever bits are left
+    if ( source[i] == '=' )
     {
-      if ( base32_table[j] == source[i] )
+      if ( bit_count > 0 )
       {
-        src_byte = j;
-        break;
+        *destination = (uint8_t)( bits << ( 8 - bit_count ) );
       }
+
+      break;
     }
 
-    if ( j == 32 )
+    value = base32_values[input[i]];
+    i++;
+
+    if ( value == ENCODING_INVALID )
     {
       continue;
     }
 
-    switch ( tmp_byte_length )
-    {
-      case 0:
-        tmp_byte = src_byte << 3;
-        tmp_byte_length = 5;
-
-        break;
-      case 5:
-        tmp_byte |= src_byte >> 2;
-        *destination = tmp_byte;
-        destination++;
-
-        tmp_byte = src_byte << 6;
-        tmp_byte_length = 2;
-
-        break;
-      case 2:
-        tmp_byte |= src_byte << 1;
-        tmp_byte_length = 7;
-
-        break;
-
-      case 7:
-        tmp_byte |= src_byte >> 4;
-        *destination = tmp_byte;
-        destination++;
-
-        tmp_byte = src_byte << 4;
-        tmp_byte_length = 4;
-
-        break;
-      case 4:
-        tmp_byte |= src_byte >> 1;
-        *destination = tmp_byte;
-        destination++;
-
-        tmp_byte = src_byte << 7;
-        tmp_byte_length = 1;
-
-        break;
-      case 1:
-        tmp_byte |= src_byte << 2;
-        tmp_byte_length = 6;
-
-        break;
-      case 6:
-        tmp_byte |= src_byte >> 3;
-        *destination = tmp_byte;
-        destination++;
-
-        tmp_byte = src_byte << 5;
-        tmp_byte_length = 3;
-
-        break;
-      case 3:
-        tmp_byte |= src_byte;
-        *destination = tmp_byte;
-        destination++;
-
-        tmp_byte_length = 0;
-
-        break;
-      default:
-        printf( "BAD DEFAULT\n" );
+    bits = ( bits << 5 ) | value;
+    bit_count += 5;
 
-        break;
+    if ( bit_count >= 8 )
+    {
+      bit_count -= 8;
+      *destination = (uint8_t)( bits >> bit_count );
+      destination++;
     }
+
+    bits &= ( 1 << bit_count ) - 1;
   }
 }
 
-void v_base_32_encode( char* destination, unsigned char* source, int source_length ) {
+void v_base_32_encode( char* destination, unsigned char* source, int source_length )
+{
   int i;
-  unsigned char tmp_byte = 0;
-  int tmp_byte_length = 0;
+  uint64_t group;
+  uint32_t bits = 0;
+  int bit_count = 0;
 
-  for ( i = 0; i < source_length; i++ ) {
-    if ( tmp_byte_length == 0 ) {
-      *destination = base32_table[(int)( source[i] >> 3 )];
-      destination++;
-      tmp_byte = ( source[i] & 0x07 ) << 2;
-      tmp_byte_length = 3;
-    } else if ( tmp_byte_length == 3 ) {
-      tmp_byte |= source[i] >> 6;
-      *destination = base32_table[(int)tmp_byte];
-      destination++;
-      *destination = base32_table[(int)( ( source[i] & 0x3f ) >> 1 )];
-      destination++;
-      tmp_byte = ( source[i] & 0x01 ) << 4;
-      tmp_byte_length = 1;
-    } else if ( tmp_byte_length == 1 ) {
-      tmp_byte |= source[i] >> 4;
-      *destination = base32_table[(int)tmp_byte];
-      destination++;
-      tmp_byte = ( source[i] & 0x0f ) << 1;
-      tmp_byte_length = 4;
-    } else if ( tmp_byte_length == 4 ) {
-      tmp_byte |= source[i] >> 7;
-      *destination = base32_table[(int)tmp_byte];
-      destination++;
-      *destination = base32_table[(int)( ( source[i] & 0x7f ) >> 2 )];
-      destination++;
-      tmp_byte = ( source[i] & 0x03 ) << 3;
-      tmp_byte_length = 2;
-    } else if ( tmp_byte_length == 2 ) {
-      tmp_byte |= source[i] >> 5;
-      *destination = base32_table[(int)tmp_byte];
-      destination++;
-      *destination = base32_table[(int)( source[i] & 0x1f )];
+  for ( i = 0; i + 5 <= source_length; i += 5 )
+  {
+    group = ( (uint64_t)source[i] << 32 ) | ( (uint64_t)source[i + 1] << 24 ) | ( (uint64_t)source[i + 2] << 16 ) | ( (uint64_t)source[i + 3] << 8 ) | source[i + 4];
+
+    destination[0] = base32_table[( group >> 35 ) & 0x1f];
+    destination[1] = base32_table[( group >> 30 ) & 0x1f];
+    destination[2] = base32_table[( group >> 25 ) & 0x1f];
+    destination[3] = base32_table[( group >> 20 ) & 0x1f];
+    destination[4] = base32_table[( group >> 15 ) & 0x1f];
+    destination[5] = base32_table[( group >> 10 ) & 0x1f];
+    destination[6] = base32_table[( group >> 5 ) & 0x1f];
+    destination[7] = base32_table[group & 0x1f];
+
+    destination += 8;
+  }
+
+  // the last partial group, unpadded
+  for ( ; i < source_length; i++ )
+  {
+    bits = ( bits << 8 ) | source[i];
+    bit_count += 8;
+
+    while ( bit_count >= 5 )
+    {
+      bit_count -= 5;
+      *destination = base32_table[( bits >> bit_count ) & 0x1f];
       destination++;
-      tmp_byte_length = 0;
     }
+
+    bits &= ( 1 << bit_count ) - 1;
   }
 
-  if ( tmp_byte_length != 0 ) {
-    *destination = base32_table[(int)tmp_byte];
+  if ( bit_count != 0 )
+  {
+    *destination = base32_table[( bits << ( 5 - bit_count ) ) & 0x1f];
   }
 }
 
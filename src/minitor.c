@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../include/config.h"
 #include "../include/minitor.h"
+#include "../include/minitor_service.h"
 #include "../h/port.h"
 
 #include "../h/consensus.h"
@@ -28,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/onion_service.h"
 #include "../h/connections.h"
 #include "../h/core.h"
+#include "../h/models/relay.h"
 
 WOLFSSL_CTX* xMinitorWolfSSL_Context;
 MinitorTask core_task;
@@ -111,14 +113,21 @@ int d_minitor_INIT()
 
   circ_id_mutex = MINITOR_MUTEX_CREATE();
   network_consensus_mutex = MINITOR_MUTEX_CREATE();
+  snapshot_mutex = MINITOR_MUTEX_CREATE();
   crypto_insert_finish = MINITOR_MUTEX_CREATE();
+  relay_batch_mutex = MINITOR_MUTEX_CREATE();
   connections_mutex = MINITOR_MUTEX_CREATE();
   circuits_mutex = MINITOR_MUTEX_CREATE();
   fastest_cache_mutex = MINITOR_MUTEX_CREATE();
+  bootstrap_mutex = MINITOR_MUTEX_CREATE();
+
+  // readers always find a snapshot, an empty one until a consensus loads
+  d_publish_consensus_snapshot( NULL, NULL, NULL );
 
   core_task_queue = MINITOR_QUEUE_CREATE( 25, sizeof( OnionMessage* ) );
   core_internal_queue = MINITOR_QUEUE_CREATE( 25, sizeof( OnionMessage* ) );
   connections_task_queue = MINITOR_QUEUE_CREATE( 25, sizeof( OnionMessage* ) );
+  bootstrap_queue = MINITOR_QUEUE_CREATE( BOOTSTRAP_MILESTONE_COUNT, sizeof( void* ) );
 
   b_create_core_task( &core_task );
 
@@ -162,20 +171,97 @@ int d_minitor_INIT()
 
   MINITOR_LOG( MINITOR_TAG, "Starting fetch" );
 
-  // fetch network consensus
-  while ( d_fetch_consensus_info() < 0 )
+  v_start_bootstrap();
+
+  // fetch network consensus in the background, a persisted consensus that is
+  // still valid is used right away, otherwise we only wait until there are
+  // enough relays to build paths and the hsdir work waits for the full ring
+  if ( d_start_consensus_refresh( true ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Fetch failed, retrying" );
+    MINITOR_LOG( MINITOR_TAG, "Failed to start consensus fetch" );
+
+    return -1;
   }
 
+  v_wait_for_bootstrap( BOOTSTRAP_PATH_SELECTION );
+
   return 0;
 }
 
 // ONION SERVICES
+// "address:port" or "unix:/path/to/socket"
+static int d_parse_backend( const char* spec, LocalBackend* backend )
+{
+  int port;
+  const char* colon;
+  char host[16];
+
+  memset( backend, 0, sizeof( LocalBackend ) );
+  backend->healthy = true;
+
+  if ( strncmp( spec, "unix:", 5 ) == 0 )
+  {
+    if ( strlen( spec + 5 ) == 0 || strlen( spec + 5 ) >= LOCAL_BACKEND_PATH_LENGTH )
+    {
+      return -1;
+    }
+
+    backend->is_unix = true;
+    strcpy( backend->path, spec + 5 );
+
+    return 0;
+  }
+
+  colon = strrchr( spec, ':' );
+
+  if ( colon == NULL || colon - spec >= sizeof( host ) )
+  {
+    return -1;
+  }
+
+  memcpy( host, spec, colon - spec );
+  host[colon - spec] = 0;
+
+  port = atoi( colon + 1 );
+  backend->address = inet_addr( host );
+
+  if ( port <= 0 || port > 65535 || backend->address == INADDR_NONE )
+  {
+    return -1;
+  }
+
+  backend->port = port;
+
+  return 0;
+}
+
 int d_setup_onion_service( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory )
+{
+  return d_setup_onion_service_with_options( local_port, exit_port, onion_service_directory, NULL );
+}
+
+int d_setup_onion_service_with_options( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory, const MinitorServiceOptions* options )
 {
   OnionMessage* onion_message;
-  OnionService* service = malloc( sizeof( OnionService ) );
+  OnionService* service;
+
+  int i;
+
+  if ( options != NULL && ( options->intro_count < 0 || options->intro_count > HS_MAX_INTRO_POINTS ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Intro point count must be between 1 and %d", HS_MAX_INTRO_POINTS );
+
+    return -1;
+  }
+
+  if ( options != NULL && ( options->backend_count < 0 || options->backend_count > HS_MAX_BACKENDS || ( options->backend_count > 0 && options->backends == NULL ) ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Backend count must be between 0 and %d", HS_MAX_BACKENDS );
+
+    return -1;
+  }
+
+  service = malloc( sizeof( OnionService ) );
 
   memset( service, 0, sizeof( OnionService ) );
 
@@ -183,6 +269,78 @@ int d_setup_onion_service( unsigned short local_port, unsigned short exit_port,
   service->exit_port = exit_port;
   service->rend_timestamp = 0;
 
+  service->intro_count = MINITOR_INTRO_POINTS;
+  service->intro_max_introductions = MINITOR_INTRO_MAX_INTRODUCTIONS;
+  service->intro_max_lifetime = MINITOR_INTRO_MAX_LIFETIME;
+  service->rend_pool_min = MINITOR_REND_POOL_MIN;
+  service->rend_pool_max = MINITOR_REND_POOL_MAX;
+
+  if ( options != NULL )
+  {
+    if ( options->intro_count > 0 )
+    {
+      service->intro_count = options->intro_count;
+    }
+
+    if ( options->intro_max_introductions > 0 )
+    {
+      service->intro_max_introductions = options->intro_max_introductions;
+    }
+
+    if ( options->intro_max_lifetime > 0 )
+    {
+      service->intro_max_lifetime = options->intro_max_lifetime;
+    }
+
+    if ( options->rend_pool_min > 0 )
+    {
+      service->rend_pool_min = options->rend_pool_min;
+    }
+
+    if ( options->rend_pool_max > 0 )
+    {
+      service->rend_pool_max = options->rend_pool_max;
+    }
+
+    service->single_onion = options->single_onion != 0;
+    service->backend_policy = options->backend_policy;
+    service->backend_count = options->backend_count;
+  }
+
+  // without a backend list streams go to local_port like before
+  if ( service->backend_count == 0 )
+  {
+    service->backend_count = 1;
+    service->backends = malloc( sizeof( LocalBackend ) );
+
+    memset( service->backends, 0, sizeof( LocalBackend ) );
+    service->backends[0].address = inet_addr( "127.0.0.1" );
+    service->backends[0].port = local_port;
+    service->backends[0].healthy = true;
+  }
+  else
+  {
+    service->backends = malloc( sizeof( LocalBackend ) * service->backend_count );
+
+    for ( i = 0; i < service->backend_count; i++ )
+    {
+      if ( d_parse_backend( options->backends[i], &service->backends[i] ) < 0 )
+      {
+        MINITOR_LOG( MINITOR_TAG, "Invalid backend: %s", options->backends[i] );
+
+        free( service->backends );
+        free( service );
+
+        return -1;
+      }
+    }
+  }
+
+  if ( service->rend_pool_max < service->rend_pool_min )
+  {
+    service->rend_pool_max = service->rend_pool_min;
+  }
+
   service->hsdir_timer = MINITOR_TIMER_CREATE_MS(
     "HSDIR_TIMER",
     1000 * 60 * 60 * 24,
@@ -196,6 +354,7 @@ int d_setup_onion_service( unsigned short local_port, unsigned short exit_port,
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to generate hs keys" );
 
+    free( service->backends );
     free( service );
 
     return -1;
@@ -0,0 +1,239 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../../include/config.h"
+#include "../../h/port.h"
+
+#include "../../h/constants.h"
+#include "../../h/models/buffered_file.h"
+
+// truncates filename and opens it for buffered writing, a file that is
+// already open is closed first
+int d_open_buffered_file( BufferedFile* file, const char* filename )
+{
+  if ( file->fd >= 0 )
+  {
+    d_close_buffered_file( file );
+  }
+
+  if ( file->buffer == NULL )
+  {
+    file->buffer = malloc( sizeof( uint8_t ) * BUFFERED_FILE_BLOCK_SIZE );
+
+    if ( file->buffer == NULL )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to allocate buffer for %s", filename );
+
+      return -1;
+    }
+  }
+
+  file->fd = open( filename, O_CREAT | O_WRONLY | O_TRUNC, 0600 );
+
+  if ( file->fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+
+    return -1;
+  }
+
+  file->filename = filename;
+  file->length = 0;
+  file->flushed_length = 0;
+
+  return 0;
+}
+
+static int d_write_all( BufferedFile* file, const uint8_t* data, int length )
+{
+  int succ;
+  int written = 0;
+
+  while ( written < length )
+  {
+    succ = write( file->fd, data + written, length - written );
+
+    if ( succ < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+
+      MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", file->filename, errno );
+
+      return -1;
+    }
+
+    written += succ;
+  }
+
+  file->flushed_length += length;
+
+  return 0;
+}
+
+int d_flush_buffered_file( BufferedFile* file )
+{
+  if ( file->fd < 0 )
+  {
+    return -1;
+  }
+
+  if ( file->length == 0 )
+  {
+    return 0;
+  }
+
+  if ( d_write_all( file, file->buffer, file->length ) < 0 )
+  {
+    return -1;
+  }
+
+  file->length = 0;
+
+  return 0;
+}
+
+int d_write_buffered_file( BufferedFile* file, const void* data, int length )
+{
+  if ( file->fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Buffered file is not open" );
+
+    return -1;
+  }
+
+  if ( file->length + length > BUFFERED_FILE_BLOCK_SIZE )
+  {
+    if ( d_flush_buffered_file( file ) < 0 )
+    {
+      return -1;
+    }
+  }
+
+  // too big to be worth buffering, send it straight through
+  if ( length >= BUFFERED_FILE_BLOCK_SIZE )
+  {
+    return d_write_all( file, data, length );
+  }
+
+  memcpy( file->buffer + file->length, data, length );
+  file->length += length;
+
+  return 0;
+}
+
+// overwrite bytes that have already been written, eg a header reserved
+// when the file was opened
+int d_write_buffered_file_at( BufferedFile* file, const void* data, int length, off_t offset )
+{
+  if ( d_flush_buffered_file( file ) < 0 )
+  {
+    return -1;
+  }
+
+  if ( pwrite( file->fd, data, length, offset ) != length )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to pwrite %s, errno: %d", file->filename, errno );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+int d_close_buffered_file( BufferedFile* file )
+{
+  int ret = 0;
+
+  if ( file->fd < 0 )
+  {
+    return 0;
+  }
+
+  if ( d_flush_buffered_file( file ) < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( close( file->fd ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", file->filename, errno );
+
+    ret = -1;
+  }
+
+  file->fd = -1;
+  file->length = 0;
+
+  free( file->buffer );
+  file->buffer = NULL;
+
+  return ret;
+}
+
+// flush, sync once and atomically rename over final_filename
+int d_commit_buffered_file( BufferedFile* file, const char* final_filename )
+{
+  const char* filename = file->filename;
+
+  if ( file->fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Can't commit %s, it isn't open", final_filename );
+
+    return -1;
+  }
+
+  if ( d_flush_buffered_file( file ) < 0 )
+  {
+    d_close_buffered_file( file );
+
+    return -1;
+  }
+
+  if ( fsync( file->fd ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to fsync %s, errno: %d", filename, errno );
+
+    d_close_buffered_file( file );
+
+    return -1;
+  }
+
+  if ( d_close_buffered_file( file ) < 0 )
+  {
+    return -1;
+  }
+
+  if ( rename( filename, final_filename ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to rename %s, errno: %d", filename, errno );
+
+    return -1;
+  }
+
+  return 0;
+}
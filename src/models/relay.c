@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -29,7 +30,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../../h/constants.h"
 #include "../../h/consensus.h"
+#include "../../h/models/buffered_file.h"
 #include "../../h/models/relay.h"
+#include "../../h/models/relay_db.h"
+#include "../../h/models/relay_table.h"
 
 uint32_t hsdir_relay_count = 0;
 uint32_t cache_relay_count = 0;
@@ -39,36 +43,51 @@ uint32_t staging_hsdir_relay_count = 0;
 uint32_t staging_cache_relay_count = 0;
 uint32_t staging_fast_relay_count = 0;
 
-static int d_add_relay_to_list( OnionRelay* onion_relay, const char* filename )
+static BufferedFile staging_hsdir_file = BUFFERED_FILE_INITIALIZER;
+static BufferedFile staging_cache_file = BUFFERED_FILE_INITIALIZER;
+static BufferedFile staging_fast_file = BUFFERED_FILE_INITIALIZER;
+static BufferedFile staging_descriptor_cache_file = BUFFERED_FILE_INITIALIZER;
+
+static const char* hsdir_index_files[2] = {
+  FILESYSTEM_PREFIX "hsdir_index_previous",
+  FILESYSTEM_PREFIX "hsdir_index",
+};
+static const char* hsdir_index_stg_files[2] = {
+  FILESYSTEM_PREFIX "hsdir_index_previous_stg",
+  FILESYSTEM_PREFIX "hsdir_index_stg",
+};
+
+static int d_add_relay_to_list( OnionRelay* onion_relay, BufferedFile* staging_file )
 {
-  int fd;
-
-  fd = open( filename, O_WRONLY | O_APPEND );
-
-  if ( fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
-
-    return -1;
-  }
+  uint8_t record[RELAY_RECORD_SIZE];
 
-  if ( write( fd, onion_relay, sizeof( OnionRelay )  ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", filename, errno );
+  v_pack_relay_record( record, onion_relay );
 
-    close( fd );
+  return d_write_buffered_file( staging_file, record, RELAY_RECORD_SIZE );
+}
 
-    return -1;
-  }
+// every hsdir in the new consensus goes into the new cache, anything the
+// consensus no longer references is left behind and so evicted
+static int d_add_relay_to_descriptor_cache( OnionRelay* onion_relay )
+{
+  DescriptorCacheEntry entry;
 
-  close( fd );
+  memcpy( entry.digest, onion_relay->digest, ID_LENGTH );
+  memcpy( entry.identity, onion_relay->identity, ID_LENGTH );
+  memcpy( entry.master_key, onion_relay->master_key, H_LENGTH );
+  memcpy( entry.ntor_onion_key, onion_relay->ntor_onion_key, H_LENGTH );
 
-  return 0;
+  return d_write_buffered_file( &staging_descriptor_cache_file, &entry, sizeof( DescriptorCacheEntry ) );
 }
 
 int d_create_hsdir_relay( OnionRelay* onion_relay )
 {
-  int ret = d_add_relay_to_list( onion_relay, FILESYSTEM_PREFIX "hsdir_list_stg" );
+  int ret = d_add_relay_to_list( onion_relay, &staging_hsdir_file );
+
+  if ( ret == 0 )
+  {
+    ret = d_add_relay_to_descriptor_cache( onion_relay );
+  }
 
   if ( ret == 0 )
   {
@@ -80,7 +99,7 @@ int d_create_hsdir_relay( OnionRelay* onion_relay )
 
 int d_create_cache_relay( OnionRelay* onion_relay )
 {
-  int ret = d_add_relay_to_list( onion_relay, FILESYSTEM_PREFIX "cache_list_stg" );
+  int ret = d_add_relay_to_list( onion_relay, &staging_cache_file );
 
   if ( ret == 0 )
   {
@@ -92,7 +111,7 @@ int d_create_cache_relay( OnionRelay* onion_relay )
 
 int d_create_fast_relay( OnionRelay* onion_relay )
 {
-  int ret = d_add_relay_to_list( onion_relay, FILESYSTEM_PREFIX "fast_list_stg" );
+  int ret = d_add_relay_to_list( onion_relay, &staging_fast_file );
 
   if ( ret == 0 )
   {
@@ -102,62 +121,329 @@ int d_create_fast_relay( OnionRelay* onion_relay )
   return ret;
 }
 
-DoublyLinkedOnionRelayList* px_get_responsible_hsdir_relays_by_hs_index( uint8_t* hs_index, int desired_count, int current, DoublyLinkedOnionRelayList* used_relays )
+static void v_free_hsdir_ring( HsDirRing* hsdir_ring )
 {
   int i;
-  int count = 0;
-  int fd;
-  int succ;
-  OnionRelay* onion_relay;
-  DoublyLinkedOnionRelay* db_relay;
-  DoublyLinkedOnionRelay* new_db_relay;
-  DoublyLinkedOnionRelayList* working_list;
-  DoublyLinkedOnionRelayList* greater_list;
-  DoublyLinkedOnionRelayList least_list;
 
-  greater_list = malloc( sizeof( DoublyLinkedOnionRelayList ) );
-  onion_relay = malloc( sizeof( OnionRelay ) );
+  if ( hsdir_ring == NULL )
+  {
+    return;
+  }
+
+  for ( i = 0; i < 2; i++ )
+  {
+    if ( hsdir_ring->index_maps[i] != NULL )
+    {
+      munmap( hsdir_ring->index_maps[i], hsdir_ring->index_map_sizes[i] );
+    }
+  }
+
+  v_unmap_relay_table( &hsdir_ring->list );
 
-  memset( greater_list, 0, sizeof( DoublyLinkedOnionRelayList ) );
-  memset( &least_list, 0, sizeof( DoublyLinkedOnionRelayList ) );
-  memset( onion_relay, 0, sizeof( OnionRelay ) );
+  free( hsdir_ring );
+}
+
+void v_retain_hsdir_ring( HsDirRing* hsdir_ring )
+{
+  if ( hsdir_ring != NULL )
+  {
+    atomic_fetch_add( &hsdir_ring->references, 1 );
+  }
+}
+
+// the mappings of a replaced list stay valid until the last snapshot that
+// points at them lets go, rename never pulls them out from under a reader
+void v_release_hsdir_ring( HsDirRing* hsdir_ring )
+{
+  if ( hsdir_ring != NULL && atomic_fetch_sub( &hsdir_ring->references, 1 ) == 1 )
+  {
+    v_free_hsdir_ring( hsdir_ring );
+  }
+}
+
+static void* px_map_relay_file( const char* filename, size_t* size )
+{
+  int fd;
+  struct stat st;
+  void* map;
 
-  fd = open( FILESYSTEM_PREFIX "hsdir_list", O_RDONLY );
+  fd = open( filename, O_RDONLY );
 
   if ( fd < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "hsdir_list, errno: %d", errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+
+    return NULL;
+  }
+
+  if ( fstat( fd, &st ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to stat %s, errno: %d", filename, errno );
+
+    close( fd );
+
+    return NULL;
+  }
+
+  *size = st.st_size;
+
+  // an empty index is valid but can't be mapped
+  if ( *size == 0 )
+  {
+    close( fd );
+
+    return NULL;
+  }
+
+  map = mmap( NULL, *size, PROT_READ, MAP_SHARED, fd, 0 );
+
+  // the mapping stays valid after the fd is closed
+  close( fd );
+
+  if ( map == MAP_FAILED )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to mmap %s, errno: %d", filename, errno );
 
     return NULL;
   }
 
-  succ = lseek( fd, sizeof( time_t ), SEEK_SET );
+  return map;
+}
+
+static int d_compare_hsdir_index_entries( const void* a, const void* b )
+{
+  return memcmp( ( (const HsDirIndexEntry*)a )->hash, ( (const HsDirIndexEntry*)b )->hash, H_LENGTH );
+}
+
+static int d_write_hsdir_index( HsDirRing* hsdir_ring, int current )
+{
+  int fd;
+  uint32_t i;
+  size_t size;
+  const uint8_t* hashes;
+  uint8_t* buffer;
+  HsDirIndexHeader* header;
+  HsDirIndexEntry* entries;
+
+  size = sizeof( HsDirIndexHeader ) + sizeof( HsDirIndexEntry ) * hsdir_ring->count;
+  buffer = malloc( size );
+
+  if ( buffer == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate %s entries", hsdir_index_files[current] );
+
+    return -1;
+  }
+
+  // ties the index to this list so a crash between renaming the list and
+  // rewriting its indexes can't pair it with the old sort
+  header = (HsDirIndexHeader*)buffer;
+  memset( header, 0, sizeof( HsDirIndexHeader ) );
+  header->magic = HSDIR_INDEX_MAGIC;
+  header->current = current;
+  header->count = hsdir_ring->count;
+  header->valid_until = (int64_t)hsdir_ring->list.valid_until;
+
+  entries = (HsDirIndexEntry*)( buffer + sizeof( HsDirIndexHeader ) );
+
+  if ( current == 1 )
+  {
+    hashes = hsdir_ring->list.id_hashes;
+  }
+  else
+  {
+    hashes = hsdir_ring->list.id_hashes_previous;
+  }
+
+  for ( i = 0; i < hsdir_ring->count; i++ )
+  {
+    memcpy( entries[i].hash, hashes + (size_t)H_LENGTH * i, H_LENGTH );
+    entries[i].relay_index = i;
+  }
+
+  if ( hsdir_ring->count > 0 )
+  {
+    qsort( entries, hsdir_ring->count, sizeof( HsDirIndexEntry ), d_compare_hsdir_index_entries );
+  }
+
+  fd = open( hsdir_index_stg_files[current], O_CREAT | O_WRONLY | O_TRUNC, 0600 );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", hsdir_index_stg_files[current], errno );
+
+    goto fail;
+  }
 
-  if ( succ < 0 )
+  if ( write( fd, buffer, size ) != size )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to lseek " FILESYSTEM_PREFIX "hsdir_list, errno: %d", errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", hsdir_index_stg_files[current], errno );
 
     close( fd );
 
+    goto fail;
+  }
+
+  if ( close( fd ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", hsdir_index_stg_files[current], errno );
+
+    goto fail;
+  }
+
+  if ( rename( hsdir_index_stg_files[current], hsdir_index_files[current] ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to rename %s, errno: %d", hsdir_index_stg_files[current], errno );
+
+    goto fail;
+  }
+
+  free( buffer );
+
+  return 0;
+
+fail:
+  free( buffer );
+
+  return -1;
+}
+
+static int d_map_hsdir_index( HsDirRing* hsdir_ring, int current )
+{
+  HsDirIndexHeader* header;
+
+  hsdir_ring->index_maps[current] = px_map_relay_file( hsdir_index_files[current], &hsdir_ring->index_map_sizes[current] );
+  header = (HsDirIndexHeader*)hsdir_ring->index_maps[current];
+
+  // an index that doesn't match the list is stale and must be rebuilt
+  if (
+    header == NULL ||
+    hsdir_ring->index_map_sizes[current] != sizeof( HsDirIndexHeader ) + sizeof( HsDirIndexEntry ) * hsdir_ring->count ||
+    header->magic != HSDIR_INDEX_MAGIC ||
+    header->current != current ||
+    header->count != hsdir_ring->count ||
+    header->valid_until != (int64_t)hsdir_ring->list.valid_until
+  )
+  {
+    if ( hsdir_ring->index_maps[current] != NULL )
+    {
+      munmap( hsdir_ring->index_maps[current], hsdir_ring->index_map_sizes[current] );
+      hsdir_ring->index_maps[current] = NULL;
+    }
+
+    hsdir_ring->index_map_sizes[current] = 0;
+
+    return -1;
+  }
+
+  hsdir_ring->indexes[current] = (const HsDirIndexEntry*)( hsdir_ring->index_maps[current] + sizeof( HsDirIndexHeader ) );
+
+  return 0;
+}
+
+// maps hsdir_list and its two sorted ring indexes into a new ring, the
+// indexes are rebuilt from the list if asked to or if the ones on disk are
+// missing or stale
+static HsDirRing* px_load_hsdir_ring( bool rebuild )
+{
+  int i;
+  HsDirRing* hsdir_ring;
+
+  hsdir_ring = malloc( sizeof( HsDirRing ) );
+  memset( hsdir_ring, 0, sizeof( HsDirRing ) );
+  atomic_init( &hsdir_ring->references, 1 );
+
+  if ( d_map_relay_table( &hsdir_ring->list, FILESYSTEM_PREFIX "hsdir_list" ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to map " FILESYSTEM_PREFIX "hsdir_list" );
+
+    goto fail;
+  }
+
+  hsdir_ring->count = hsdir_ring->list.count;
+
+  for ( i = 0; i < 2; i++ )
+  {
+    if ( rebuild == true || d_map_hsdir_index( hsdir_ring, i ) < 0 )
+    {
+      // only the owner of the relay database writes to it
+      if ( b_relay_db_owner() == false )
+      {
+        MINITOR_LOG( MINITOR_TAG, "%s doesn't match the relay database", hsdir_index_files[i] );
+
+        goto fail;
+      }
+
+      if ( d_write_hsdir_index( hsdir_ring, i ) < 0 || d_map_hsdir_index( hsdir_ring, i ) < 0 )
+      {
+        MINITOR_LOG( MINITOR_TAG, "Failed to build %s", hsdir_index_files[i] );
+
+        goto fail;
+      }
+    }
+  }
+
+  return hsdir_ring;
+
+fail:
+  v_free_hsdir_ring( hsdir_ring );
+
+  return NULL;
+}
+
+// the caller holds a snapshot reference that keeps hsdir_ring mapped
+DoublyLinkedOnionRelayList* px_get_responsible_hsdir_relays_by_hs_index( HsDirRing* hsdir_ring, uint8_t* hs_index, int desired_count, int current, DoublyLinkedOnionRelayList* used_relays )
+{
+  uint32_t i;
+  uint32_t low;
+  uint32_t high;
+  uint32_t mid;
+  uint32_t relay_index;
+  const HsDirIndexEntry* index;
+  DoublyLinkedOnionRelay* db_relay;
+  DoublyLinkedOnionRelayList* responsible_list;
+
+  if ( hsdir_ring == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "hsdir index is not loaded" );
+
     return NULL;
   }
 
-  while ( 1 )
+  index = hsdir_ring->indexes[current == 1 ? 1 : 0];
+
+  responsible_list = malloc( sizeof( DoublyLinkedOnionRelayList ) );
+  memset( responsible_list, 0, sizeof( DoublyLinkedOnionRelayList ) );
+
+  // find the first relay on the ring past hs_index
+  low = 0;
+  high = hsdir_ring->count;
+
+  while ( low < high )
   {
-    succ = read( fd, onion_relay, sizeof( OnionRelay ) );
+    mid = low + ( high - low ) / 2;
 
-    if ( succ != sizeof( OnionRelay ) )
+    if ( memcmp( index[mid].hash, hs_index, H_LENGTH ) > 0 )
     {
-      break;
+      high = mid;
+    }
+    else
+    {
+      low = mid + 1;
     }
+  }
 
-    count++;
+  // walk the ring from there, wrapping past the end, until we have enough
+  for ( i = 0; i < hsdir_ring->count && responsible_list->length < desired_count; i++ )
+  {
+    relay_index = index[( low + i ) % hsdir_ring->count].relay_index;
 
     db_relay = used_relays->head;
 
+    // only the identity column is touched until we know we want the relay
     while ( db_relay != NULL )
     {
-      if ( memcmp( db_relay->relay->identity, onion_relay->identity, ID_LENGTH ) == 0 )
+      if ( memcmp( db_relay->relay->identity, hsdir_ring->list.identities + (size_t)ID_LENGTH * relay_index, ID_LENGTH ) == 0 )
       {
         break;
       }
@@ -170,243 +456,836 @@ DoublyLinkedOnionRelayList* px_get_responsible_hsdir_relays_by_hs_index( uint8_t
       continue;
     }
 
-    if ( current == 1 )
+    db_relay = malloc( sizeof( DoublyLinkedOnionRelay ) );
+    memset( db_relay, 0, sizeof( DoublyLinkedOnionRelay ) );
+
+    db_relay->relay = malloc( sizeof( OnionRelay ) );
+    v_get_relay_table_row( &hsdir_ring->list, relay_index, db_relay->relay );
+
+    v_add_relay_to_list( db_relay, responsible_list );
+  }
+
+  return responsible_list;
+}
+
+static OnionRelay* get_random_relay_from_list( const char* filename, int count )
+{
+  int fd;
+  int rand;
+  uint8_t record[RELAY_RECORD_SIZE];
+  OnionRelay* ret_relay;
+
+  if ( count <= 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "No relays in %s", filename );
+
+    return NULL;
+  }
+
+  rand = MINITOR_RANDOM() % count;
+  ret_relay = malloc( sizeof( OnionRelay ) );
+
+  fd = open( filename, O_RDONLY );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+
+    free( ret_relay );
+
+    return NULL;
+  }
+
+  // min of rand is zero so this won't go over by 1
+  if ( lseek( fd, RELAY_TABLE_HEADER_SIZE + rand * RELAY_RECORD_SIZE, SEEK_SET ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to lseek %s, errno: %d", filename, errno );
+
+    goto fail;
+  }
+
+  if ( read( fd, record, RELAY_RECORD_SIZE ) != RELAY_RECORD_SIZE )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", filename, errno );
+
+    goto fail;
+  }
+
+  v_unpack_relay_record( ret_relay, record );
+
+  if ( close( fd ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filename, errno );
+
+    free( ret_relay );
+
+    return NULL;
+  }
+
+  return ret_relay;
+
+fail:
+  free( ret_relay );
+  close( fd );
+
+  return NULL;
+}
+
+// gathers a live list into rows for the selection table, which hands out
+// whole relays
+static OnionRelay* px_read_relay_list( const char* filename, uint32_t* count )
+{
+  uint32_t i;
+  RelayTable table;
+  OnionRelay* relays = NULL;
+
+  *count = 0;
+
+  if ( d_map_relay_table( &table, filename ) < 0 )
+  {
+    *count = -1;
+
+    return NULL;
+  }
+
+  if ( table.count > 0 )
+  {
+    relays = malloc( sizeof( OnionRelay ) * table.count );
+
+    if ( relays == NULL )
     {
-      succ = memcmp( onion_relay->id_hash, hs_index, H_LENGTH );
+      MINITOR_LOG( MINITOR_TAG, "Failed to allocate %s", filename );
+
+      v_unmap_relay_table( &table );
+      *count = -1;
+
+      return NULL;
     }
-    else
+  }
+
+  for ( i = 0; i < table.count; i++ )
+  {
+    v_get_relay_table_row( &table, i, &relays[i] );
+  }
+
+  *count = table.count;
+
+  v_unmap_relay_table( &table );
+
+  return relays;
+}
+
+static void v_free_alias_table( RelayAliasTable* alias_table )
+{
+  free( alias_table->indexes );
+  free( alias_table->probabilities );
+  free( alias_table->aliases );
+}
+
+static void v_free_relay_selection_table( RelaySelectionTable* table )
+{
+  if ( table == NULL )
+  {
+    return;
+  }
+
+  free( table->fast_relays );
+  free( table->cache_relays );
+  v_free_alias_table( &table->guard_table );
+  v_free_alias_table( &table->middle_table );
+  v_free_alias_table( &table->cache_table );
+  free( table );
+}
+
+void v_retain_relay_selection_table( RelaySelectionTable* table )
+{
+  if ( table != NULL )
+  {
+    atomic_fetch_add( &table->references, 1 );
+  }
+}
+
+void v_release_relay_selection_table( RelaySelectionTable* table )
+{
+  if ( table != NULL && atomic_fetch_sub( &table->references, 1 ) == 1 )
+  {
+    v_free_relay_selection_table( table );
+  }
+}
+
+// the consensus weight a relay gets in a given position, based on the
+// guard and exit flags it carries
+static double f_get_position_weight( OnionRelay* onion_relay, int position, BandwidthWeights* weights )
+{
+  int32_t weight;
+
+  switch ( position )
+  {
+    case RELAY_POSITION_GUARD:
+      weight = onion_relay->can_exit ? weights->wgd : weights->wgg;
+      break;
+    case RELAY_POSITION_MIDDLE:
+      if ( onion_relay->can_guard && onion_relay->can_exit )
+      {
+        weight = weights->wmd;
+      }
+      else if ( onion_relay->can_guard )
+      {
+        weight = weights->wmg;
+      }
+      else if ( onion_relay->can_exit )
+      {
+        weight = weights->wme;
+      }
+      else
+      {
+        weight = weights->wmm;
+      }
+      break;
+    default:
+      if ( onion_relay->can_guard && onion_relay->can_exit )
+      {
+        weight = weights->wbd;
+      }
+      else if ( onion_relay->can_guard )
+      {
+        weight = weights->wbg;
+      }
+      else if ( onion_relay->can_exit )
+      {
+        weight = weights->wbe;
+      }
+      else
+      {
+        weight = weights->wbm;
+      }
+      break;
+  }
+
+  if ( weight <= 0 )
+  {
+    return 0;
+  }
+
+  return (double)onion_relay->bandwidth * weight / BANDWIDTH_WEIGHT_SCALE;
+}
+
+// build a walker alias table over the relays eligible for position so each
+// pick is one random column and one biased coin flip
+static int d_build_alias_table( RelayAliasTable* alias_table, OnionRelay* relays, uint32_t count, int position, BandwidthWeights* weights )
+{
+  uint32_t i;
+  uint32_t small_count = 0;
+  uint32_t large_count = 0;
+  uint32_t small;
+  uint32_t large;
+  uint32_t* small_stack = NULL;
+  uint32_t* large_stack = NULL;
+  double total = 0;
+  double* scaled = NULL;
+
+  memset( alias_table, 0, sizeof( RelayAliasTable ) );
+
+  if ( count == 0 )
+  {
+    return 0;
+  }
+
+  alias_table->indexes = malloc( sizeof( uint32_t ) * count );
+  alias_table->probabilities = malloc( sizeof( double ) * count );
+  alias_table->aliases = malloc( sizeof( uint32_t ) * count );
+  scaled = malloc( sizeof( double ) * count );
+  small_stack = malloc( sizeof( uint32_t ) * count );
+  large_stack = malloc( sizeof( uint32_t ) * count );
+
+  if (
+    alias_table->indexes == NULL ||
+    alias_table->probabilities == NULL ||
+    alias_table->aliases == NULL ||
+    scaled == NULL ||
+    small_stack == NULL ||
+    large_stack == NULL
+  )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate alias table" );
+
+    goto fail;
+  }
+
+  for ( i = 0; i < count; i++ )
+  {
+    if ( position == RELAY_POSITION_GUARD && relays[i].can_guard == false )
     {
-      succ = memcmp( onion_relay->id_hash_previous, hs_index, H_LENGTH );
+      continue;
     }
 
-    if ( succ > 0 )
+    alias_table->indexes[alias_table->count] = i;
+    scaled[alias_table->count] = f_get_position_weight( &relays[i], position, weights );
+    total += scaled[alias_table->count];
+    alias_table->count++;
+  }
+
+  if ( alias_table->count == 0 )
+  {
+    goto finish;
+  }
+
+  // nobody has any weight, fall back to a uniform pick
+  if ( total <= 0 )
+  {
+    for ( i = 0; i < alias_table->count; i++ )
     {
-      working_list = greater_list;
+      scaled[i] = 1;
     }
-    else if ( greater_list->length < desired_count )
+
+    total = alias_table->count;
+  }
+
+  for ( i = 0; i < alias_table->count; i++ )
+  {
+    scaled[i] = scaled[i] * alias_table->count / total;
+    alias_table->aliases[i] = i;
+
+    if ( scaled[i] < 1 )
     {
-      working_list = &least_list;
+      small_stack[small_count] = i;
+      small_count++;
     }
     else
     {
-      continue;
+      large_stack[large_count] = i;
+      large_count++;
+    }
+  }
+
+  while ( small_count > 0 && large_count > 0 )
+  {
+    small_count--;
+    small = small_stack[small_count];
+    large = large_stack[large_count - 1];
+
+    alias_table->probabilities[small] = scaled[small];
+    alias_table->aliases[small] = large;
+
+    scaled[large] = ( scaled[large] + scaled[small] ) - 1;
+
+    if ( scaled[large] < 1 )
+    {
+      large_count--;
+      small_stack[small_count] = large;
+      small_count++;
     }
+  }
+
+  // whatever is left is 1 give or take rounding
+  while ( large_count > 0 )
+  {
+    large_count--;
+    alias_table->probabilities[large_stack[large_count]] = 1;
+  }
+
+  while ( small_count > 0 )
+  {
+    small_count--;
+    alias_table->probabilities[small_stack[small_count]] = 1;
+  }
+
+finish:
+  free( scaled );
+  free( small_stack );
+  free( large_stack );
+
+  return 0;
+
+fail:
+  free( scaled );
+  free( small_stack );
+  free( large_stack );
+  v_free_alias_table( alias_table );
+  memset( alias_table, 0, sizeof( RelayAliasTable ) );
+
+  return -1;
+}
+
+static uint32_t d_sample_alias_table( RelayAliasTable* alias_table )
+{
+  uint32_t column = MINITOR_RANDOM() % alias_table->count;
+  double coin = (double)MINITOR_RANDOM() / ( (double)RAND_MAX + 1 );
+
+  if ( coin < alias_table->probabilities[column] )
+  {
+    return alias_table->indexes[column];
+  }
+
+  return alias_table->indexes[alias_table->aliases[column]];
+}
+
+static int d_get_bandwidth_weights( BandwidthWeights* weights )
+{
+  int fd;
+
+  v_set_default_bandwidth_weights( weights );
+
+  fd = open( FILESYSTEM_PREFIX "bandwidth_weights", O_RDONLY );
+
+  // consensus without weights, bandwidth alone will do
+  if ( fd < 0 )
+  {
+    return 0;
+  }
+
+  if ( read( fd, weights, sizeof( BandwidthWeights ) ) != sizeof( BandwidthWeights ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to read " FILESYSTEM_PREFIX "bandwidth_weights, errno: %d", errno );
+
+    v_set_default_bandwidth_weights( weights );
+  }
+
+  close( fd );
+
+  return 0;
+}
+
+int d_set_staging_bandwidth_weights( BandwidthWeights* weights )
+{
+  int fd;
+
+  fd = open( FILESYSTEM_PREFIX "bandwidth_weights_stg", O_CREAT | O_WRONLY | O_TRUNC, 0600 );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "bandwidth_weights_stg, errno: %d", errno );
+
+    return -1;
+  }
+
+  if ( write( fd, weights, sizeof( BandwidthWeights ) ) != sizeof( BandwidthWeights ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to write " FILESYSTEM_PREFIX "bandwidth_weights_stg, errno: %d", errno );
+
+    close( fd );
+
+    return -1;
+  }
+
+  if ( close( fd ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to close " FILESYSTEM_PREFIX "bandwidth_weights_stg, errno: %d", errno );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// builds the alias tables of a filled in table, the table is freed on failure
+static int d_build_relay_selection_table( RelaySelectionTable* table, BandwidthWeights* weights )
+{
+  if (
+    d_build_alias_table( &table->guard_table, table->fast_relays, table->fast_count, RELAY_POSITION_GUARD, weights ) < 0 ||
+    d_build_alias_table( &table->middle_table, table->fast_relays, table->fast_count, RELAY_POSITION_MIDDLE, weights ) < 0 ||
+    d_build_alias_table( &table->cache_table, table->cache_relays, table->cache_count, RELAY_POSITION_DIR, weights ) < 0
+  )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to load relay selection table" );
+
+    v_free_relay_selection_table( table );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// reads the live fast and cache lists into a new table
+static RelaySelectionTable* px_load_relay_selection_table()
+{
+  RelaySelectionTable* table;
+  BandwidthWeights weights;
+
+  table = malloc( sizeof( RelaySelectionTable ) );
+  memset( table, 0, sizeof( RelaySelectionTable ) );
+  atomic_init( &table->references, 1 );
+
+  table->fast_relays = px_read_relay_list( FILESYSTEM_PREFIX "fast_list", &table->fast_count );
+
+  if ( (int)table->fast_count < 0 )
+  {
+    goto fail;
+  }
+
+  table->cache_relays = px_read_relay_list( FILESYSTEM_PREFIX "cache_list", &table->cache_count );
+
+  if ( (int)table->cache_count < 0 )
+  {
+    goto fail;
+  }
+
+  d_get_bandwidth_weights( &weights );
+
+  if ( d_build_relay_selection_table( table, &weights ) < 0 )
+  {
+    return NULL;
+  }
+
+  return table;
+
+fail:
+  MINITOR_LOG( MINITOR_TAG, "Failed to load relay selection table" );
+
+  v_free_relay_selection_table( table );
+
+  return NULL;
+}
+
+// loads the ring and selection table from the live lists and publishes them
+// with consensus as one snapshot, readers keep whatever snapshot they hold
+static int d_publish_relay_tables( NetworkConsensus* consensus, bool rebuild )
+{
+  HsDirRing* hsdir_ring;
+  RelaySelectionTable* table;
+
+  hsdir_ring = px_load_hsdir_ring( rebuild );
+
+  if ( hsdir_ring == NULL )
+  {
+    return -1;
+  }
+
+  table = px_load_relay_selection_table();
+
+  if ( table == NULL )
+  {
+    v_release_hsdir_ring( hsdir_ring );
+
+    return -1;
+  }
+
+  return d_publish_consensus_snapshot( consensus, table, hsdir_ring );
+}
+
+int d_load_relay_tables( NetworkConsensus* consensus )
+{
+  return d_publish_relay_tables( consensus, false );
+}
+
+// publishes a table over the fast relays seen so far in a download that is
+// still running, takes ownership of fast_relays, there are no caches in it
+// and the consensus and ring of the current snapshot carry over
+int d_load_provisional_relay_selection_table( OnionRelay* fast_relays, uint32_t fast_count )
+{
+  RelaySelectionTable* table;
+  BandwidthWeights weights;
+
+  table = malloc( sizeof( RelaySelectionTable ) );
+  memset( table, 0, sizeof( RelaySelectionTable ) );
+  atomic_init( &table->references, 1 );
+
+  table->fast_relays = fast_relays;
+  table->fast_count = fast_count;
+
+  // the weights for this consensus aren't parsed until the footer
+  v_set_default_bandwidth_weights( &weights );
+
+  if ( d_build_relay_selection_table( table, &weights ) < 0 )
+  {
+    return -1;
+  }
+
+  return d_publish_consensus_snapshot( NULL, table, NULL );
+}
+
+static uint32_t ul_descriptor_slot( uint8_t* digest, uint32_t slot_mask )
+{
+  // the digest is a sha1, any four bytes of it are already well mixed
+  return ( (uint32_t)digest[0] | ( (uint32_t)digest[1] << 8 ) | ( (uint32_t)digest[2] << 16 ) | ( (uint32_t)digest[3] << 24 ) ) & slot_mask;
+}
+
+// read the entries of the last finalized cache, a missing cache just leaves
+// it empty so every descriptor gets fetched
+static int d_read_descriptor_cache( DescriptorCache* cache )
+{
+  int fd;
+  struct stat st;
+
+  fd = open( FILESYSTEM_PREFIX "descriptor_cache", O_RDONLY );
+
+  if ( fd < 0 )
+  {
+    return 0;
+  }
+
+  if ( fstat( fd, &st ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to stat " FILESYSTEM_PREFIX "descriptor_cache, errno: %d", errno );
+
+    goto fail;
+  }
+
+  cache->count = st.st_size / sizeof( DescriptorCacheEntry );
+
+  if ( cache->count == 0 )
+  {
+    close( fd );
+
+    return 0;
+  }
 
-    db_relay = working_list->head;
+  cache->entries = malloc( sizeof( DescriptorCacheEntry ) * cache->count );
 
-    // find the node i am lower than
-    while ( db_relay != NULL )
-    {
-      if ( current == 1 )
-      {
-        succ = memcmp( onion_relay->id_hash, db_relay->relay->id_hash, H_LENGTH );
-      }
-      else
-      {
-        succ = memcmp( onion_relay->id_hash_previous, db_relay->relay->id_hash_previous, H_LENGTH );
-      }
+  if ( cache->entries == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate descriptor cache" );
 
-      if ( succ > 0 )
-      {
-        break;
-      }
+    goto fail;
+  }
 
-      db_relay = db_relay->next;
-    }
+  if ( read( fd, cache->entries, sizeof( DescriptorCacheEntry ) * cache->count ) != sizeof( DescriptorCacheEntry ) * cache->count )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to read " FILESYSTEM_PREFIX "descriptor_cache, errno: %d", errno );
 
-    new_db_relay = malloc( sizeof( DoublyLinkedOnionRelay ) );
-    memset( new_db_relay, 0, sizeof( DoublyLinkedOnionRelay ) );
-    new_db_relay->relay = onion_relay;
+    goto fail;
+  }
 
-    if ( db_relay == NULL )
-    {
-      v_add_relay_to_list( new_db_relay, working_list );
-    }
-    else
-    {
-      new_db_relay->next = db_relay;
-      new_db_relay->previous = db_relay->previous;
+  close( fd );
 
-      if ( db_relay->previous != NULL )
-      {
-        db_relay->previous->next = new_db_relay;
-      }
+  return 0;
 
-      db_relay->previous = new_db_relay;
+fail:
+  free( cache->entries );
+  cache->entries = NULL;
+  cache->count = 0;
+  close( fd );
 
-      if ( working_list->head == db_relay )
-      {
-        working_list->head = new_db_relay;
-      }
+  return -1;
+}
 
-      working_list->length++;
-    }
+// load the persisted descriptor cache and index it by digest
+int d_load_descriptor_cache( DescriptorCache* cache )
+{
+  uint32_t i;
+  uint32_t slot;
+  uint32_t slot_count = 1;
 
-    if ( working_list->length > desired_count )
-    {
-      working_list->head = working_list->head->next;
-      free( working_list->head->previous->relay );
-      free( working_list->head->previous );
-      working_list->head->previous = NULL;
-      working_list->length--;
-    }
+  memset( cache, 0, sizeof( DescriptorCache ) );
 
-    onion_relay = malloc( sizeof( OnionRelay ) );
-    memset( onion_relay, 0, sizeof( OnionRelay ) );
+  if ( d_read_descriptor_cache( cache ) < 0 || cache->count == 0 )
+  {
+    return 0;
   }
 
-  free( onion_relay );
-
-  // merge the two lists, order no loger matters
-  while ( greater_list->length < desired_count && least_list.tail != NULL )
+  // keep the table at most half full so probes stay short
+  while ( slot_count < cache->count * 2 )
   {
-    db_relay = least_list.tail;
+    slot_count <<= 1;
+  }
 
-    least_list.tail = db_relay->previous;
+  cache->slots = malloc( sizeof( uint32_t ) * slot_count );
 
-    if ( least_list.tail != NULL )
-    {
-      least_list.tail->next = NULL;
-    }
+  if ( cache->slots == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate descriptor cache index" );
 
-    least_list.length--;
+    v_free_descriptor_cache( cache );
 
-    v_add_relay_to_list( db_relay, greater_list );
+    return -1;
   }
 
-  while ( least_list.length > 0 )
-  {
-    v_pop_relay_from_list_back( &least_list );
-  }
+  memset( cache->slots, 0, sizeof( uint32_t ) * slot_count );
+  cache->slot_mask = slot_count - 1;
 
-  if ( succ < 0 )
+  for ( i = 0; i < cache->count; i++ )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to read " FILESYSTEM_PREFIX "hsdir_list, errno: %d", errno );
+    slot = ul_descriptor_slot( cache->entries[i].digest, cache->slot_mask );
 
-    while ( greater_list->length > 0 )
+    while ( cache->slots[slot] != 0 )
     {
-      v_pop_relay_from_list_back( greater_list );
+      slot = ( slot + 1 ) & cache->slot_mask;
     }
 
-    free( greater_list );
-
-    close( fd );
-
-    return NULL;
+    cache->slots[slot] = i + 1;
   }
 
-  close( fd );
-
-  return greater_list;
+  return 0;
 }
 
-static OnionRelay* get_random_relay_from_list( const char* filename, int count )
+// fills in the descriptor keys of onion_relay if the cache holds the
+// descriptor its consensus entry points to
+bool b_resolve_relay_descriptor( DescriptorCache* cache, OnionRelay* onion_relay )
 {
-  int fd;
-  int rand = MINITOR_RANDOM() % count;
-  OnionRelay* ret_relay = malloc( sizeof( OnionRelay ) );
+  uint32_t slot;
+  DescriptorCacheEntry* entry;
 
-  fd = open( filename, O_RDONLY );
+  if ( cache->slots == NULL )
+  {
+    return false;
+  }
 
-  if ( fd < 0 )
+  slot = ul_descriptor_slot( onion_relay->digest, cache->slot_mask );
+
+  while ( cache->slots[slot] != 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+    entry = &cache->entries[cache->slots[slot] - 1];
 
-    free( ret_relay );
+    if (
+      memcmp( entry->digest, onion_relay->digest, ID_LENGTH ) == 0 &&
+      memcmp( entry->identity, onion_relay->identity, ID_LENGTH ) == 0
+    )
+    {
+      memcpy( onion_relay->master_key, entry->master_key, H_LENGTH );
+      memcpy( onion_relay->ntor_onion_key, entry->ntor_onion_key, H_LENGTH );
 
-    return NULL;
+      return true;
+    }
+
+    slot = ( slot + 1 ) & cache->slot_mask;
   }
 
-  // min of rand is zero so this won't go over by 1
-  if ( lseek( fd, sizeof( time_t ) + rand * sizeof( OnionRelay ), SEEK_SET ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to lseek %s, errno: %d", filename, errno );
+  return false;
+}
 
-    goto fail;
-  }
+void v_free_descriptor_cache( DescriptorCache* cache )
+{
+  free( cache->entries );
+  free( cache->slots );
+  memset( cache, 0, sizeof( DescriptorCache ) );
+}
 
-  if ( read( fd, ret_relay, sizeof( OnionRelay ) ) != sizeof( OnionRelay ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", filename, errno );
+static bool b_relay_excluded( OnionRelay* onion_relay, DoublyLinkedOnionRelayList* relay_list, uint8_t* exclude_start, uint8_t* exclude_end )
+{
+  DoublyLinkedOnionRelay* db_relay;
 
-    goto fail;
+  if (
+    ( exclude_start != NULL && memcmp( onion_relay->identity, exclude_start, ID_LENGTH ) == 0 ) ||
+    ( exclude_end != NULL && memcmp( onion_relay->identity, exclude_end, ID_LENGTH ) == 0 )
+  )
+  {
+    return true;
   }
 
-  if ( close( fd ) < 0 )
+  if ( relay_list != NULL )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filename, errno );
+    db_relay = relay_list->head;
 
-    free( ret_relay );
+    while ( db_relay != NULL )
+    {
+      if ( memcmp( db_relay->relay->identity, onion_relay->identity, ID_LENGTH ) == 0 )
+      {
+        return true;
+      }
 
-    return NULL;
+      db_relay = db_relay->next;
+    }
   }
 
-  return ret_relay;
+  return false;
+}
 
-fail:
-  free( ret_relay );
-  close( fd );
+static OnionRelay* px_copy_relay( OnionRelay* onion_relay )
+{
+  OnionRelay* ret_relay = malloc( sizeof( OnionRelay ) );
 
-  return NULL;
+  memcpy( ret_relay, onion_relay, sizeof( OnionRelay ) );
+
+  return ret_relay;
 }
 
 OnionRelay* px_get_random_cache_relay( bool staging )
 {
+  OnionRelay* cache_relay = NULL;
+  ConsensusSnapshot* snapshot;
+  RelaySelectionTable* table;
+
   if ( staging == true )
   {
-    return get_random_relay_from_list( FILESYSTEM_PREFIX "cache_list_stg", staging_cache_relay_count );
+    return get_random_relay_from_list( FILESYSTEM_PREFIX "cache_list_stg", d_get_staging_cache_relay_count() );
   }
-  else
+
+  snapshot = px_acquire_consensus_snapshot();
+  table = snapshot->selection_table;
+
+  if ( table != NULL && table->cache_table.count > 0 )
+  {
+    cache_relay = px_copy_relay( &table->cache_relays[d_sample_alias_table( &table->cache_table )] );
+  }
+
+  v_release_consensus_snapshot( snapshot );
+
+  if ( cache_relay == NULL )
   {
-    return get_random_relay_from_list( FILESYSTEM_PREFIX "cache_list", cache_relay_count );
+    MINITOR_LOG( MINITOR_TAG, "No cache relays loaded" );
   }
+
+  return cache_relay;
 }
 
 OnionRelay* px_get_random_fast_relay( bool want_guard, DoublyLinkedOnionRelayList* relay_list, uint8_t* exclude_start, uint8_t* exclude_end )
 {
+  uint32_t i;
+  uint32_t start;
+  OnionRelay* candidate;
   OnionRelay* fast_relay = NULL;
-  DoublyLinkedOnionRelay* db_relay;
+  RelayAliasTable* alias_table;
+  ConsensusSnapshot* snapshot;
+  RelaySelectionTable* table;
 
-  do
+  snapshot = px_acquire_consensus_snapshot();
+  table = snapshot->selection_table;
+
+  if ( table == NULL )
   {
-    fast_relay = get_random_relay_from_list( FILESYSTEM_PREFIX "fast_list", fast_relay_count );
+    goto finish;
+  }
 
-    if ( fast_relay == NULL )
-    {
-      return fast_relay;
-    }
+  if ( want_guard == true )
+  {
+    alias_table = &table->guard_table;
+  }
+  else
+  {
+    alias_table = &table->middle_table;
+  }
 
-    if ( want_guard == true && fast_relay->can_guard == false )
-    {
-      free( fast_relay );
-      fast_relay = NULL;
-    }
-    else if (
-      ( exclude_start != NULL && memcmp( fast_relay->identity, exclude_start, ID_LENGTH ) == 0 ) ||
-      ( exclude_end != NULL && memcmp( fast_relay->identity, exclude_end, ID_LENGTH ) == 0 )
-    )
+  if ( alias_table->count == 0 )
+  {
+    goto finish;
+  }
+
+  // the exclusions are only ever a handful of relays so a few weighted
+  // draws almost always land, fall back to a scan so we can't spin
+  for ( i = 0; i < RELAY_SELECTION_ATTEMPTS; i++ )
+  {
+    candidate = &table->fast_relays[d_sample_alias_table( alias_table )];
+
+    if ( b_relay_excluded( candidate, relay_list, exclude_start, exclude_end ) == false )
     {
-      free( fast_relay );
-      fast_relay = NULL;
+      fast_relay = px_copy_relay( candidate );
+
+      goto finish;
     }
-    else if ( relay_list != NULL )
-    {
-      db_relay = relay_list->head;
+  }
 
-      while ( db_relay != NULL )
-      {
-        if ( memcmp( db_relay->relay->identity, fast_relay->identity, ID_LENGTH ) == 0 )
-        {
-          free( fast_relay );
-          fast_relay = NULL;
+  start = MINITOR_RANDOM() % alias_table->count;
 
-          break;
-        }
+  for ( i = 0; i < alias_table->count; i++ )
+  {
+    candidate = &table->fast_relays[alias_table->indexes[( start + i ) % alias_table->count]];
 
-        db_relay = db_relay->next;
-      }
+    if ( b_relay_excluded( candidate, relay_list, exclude_start, exclude_end ) == false )
+    {
+      fast_relay = px_copy_relay( candidate );
+
+      break;
     }
-  } while( fast_relay == NULL );
+  }
+
+finish:
+  v_release_consensus_snapshot( snapshot );
+
+  if ( fast_relay == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to find a suitable fast relay" );
+  }
 
   return fast_relay;
 }
@@ -414,50 +1293,67 @@ OnionRelay* px_get_random_fast_relay( bool want_guard, DoublyLinkedOnionRelayLis
 OnionRelay* px_get_cache_relay_by_identity( uint8_t* identity, bool staging )
 {
   int fd;
-  char filepath[60];
-  OnionRelay* ret_relay = malloc( sizeof( OnionRelay ) );
+  uint32_t i;
+  uint8_t record[RELAY_RECORD_SIZE];
+  OnionRelay* ret_relay = NULL;
+  ConsensusSnapshot* snapshot;
+  RelaySelectionTable* table;
 
-  if ( staging == true )
-  {
-    strcpy( filepath, FILESYSTEM_PREFIX "cache_list_stg" );
-  }
-  else
+  if ( staging == false )
   {
-    strcpy( filepath, FILESYSTEM_PREFIX "cache_list" );
+    snapshot = px_acquire_consensus_snapshot();
+    table = snapshot->selection_table;
+
+    for ( i = 0; table != NULL && i < table->cache_count; i++ )
+    {
+      if ( memcmp( table->cache_relays[i].identity, identity, ID_LENGTH ) == 0 )
+      {
+        ret_relay = px_copy_relay( &table->cache_relays[i] );
+
+        break;
+      }
+    }
+
+    v_release_consensus_snapshot( snapshot );
+
+    return ret_relay;
   }
 
-  fd = open( filepath, O_RDONLY );
+  ret_relay = malloc( sizeof( OnionRelay ) );
+
+  fd = open( FILESYSTEM_PREFIX "cache_list_stg", O_RDONLY );
 
   if ( fd < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filepath, errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "cache_list_stg, errno: %d", errno );
 
     free( ret_relay );
 
     return NULL;
   }
 
-  // min of rand is zero so this won't go over by 1
-  if ( lseek( fd, sizeof( time_t ), SEEK_SET ) < 0 )
+  if ( lseek( fd, RELAY_TABLE_HEADER_SIZE, SEEK_SET ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to lseek %s, errno: %d", filepath, errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to lseek " FILESYSTEM_PREFIX "cache_list_stg, errno: %d", errno );
 
     goto fail;
   }
 
   do
   {
-    if ( read( fd, ret_relay, sizeof( OnionRelay ) ) != sizeof( OnionRelay ) )
+    if ( read( fd, record, RELAY_RECORD_SIZE ) != RELAY_RECORD_SIZE )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read next relay from %s", filepath );
+      MINITOR_LOG( MINITOR_TAG, "Failed to read next relay from " FILESYSTEM_PREFIX "cache_list_stg" );
 
       goto fail;
     }
-  } while ( memcmp( ret_relay->identity, identity, ID_LENGTH ) != 0 );
+  } while ( memcmp( record, identity, ID_LENGTH ) != 0 );
+
+  v_unpack_relay_record( ret_relay, record );
 
   if ( close( fd ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filepath, errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to close " FILESYSTEM_PREFIX "cache_list_stg, errno: %d", errno );
 
     free( ret_relay );
 
@@ -493,9 +1389,16 @@ int d_get_staging_hsdir_relay_count()
   return staging_hsdir_relay_count;
 }
 
+// the insert task may still be holding records in its buffer, only count
+// the ones that have made it to the file so readers can see them
 int d_get_staging_cache_relay_count()
 {
-  return staging_cache_relay_count;
+  if ( staging_cache_file.flushed_length < RELAY_TABLE_HEADER_SIZE )
+  {
+    return 0;
+  }
+
+  return ( staging_cache_file.flushed_length - RELAY_TABLE_HEADER_SIZE ) / RELAY_RECORD_SIZE;
 }
 
 int d_get_staging_fast_relay_count()
@@ -503,34 +1406,31 @@ int d_get_staging_fast_relay_count()
   return staging_fast_relay_count;
 }
 
-static int d_reset_relay_list( const char* filename )
+static int d_reset_relay_list( BufferedFile* staging_file, const char* filename )
 {
-  int fd;
-  time_t dummy_until = 0;
+  uint8_t header[RELAY_TABLE_HEADER_SIZE];
 
-  fd = open( filename, O_CREAT | O_WRONLY | O_TRUNC, 0600 );
-
-  if ( fd < 0 )
+  if ( d_open_buffered_file( staging_file, filename ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to reset %s, errno: %d", filename, errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to reset %s", filename );
 
     return -1;
   }
 
-  if ( write( fd, &dummy_until, sizeof( time_t )  ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", filename, errno );
+  // valid until is filled in once the list is done, the count comes from
+  // the length of the file until it's committed
+  v_pack_relay_table_header( header, RELAY_TABLE_ROWS, 0, 0 );
 
-    close( fd );
+  if (
+    d_write_buffered_file( staging_file, header, RELAY_TABLE_HEADER_SIZE ) < 0 ||
+    d_flush_buffered_file( staging_file ) < 0
+  )
+  {
+    d_close_buffered_file( staging_file );
 
     return -1;
   }
 
-  if ( close( fd ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filename, errno );
-  }
-
   return 0;
 }
 
@@ -538,54 +1438,41 @@ int d_reset_staging_hsdir_relays()
 {
   staging_hsdir_relay_count = 0;
 
-  return d_reset_relay_list( FILESYSTEM_PREFIX "hsdir_list_stg" );
+  // the cache has no header, it's just the entries
+  if ( d_open_buffered_file( &staging_descriptor_cache_file, FILESYSTEM_PREFIX "descriptor_cache_stg" ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to reset " FILESYSTEM_PREFIX "descriptor_cache_stg" );
+
+    return -1;
+  }
+
+  return d_reset_relay_list( &staging_hsdir_file, FILESYSTEM_PREFIX "hsdir_list_stg" );
 }
 
 int d_reset_staging_cache_relays()
 {
   staging_cache_relay_count = 0;
 
-  return d_reset_relay_list( FILESYSTEM_PREFIX "cache_list_stg" );
+  return d_reset_relay_list( &staging_cache_file, FILESYSTEM_PREFIX "cache_list_stg" );
 }
 
 int d_reset_staging_fast_relays()
 {
   staging_fast_relay_count = 0;
 
-  return d_reset_relay_list( FILESYSTEM_PREFIX "fast_list_stg" );
+  return d_reset_relay_list( &staging_fast_file, FILESYSTEM_PREFIX "fast_list_stg" );
 }
 
 static int d_get_relay_list_valid_until( const char* filename )
 {
-  int fd;
-  time_t valid_until;
-
-  fd = open( filename, O_RDONLY );
-
-  if ( fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
-
-    return -1;
-  }
-
-  if ( read( fd, &valid_until, sizeof( time_t )  ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", filename, errno );
+  RelayTableHeader header;
 
-    close( fd );
-
-    return -1;
-  }
-
-  if ( close( fd ) < 0 )
+  if ( d_read_relay_table_header( filename, &header ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filename, errno );
-
     return -1;
   }
 
-  return valid_until;
+  return header.valid_until;
 }
 
 int d_get_hsdir_relay_valid_until()
@@ -603,32 +1490,14 @@ int d_get_fast_relay_valid_until()
   return d_get_relay_list_valid_until( FILESYSTEM_PREFIX "fast_list" );
 }
 
-static int d_set_relay_list_valid_until( time_t valid_until, const char* filename )
+static int d_set_relay_list_valid_until( time_t valid_until, BufferedFile* staging_file )
 {
-  int fd;
-
-  fd = open( filename, O_WRONLY );
-
-  if ( fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
-
-    return -1;
-  }
-
-  if ( write( fd, &valid_until, sizeof( time_t )  ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", filename, errno );
+  uint8_t header[RELAY_TABLE_HEADER_SIZE];
 
-    close( fd );
-
-    return -1;
-  }
+  v_pack_relay_table_header( header, RELAY_TABLE_ROWS, 0, valid_until );
 
-  if ( close( fd ) < 0 )
+  if ( d_write_buffered_file_at( staging_file, header, RELAY_TABLE_HEADER_SIZE, 0 ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to close %s, errno: %d", filename, errno );
-
     return -1;
   }
 
@@ -637,38 +1506,43 @@ static int d_set_relay_list_valid_until( time_t valid_until, const char* filenam
 
 int d_set_staging_hsdir_relay_valid_until( time_t valid_until )
 {
-  return d_set_relay_list_valid_until( valid_until, FILESYSTEM_PREFIX "hsdir_list_stg" );
+  return d_set_relay_list_valid_until( valid_until, &staging_hsdir_file );
 }
 
 int d_set_staging_cache_relay_valid_until( time_t valid_until )
 {
-  return d_set_relay_list_valid_until( valid_until, FILESYSTEM_PREFIX "cache_list_stg" );
+  return d_set_relay_list_valid_until( valid_until, &staging_cache_file );
 }
 
 int d_set_staging_fast_relay_valid_until( time_t valid_until )
 {
-  return d_set_relay_list_valid_until( valid_until, FILESYSTEM_PREFIX "fast_list_stg" );
+  return d_set_relay_list_valid_until( valid_until, &staging_fast_file );
 }
 
 static int d_get_relay_list_count( const char* filename )
 {
-  struct stat st;
+  RelayTableHeader header;
 
-  if ( stat( filename, &st ) < 0 )
+  // lists written by an older build have to be refetched
+  if ( d_read_relay_table_header( filename, &header ) < 0 || header.layout != RELAY_TABLE_COLUMNS )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to stat %s, errno: %d", filename, errno );
+    MINITOR_LOG( MINITOR_TAG, "%s is not a relay table", filename );
 
     return -1;
   }
 
-  // subtract the valid until time size
-  return ( st.st_size - sizeof( time_t ) ) / sizeof( OnionRelay );
+  return header.count;
 }
 
 int d_load_hsdir_relay_count()
 {
   hsdir_relay_count = d_get_relay_list_count( FILESYSTEM_PREFIX "hsdir_list" );
 
+  if ( (int)hsdir_relay_count < 0 )
+  {
+    return -1;
+  }
+
   return hsdir_relay_count;
 }
 
@@ -686,57 +1560,30 @@ int d_load_fast_relay_count()
   return fast_relay_count;
 }
 
-int d_finalize_staged_relay_lists()
+// commits the staged lists and publishes the tables built from them with
+// consensus, readers still on the old snapshot keep the old mappings
+int d_finalize_staged_relay_lists( NetworkConsensus* consensus )
 {
-  struct stat st;
-
-  if ( stat( FILESYSTEM_PREFIX "hsdir_list", &st ) == 0 )
-  {
-    if ( unlink( FILESYSTEM_PREFIX "hsdir_list" ) < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink " FILESYSTEM_PREFIX "hsdir_list, errno: %d", errno );
-
-      return -1;
-    }
-  }
-
-  if ( stat( FILESYSTEM_PREFIX "cache_list", &st ) == 0 )
-  {
-    if ( unlink( FILESYSTEM_PREFIX "cache_list" ) < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink " FILESYSTEM_PREFIX "cache_list, errno: %d", errno );
-
-      return -1;
-    }
-  }
-
-  if ( stat( FILESYSTEM_PREFIX "fast_list", &st ) == 0 )
-  {
-    if ( unlink( FILESYSTEM_PREFIX "fast_list" ) < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink " FILESYSTEM_PREFIX "fast_list, errno: %d", errno );
-
-      return -1;
-    }
-  }
-
-  if ( rename( FILESYSTEM_PREFIX "hsdir_list_stg", FILESYSTEM_PREFIX "hsdir_list" ) < 0 )
+  // the staged rows are transposed into tables that rename over the live
+  // lists atomically, readers see either the old list or the new one
+  if (
+    d_close_buffered_file( &staging_hsdir_file ) < 0 ||
+    d_close_buffered_file( &staging_cache_file ) < 0 ||
+    d_close_buffered_file( &staging_fast_file ) < 0 ||
+    d_write_relay_table( FILESYSTEM_PREFIX "hsdir_list_stg", FILESYSTEM_PREFIX "hsdir_list" ) < 0 ||
+    d_write_relay_table( FILESYSTEM_PREFIX "cache_list_stg", FILESYSTEM_PREFIX "cache_list" ) < 0 ||
+    d_write_relay_table( FILESYSTEM_PREFIX "fast_list_stg", FILESYSTEM_PREFIX "fast_list" ) < 0 ||
+    d_commit_buffered_file( &staging_descriptor_cache_file, FILESYSTEM_PREFIX "descriptor_cache" ) < 0
+  )
   {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename " FILESYSTEM_PREFIX "hsdir_list, errno: %d", errno );
+    MINITOR_LOG( MINITOR_TAG, "Failed to commit staged relay lists" );
 
-      return -1;
-  }
-
-  if ( rename( FILESYSTEM_PREFIX "cache_list_stg", FILESYSTEM_PREFIX "cache_list" ) < 0 )
-  {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename " FILESYSTEM_PREFIX "cache_list, errno: %d", errno );
-
-      return -1;
+    return -1;
   }
 
-  if ( rename( FILESYSTEM_PREFIX "fast_list_stg", FILESYSTEM_PREFIX "fast_list" ) < 0 )
+  if ( rename( FILESYSTEM_PREFIX "bandwidth_weights_stg", FILESYSTEM_PREFIX "bandwidth_weights" ) < 0 )
   {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename " FILESYSTEM_PREFIX "fast_list, errno: %d", errno );
+      MINITOR_LOG( MINITOR_TAG, "Failed to rename " FILESYSTEM_PREFIX "bandwidth_weights, errno: %d", errno );
 
       return -1;
   }
@@ -745,5 +1592,5 @@ int d_finalize_staged_relay_lists()
   cache_relay_count = staging_cache_relay_count;
   fast_relay_count = staging_fast_relay_count;
 
-  return 0;
+  return d_publish_relay_tables( consensus, true );
 }
@@ -0,0 +1,235 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+
+#include "../../include/config.h"
+#include "../../h/port.h"
+
+#include "../../h/constants.h"
+#include "../../h/structures/consensus.h"
+#include "../../h/models/relay_db.h"
+
+// only touched from the consensus refresh task, which never runs twice
+static int relay_db_fd = -1;
+static int relay_db_owner_fd = -1;
+static bool relay_db_owner = false;
+static uint32_t read_generation = 0;
+static uint32_t loaded_generation = 0;
+
+static int d_open_relay_db()
+{
+  if ( relay_db_fd >= 0 )
+  {
+    return 0;
+  }
+
+  relay_db_fd = open( FILESYSTEM_PREFIX "relay_db", O_CREAT | O_RDWR | O_CLOEXEC, 0600 );
+
+  if ( relay_db_fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "relay_db, errno: %d", errno );
+
+    return -1;
+  }
+
+  relay_db_owner_fd = open( FILESYSTEM_PREFIX "relay_db_owner", O_CREAT | O_RDWR | O_CLOEXEC, 0600 );
+
+  if ( relay_db_owner_fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "relay_db_owner, errno: %d", errno );
+
+    close( relay_db_fd );
+    relay_db_fd = -1;
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static int d_read_relay_db_header( RelayDbHeader* header )
+{
+  memset( header, 0, sizeof( RelayDbHeader ) );
+
+  // a new database is empty until its first commit
+  if ( pread( relay_db_fd, header, sizeof( RelayDbHeader ), 0 ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to read " FILESYSTEM_PREFIX "relay_db, errno: %d", errno );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// the owner lock is released by the kernel when its process exits, so
+// whoever asks next takes over the refresh
+bool b_relay_db_owner()
+{
+  if ( relay_db_owner == true )
+  {
+    return true;
+  }
+
+  if ( d_open_relay_db() < 0 )
+  {
+    // without the database we can only run on our own
+    return true;
+  }
+
+  if ( flock( relay_db_owner_fd, LOCK_EX | LOCK_NB ) == 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Took ownership of the relay database" );
+
+    relay_db_owner = true;
+  }
+  else if ( errno != EWOULDBLOCK )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to lock " FILESYSTEM_PREFIX "relay_db_owner, errno: %d", errno );
+
+    return true;
+  }
+
+  return relay_db_owner;
+}
+
+// lists written by a build with a different OnionRelay can't be read
+bool b_relay_db_compatible()
+{
+  RelayDbHeader header;
+
+  if ( d_open_relay_db() < 0 || d_read_relay_db_header( &header ) < 0 )
+  {
+    return false;
+  }
+
+  return header.magic == RELAY_DB_MAGIC && header.version == RELAY_DB_VERSION && header.relay_size == RELAY_RECORD_SIZE;
+}
+
+uint32_t ul_get_relay_db_generation()
+{
+  RelayDbHeader header;
+
+  if ( b_relay_db_compatible() == false || d_read_relay_db_header( &header ) < 0 )
+  {
+    return 0;
+  }
+
+  return header.generation;
+}
+
+bool b_relay_db_changed()
+{
+  uint32_t generation = ul_get_relay_db_generation();
+
+  return generation != 0 && generation != loaded_generation;
+}
+
+// holds off the owner's commit while the live files are read
+int d_begin_relay_db_read()
+{
+  if ( d_open_relay_db() < 0 )
+  {
+    return -1;
+  }
+
+  if ( flock( relay_db_fd, LOCK_SH ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to lock " FILESYSTEM_PREFIX "relay_db, errno: %d", errno );
+
+    return -1;
+  }
+
+  read_generation = ul_get_relay_db_generation();
+
+  return 0;
+}
+
+void v_end_relay_db_read( bool loaded )
+{
+  if ( loaded == true )
+  {
+    loaded_generation = read_generation;
+  }
+
+  flock( relay_db_fd, LOCK_UN );
+}
+
+// readers never see half of the renames that make up a commit
+int d_begin_relay_db_commit()
+{
+  // nobody else can be reading without the database either
+  if ( d_open_relay_db() < 0 )
+  {
+    return 0;
+  }
+
+  if ( flock( relay_db_fd, LOCK_EX ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to lock " FILESYSTEM_PREFIX "relay_db, errno: %d", errno );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+int d_end_relay_db_commit( bool committed )
+{
+  int ret = 0;
+  RelayDbHeader header;
+
+  if ( relay_db_fd < 0 )
+  {
+    return 0;
+  }
+
+  if ( committed == true )
+  {
+    header.magic = RELAY_DB_MAGIC;
+    header.version = RELAY_DB_VERSION;
+    header.relay_size = RELAY_RECORD_SIZE;
+    header.generation = ul_get_relay_db_generation() + 1;
+
+    // zero means nothing has been committed yet
+    if ( header.generation == 0 )
+    {
+      header.generation = 1;
+    }
+
+    if ( pwrite( relay_db_fd, &header, sizeof( RelayDbHeader ), 0 ) != sizeof( RelayDbHeader ) )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to write " FILESYSTEM_PREFIX "relay_db, errno: %d", errno );
+
+      ret = -1;
+    }
+    else
+    {
+      loaded_generation = header.generation;
+    }
+  }
+
+  flock( relay_db_fd, LOCK_UN );
+
+  return ret;
+}
@@ -0,0 +1,533 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../../include/config.h"
+#include "../../h/port.h"
+
+#include "../../h/constants.h"
+#include "../../h/models/buffered_file.h"
+#include "../../h/models/relay_table.h"
+
+// offsets into a packed row record
+#define ROW_IDENTITY 0
+#define ROW_DIGEST 20
+#define ROW_MASTER_KEY 40
+#define ROW_NTOR_ONION_KEY 72
+#define ROW_ADDRESS 104
+#define ROW_OR_PORT 108
+#define ROW_DIR_PORT 110
+#define ROW_ID_HASH 112
+#define ROW_ID_HASH_PREVIOUS 144
+#define ROW_FLAGS 176
+#define ROW_BANDWIDTH 177
+
+// offsets into a cold record
+#define COLD_DIGEST 0
+#define COLD_MASTER_KEY 20
+#define COLD_NTOR_ONION_KEY 52
+#define COLD_ADDRESS 84
+#define COLD_OR_PORT 88
+#define COLD_DIR_PORT 90
+
+// rows read per block while transposing
+#define ROW_BLOCK_COUNT 64
+
+// the columns in the order they're written, one pass over the rows each
+typedef enum RelayColumn
+{
+  COLUMN_ID_HASH,
+  COLUMN_ID_HASH_PREVIOUS,
+  COLUMN_IDENTITY,
+  COLUMN_FLAGS,
+  COLUMN_BANDWIDTH = COLUMN_FLAGS + RELAY_FLAG_COUNT,
+  COLUMN_COLD,
+  COLUMN_COUNT,
+} RelayColumn;
+
+static void v_put_u16( uint8_t* buffer, uint16_t value )
+{
+  buffer[0] = (uint8_t)( value >> 8 );
+  buffer[1] = (uint8_t)value;
+}
+
+static void v_put_u32( uint8_t* buffer, uint32_t value )
+{
+  buffer[0] = (uint8_t)( value >> 24 );
+  buffer[1] = (uint8_t)( value >> 16 );
+  buffer[2] = (uint8_t)( value >> 8 );
+  buffer[3] = (uint8_t)value;
+}
+
+static void v_put_u64( uint8_t* buffer, uint64_t value )
+{
+  v_put_u32( buffer, (uint32_t)( value >> 32 ) );
+  v_put_u32( buffer + 4, (uint32_t)value );
+}
+
+static uint16_t us_get_u16( const uint8_t* buffer )
+{
+  return ( (uint16_t)buffer[0] << 8 ) | buffer[1];
+}
+
+static uint32_t ul_get_u32( const uint8_t* buffer )
+{
+  return ( (uint32_t)buffer[0] << 24 ) | ( (uint32_t)buffer[1] << 16 ) | ( (uint32_t)buffer[2] << 8 ) | buffer[3];
+}
+
+static uint64_t ull_get_u64( const uint8_t* buffer )
+{
+  return ( (uint64_t)ul_get_u32( buffer ) << 32 ) | ul_get_u32( buffer + 4 );
+}
+
+static uint32_t ul_flag_column_size( uint32_t count )
+{
+  return ( count + 7 ) / 8;
+}
+
+static size_t ul_relay_table_size( uint32_t count )
+{
+  return RELAY_TABLE_HEADER_SIZE +
+    (size_t)count * ( H_LENGTH * 2 + ID_LENGTH + 4 + RELAY_COLD_RECORD_SIZE ) +
+    (size_t)ul_flag_column_size( count ) * RELAY_FLAG_COUNT;
+}
+
+void v_pack_relay_table_header( uint8_t* buffer, RelayTableLayout layout, uint32_t count, time_t valid_until )
+{
+  memset( buffer, 0, RELAY_TABLE_HEADER_SIZE );
+
+  v_put_u32( buffer, RELAY_TABLE_MAGIC );
+  v_put_u16( buffer + 4, RELAY_TABLE_VERSION );
+  v_put_u16( buffer + 6, layout );
+  v_put_u32( buffer + 8, count );
+  v_put_u64( buffer + RELAY_TABLE_VALID_UNTIL_OFFSET, (uint64_t)(int64_t)valid_until );
+}
+
+int d_unpack_relay_table_header( RelayTableHeader* header, const uint8_t* buffer )
+{
+  header->magic = ul_get_u32( buffer );
+  header->version = us_get_u16( buffer + 4 );
+  header->layout = us_get_u16( buffer + 6 );
+  header->count = ul_get_u32( buffer + 8 );
+  header->valid_until = (time_t)(int64_t)ull_get_u64( buffer + RELAY_TABLE_VALID_UNTIL_OFFSET );
+
+  // anything else was written by an older build and has to be refetched
+  if ( header->magic != RELAY_TABLE_MAGIC || header->version != RELAY_TABLE_VERSION )
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+// reads the header of a relay list, a column table is also checked against
+// its size so a truncated one is never mapped
+int d_read_relay_table_header( const char* filename, RelayTableHeader* header )
+{
+  int fd;
+  struct stat st;
+  uint8_t buffer[RELAY_TABLE_HEADER_SIZE];
+
+  fd = open( filename, O_RDONLY );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+
+    return -1;
+  }
+
+  if ( fstat( fd, &st ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to stat %s, errno: %d", filename, errno );
+
+    goto fail;
+  }
+
+  if ( read( fd, buffer, RELAY_TABLE_HEADER_SIZE ) != RELAY_TABLE_HEADER_SIZE )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", filename, errno );
+
+    goto fail;
+  }
+
+  close( fd );
+
+  if ( d_unpack_relay_table_header( header, buffer ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%s has an unknown format", filename );
+
+    return -1;
+  }
+
+  if ( header->layout == RELAY_TABLE_COLUMNS && st.st_size != ul_relay_table_size( header->count ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%s has an unexpected size %ld", filename, (long)st.st_size );
+
+    return -1;
+  }
+
+  // the count of a staged list is only known from how much has been written
+  if ( header->layout == RELAY_TABLE_ROWS )
+  {
+    if ( st.st_size < RELAY_TABLE_HEADER_SIZE || ( st.st_size - RELAY_TABLE_HEADER_SIZE ) % RELAY_RECORD_SIZE != 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "%s has an unexpected size %ld", filename, (long)st.st_size );
+
+      return -1;
+    }
+
+    header->count = ( st.st_size - RELAY_TABLE_HEADER_SIZE ) / RELAY_RECORD_SIZE;
+  }
+
+  return 0;
+
+fail:
+  close( fd );
+
+  return -1;
+}
+
+void v_pack_relay_record( uint8_t* record, OnionRelay* onion_relay )
+{
+  memcpy( record + ROW_IDENTITY, onion_relay->identity, ID_LENGTH );
+  memcpy( record + ROW_DIGEST, onion_relay->digest, ID_LENGTH );
+  memcpy( record + ROW_MASTER_KEY, onion_relay->master_key, H_LENGTH );
+  memcpy( record + ROW_NTOR_ONION_KEY, onion_relay->ntor_onion_key, H_LENGTH );
+  v_put_u32( record + ROW_ADDRESS, onion_relay->address );
+  v_put_u16( record + ROW_OR_PORT, onion_relay->or_port );
+  v_put_u16( record + ROW_DIR_PORT, onion_relay->dir_port );
+  memcpy( record + ROW_ID_HASH, onion_relay->id_hash, H_LENGTH );
+  memcpy( record + ROW_ID_HASH_PREVIOUS, onion_relay->id_hash_previous, H_LENGTH );
+
+  record[ROW_FLAGS] =
+    ( onion_relay->suitable << RELAY_FLAG_SUITABLE ) |
+    ( onion_relay->hsdir << RELAY_FLAG_HSDIR ) |
+    ( onion_relay->dir_cache << RELAY_FLAG_DIR_CACHE ) |
+    ( onion_relay->can_guard << RELAY_FLAG_CAN_GUARD ) |
+    ( onion_relay->can_exit << RELAY_FLAG_CAN_EXIT );
+
+  v_put_u32( record + ROW_BANDWIDTH, onion_relay->bandwidth );
+}
+
+void v_unpack_relay_record( OnionRelay* onion_relay, const uint8_t* record )
+{
+  memcpy( onion_relay->identity, record + ROW_IDENTITY, ID_LENGTH );
+  memcpy( onion_relay->digest, record + ROW_DIGEST, ID_LENGTH );
+  memcpy( onion_relay->master_key, record + ROW_MASTER_KEY, H_LENGTH );
+  memcpy( onion_relay->ntor_onion_key, record + ROW_NTOR_ONION_KEY, H_LENGTH );
+  onion_relay->address = ul_get_u32( record + ROW_ADDRESS );
+  onion_relay->or_port = us_get_u16( record + ROW_OR_PORT );
+  onion_relay->dir_port = us_get_u16( record + ROW_DIR_PORT );
+  memcpy( onion_relay->id_hash, record + ROW_ID_HASH, H_LENGTH );
+  memcpy( onion_relay->id_hash_previous, record + ROW_ID_HASH_PREVIOUS, H_LENGTH );
+  onion_relay->suitable = ( record[ROW_FLAGS] >> RELAY_FLAG_SUITABLE ) & 1;
+  onion_relay->hsdir = ( record[ROW_FLAGS] >> RELAY_FLAG_HSDIR ) & 1;
+  onion_relay->dir_cache = ( record[ROW_FLAGS] >> RELAY_FLAG_DIR_CACHE ) & 1;
+  onion_relay->can_guard = ( record[ROW_FLAGS] >> RELAY_FLAG_CAN_GUARD ) & 1;
+  onion_relay->can_exit = ( record[ROW_FLAGS] >> RELAY_FLAG_CAN_EXIT ) & 1;
+  onion_relay->bandwidth = ul_get_u32( record + ROW_BANDWIDTH );
+}
+
+// writes one column of a row, flags are handled by the caller since eight
+// rows share a byte
+static int d_write_relay_column( BufferedFile* table_file, int column, const uint8_t* record )
+{
+  uint8_t cold[RELAY_COLD_RECORD_SIZE];
+
+  switch ( column )
+  {
+    case COLUMN_ID_HASH:
+      return d_write_buffered_file( table_file, record + ROW_ID_HASH, H_LENGTH );
+    case COLUMN_ID_HASH_PREVIOUS:
+      return d_write_buffered_file( table_file, record + ROW_ID_HASH_PREVIOUS, H_LENGTH );
+    case COLUMN_IDENTITY:
+      return d_write_buffered_file( table_file, record + ROW_IDENTITY, ID_LENGTH );
+    case COLUMN_BANDWIDTH:
+      return d_write_buffered_file( table_file, record + ROW_BANDWIDTH, 4 );
+    case COLUMN_COLD:
+      memcpy( cold + COLD_DIGEST, record + ROW_DIGEST, ID_LENGTH );
+      memcpy( cold + COLD_MASTER_KEY, record + ROW_MASTER_KEY, H_LENGTH );
+      memcpy( cold + COLD_NTOR_ONION_KEY, record + ROW_NTOR_ONION_KEY, H_LENGTH );
+      memcpy( cold + COLD_ADDRESS, record + ROW_ADDRESS, 4 );
+      memcpy( cold + COLD_OR_PORT, record + ROW_OR_PORT, 2 );
+      memcpy( cold + COLD_DIR_PORT, record + ROW_DIR_PORT, 2 );
+
+      return d_write_buffered_file( table_file, cold, RELAY_COLD_RECORD_SIZE );
+    default:
+      return -1;
+  }
+}
+
+// transposes a staged row list into a column table at table_filename, the
+// rows are streamed once per column so only a block of them is in memory
+int d_write_relay_table( const char* rows_filename, const char* table_filename )
+{
+  int fd;
+  int column;
+  int flag;
+  int block_count;
+  uint32_t i;
+  uint32_t j;
+  uint8_t flag_bits;
+  uint8_t* rows = NULL;
+  char* stg_filename = NULL;
+  RelayTableHeader header;
+  uint8_t header_buffer[RELAY_TABLE_HEADER_SIZE];
+  BufferedFile table_file = BUFFERED_FILE_INITIALIZER;
+
+  if ( d_read_relay_table_header( rows_filename, &header ) < 0 || header.layout != RELAY_TABLE_ROWS )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%s is not a staged relay list", rows_filename );
+
+    return -1;
+  }
+
+  fd = open( rows_filename, O_RDONLY );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", rows_filename, errno );
+
+    return -1;
+  }
+
+  rows = malloc( sizeof( uint8_t ) * RELAY_RECORD_SIZE * ROW_BLOCK_COUNT );
+  stg_filename = malloc( sizeof( char ) * ( strlen( table_filename ) + 5 ) );
+
+  if ( rows == NULL || stg_filename == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate %s transpose buffers", table_filename );
+
+    goto fail;
+  }
+
+  sprintf( stg_filename, "%s_tbl", table_filename );
+
+  if ( d_open_buffered_file( &table_file, stg_filename ) < 0 )
+  {
+    goto fail;
+  }
+
+  v_pack_relay_table_header( header_buffer, RELAY_TABLE_COLUMNS, header.count, header.valid_until );
+
+  if ( d_write_buffered_file( &table_file, header_buffer, RELAY_TABLE_HEADER_SIZE ) < 0 )
+  {
+    goto fail;
+  }
+
+  for ( column = 0; column < COLUMN_COUNT; column++ )
+  {
+    if ( lseek( fd, RELAY_TABLE_HEADER_SIZE, SEEK_SET ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to lseek %s, errno: %d", rows_filename, errno );
+
+      goto fail;
+    }
+
+    flag = column - COLUMN_FLAGS;
+    flag_bits = 0;
+
+    for ( i = 0; i < header.count; i += block_count )
+    {
+      block_count = header.count - i;
+
+      if ( block_count > ROW_BLOCK_COUNT )
+      {
+        block_count = ROW_BLOCK_COUNT;
+      }
+
+      if ( read( fd, rows, RELAY_RECORD_SIZE * block_count ) != RELAY_RECORD_SIZE * block_count )
+      {
+        MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", rows_filename, errno );
+
+        goto fail;
+      }
+
+      for ( j = 0; j < block_count; j++ )
+      {
+        if ( column >= COLUMN_FLAGS && column < COLUMN_BANDWIDTH )
+        {
+          flag_bits |= ( ( rows[j * RELAY_RECORD_SIZE + ROW_FLAGS] >> flag ) & 1 ) << ( ( i + j ) % 8 );
+
+          if ( ( i + j ) % 8 == 7 )
+          {
+            if ( d_write_buffered_file( &table_file, &flag_bits, 1 ) < 0 )
+            {
+              goto fail;
+            }
+
+            flag_bits = 0;
+          }
+        }
+        else if ( d_write_relay_column( &table_file, column, rows + j * RELAY_RECORD_SIZE ) < 0 )
+        {
+          goto fail;
+        }
+      }
+    }
+
+    // the last partial byte of a flag column
+    if ( column >= COLUMN_FLAGS && column < COLUMN_BANDWIDTH && header.count % 8 != 0 )
+    {
+      if ( d_write_buffered_file( &table_file, &flag_bits, 1 ) < 0 )
+      {
+        goto fail;
+      }
+    }
+  }
+
+  if ( d_commit_buffered_file( &table_file, table_filename ) < 0 )
+  {
+    goto fail;
+  }
+
+  close( fd );
+  free( rows );
+  free( stg_filename );
+
+  return 0;
+
+fail:
+  d_close_buffered_file( &table_file );
+  close( fd );
+  free( rows );
+  free( stg_filename );
+
+  return -1;
+}
+
+// maps a column table and points each column into the mapping, the mapping
+// is shared and stays valid after the file is replaced
+int d_map_relay_table( RelayTable* table, const char* filename )
+{
+  int fd;
+  int i;
+  uint32_t flag_size;
+  const uint8_t* column;
+  RelayTableHeader header;
+
+  memset( table, 0, sizeof( RelayTable ) );
+
+  if ( d_read_relay_table_header( filename, &header ) < 0 )
+  {
+    return -1;
+  }
+
+  if ( header.layout != RELAY_TABLE_COLUMNS )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%s is not a relay table", filename );
+
+    return -1;
+  }
+
+  fd = open( filename, O_RDONLY );
+
+  if ( fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", filename, errno );
+
+    return -1;
+  }
+
+  table->map_size = ul_relay_table_size( header.count );
+  table->map = mmap( NULL, table->map_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+  // the mapping stays valid after the fd is closed
+  close( fd );
+
+  if ( table->map == MAP_FAILED )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to mmap %s, errno: %d", filename, errno );
+
+    table->map = NULL;
+
+    return -1;
+  }
+
+  table->count = header.count;
+  table->valid_until = header.valid_until;
+
+  column = table->map + RELAY_TABLE_HEADER_SIZE;
+
+  table->id_hashes = column;
+  column += (size_t)H_LENGTH * table->count;
+  table->id_hashes_previous = column;
+  column += (size_t)H_LENGTH * table->count;
+  table->identities = column;
+  column += (size_t)ID_LENGTH * table->count;
+
+  flag_size = ul_flag_column_size( table->count );
+
+  for ( i = 0; i < RELAY_FLAG_COUNT; i++ )
+  {
+    table->flags[i] = column;
+    column += flag_size;
+  }
+
+  table->bandwidths = column;
+  column += (size_t)4 * table->count;
+  table->cold_records = column;
+
+  return 0;
+}
+
+void v_unmap_relay_table( RelayTable* table )
+{
+  if ( table->map != NULL )
+  {
+    munmap( table->map, table->map_size );
+  }
+
+  memset( table, 0, sizeof( RelayTable ) );
+}
+
+bool b_relay_table_flag( RelayTable* table, RelayFlag flag, uint32_t index )
+{
+  return ( table->flags[flag][index / 8] >> ( index % 8 ) ) & 1;
+}
+
+// gathers one relay back out of the columns
+void v_get_relay_table_row( RelayTable* table, uint32_t index, OnionRelay* onion_relay )
+{
+  const uint8_t* cold = table->cold_records + (size_t)RELAY_COLD_RECORD_SIZE * index;
+
+  memcpy( onion_relay->identity, table->identities + (size_t)ID_LENGTH * index, ID_LENGTH );
+  memcpy( onion_relay->digest, cold + COLD_DIGEST, ID_LENGTH );
+  memcpy( onion_relay->master_key, cold + COLD_MASTER_KEY, H_LENGTH );
+  memcpy( onion_relay->ntor_onion_key, cold + COLD_NTOR_ONION_KEY, H_LENGTH );
+  onion_relay->address = ul_get_u32( cold + COLD_ADDRESS );
+  onion_relay->or_port = us_get_u16( cold + COLD_OR_PORT );
+  onion_relay->dir_port = us_get_u16( cold + COLD_DIR_PORT );
+  memcpy( onion_relay->id_hash, table->id_hashes + (size_t)H_LENGTH * index, H_LENGTH );
+  memcpy( onion_relay->id_hash_previous, table->id_hashes_previous + (size_t)H_LENGTH * index, H_LENGTH );
+  onion_relay->suitable = b_relay_table_flag( table, RELAY_FLAG_SUITABLE, index );
+  onion_relay->hsdir = b_relay_table_flag( table, RELAY_FLAG_HSDIR, index );
+  onion_relay->dir_cache = b_relay_table_flag( table, RELAY_FLAG_DIR_CACHE, index );
+  onion_relay->can_guard = b_relay_table_flag( table, RELAY_FLAG_CAN_GUARD, index );
+  onion_relay->can_exit = b_relay_table_flag( table, RELAY_FLAG_CAN_EXIT, index );
+  onion_relay->bandwidth = ul_get_u32( table->bandwidths + (size_t)4 * index );
+}
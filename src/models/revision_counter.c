@@ -25,65 +25,51 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../../h/constants.h"
 
+// the counter file is opened once and kept open, after the first roll each
+// publish costs a single pwrite
+static int rev_counter_fd = -1;
+static int rev_counter = -1;
+
 int d_roll_revision_counter()
 {
-  int fd;
-  int count = 0;
-  struct stat st;
-
-  if ( stat( FILESYSTEM_PREFIX "rev_counter", &st ) != 0 )
-  {
-    fd = open( FILESYSTEM_PREFIX "rev_counter", O_CREAT | O_TRUNC | O_WRONLY, 0600 );
-    count = -1;
-  }
-  else
-  {
-    fd = open( FILESYSTEM_PREFIX "rev_counter", O_RDWR );
-  }
+  int count;
 
-  if ( fd < 0 )
+  if ( rev_counter_fd < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "rev_counter" );
-    
-    return -1;
-  }
+    rev_counter_fd = open( FILESYSTEM_PREFIX "rev_counter", O_CREAT | O_RDWR, 0600 );
 
-  if ( count != -1 )
-  {
-    if ( read( fd, &count, sizeof( int ) ) != sizeof( int ) )
+    if ( rev_counter_fd < 0 )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read " FILESYSTEM_PREFIX "rev_counter" );
+      MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "rev_counter" );
 
-      count = -1;
-      goto finish;
+      return -1;
     }
 
-    if ( lseek( fd, 0, SEEK_SET ) != 0 )
+    // a new or short file starts the count over
+    if ( pread( rev_counter_fd, &rev_counter, sizeof( int ), 0 ) != sizeof( int ) )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to seek " FILESYSTEM_PREFIX "rev_counter" );
-
-      count = -1;
-      goto finish;
+      rev_counter = -1;
     }
   }
 
-  count++;
+  count = rev_counter + 1;
 
   if ( count == INT_MAX )
   {
     count = 0;
   }
 
-  if ( write( fd, &count, sizeof( int ) ) != sizeof( int ) )
+  if ( pwrite( rev_counter_fd, &count, sizeof( int ), 0 ) != sizeof( int ) )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to write " FILESYSTEM_PREFIX "rev_counter" );
 
-    count = -1;
-    goto finish;
+    close( rev_counter_fd );
+    rev_counter_fd = -1;
+
+    return -1;
   }
 
-finish:
-  close( fd );
+  rev_counter = count;
 
   return count;
 }
@@ -34,6 +34,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/connections.h"
 #include "../h/core.h"
 #include "../h/models/relay.h"
+#include "../h/tokenizer.h"
 
 const char* CLIENT_TAG = "MINITOR_CLIENT";
 
@@ -48,6 +49,7 @@ void* px_create_onion_client( const char* onion_address )
   wc_Sha3 address_sha3;
   OnionMessage* onion_message;
   OnionClient* client;
+  ConsensusSnapshot* snapshot;
 
   if ( strlen( onion_address ) != 62 )
   {
@@ -83,8 +85,17 @@ void* px_create_onion_client( const char* onion_address )
     goto finish;
   }
 
-  // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+  // the descriptor lookup needs the full hsdir ring, not just enough relays
+  if ( b_bootstrap_reached( BOOTSTRAP_HSDIR_RING ) == false )
+  {
+    MINITOR_LOG( CLIENT_TAG, "HSDir ring not ready yet" );
+
+    client = NULL;
+    goto finish;
+  }
+
+  // one snapshot for the time period and the ring lookup
+  snapshot = px_acquire_consensus_snapshot();
 
   client = malloc( sizeof( OnionClient ) );
   wc_ed25519_init( &client->blinded_key );
@@ -92,12 +103,11 @@ void* px_create_onion_client( const char* onion_address )
   memset( client, 0, sizeof( OnionClient ) );
 
   // +1 for current
-  time_period = d_get_hs_time_period( network_consensus.fresh_until, network_consensus.valid_after, network_consensus.hsdir_interval ) + 1;
+  time_period = d_get_hs_time_period( snapshot->consensus.fresh_until, snapshot->consensus.valid_after, snapshot->consensus.hsdir_interval ) + 1;
 
-  if ( d_derive_blinded_pubkey( &client->blinded_key, decoded_address, time_period, network_consensus.hsdir_interval, NULL, 0 ) )
+  if ( d_derive_blinded_pubkey( &client->blinded_key, decoded_address, time_period, snapshot->consensus.hsdir_interval, NULL, 0 ) )
   {
-    MINITOR_MUTEX_GIVE( network_consensus_mutex );
-    // MUTEX GIVE
+    v_release_consensus_snapshot( snapshot );
 
     MINITOR_LOG( CLIENT_TAG, "Failed to derive blinded public key" );
 
@@ -112,8 +122,7 @@ void* px_create_onion_client( const char* onion_address )
 
   if ( succ < 0 || idx != ED25519_PUB_KEY_SIZE )
   {
-    MINITOR_MUTEX_GIVE( network_consensus_mutex );
-    // MUTEX GIVE
+    v_release_consensus_snapshot( snapshot );
 
     MINITOR_LOG( CLIENT_TAG, "Failed to export blinded public key" );
 
@@ -123,10 +132,9 @@ void* px_create_onion_client( const char* onion_address )
     goto finish;
   }
 
-  client->target_relays = px_get_target_relays( network_consensus.hsdir_n_replicas, blinded_pubkey, time_period, network_consensus.hsdir_interval, network_consensus.hsdir_spread_store - 1, 1 );
+  client->target_relays = px_get_target_relays( snapshot->hsdir_ring, snapshot->consensus.hsdir_n_replicas, blinded_pubkey, time_period, snapshot->consensus.hsdir_interval, snapshot->consensus.hsdir_spread_store - 1, 1 );
 
-  MINITOR_MUTEX_GIVE( network_consensus_mutex );
-  // MUTEX GIVE
+  v_release_consensus_snapshot( snapshot );
 
   // make the connection strut
   strcpy( client->hostname, onion_address );
@@ -697,49 +705,331 @@ int d_get_hs_desc( OnionCircuit* circuit, DlConnection* or_connection )
   return 0;
 }
 
+enum
+{
+  HSDESC_KEYWORD_VERSION,
+  HSDESC_KEYWORD_LIFETIME,
+  HSDESC_KEYWORD_SIGNING_KEY_CERT,
+  HSDESC_KEYWORD_REVISION_COUNTER,
+  HSDESC_KEYWORD_SUPERENCRYPTED,
+  HSDESC_KEYWORD_SIGNATURE,
+  HSDESC_KEYWORD_COUNT,
+};
+
+static const char* hsdesc_keywords[] = {
+  "hs-descriptor",
+  "descriptor-lifetime",
+  "descriptor-signing-key-cert",
+  "revision-counter",
+  "superencrypted",
+  "signature",
+};
+
+enum
+{
+  INTRO_KEYWORD_INTRODUCTION_POINT,
+  INTRO_KEYWORD_ONION_KEY,
+  INTRO_KEYWORD_AUTH_KEY,
+  INTRO_KEYWORD_ENC_KEY,
+  INTRO_KEYWORD_ENC_KEY_CERT,
+  INTRO_KEYWORD_COUNT,
+};
+
+static const char* intro_keywords[] = {
+  "introduction-point",
+  "onion-key",
+  "auth-key",
+  "enc-key",
+  "enc-key-cert",
+};
+
+// checks an ed25519 cert object, it must name signing_key in its
+// signed-with-key extension and carry a valid signature from it
+static int d_verify_hsdesc_cert( TokenSlice* object, uint8_t cert_type, ed25519_key* signing_key, uint8_t* certified_key )
+{
+  int j;
+  int idx;
+  int succ;
+  int wolf_succ;
+  time_t now;
+  int unpacked_crosscert_length;
+  uint8_t* unpacked_crosscert_end;
+  TorCrosscert* unpacked_crosscert;
+  TorCrosscertExtension* extension;
+  uint8_t signing_pubkey[ED25519_PUB_KEY_SIZE];
+
+  idx = ED25519_PUB_KEY_SIZE;
+  succ = wc_ed25519_export_public( signing_key, signing_pubkey, &idx );
+
+  if ( succ < 0 || idx != ED25519_PUB_KEY_SIZE )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to export cert signing key" );
+
+    return -1;
+  }
+
+  unpacked_crosscert_length = object->length * 3 / 4;
+
+  if ( object->length % 4 != 0 )
+  {
+    unpacked_crosscert_length++;
+  }
+
+  unpacked_crosscert = malloc( unpacked_crosscert_length );
+  unpacked_crosscert_length = d_base_64_decode( (uint8_t*)unpacked_crosscert, (char*)object->data, object->length );
+  unpacked_crosscert_end = (uint8_t*)unpacked_crosscert + unpacked_crosscert_length;
+
+  if ( unpacked_crosscert_length < sizeof( TorCrosscert ) + 64 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert length" );
+
+    goto fail;
+  }
+
+  if ( unpacked_crosscert->version != 1 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert version" );
+
+    goto fail;
+  }
+
+  if ( unpacked_crosscert->cert_type != cert_type )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert type" );
+
+    goto fail;
+  }
+
+  time( &now );
+
+  if ( unpacked_crosscert->epoch_hours < now / 60 / 60 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert epoch hours" );
+
+    goto fail;
+  }
+
+  if ( unpacked_crosscert->cert_key_type != 1 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert cert key type" );
+
+    goto fail;
+  }
+
+  extension = (TorCrosscertExtension*)unpacked_crosscert->extensions;
+
+  for ( j = 0; j < unpacked_crosscert->num_extensions; j++ )
+  {
+    if (
+      extension->ext_data > unpacked_crosscert_end ||
+      extension->ext_data + ntohs( extension->ext_length ) > unpacked_crosscert_end
+    )
+    {
+      MINITOR_LOG( CLIENT_TAG, "Invalid crosscert ext length" );
+
+      goto fail;
+    }
+
+    if ( extension->ext_type != 4 )
+    {
+      extension = (TorCrosscertExtension*)( extension->ext_data + ntohs( extension->ext_length ) );
+
+      continue;
+    }
+
+    if ( ntohs( extension->ext_length ) != ED25519_PUB_KEY_SIZE )
+    {
+      MINITOR_LOG( CLIENT_TAG, "Invalid crosscert ext length" );
+
+      goto fail;
+    }
+
+    if ( memcmp( extension->ext_data, signing_pubkey, ED25519_PUB_KEY_SIZE ) != 0 )
+    {
+      MINITOR_LOG( CLIENT_TAG, "Invalid crosscert ext data" );
+
+      goto fail;
+    }
+
+    extension = (TorCrosscertExtension*)( extension->ext_data + ntohs( extension->ext_length ) );
+  }
+
+  if ( (uint8_t*)extension + 64 > unpacked_crosscert_end )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Invalid crosscert length" );
+
+    goto fail;
+  }
+
+  // proves that the certified key was signed by the signing key holder
+  wolf_succ = wc_ed25519_verify_msg( (uint8_t*)extension, 64, (uint8_t*)unpacked_crosscert, (uint8_t*)extension - (uint8_t*)unpacked_crosscert, &succ, signing_key );
+
+  if ( wolf_succ < 0 || succ == 0 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to verify the ed crosscert signature, error code: %d", wolf_succ );
+
+    goto fail;
+  }
+
+  memcpy( certified_key, unpacked_crosscert->certified_key, ED25519_PUB_KEY_SIZE );
+
+  free( unpacked_crosscert );
+
+  return 0;
+
+fail:
+  free( unpacked_crosscert );
+
+  return -1;
+}
+
+// the introduction-point argument is a base64 list of link specifiers, we
+// need both the ipv4 and the legacy identity specifier
+static int d_parse_intro_link_specifiers( OnionRelay* intro_relay, TokenSlice* arguments )
+{
+  int j;
+  int ret = -1;
+  TokenSlice token;
+  uint8_t num_specifiers;
+  int link_specifiers_length;
+  uint8_t* link_specifiers_p;
+  uint8_t* link_specifiers_end;
+  LinkSpecifier* link_specifiers;
+  bool ipv4_spec_found = false;
+  bool legacy_spec_found = false;
+
+  if ( b_next_token( arguments, &token ) == false )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to find link specifier" );
+
+    return -1;
+  }
+
+  link_specifiers_length = token.length * 3 / 4;
+
+  if ( token.length % 4 != 0 )
+  {
+    link_specifiers_length++;
+  }
+
+  link_specifiers_p = malloc( link_specifiers_length );
+  link_specifiers_length = d_base_64_decode( link_specifiers_p, (char*)token.data, token.length );
+  link_specifiers_end = link_specifiers_p + link_specifiers_length;
+
+  if ( link_specifiers_length < 1 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to find link specifier" );
+
+    goto finish;
+  }
+
+  num_specifiers = link_specifiers_p[0];
+  link_specifiers = (LinkSpecifier*)( link_specifiers_p + 1 );
+
+  for ( j = 0; j < num_specifiers; j++ )
+  {
+    if (
+      link_specifiers->specifier > link_specifiers_end ||
+      link_specifiers->specifier + link_specifiers->length > link_specifiers_end
+    )
+    {
+      MINITOR_LOG( CLIENT_TAG, "Invalid link specifier length" );
+
+      goto finish;
+    }
+
+    if ( link_specifiers->type == IPv4Link )
+    {
+      if ( link_specifiers->length != 6 )
+      {
+        MINITOR_LOG( CLIENT_TAG, "Invalid ipv4 link specifier" );
+
+        goto finish;
+      }
+
+      intro_relay->address = link_specifiers->specifier[0];
+      intro_relay->address |= (uint32_t)link_specifiers->specifier[1] << 8;
+      intro_relay->address |= (uint32_t)link_specifiers->specifier[2] << 16;
+      intro_relay->address |= (uint32_t)link_specifiers->specifier[3] << 24;
+
+      intro_relay->or_port = (uint32_t)link_specifiers->specifier[4] << 8;
+      intro_relay->or_port |= (uint32_t)link_specifiers->specifier[5];
+
+      ipv4_spec_found = true;
+    }
+    else if ( link_specifiers->type == LEGACYLink )
+    {
+      if ( link_specifiers->length != ID_LENGTH )
+      {
+        MINITOR_LOG( CLIENT_TAG, "Invalid legacy link specifier" );
+
+        goto finish;
+      }
+
+      memcpy( intro_relay->identity, link_specifiers->specifier, ID_LENGTH );
+
+      legacy_spec_found = true;
+    }
+
+    link_specifiers = (LinkSpecifier*)( link_specifiers->specifier + link_specifiers->length );
+  }
+
+  if ( ipv4_spec_found == false || legacy_spec_found == false )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to find both link specifiers" );
+
+    goto finish;
+  }
+
+  ret = 0;
+
+finish:
+  free( link_specifiers_p );
+
+  return ret;
+}
+
 int d_parse_hsdesc( OnionCircuit* circuit, Cell* cell )
 {
   int i;
-  int j;
   int idx;
   int succ;
   int wolf_succ;
   uint8_t* first_layer;
-  uint8_t* first_layer_p;
+  uint8_t* first_layer_p = NULL;
   int first_layer_length;
-  time_t now;
+  uint8_t* second_layer;
+  uint8_t* second_layer_p = NULL;
+  int second_layer_length;
   const char* http_header_finish = "\r\n\r\n";
   const char* http_ok = "HTTP/1.0 200 OK\r\n";
   const char* content_length_string = "Content-Length: ";
   int content_length_found = 0;
-  const char* version_string = "hs-descriptor 3\n";
-  int version_found = 0;
-  const char* lifetime_string = "descriptor-lifetime ";
-  int lifetime_found = 0;
+  bool version_found = false;
   int desc_lifetime = 0;
-  const char* signing_key_cert_string = "descriptor-signing-key-cert\n-----BEGIN ED25519 CERT-----\n";
-  int signing_key_cert_found = 0;
-  const char* end_key_cert_string = "-----END ED25519 CERT-----\n";
-  int end_key_cert_found = 0;
-  int cert_start;
-  const char* revision_counter_string = "revision-counter ";
-  int revision_counter_found = 0;
+  bool signing_key_found = false;
   uint64_t revision_counter = 0;
-  const char* superencrypted_string = "superencrypted\n-----BEGIN MESSAGE-----\n";
-  int superencrypted_found = 0;
-  int superencrypted_start = 0;
-  int superencrypted_end = 0;
-  const char* end_message_string = "-----END MESSAGE-----";
-  int end_message_found = 0;
-  const char* signature_string = "signature ";
-  int signature_found = 0;
+  bool superencrypted_found = false;
+  bool encrypted_found = false;
+  bool signature_found = false;
+  int signed_length;
   uint8_t blinded_pubkey[ED25519_PUB_KEY_SIZE];
+  uint8_t certified_key[ED25519_PUB_KEY_SIZE];
   ed25519_key descriptor_signing_key;
   uint8_t signature[64];
-  int unpacked_crosscert_length;
-  TorCrosscert* unpacked_crosscert;
-  TorCrosscertExtension* extension;
+  uint8_t enc_pub_key[CURVE25519_KEYSIZE];
   int alloced_relays = 0;
+  OnionRelay* intro_relay;
+  IntroCrypto* intro_crypto;
+  LineTokenizer tokenizer;
+  KeywordTable keyword_table;
+  TokenSlice line;
+  TokenSlice arguments;
+  TokenSlice object;
+  TokenSlice superencrypted;
+  TokenSlice encrypted;
+  TokenSlice key_type;
+  TokenSlice key;
 
   for ( i = 0; i < cell->payload.relay.length; i++ )
   {
@@ -800,895 +1090,326 @@ int d_parse_hsdesc( OnionCircuit* circuit, Cell* cell )
     }
   }
 
-  if ( circuit->client->hsdesc_size == circuit->client->hsdesc_content_length + HS_DESC_SIG_PREFIX_LENGTH )
+  if ( circuit->client->hsdesc_size != circuit->client->hsdesc_content_length + HS_DESC_SIG_PREFIX_LENGTH )
   {
-    wc_ed25519_init( &descriptor_signing_key );
-
-    for ( i = 0; i < circuit->client->hsdesc_size; i++ )
-    {
-      if ( version_found < strlen( version_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == version_string[version_found] )
-        {
-          version_found++;
-        }
-        else
-        {
-          version_found = 0;
-        }
-      }
-      else if ( lifetime_found < strlen( lifetime_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == lifetime_string[lifetime_found] )
-        {
-          lifetime_found++;
-        }
-        else
-        {
-          lifetime_found = 0;
-        }
-
-        if ( lifetime_found == strlen( lifetime_string ) )
-        {
-          desc_lifetime = atoi( circuit->client->hsdesc + i + 1 ) * 60;
-        }
-      }
-      else if ( signing_key_cert_found < strlen( signing_key_cert_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == signing_key_cert_string[signing_key_cert_found] )
-        {
-          signing_key_cert_found++;
-        }
-        else
-        {
-          signing_key_cert_found = 0;
-        }
-
-        if ( signing_key_cert_found == strlen( signing_key_cert_string ) )
-        {
-          cert_start = i + 1;
-        }
-      }
-      else if ( end_key_cert_found < strlen( end_key_cert_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == end_key_cert_string[end_key_cert_found] )
-        {
-          end_key_cert_found++;
-        }
-        else
-        {
-          end_key_cert_found = 0;
-        }
-
-        if ( end_key_cert_found == strlen( end_key_cert_string ) )
-        {
-          unpacked_crosscert_length = ( i - cert_start - strlen( end_key_cert_string ) + 1 ) * 3 / 4;
-
-          if ( ( i - cert_start - strlen( end_key_cert_string ) + 1 ) % 4 != 0 )
-          {
-            unpacked_crosscert_length++;
-          }
-
-          unpacked_crosscert = malloc( unpacked_crosscert_length );
-
-          // adding 1 makes it the length, not the end positon
-          d_base_64_decode( unpacked_crosscert, circuit->client->hsdesc + cert_start, i - cert_start - strlen( end_key_cert_string ) + 1 );
-
-          if ( unpacked_crosscert->version != 1 )
-          {
-            free( unpacked_crosscert );
-            goto fail;
-          }
-
-          if ( unpacked_crosscert->cert_type != 8 )
-          {
-            free( unpacked_crosscert );
-            goto fail;
-          }
-
-          time( &now );
-
-          if ( unpacked_crosscert->epoch_hours < now / 60 / 60 )
-          {
-            free( unpacked_crosscert );
-            goto fail;
-          }
-
-          if ( unpacked_crosscert->cert_key_type != 1 )
-          {
-            free( unpacked_crosscert );
-            goto fail;
-          }
-
-          extension = unpacked_crosscert->extensions;
-
-          for ( j = 0; j < unpacked_crosscert->num_extensions; j++ )
-          {
-            if ( extension->ext_type != 4 )
-            {
-              extension = extension->ext_data + extension->ext_length;
-
-              continue;
-            }
-
-            if ( ntohs( extension->ext_length ) != ED25519_PUB_KEY_SIZE )
-            {
-              free( unpacked_crosscert );
-              goto fail;
-            }
-
-            idx = ED25519_PUB_KEY_SIZE;
-            succ = wc_ed25519_export_public( &( circuit->client->blinded_key ), blinded_pubkey, &idx );
-
-            if ( succ < 0 || idx != ED25519_PUB_KEY_SIZE )
-            {
-              MINITOR_LOG( CLIENT_TAG, "Failed to export blinded public key" );
-
-              free( unpacked_crosscert );
-              goto fail;
-            }
+    return 1;
+  }
 
-            if ( memcmp( extension->ext_data, blinded_pubkey, ED25519_PUB_KEY_SIZE ) != 0 )
-            {
-              free( unpacked_crosscert );
-              goto fail;
-            }
+  wc_ed25519_init( &descriptor_signing_key );
 
-            extension = extension->ext_data + ntohs( extension->ext_length );
-          }
+  idx = ED25519_PUB_KEY_SIZE;
+  succ = wc_ed25519_export_public( &( circuit->client->blinded_key ), blinded_pubkey, &idx );
 
-          // proves that this signing key was signed by the blinded private key holder
-          wolf_succ = wc_ed25519_verify_msg( (uint8_t*)extension, 64, (uint8_t*)unpacked_crosscert, (uint8_t*)extension - (uint8_t*)unpacked_crosscert, &succ, &( circuit->client->blinded_key ) );
+  if ( succ < 0 || idx != ED25519_PUB_KEY_SIZE )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to export blinded public key" );
 
-          if ( wolf_succ < 0 || succ == 0 )
-          {
-            MINITOR_LOG( CLIENT_TAG, "Failed to verify the outer layer ed crosscert signature, error code: %d", wolf_succ );
+    goto fail;
+  }
 
-            free( unpacked_crosscert );
-            goto fail;
-          }
+  if ( d_init_keyword_table( &keyword_table, hsdesc_keywords, HSDESC_KEYWORD_COUNT ) < 0 )
+  {
+    goto fail;
+  }
 
-          succ = wc_ed25519_import_public( unpacked_crosscert->certified_key, ED25519_PUB_KEY_SIZE, &descriptor_signing_key );
+  // the signature prefix is only there so the signed bytes are contiguous
+  v_init_memory_tokenizer( &tokenizer, (char*)circuit->client->hsdesc + HS_DESC_SIG_PREFIX_LENGTH, circuit->client->hsdesc_size - HS_DESC_SIG_PREFIX_LENGTH );
 
-          if ( succ < 0 )
-          {
-            free( unpacked_crosscert );
-            goto fail;
-          }
+  while ( signature_found == false && d_next_line( &tokenizer, &line ) == 1 )
+  {
+    switch ( d_match_keyword( &keyword_table, &line, &arguments ) )
+    {
+      case HSDESC_KEYWORD_VERSION:
+        version_found = b_token_equals( &arguments, "3" );
 
-          free( unpacked_crosscert );
-        }
-      }
-      else if ( revision_counter_found < strlen( revision_counter_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == revision_counter_string[revision_counter_found] )
-        {
-          revision_counter_found++;
-        }
-        else
-        {
-          revision_counter_found = 0;
-        }
+        break;
+      case HSDESC_KEYWORD_LIFETIME:
+        desc_lifetime = ul_token_to_number( &arguments ) * 60;
 
-        if ( revision_counter_found == strlen( revision_counter_string ) )
-        {
-          //revision_counter = atoi( circuit->client->hsdesc + i + 1 );
-          revision_counter = atol( circuit->client->hsdesc + i + 1 );
-        }
-      }
-      else if ( superencrypted_found < strlen( superencrypted_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == superencrypted_string[superencrypted_found] )
-        {
-          superencrypted_found++;
-        }
-        else
+        break;
+      case HSDESC_KEYWORD_SIGNING_KEY_CERT:
+        if (
+          d_next_object( &tokenizer, &object ) < 0 ||
+          d_verify_hsdesc_cert( &object, 8, &( circuit->client->blinded_key ), certified_key ) < 0 ||
+          wc_ed25519_import_public( certified_key, ED25519_PUB_KEY_SIZE, &descriptor_signing_key ) < 0
+        )
         {
-          superencrypted_found = 0;
-        }
+          MINITOR_LOG( CLIENT_TAG, "Failed to verify the descriptor signing key" );
 
-        if ( superencrypted_found == strlen( superencrypted_string ) )
-        {
-          superencrypted_start = i + 1;
-        }
-      }
-      else if ( end_message_found < strlen( end_message_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == end_message_string[end_message_found] )
-        {
-          end_message_found++;
-        }
-        else
-        {
-          end_message_found = 0;
+          goto fail;
         }
 
-        if ( end_message_found == strlen( end_message_string ) )
-        {
-          // TODO it seems our length is no good because the base64 string includes \n every so often
-          first_layer_length = ( i - strlen( end_message_string ) + 1 - superencrypted_start ) * 3 / 4;
+        signing_key_found = true;
 
-          if ( ( i - strlen( end_message_string ) + 1 - superencrypted_start ) % 4 != 0 )
-          {
-            first_layer_length++;
-          }
+        break;
+      case HSDESC_KEYWORD_REVISION_COUNTER:
+        revision_counter = ul_token_to_number( &arguments );
 
-          superencrypted_end = i - strlen( end_message_string ) + 1;
-        }
-      }
-      else if ( signature_found < strlen( signature_string ) )
-      {
-        if ( circuit->client->hsdesc[i] == signature_string[signature_found] )
-        {
-          signature_found++;
-        }
-        else
+        break;
+      case HSDESC_KEYWORD_SUPERENCRYPTED:
+        if ( d_next_object( &tokenizer, &superencrypted ) < 0 )
         {
-          signature_found = 0;
+          goto fail;
         }
 
-        if ( signature_found == strlen( signature_string ) )
-        {
-          d_base_64_decode( signature, circuit->client->hsdesc + i + 1, 86 );
+        superencrypted_found = true;
 
-          // proves that this hsdesc was signed by the descriptor signing key
-          wolf_succ = wc_ed25519_verify_msg( signature, 64, circuit->client->hsdesc, i - strlen( signature_string ) + 1, &succ, &descriptor_signing_key );
+        break;
+      case HSDESC_KEYWORD_SIGNATURE:
+        if ( arguments.length < 86 )
+        {
+          goto fail;
+        }
 
-          if ( wolf_succ < 0 || succ == 0 )
-          {
-            MINITOR_LOG( CLIENT_TAG, "Failed to verify the first_layer ed crosscert signature, error code: %d", wolf_succ );
+        d_base_64_decode( signature, (char*)arguments.data, 86 );
+        signed_length = (uint8_t*)line.data - circuit->client->hsdesc;
+        signature_found = true;
 
-            goto fail;
-          }
+        break;
+      default:
+        break;
+    }
+  }
 
-          first_layer_p = malloc( first_layer_length );
+  if ( version_found == false || signing_key_found == false || superencrypted_found == false || signature_found == false )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to find first layer" );
 
-          first_layer_length = d_base_64_decode( first_layer_p, circuit->client->hsdesc + superencrypted_start, superencrypted_end - superencrypted_start );
+    goto fail;
+  }
 
-          free( circuit->client->hsdesc );
-          circuit->client->hsdesc = NULL;
+  // proves that this hsdesc was signed by the descriptor signing key
+  wolf_succ = wc_ed25519_verify_msg( signature, 64, circuit->client->hsdesc, signed_length, &succ, &descriptor_signing_key );
 
-          succ = d_decrypt_descriptor_ciphertext(
-            first_layer_p,
-            first_layer_p,
-            first_layer_length,
-            circuit->client->onion_pubkey,
-            blinded_pubkey,
-            ED25519_PUB_KEY_SIZE,
-            "hsdir-superencrypted-data",
-            strlen( "hsdir-superencrypted-data" ),
-            revision_counter,
-            circuit->client->sub_credential
-          );
+  if ( wolf_succ < 0 || succ == 0 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to verify the first_layer ed crosscert signature, error code: %d", wolf_succ );
 
-          if ( succ < 0 )
-          {
-            MINITOR_LOG( CLIENT_TAG, "Failed to decrypt first_layer", wolf_succ );
+    goto fail;
+  }
 
-            free( first_layer_p );
-            goto fail;
-          }
+  first_layer_length = superencrypted.length * 3 / 4;
 
-          // skip the iv
-          first_layer = first_layer_p + 16;
+  if ( superencrypted.length % 4 != 0 )
+  {
+    first_layer_length++;
+  }
 
-          const char* encrypted_string = "encrypted\n-----BEGIN MESSAGE-----\n";
-          int encrypted_found = 0;
-          int encrypted_start = 0;
-          uint8_t* second_layer;
-          uint8_t* second_layer_p;
-          int second_layer_length;
+  first_layer_p = malloc( first_layer_length );
 
-          for ( i = 0; i < first_layer_length - 16; i++ )
-          {
-            // TODO implement auth keys
-            if ( encrypted_found < strlen( encrypted_string ) )
-            {
-              if ( first_layer[i] == encrypted_string[encrypted_found] )
-              {
-                encrypted_found++;
-              }
-              else
-              {
-                encrypted_found = 0;
-              }
-
-              if ( encrypted_found == strlen( encrypted_string ) )
-              {
-                encrypted_start = i + 1;
-                end_message_found = 0;
-              }
-            }
-            else if ( end_message_found < strlen( end_message_string ) )
-            {
-              if ( first_layer[i] == end_message_string[end_message_found] )
-              {
-                end_message_found++;
-              }
-              else
-              {
-                end_message_found = 0;
-              }
-
-              if ( end_message_found == strlen( end_message_string ) )
-              {
-                second_layer_length = ( i - strlen( end_message_string ) + 1 - encrypted_start ) * 3 / 4;
-
-                if ( ( i - strlen( end_message_string ) + 1 - encrypted_start ) % 4 != 0 )
-                {
-                  second_layer_length++;
-                }
-
-                second_layer_p = malloc( second_layer_length );
-
-                second_layer_length = d_base_64_decode( second_layer_p, first_layer + encrypted_start, i - strlen( end_message_string ) + 1 - encrypted_start );
-
-                free( first_layer_p );
-
-                succ = d_decrypt_descriptor_ciphertext(
-                  second_layer_p,
-                  second_layer_p,
-                  second_layer_length,
-                  circuit->client->onion_pubkey,
-                  blinded_pubkey,
-                  ED25519_PUB_KEY_SIZE,
-                  "hsdir-encrypted-data",
-                  strlen( "hsdir-encrypted-data" ),
-                  revision_counter,
-                  circuit->client->sub_credential
-                );
-
-                if ( succ < 0 )
-                {
-                  MINITOR_LOG( CLIENT_TAG, "Failed to decrypt second_layer", wolf_succ );
-
-                  free( second_layer_p );
-                  goto fail;
-                }
-
-                const char* formats_string = "create2-formats 2\n";
-                int formats_found = 0;
-                const char* intro_point_string = "introduction-point ";
-                int intro_point_found = 0;
-                const char* onion_key_string = "onion-key ntor ";
-                int onion_key_found = 0;
-                const char* auth_key_string = "auth-key\n-----BEGIN ED25519 CERT-----\n";
-                int auth_key_found = 0;
-                int auth_key_start = 0;
-                const char* enc_key_string = "enc-key ntor ";
-                int enc_key_found = 0;
-                uint8_t enc_pub_key[CURVE25519_KEYSIZE];
-                const char* enc_cert_string = "enc-key-cert\n-----BEGIN ED25519 CERT-----\n";
-                int enc_cert_found = 0;
-                int enc_cert_start = 0;
-                int enc_cert_end_found = 0;
-                uint8_t num_specifiers;
-                int link_specifiers_length;
-                int link_specifiers_start = 0;
-
-                uint8_t* link_specifiers_p;
-                LinkSpecifier* link_specifiers;
-
-                bool ipv4_spec_found = false;
-                bool legacy_spec_found = false;
-
-                // skip the iv
-                second_layer = second_layer_p + 16;
-
-                for ( i = 0; i < second_layer_length - 16; i++ )
-                {
-                  if ( formats_found < strlen( formats_string ) )
-                  {
-                    if ( second_layer[i] == formats_string[formats_found] )
-                    {
-                      formats_found++;
-                    }
-                    else
-                    {
-                      formats_found = 0;
-                    }
-                  }
-                  else if ( intro_point_found < strlen( intro_point_string ) )
-                  {
-                    if ( second_layer[i] == intro_point_string[intro_point_found] )
-                    {
-                      intro_point_found++;
-                    }
-                    else
-                    {
-                      intro_point_found = 0;
-                    }
-
-                    if ( intro_point_found == strlen( intro_point_string ) )
-                    {
-                      circuit->client->intro_relays[circuit->client->num_intro_relays] = malloc( sizeof( OnionRelay ) );
-                      circuit->client->intro_cryptos[circuit->client->num_intro_relays] = malloc( sizeof( IntroCrypto ) );
-
-                      memset( circuit->client->intro_relays[circuit->client->num_intro_relays], 0, sizeof( OnionRelay ) );
-                      memset( circuit->client->intro_cryptos[circuit->client->num_intro_relays], 0, sizeof( IntroCrypto ) );
-
-                      wc_ed25519_init( &circuit->client->intro_cryptos[circuit->client->num_intro_relays]->auth_key );
-                      wc_curve25519_init( &circuit->client->intro_cryptos[circuit->client->num_intro_relays]->encrypt_key );
-
-                      alloced_relays++;
-
-                      link_specifiers_start = i + 1;
-
-                      for ( ; i < second_layer_length; i++ )
-                      {
-                        if ( second_layer[i] == '\n' )
-                        {
-                          link_specifiers_length = i - link_specifiers_start * 3 / 4;
-
-                          if ( ( i - link_specifiers_start ) % 4 != 0 )
-                          {
-                            link_specifiers_length++;
-                          }
-
-                          link_specifiers_p = malloc( link_specifiers_length );
-
-                          d_base_64_decode( link_specifiers_p, second_layer + link_specifiers_start, i - link_specifiers_start );
-
-                          break;
-                        }
-                      }
-
-                      if ( i >= second_layer_length )
-                      {
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Failed to find link specifier" );
-
-                        goto cleanup_relays;
-                      }
-
-                      link_specifiers = link_specifiers_p;
-
-                      num_specifiers = ((uint8_t*)link_specifiers)[0];
-
-                      link_specifiers = (uint8_t*)link_specifiers + 1;
-
-                      for ( j = 0; j < num_specifiers; j++ )
-                      {
-                        if ( link_specifiers->type == IPv4Link )
-                        {
-                          if ( link_specifiers->length != 6 )
-                          {
-                            free( link_specifiers_p );
-                            free( second_layer_p );
-
-                            MINITOR_LOG( CLIENT_TAG, "Invalid ipv4 link specifier" );
-
-                            goto cleanup_relays;
-                          }
-
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->address = link_specifiers->specifier[0];
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->address |= (uint32_t)link_specifiers->specifier[1] << 8;
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->address |= (uint32_t)link_specifiers->specifier[2] << 16;
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->address |= (uint32_t)link_specifiers->specifier[3] << 24;
-
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->or_port = (uint32_t)link_specifiers->specifier[4] << 8;
-                          circuit->client->intro_relays[circuit->client->num_intro_relays]->or_port |= (uint32_t)link_specifiers->specifier[5];
-
-                          ipv4_spec_found = true;
-                        }
-                        else if ( link_specifiers->type == LEGACYLink )
-                        {
-                          if ( link_specifiers->length != ID_LENGTH )
-                          {
-                            free( link_specifiers_p );
-                            free( second_layer_p );
-
-                            MINITOR_LOG( CLIENT_TAG, "Invalid legacy link specifier" );
-
-                            goto cleanup_relays;
-                          }
-
-                          memcpy( circuit->client->intro_relays[circuit->client->num_intro_relays]->identity, link_specifiers->specifier, ID_LENGTH );
-
-                          legacy_spec_found = true;
-                        }
-
-                        link_specifiers = link_specifiers->specifier + link_specifiers->length;
-                      }
-
-                      if ( ipv4_spec_found == false || legacy_spec_found == false )
-                      {
-                        free( link_specifiers_p );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Failed to find both link specifiers" );
-
-                        goto cleanup_relays;
-                      }
-
-                      free( link_specifiers_p );
-                    }
-                  }
-                  else if ( onion_key_found < strlen( onion_key_string ) )
-                  {
-                    if ( second_layer[i] == onion_key_string[onion_key_found] )
-                    {
-                      onion_key_found++;
-                    }
-                    else
-                    {
-                      onion_key_found = 0;
-                    }
-
-                    if ( onion_key_found == strlen( onion_key_string ) )
-                    {
-                      d_base_64_decode( circuit->client->intro_relays[circuit->client->num_intro_relays]->ntor_onion_key, second_layer + i + 1, 43 );
-                    }
-                  }
-                  else if ( auth_key_found < strlen( auth_key_string ) )
-                  {
-                    if ( second_layer[i] == auth_key_string[auth_key_found] )
-                    {
-                      auth_key_found++;
-                    }
-                    else
-                    {
-                      auth_key_found = 0;
-                    }
-
-                    if ( auth_key_found == strlen( auth_key_string ) )
-                    {
-                      auth_key_start = i + 1;
-                      end_key_cert_found = 0;
-                    }
-                  }
-                  else if ( end_key_cert_found < strlen( end_key_cert_string ) )
-                  {
-                    if ( second_layer[i] == end_key_cert_string[end_key_cert_found] )
-                    {
-                      end_key_cert_found++;
-                    }
-                    else
-                    {
-                      end_key_cert_found = 0;
-                    }
-
-                    if ( end_key_cert_found == strlen( end_key_cert_string ) )
-                    {
-                      unpacked_crosscert_length = ( i - auth_key_start - strlen( end_key_cert_string ) + 1 ) * 3 / 4;
-
-                      if ( ( i - auth_key_start - strlen( end_key_cert_string ) + 1 ) % 4 != 0 )
-                      {
-                        unpacked_crosscert_length++;
-                      }
-
-                      unpacked_crosscert = malloc( unpacked_crosscert_length );
-
-                      d_base_64_decode( unpacked_crosscert, second_layer + auth_key_start, i - auth_key_start - strlen( end_key_cert_string ) + 1 );
+  first_layer_length = d_base_64_decode( first_layer_p, (char*)superencrypted.data, superencrypted.length );
 
-                      if ( unpacked_crosscert->version != 1 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid crosscert version" );
-
-                        goto cleanup_relays;
-                      }
-
-                      if ( unpacked_crosscert->cert_type != 9 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid crosscert type" );
-
-                        goto cleanup_relays;
-                      }
-
-                      time( &now );
-
-                      if ( unpacked_crosscert->epoch_hours < now / 60 / 60 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid crosscert epoch hours" );
-
-                        goto cleanup_relays;
-                      }
-
-                      if ( unpacked_crosscert->cert_key_type != 1 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid crosscert cert key type" );
-
-                        goto cleanup_relays;
-                      }
-
-                      extension = unpacked_crosscert->extensions;
-
-                      for ( j = 0; j < unpacked_crosscert->num_extensions; j++ )
-                      {
-                        if ( extension->ext_type != 4 )
-                        {
-                          extension = extension->ext_data + extension->ext_length;
-
-                          continue;
-                        }
-
-                        if ( ntohs( extension->ext_length ) != ED25519_PUB_KEY_SIZE )
-                        {
-                          free( unpacked_crosscert );
-                          free( second_layer_p );
-
-                          MINITOR_LOG( CLIENT_TAG, "Invalid crosscert ext length" );
-
-                          goto cleanup_relays;
-                        }
-
-                        if ( memcmp( extension->ext_data, descriptor_signing_key.p, ED25519_PUB_KEY_SIZE ) != 0 )
-                        {
-                          free( unpacked_crosscert );
-                          free( second_layer_p );
-
-                          MINITOR_LOG( CLIENT_TAG, "Invalid crosscert ext data" );
-
-                          goto cleanup_relays;
-                        }
-
-                        extension = extension->ext_data + ntohs( extension->ext_length );
-                      }
-
-                      // proves that this signing key was signed by the blinded private key holder
-                      wolf_succ = wc_ed25519_verify_msg( (uint8_t*)extension, 64, (uint8_t*)unpacked_crosscert, (uint8_t*)extension - (uint8_t*)unpacked_crosscert, &succ, &( descriptor_signing_key ) );
-
-                      if ( wolf_succ < 0 || succ == 0 )
-                      {
-                        MINITOR_LOG( CLIENT_TAG, "Failed to verify the ed crosscert signature, error code: %d", wolf_succ );
-
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
+  free( circuit->client->hsdesc );
+  circuit->client->hsdesc = NULL;
 
-                        goto cleanup_relays;
-                      }
+  succ = d_decrypt_descriptor_ciphertext(
+    first_layer_p,
+    first_layer_p,
+    first_layer_length,
+    circuit->client->onion_pubkey,
+    blinded_pubkey,
+    ED25519_PUB_KEY_SIZE,
+    "hsdir-superencrypted-data",
+    strlen( "hsdir-superencrypted-data" ),
+    revision_counter,
+    circuit->client->sub_credential
+  );
 
+  if ( succ < 0 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to decrypt first_layer" );
 
-                      if ( wc_ed25519_import_public( unpacked_crosscert->certified_key, ED25519_PUB_KEY_SIZE, &( circuit->client->intro_cryptos[circuit->client->num_intro_relays]->auth_key ) ) < 0 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
+    goto fail;
+  }
 
-                        MINITOR_LOG( CLIENT_TAG, "Failed to import auth key" );
+  // skip the iv
+  first_layer = first_layer_p + 16;
 
-                        goto cleanup_relays;
-                      }
+  // TODO implement auth keys
+  v_init_memory_tokenizer( &tokenizer, (char*)first_layer, first_layer_length - 16 );
 
-                      free( unpacked_crosscert );
-                    }
-                  }
-                  else if ( enc_key_found < strlen( enc_key_string ) )
-                  {
-                    if ( second_layer[i] == enc_key_string[enc_key_found] )
-                    {
-                      enc_key_found++;
-                    }
-                    else
-                    {
-                      enc_key_found = 0;
-                    }
+  while ( encrypted_found == false && d_next_line( &tokenizer, &line ) == 1 )
+  {
+    if ( b_token_equals( &line, "encrypted" ) && d_next_object( &tokenizer, &encrypted ) == 0 )
+    {
+      encrypted_found = true;
+    }
+  }
 
-                    if ( enc_key_found == strlen( enc_key_string ) )
-                    {
-                      d_base_64_decode( enc_pub_key, second_layer + i + 1, 43 );
+  if ( encrypted_found == false )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to find second layer" );
 
-                      if ( wc_curve25519_import_public_ex( enc_pub_key, CURVE25519_KEYSIZE, &( circuit->client->intro_cryptos[circuit->client->num_intro_relays]->encrypt_key ), EC25519_LITTLE_ENDIAN ) < 0 )
-                      {
-                        free( second_layer_p );
+    goto fail;
+  }
 
-                        MINITOR_LOG( CLIENT_TAG, "Failed to import encrypt key" );
+  second_layer_length = encrypted.length * 3 / 4;
 
-                        goto cleanup_relays;
-                      }
-                    }
-                  }
-                  else if ( enc_cert_found < strlen( enc_cert_string ) )
-                  {
-                    if ( second_layer[i] == enc_cert_string[enc_cert_found] )
-                    {
-                      enc_cert_found++;
-                    }
-                    else
-                    {
-                      enc_cert_found = 0;
-                    }
+  if ( encrypted.length % 4 != 0 )
+  {
+    second_layer_length++;
+  }
 
-                    if ( enc_cert_found == strlen( enc_cert_string ) )
-                    {
-                      enc_cert_start = i + 1;
-                      enc_cert_end_found = 0;
-                    }
-                  }
-                  else if ( enc_cert_end_found < strlen( end_key_cert_string ) )
-                  {
-                    if ( second_layer[i] == end_key_cert_string[enc_cert_end_found] )
-                    {
-                      enc_cert_end_found++;
-                    }
-                    else
-                    {
-                      enc_cert_end_found = 0;
-                    }
+  second_layer_p = malloc( second_layer_length );
 
-                    if ( enc_cert_end_found == strlen( end_key_cert_string ) )
-                    {
-                      unpacked_crosscert_length = ( i - enc_cert_start - strlen( end_key_cert_string ) + 1 ) * 3 / 4;
+  second_layer_length = d_base_64_decode( second_layer_p, (char*)encrypted.data, encrypted.length );
 
-                      if ( ( i - enc_cert_start - strlen( end_key_cert_string ) + 1 ) % 4 != 0 )
-                      {
-                        unpacked_crosscert_length++;
-                      }
-
-                      unpacked_crosscert = malloc( unpacked_crosscert_length );
+  free( first_layer_p );
+  first_layer_p = NULL;
 
-                      // adding 1 makes it the length, not the end positon
-                      d_base_64_decode( (uint8_t*)unpacked_crosscert, second_layer + enc_cert_start, i - enc_cert_start - strlen( end_key_cert_string ) + 1 );
+  succ = d_decrypt_descriptor_ciphertext(
+    second_layer_p,
+    second_layer_p,
+    second_layer_length,
+    circuit->client->onion_pubkey,
+    blinded_pubkey,
+    ED25519_PUB_KEY_SIZE,
+    "hsdir-encrypted-data",
+    strlen( "hsdir-encrypted-data" ),
+    revision_counter,
+    circuit->client->sub_credential
+  );
 
-                      if ( unpacked_crosscert->version != 1 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid croscert version" );
-
-                        goto cleanup_relays;
-                      }
-
-                      if ( unpacked_crosscert->cert_type != 11 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid croscert type" );
-
-                        goto cleanup_relays;
-                      }
-
-                      time( &now );
-
-                      if ( unpacked_crosscert->epoch_hours < now / 60 / 60 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid epoch hours" );
-
-                        goto cleanup_relays;
-                      }
-
-                      if ( unpacked_crosscert->cert_key_type != 1 )
-                      {
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-
-                        MINITOR_LOG( CLIENT_TAG, "Invalid cert key type" );
-
-                        goto cleanup_relays;
-                      }
+  if ( succ < 0 )
+  {
+    MINITOR_LOG( CLIENT_TAG, "Failed to decrypt second_layer" );
 
-                      extension = unpacked_crosscert->extensions;
+    goto fail;
+  }
 
-                      for ( j = 0; j < unpacked_crosscert->num_extensions; j++ )
-                      {
-                        if ( extension->ext_type != 4 )
-                        {
-                          extension = extension->ext_data + extension->ext_length;
+  // skip the iv
+  second_layer = second_layer_p + 16;
 
-                          continue;
-                        }
-
-                        if ( ntohs( extension->ext_length ) != ED25519_PUB_KEY_SIZE )
-                        {
-                          free( unpacked_crosscert );
-                          free( second_layer_p );
+  if ( d_init_keyword_table( &keyword_table, intro_keywords, INTRO_KEYWORD_COUNT ) < 0 )
+  {
+    goto fail;
+  }
 
-                          MINITOR_LOG( CLIENT_TAG, "Invalid ext length" );
+  v_init_memory_tokenizer( &tokenizer, (char*)second_layer, second_layer_length - 16 );
 
-                          goto cleanup_relays;
-                        }
+  while ( d_next_line( &tokenizer, &line ) == 1 )
+  {
+    idx = d_match_keyword( &keyword_table, &line, &arguments );
 
-                        if ( memcmp( extension->ext_data, descriptor_signing_key.p, ED25519_PUB_KEY_SIZE ) != 0 )
-                        {
-                          free( unpacked_crosscert );
-                          free( second_layer_p );
+    if ( idx == INTRO_KEYWORD_INTRODUCTION_POINT )
+    {
+      // we only want 3 intro points
+      if ( circuit->client->num_intro_relays >= 3 )
+      {
+        break;
+      }
 
-                          MINITOR_LOG( CLIENT_TAG, "Invalid ext data" );
+      // an intro point that never got its enc-key-cert is replaced
+      if ( alloced_relays == circuit->client->num_intro_relays )
+      {
+        circuit->client->intro_relays[circuit->client->num_intro_relays] = malloc( sizeof( OnionRelay ) );
+        circuit->client->intro_cryptos[circuit->client->num_intro_relays] = malloc( sizeof( IntroCrypto ) );
 
-                          goto cleanup_relays;
-                        }
+        memset( circuit->client->intro_cryptos[circuit->client->num_intro_relays], 0, sizeof( IntroCrypto ) );
 
-                        extension = extension->ext_data + ntohs( extension->ext_length );
-                      }
+        wc_ed25519_init( &circuit->client->intro_cryptos[circuit->client->num_intro_relays]->auth_key );
+        wc_curve25519_init( &circuit->client->intro_cryptos[circuit->client->num_intro_relays]->encrypt_key );
 
-                      // proves that this signing key was signed by the blinded private key holder
-                      wolf_succ = wc_ed25519_verify_msg( (uint8_t*)extension, 64, (uint8_t*)unpacked_crosscert, (uint8_t*)extension - (uint8_t*)unpacked_crosscert, &succ, &descriptor_signing_key );
+        alloced_relays++;
+      }
 
-                      if ( wolf_succ < 0 || succ == 0 )
-                      {
-                        MINITOR_LOG( CLIENT_TAG, "Failed to verify the ed crosscert signature, error code: %d", wolf_succ );
+      memset( circuit->client->intro_relays[circuit->client->num_intro_relays], 0, sizeof( OnionRelay ) );
 
-                        free( unpacked_crosscert );
-                        free( second_layer_p );
-                        goto cleanup_relays;
-                      }
+      if ( d_parse_intro_link_specifiers( circuit->client->intro_relays[circuit->client->num_intro_relays], &arguments ) < 0 )
+      {
+        goto cleanup_relays;
+      }
 
+      continue;
+    }
 
-                      /*
-                      // TODO figure out what to do with the certified key
-                      if ( wc_ed25519_import_public_ex( unpacked_crosscert->certified_key, ED25519_PUB_KEY_SIZE, &TODO, EC25519_LITTLE_ENDIAN ) < 0 )
-                      {
-                        goto fail;
-                      }
-                      */
+    // the rest of the keywords belong to the intro point being parsed
+    if ( idx < 0 || alloced_relays == circuit->client->num_intro_relays )
+    {
+      continue;
+    }
 
-                      free( unpacked_crosscert );
+    intro_relay = circuit->client->intro_relays[circuit->client->num_intro_relays];
+    intro_crypto = circuit->client->intro_cryptos[circuit->client->num_intro_relays];
 
-                      circuit->client->num_intro_relays++;
+    switch ( idx )
+    {
+      case INTRO_KEYWORD_ONION_KEY:
+        if ( b_next_token( &arguments, &key_type ) && b_token_equals( &key_type, "ntor" ) && b_next_token( &arguments, &key ) && key.length >= 43 )
+        {
+          d_base_64_decode( intro_relay->ntor_onion_key, (char*)key.data, 43 );
+        }
 
-                      intro_point_found = 0;
-                      onion_key_found = 0;
-                      auth_key_found = 0;
-                      end_key_cert_found = 0;
-                      enc_key_found = 0;
-                      enc_cert_found = 0;
-                      enc_cert_end_found = 0;
+        break;
+      case INTRO_KEYWORD_AUTH_KEY:
+        if (
+          d_next_object( &tokenizer, &object ) < 0 ||
+          d_verify_hsdesc_cert( &object, 9, &descriptor_signing_key, certified_key ) < 0
+        )
+        {
+          goto cleanup_relays;
+        }
 
-                      // we only want 3 intro points
-                      if ( circuit->client->num_intro_relays >= 3 )
-                      {
-                        break;
-                      }
-                    }
-                  }
-                }
+        if ( wc_ed25519_import_public( certified_key, ED25519_PUB_KEY_SIZE, &( intro_crypto->auth_key ) ) < 0 )
+        {
+          MINITOR_LOG( CLIENT_TAG, "Failed to import auth key" );
 
-                free( second_layer_p );
+          goto cleanup_relays;
+        }
 
-                if ( circuit->client->num_intro_relays > 0 )
-                {
-                  MINITOR_FILL_RANDOM( circuit->client->rendezvous_cookie, 20 );
+        break;
+      case INTRO_KEYWORD_ENC_KEY:
+        if ( b_next_token( &arguments, &key_type ) && b_token_equals( &key_type, "ntor" ) && b_next_token( &arguments, &key ) && key.length >= 43 )
+        {
+          d_base_64_decode( enc_pub_key, (char*)key.data, 43 );
 
-                  v_send_init_circuit_internal( 3, CIRCUIT_CLIENT_INTRO, NULL, circuit->client, 0, 0, NULL, circuit->client->intro_relays[0], NULL, circuit->client->intro_cryptos[0] );
+          if ( wc_curve25519_import_public_ex( enc_pub_key, CURVE25519_KEYSIZE, &( intro_crypto->encrypt_key ), EC25519_LITTLE_ENDIAN ) < 0 )
+          {
+            MINITOR_LOG( CLIENT_TAG, "Failed to import encrypt key" );
 
-                  // relay now belongs to the circuit, don't free
-                  circuit->client->intro_relays[0] = NULL;
-                  circuit->client->intro_cryptos[0] = NULL;
+            goto cleanup_relays;
+          }
+        }
 
-                  wc_ed25519_free( &descriptor_signing_key );
+        break;
+      // TODO figure out what to do with the certified key
+      case INTRO_KEYWORD_ENC_KEY_CERT:
+        if (
+          d_next_object( &tokenizer, &object ) < 0 ||
+          d_verify_hsdesc_cert( &object, 11, &descriptor_signing_key, certified_key ) < 0
+        )
+        {
+          goto cleanup_relays;
+        }
 
-                  return 0;
-                }
+        // the enc-key-cert closes out the intro point
+        circuit->client->num_intro_relays++;
 
-                MINITOR_LOG( CLIENT_TAG, "Failed to find intro relays" );
+        break;
+      default:
+        break;
+    }
+  }
 
-                goto cleanup_relays;
-              }
-            }
-          }
+  free( second_layer_p );
+  second_layer_p = NULL;
 
-          free( first_layer_p );
+  if ( circuit->client->num_intro_relays > 0 )
+  {
+    MINITOR_FILL_RANDOM( circuit->client->rendezvous_cookie, 20 );
 
-          MINITOR_LOG( CLIENT_TAG, "Failed to find second layer" );
+    v_send_init_circuit_internal( 3, CIRCUIT_CLIENT_INTRO, NULL, circuit->client, 0, 0, NULL, circuit->client->intro_relays[0], NULL, circuit->client->intro_cryptos[0] );
 
-          goto fail;
-        }
-      }
-    }
+    // relay now belongs to the circuit, don't free
+    circuit->client->intro_relays[0] = NULL;
+    circuit->client->intro_cryptos[0] = NULL;
 
-    MINITOR_LOG( CLIENT_TAG, "Failed to find first layer" );
+    wc_ed25519_free( &descriptor_signing_key );
 
-    goto fail;
+    return 0;
   }
 
-  return 1;
+  MINITOR_LOG( CLIENT_TAG, "Failed to find intro relays" );
 
 cleanup_relays:
   for ( i = 0; i < alloced_relays; i++ )
@@ -1706,6 +1427,9 @@ cleanup_relays:
 fail:
   wc_ed25519_free( &descriptor_signing_key );
 
+  free( first_layer_p );
+  free( second_layer_p );
+
   circuit->client->hsdesc_header_finish_found = 0;
   circuit->client->hsdesc_ok_found = 0;
   circuit->client->hsdesc_content_length = 0;
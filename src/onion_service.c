@@ -17,6 +17,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include "../include/config.h"
+#include "../include/minitor_service.h"
 #include "../h/port.h"
 
 #include "wolfssl/options.h"
@@ -72,9 +73,59 @@ void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection*
   }
 }
 
+static int d_send_stream_sendmes( OnionCircuit* circuit, DlConnection* or_connection, uint16_t stream_id, int count )
+{
+  int i;
+  Cell* sendme_cell;
+
+  for ( i = 0; i < count; i++ )
+  {
+    sendme_cell = malloc( MINITOR_CELL_LEN );
+
+    sendme_cell->circ_id = circuit->circ_id;
+    sendme_cell->command = RELAY;
+
+    sendme_cell->payload.relay.relay_command = RELAY_SENDME;
+    sendme_cell->payload.relay.recognized = 0;
+    sendme_cell->payload.relay.stream_id = stream_id;
+    sendme_cell->payload.relay.digest = 0;
+    sendme_cell->payload.relay.length = 0;
+
+    sendme_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE;
+
+    if ( d_send_relay_cell_and_free( or_connection, sendme_cell, &circuit->relay_list, circuit->hs_crypto ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to send stream RELAY_SENDME" );
+
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// the local backend drained some of its queue, withheld SENDMEs may go out now
+void v_onion_service_handle_local_writable( OnionCircuit* circuit, DlConnection* or_connection, ServiceTcpTraffic* tcp_traffic )
+{
+  int sendmes;
+
+  sendmes = d_flush_local_connection( tcp_traffic->circ_id, tcp_traffic->stream_id );
+
+  // a broken backend shows up as a read error in its handler, which ends the stream
+  if ( sendmes < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to flush local connection" );
+
+    return;
+  }
+
+  d_send_stream_sendmes( circuit, or_connection, tcp_traffic->stream_id, sendmes );
+}
+
 // at this point we have a lock on the connection access mutex
 void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell )
 {
+  int sendmes;
   MinitorMutex access_mutex;
 
   access_mutex = connection_access_mutex[or_connection->mutex_index];
@@ -103,15 +154,14 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 
       break;
     case RELAY_DATA:
-      if
-      (
-        d_forward_to_local_connection(
-          relay_cell->circ_id,
-          relay_cell->payload.relay.stream_id,
-          relay_cell->payload.relay.data,
-          relay_cell->payload.relay.length
-        ) < 0
-      )
+      sendmes = d_forward_to_local_connection(
+        relay_cell->circ_id,
+        relay_cell->payload.relay.stream_id,
+        relay_cell->payload.relay.data,
+        relay_cell->payload.relay.length
+      );
+
+      if ( sendmes < 0 || d_send_stream_sendmes( circuit, or_connection, relay_cell->payload.relay.stream_id, sendmes ) < 0 )
       {
         MINITOR_LOG( MINITOR_TAG, "Failed to handle RELAY_DATA cell" );
 
@@ -125,7 +175,7 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 
       access_mutex = NULL;
 
-      v_cleanup_local_connection( relay_cell->circ_id, relay_cell->payload.relay.stream_id );
+      v_end_local_connection( relay_cell->circ_id, relay_cell->payload.relay.stream_id );
 
       break;
     case RELAY_TRUNCATED:
@@ -151,6 +201,14 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 
       access_mutex = NULL;
 
+      circuit->intro_crypto->introductions++;
+      circuit->service->intro_window_count++;
+
+      if ( circuit->intro_crypto->introductions >= circuit->service->intro_max_introductions )
+      {
+        v_retire_intro_circuit( circuit );
+      }
+
       if ( d_onion_service_handle_introduce_2( circuit, relay_cell ) < 0 )
       {
         MINITOR_LOG( MINITOR_TAG, "Failed to handle RELAY_COMMAND_INTRODUCE2 cell" );
@@ -179,13 +237,117 @@ circuit_rebuild:
   // MUTEX GIVE
 }
 
+// healthy backends first, ejected ones only once every healthy one refused,
+// tried marks the backends this stream already failed on
+static LocalBackend* px_select_backend( OnionService* service, bool* tried )
+{
+  int i;
+  int pass;
+  int index;
+  int best_index = 0;
+  LocalBackend* backend;
+  LocalBackend* best = NULL;
+
+  for ( pass = 0; pass < 2 && best == NULL; pass++ )
+  {
+    for ( i = 0; i < service->backend_count; i++ )
+    {
+      index = ( service->backend_next + i ) % service->backend_count;
+      backend = &service->backends[index];
+
+      if ( tried[index] == true || ( pass == 0 && atomic_load( &backend->healthy ) == false ) )
+      {
+        continue;
+      }
+
+      if ( best == NULL || atomic_load( &backend->active_streams ) < atomic_load( &best->active_streams ) )
+      {
+        best = backend;
+        best_index = index;
+      }
+
+      if ( service->backend_policy == MINITOR_BACKEND_ROUND_ROBIN )
+      {
+        break;
+      }
+    }
+  }
+
+  if ( best != NULL )
+  {
+    tried[best_index] = true;
+    service->backend_next = ( best_index + 1 ) % service->backend_count;
+  }
+
+  return best;
+}
+
+// picks a backend for the stream and starts connecting to it, a backend that
+// refuses outright is ejected and the next one tried, the stream's handler
+// task reports back once the connect finishes
+static int d_connect_stream_backend( OnionService* service, uint32_t circ_id, uint16_t stream_id, bool* tried )
+{
+  LocalBackend* backend;
+
+  while ( ( backend = px_select_backend( service, tried ) ) != NULL )
+  {
+    if ( d_create_local_connection( circ_id, stream_id, backend, tried ) == 0 )
+    {
+      return 0;
+    }
+
+    if ( atomic_exchange( &backend->healthy, false ) == true )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Backend %d refused a stream, ejecting it", (int)( backend - service->backends ) );
+    }
+  }
+
+  return -1;
+}
+
+// health check task, probes every backend so a dead one is ejected before a
+// stream lands on it and an ejected one comes back once it accepts again
+void v_check_service_backends( void* pv_parameters )
+{
+  int i;
+  int sock_fd;
+  OnionService* service = pv_parameters;
+  LocalBackend* backend;
+
+  for ( i = 0; i < service->backend_count; i++ )
+  {
+    backend = &service->backends[i];
+
+    sock_fd = d_connect_local_backend( backend, LOCAL_BACKEND_CONNECT_TIMEOUT_MS );
+
+    if ( sock_fd >= 0 )
+    {
+      shutdown( sock_fd, 0 );
+      close( sock_fd );
+
+      if ( atomic_exchange( &backend->healthy, true ) == false )
+      {
+        MINITOR_LOG( MINITOR_TAG, "Backend %d is accepting again", i );
+      }
+    }
+    else if ( atomic_exchange( &backend->healthy, false ) == true )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Backend %d failed its health check, ejecting it", i );
+    }
+  }
+
+  atomic_store( &service->backends_checking, false );
+
+  MINITOR_TASK_DELETE( NULL );
+}
+
 int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* begin_cell )
 {
   int i;
   int ret = 0;
-  Cell* connected_cell;
   char* addr;
   uint16_t port = 0;
+  bool tried[HS_MAX_BACKENDS] = { false };
 
   addr = malloc( strlen( (char*)begin_cell->payload.relay.data ) + 1 );
 
@@ -220,50 +382,93 @@ int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection
     goto finish;
   }
 
-  if ( d_create_local_connection( begin_cell->circ_id, begin_cell->payload.relay.stream_id, rend_circuit->service->local_port ) < 0 )
+  // RELAY_CONNECTED goes out once the handler task finishes the connect
+  if ( d_connect_stream_backend( rend_circuit->service, begin_cell->circ_id, begin_cell->payload.relay.stream_id, tried ) < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "couldn't create local connection" );
 
     ret = -1;
-    goto finish;
   }
 
-  // re-aquire our connection lock
-  // MUTEX TAKE
-  or_connection = px_get_conn_by_id_and_lock( or_connection->conn_id );
+finish:
+  free( addr );
 
-  if ( or_connection == NULL )
+  return ret;
+}
+
+// a stream's connect to its backend finished, answer the RELAY_BEGIN or move
+// on to the next backend
+void v_onion_service_handle_local_connected( OnionCircuit* circuit, ServiceTcpTraffic* tcp_traffic )
+{
+  bool tried[HS_MAX_BACKENDS];
+  Cell* relay_cell;
+  LocalBackend* backend;
+  DlConnection* or_connection;
+
+  relay_cell = malloc( MINITOR_CELL_LEN );
+
+  relay_cell->circ_id = tcp_traffic->circ_id;
+  relay_cell->command = RELAY;
+
+  relay_cell->payload.relay.recognized = 0;
+  relay_cell->payload.relay.stream_id = tcp_traffic->stream_id;
+  relay_cell->payload.relay.digest = 0;
+
+  if ( tcp_traffic->length == 0 )
   {
-    ret = -1;
-    goto finish;
-  }
+    backend = px_fail_local_connection( tcp_traffic->circ_id, tcp_traffic->stream_id, tried );
+
+    // the stream was torn down while connecting
+    if ( backend == NULL )
+    {
+      free( relay_cell );
+
+      return;
+    }
+
+    if ( atomic_exchange( &backend->healthy, false ) == true )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Backend %d didn't accept a stream, ejecting it", (int)( backend - circuit->service->backends ) );
+    }
 
-  connected_cell = malloc( MINITOR_CELL_LEN );
+    if ( d_connect_stream_backend( circuit->service, tcp_traffic->circ_id, tcp_traffic->stream_id, tried ) == 0 )
+    {
+      free( relay_cell );
 
-  connected_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE;
-  connected_cell->circ_id = begin_cell->circ_id;
-  connected_cell->command = RELAY;
+      return;
+    }
 
-  connected_cell->payload.relay.relay_command = RELAY_CONNECTED;
-  connected_cell->payload.relay.recognized = 0;
-  connected_cell->payload.relay.stream_id = begin_cell->payload.relay.stream_id;
-  connected_cell->payload.relay.digest = 0;
-  connected_cell->payload.relay.length = 0;
+    MINITOR_LOG( MINITOR_TAG, "couldn't create local connection" );
 
-  if ( d_send_relay_cell_and_free( or_connection, connected_cell, &rend_circuit->relay_list, rend_circuit->hs_crypto ) < 0 )
+    relay_cell->payload.relay.relay_command = RELAY_END;
+    relay_cell->payload.relay.length = 1;
+    relay_cell->payload.relay.destroy_code = REASON_CONNECTREFUSED;
+  }
+  else
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to send RELAY_CONNECTED" );
+    relay_cell->payload.relay.relay_command = RELAY_CONNECTED;
+    relay_cell->payload.relay.length = 0;
+  }
 
-    ret = -1;
+  relay_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + relay_cell->payload.relay.length;
+
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( circuit->conn_id );
+
+  if ( or_connection == NULL )
+  {
+    free( relay_cell );
+
+    return;
+  }
+
+  if ( d_send_relay_cell_and_free( or_connection, relay_cell, &circuit->relay_list, circuit->hs_crypto ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to answer RELAY_BEGIN" );
   }
 
   MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
   // MUTEX GIVE
-
-finish:
-  free( addr );
-
-  return ret;
 }
 
 int d_onion_service_handle_relay_truncated( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* truncated_cell )
@@ -288,6 +493,127 @@ int d_onion_service_handle_relay_truncated( OnionCircuit* rend_circuit, DlConnec
   return 0;
 }
 
+static bool b_replay_slot_empty( uint8_t* slot )
+{
+  int i;
+
+  for ( i = 0; i < REPLAY_DIGEST_LENGTH; i++ )
+  {
+    if ( slot[i] != 0 )
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// keyed so a client can't pick cookies that all land in one probe chain
+static void v_replay_digest( ReplayCache* cache, uint8_t* data, int length, uint8_t* digest )
+{
+  wc_Sha3 reusable_sha3;
+  uint8_t reusable_sha3_sum[WC_SHA3_256_DIGEST_SIZE];
+
+  wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
+
+  wc_Sha3_256_Update( &reusable_sha3, cache->key, REPLAY_DIGEST_LENGTH );
+  wc_Sha3_256_Update( &reusable_sha3, data, length );
+  wc_Sha3_256_Final( &reusable_sha3, reusable_sha3_sum );
+
+  wc_Sha3_256_Free( &reusable_sha3 );
+
+  memcpy( digest, reusable_sha3_sum, REPLAY_DIGEST_LENGTH );
+}
+
+static void v_rotate_replay_cache( ReplayCache* cache, time_t now )
+{
+  int i;
+  int rotations;
+
+  if ( cache->bucket_start == 0 )
+  {
+    MINITOR_FILL_RANDOM( cache->key, REPLAY_DIGEST_LENGTH );
+    cache->bucket_start = now;
+
+    return;
+  }
+
+  rotations = ( now - cache->bucket_start ) / REPLAY_CACHE_BUCKET_SECONDS;
+
+  if ( rotations == 0 && cache->counts[cache->current] >= REPLAY_CACHE_SLOTS / 4 * 3 )
+  {
+    rotations = 1;
+  }
+
+  if ( rotations > REPLAY_CACHE_BUCKETS )
+  {
+    rotations = REPLAY_CACHE_BUCKETS;
+  }
+
+  for ( i = 0; i < rotations; i++ )
+  {
+    cache->current = ( cache->current + 1 ) % REPLAY_CACHE_BUCKETS;
+    cache->counts[cache->current] = 0;
+    memset( cache->slots[cache->current], 0, sizeof( cache->slots[cache->current] ) );
+  }
+
+  if ( rotations > 0 )
+  {
+    cache->bucket_start = now;
+  }
+}
+
+// fills digest for a later v_add_replay
+static bool b_replay_seen( ReplayCache* cache, uint8_t* data, int length, uint8_t* digest, time_t now )
+{
+  int i;
+  int b;
+  uint32_t slot;
+
+  v_rotate_replay_cache( cache, now );
+  v_replay_digest( cache, data, length, digest );
+
+  for ( b = 0; b < REPLAY_CACHE_BUCKETS; b++ )
+  {
+    slot = ( (uint32_t)digest[0] | (uint32_t)digest[1] << 8 ) & ( REPLAY_CACHE_SLOTS - 1 );
+
+    // buckets never fill, so every chain ends in an empty slot
+    for ( i = 0; i < REPLAY_CACHE_SLOTS; i++ )
+    {
+      if ( b_replay_slot_empty( cache->slots[b][slot] ) )
+      {
+        break;
+      }
+
+      if ( memcmp( cache->slots[b][slot], digest, REPLAY_DIGEST_LENGTH ) == 0 )
+      {
+        return true;
+      }
+
+      slot = ( slot + 1 ) & ( REPLAY_CACHE_SLOTS - 1 );
+    }
+  }
+
+  return false;
+}
+
+static void v_add_replay( ReplayCache* cache, uint8_t* digest, time_t now )
+{
+  uint32_t slot;
+
+  v_rotate_replay_cache( cache, now );
+
+  slot = ( (uint32_t)digest[0] | (uint32_t)digest[1] << 8 ) & ( REPLAY_CACHE_SLOTS - 1 );
+
+  while ( !b_replay_slot_empty( cache->slots[cache->current][slot] ) )
+  {
+    slot = ( slot + 1 ) & ( REPLAY_CACHE_SLOTS - 1 );
+  }
+
+  memcpy( cache->slots[cache->current][slot], digest, REPLAY_DIGEST_LENGTH );
+  cache->counts[cache->current]++;
+}
+
 int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* introduce_cell )
 {
   int ret = 0;
@@ -302,13 +628,17 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   WC_RNG rng;
   curve25519_key hs_handshake_key;
   curve25519_key client_handshake_key;
-  DoublyLinkedRendezvousCookie* db_rendezvous_cookie;
+  uint8_t intro_digest[REPLAY_DIGEST_LENGTH];
+  uint8_t cookie_digest[REPLAY_DIGEST_LENGTH];
+  uint8_t rendezvous_cookie[20];
   OnionRelay* rend_relay;
   HsCrypto* hs_crypto;
   OnionCircuit* rend_circuit;
   DoublyLinkedOnionRelay* dl_relay;
   DlConnection* or_connection = NULL;
+  uint32_t intro_ms;
 
+  intro_ms = MINITOR_GET_TIME_MS();
   time( &now );
 
   if ( now - intro_circuit->service->rend_timestamp < 5 )
@@ -376,6 +706,14 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   // skip past the client_pk
   introduce_p += PK_PUBKEY_LEN;
 
+  // a replayed encrypted section is dropped before paying for the handshake
+  if ( b_replay_seen( &intro_circuit->service->intro_replays, introduce_p, introduce_cell->payload.relay.data + introduce_cell->payload.relay.length - introduce_p, intro_digest, now ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Got a replay, silently dropping" );
+
+    goto finish;
+  }
+
   // verify and decrypt
   if ( d_verify_and_decrypt_introduce_2( intro_circuit->service, introduce_cell, num_extensions, client_pk, introduce_p, intro_circuit, &client_handshake_key ) < 0 )
   {
@@ -385,26 +723,19 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
     goto finish;
   }
 
-  db_rendezvous_cookie = intro_circuit->service->rendezvous_cookies.head;
+  v_add_replay( &intro_circuit->service->intro_replays, intro_digest, now );
 
-  for ( i = 0; i < intro_circuit->service->rendezvous_cookies.length; i++ )
-  {
-    if ( memcmp( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 ) == 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Got a replay, silently dropping" );
+  // copy rendezvous cookie
+  memcpy( rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 );
 
-      goto finish;
-    }
+  if ( b_replay_seen( &intro_circuit->service->cookie_replays, rendezvous_cookie, 20, cookie_digest, now ) )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Got a replayed rendezvous cookie, silently dropping" );
 
-    db_rendezvous_cookie = db_rendezvous_cookie->next;
+    goto finish;
   }
 
-  db_rendezvous_cookie = malloc( sizeof( DoublyLinkedRendezvousCookie ) );
-
-  // copy rendezvous cookie
-  memcpy( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 );
-
-  v_add_rendezvous_cookie_to_list( db_rendezvous_cookie, &intro_circuit->service->rendezvous_cookies );
+  v_add_replay( &intro_circuit->service->cookie_replays, cookie_digest, now );
 
   wolf_succ = wc_curve25519_make_key( &rng, 32, &hs_handshake_key );
 
@@ -491,31 +822,44 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
     introduce_p += ((LinkSpecifier*)introduce_p)->length + 2;
   }
 
-  // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
-
-  rend_circuit = onion_circuits;
+  rend_circuit = NULL;
 
-  while ( rend_circuit != NULL )
+  if ( intro_circuit->service->single_onion == false )
   {
-    if ( rend_circuit->status == CIRCUIT_STANDBY )
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+    rend_circuit = onion_circuits;
+
+    while ( rend_circuit != NULL )
     {
-      break;
+      if ( rend_circuit->status == CIRCUIT_STANDBY && rend_circuit->service == intro_circuit->service )
+      {
+        break;
+      }
+
+      rend_circuit = rend_circuit->next;
     }
 
-    rend_circuit = rend_circuit->next;
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
   }
 
-  MINITOR_MUTEX_GIVE( circuits_mutex );
-  // MUTEX GIVE
-
-  memcpy( hs_crypto->rendezvous_cookie, db_rendezvous_cookie->rendezvous_cookie, 20 );
+  memcpy( hs_crypto->rendezvous_cookie, rendezvous_cookie, 20 );
   memcpy( hs_crypto->point, hs_handshake_key.p.point, PK_PUBKEY_LEN );
   memcpy( hs_crypto->auth_input_mac, auth_input_mac, MAC_LEN );
+  hs_crypto->intro_ms = intro_ms;
 
-  if ( rend_circuit == NULL )
+  if ( intro_circuit->service->single_onion == true )
+  {
+    v_send_init_circuit_internal( SINGLE_ONION_CIRCUIT_LENGTH, CIRCUIT_RENDEZVOUS, intro_circuit->service, NULL, 0, 0, NULL, rend_relay, hs_crypto, NULL );
+  }
+  // the pool ran dry, build the whole path
+  else if ( rend_circuit == NULL )
   {
-    v_send_init_circuit_internal( 2, CIRCUIT_RENDEZVOUS, intro_circuit->service, NULL, 0, 0, NULL, rend_relay, hs_crypto, NULL );
+    MINITOR_LOG( MINITOR_TAG, "Rendezvous pool empty, building a full circuit" );
+
+    v_send_init_circuit_internal( REND_STEM_LENGTH + 1, CIRCUIT_RENDEZVOUS, intro_circuit->service, NULL, 0, 0, NULL, rend_relay, hs_crypto, NULL );
   }
   else
   {
@@ -569,6 +913,8 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
 
   time( &( intro_circuit->service->rend_timestamp ) );
 
+  v_fill_rend_pool( intro_circuit->service );
+
 finish:
   wc_FreeRng( &rng );
 
@@ -609,18 +955,60 @@ int d_router_join_rendezvous( OnionCircuit* rend_circuit, DlConnection* or_conne
   return 0;
 }
 
-int d_verify_and_decrypt_introduce_2(
-  OnionService* onion_service,
-  Cell* introduce_cell,
-  uint8_t num_extensions,
-  uint8_t* client_pk,
-  uint8_t* encrypted_data,
-  OnionCircuit* intro_circuit,
-  curve25519_key* client_handshake_key
-)
+void v_record_rend_latency( OnionService* service, uint32_t latency_ms )
 {
-  int ret = 0;
-  int i;
+  service->rend_latencies[service->rend_latency_next] = latency_ms;
+  service->rend_latency_next = ( service->rend_latency_next + 1 ) % REND_LATENCY_SAMPLES;
+
+  if ( service->rend_latency_count < REND_LATENCY_SAMPLES )
+  {
+    service->rend_latency_count++;
+  }
+}
+
+static int d_compare_latency( const void* a, const void* b )
+{
+  uint32_t left = *(const uint32_t*)a;
+  uint32_t right = *(const uint32_t*)b;
+
+  return ( left > right ) - ( left < right );
+}
+
+// p50 and p99 over the recorded INTRODUCE2 to RENDEZVOUS1 latencies
+void v_log_rend_latency( OnionService* service )
+{
+  uint32_t sorted[REND_LATENCY_SAMPLES];
+
+  if ( service->rend_latency_count == 0 )
+  {
+    return;
+  }
+
+  memcpy( sorted, service->rend_latencies, sizeof( uint32_t ) * service->rend_latency_count );
+  qsort( sorted, service->rend_latency_count, sizeof( uint32_t ), d_compare_latency );
+
+  MINITOR_LOG(
+    MINITOR_TAG,
+    "Rendezvous latency over the last %d: p50 %u ms, p99 %u ms, intro rate %d per minute",
+    service->rend_latency_count,
+    sorted[( service->rend_latency_count - 1 ) / 2],
+    sorted[( service->rend_latency_count - 1 ) * 99 / 100],
+    service->intro_rate
+  );
+}
+
+int d_verify_and_decrypt_introduce_2(
+  OnionService* onion_service,
+  Cell* introduce_cell,
+  uint8_t num_extensions,
+  uint8_t* client_pk,
+  uint8_t* encrypted_data,
+  OnionCircuit* intro_circuit,
+  curve25519_key* client_handshake_key
+)
+{
+  int ret = 0;
+  int i;
   int encrypted_length;
   unsigned int idx;
   int wolf_succ;
@@ -941,7 +1329,7 @@ finish:
   return ret;
 }
 
-DoublyLinkedOnionRelayList* px_get_target_relays( unsigned int hsdir_n_replicas, unsigned char* blinded_pub_key, int time_period, unsigned int hsdir_interval, unsigned int hsdir_spread_store, int next )
+DoublyLinkedOnionRelayList* px_get_target_relays( HsDirRing* hsdir_ring, unsigned int hsdir_n_replicas, unsigned char* blinded_pub_key, int time_period, unsigned int hsdir_interval, unsigned int hsdir_spread_store, int next )
 {
   int i;
   int j;
@@ -1006,7 +1394,7 @@ DoublyLinkedOnionRelayList* px_get_target_relays( unsigned int hsdir_n_replicas,
 
     to_store = hsdir_spread_store;
 
-    hsdir_index_list = px_get_responsible_hsdir_relays_by_hs_index( hs_index, hsdir_spread_store, next, target_relays );
+    hsdir_index_list = px_get_responsible_hsdir_relays_by_hs_index( hsdir_ring, hs_index, hsdir_spread_store, next, target_relays );
 
     if ( hsdir_index_list == NULL )
     {
@@ -1059,258 +1447,227 @@ cleanup:
   return target_relays;
 }
 
-int d_generate_outer_descriptor( char* filename, ed25519_key* descriptor_signing_key, long int valid_after, ed25519_key* blinded_key, int revision_counter )
+void v_retain_hs_descriptor( HsDescriptor* hs_desc )
 {
-  int ret = 0;
-  int cipher_fd;
-  uint8_t cipher_buff[255];
-  char plain_file[60];
-  int plain_fd;
-  char plain_buff[340];
-  unsigned int idx;
-  int succ;
-  int write_len;
-  int wolf_succ;
-  char revision_counter_str[32];
-  unsigned char tmp_signature[64];
-  char tmp_buff[187];
-
-  const char* outer_layer_template_0 =
-    "hs-descriptor 3\n"
-    "descriptor-lifetime 180\n"
-    "descriptor-signing-key-cert\n"
-    "-----BEGIN ED25519 CERT-----\n"
-    ;
-  const char* outer_layer_template_1 =
-    "-----END ED25519 CERT-----\n"
-    "revision-counter "
-    ;
-  const char* outer_layer_template_2 =
-    "\nsuperencrypted\n"
-    "-----BEGIN MESSAGE-----\n"
-    ;
-  const char* outer_layer_template_3 =
-    "-----END MESSAGE-----\n"
-    ;
-  const char* outer_layer_template_4 =
-    "signature "
-    ;
-
-  sprintf( revision_counter_str, "%d", revision_counter );
-
-  sprintf( plain_file, "%s_plain", filename );
-
-  plain_fd = open( plain_file, O_CREAT | O_RDWR | O_TRUNC, 0600 );
-
-  if ( plain_fd < 0 )
+  if ( hs_desc != NULL )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", plain_file );
-
-    return -1;
+    atomic_fetch_add( &hs_desc->references, 1 );
   }
+}
 
-  cipher_fd = open( filename, O_RDONLY );
-
-  if ( cipher_fd < 0 )
+void v_release_hs_descriptor( HsDescriptor* hs_desc )
+{
+  if ( hs_desc != NULL && atomic_fetch_sub( &hs_desc->references, 1 ) == 1 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", filename );
-
-    close( plain_fd );
-
-    return -1;
+    free( hs_desc->data );
+    free( hs_desc );
   }
+}
 
-  succ = write( plain_fd, HS_DESC_SIG_PREFIX, HS_DESC_SIG_PREFIX_LENGTH );
+// grows the arena by length bytes and returns the offset of the new space,
+// any pointer into the arena is invalid after this
+static int d_reserve_hs_desc_arena( HsDescArena* arena, int length )
+{
+  int offset;
+  int capacity;
+  uint8_t* data;
 
-  if ( succ != HS_DESC_SIG_PREFIX_LENGTH )
+  if ( arena->length + length > arena->capacity )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+    capacity = arena->capacity == 0 ? HS_DESC_ARENA_SIZE : arena->capacity;
 
-    ret = -1;
-    goto finish;
-  }
+    while ( arena->length + length > capacity )
+    {
+      capacity *= 2;
+    }
 
-  succ = write( plain_fd, outer_layer_template_0, strlen( outer_layer_template_0 ) );
+    data = realloc( arena->data, capacity );
 
-  if ( succ != strlen( outer_layer_template_0 ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+    if ( data == NULL )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to grow descriptor arena to %d", capacity );
 
-    ret = -1;
-    goto finish;
+      return -1;
+    }
+
+    arena->data = data;
+    arena->capacity = capacity;
   }
 
-  if ( d_generate_packed_crosscert( tmp_buff, descriptor_signing_key->p, blinded_key, 0x08, 1, valid_after ) < 0 ) {
-    MINITOR_LOG( MINITOR_TAG, "Failed to generate the auth_key cross cert" );
+  offset = arena->length;
+  arena->length += length;
 
-    ret = -1;
-    goto finish;
-  }
+  return offset;
+}
 
-  succ = write( plain_fd, tmp_buff, 187 );
+static int d_append_hs_desc_arena( HsDescArena* arena, const void* data, int length )
+{
+  int offset = d_reserve_hs_desc_arena( arena, length );
 
-  if ( succ != 187 )
+  if ( offset < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  succ = write( plain_fd, outer_layer_template_1, strlen( outer_layer_template_1 ) );
+  memcpy( arena->data + offset, data, length );
 
-  if ( succ != strlen( outer_layer_template_1 ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+  return 0;
+}
 
-    ret = -1;
-    goto finish;
-  }
+static int d_append_hs_desc_string( HsDescArena* arena, const char* string )
+{
+  return d_append_hs_desc_arena( arena, string, strlen( string ) );
+}
 
-  succ = write( plain_fd, revision_counter_str, strlen( revision_counter_str ) );
+// base64 encodes an earlier part of the arena onto its end, unpadded and
+// unwrapped like the rest of our descriptors
+static int d_append_hs_desc_base_64( HsDescArena* arena, int source_offset, int source_length )
+{
+  int offset = d_reserve_hs_desc_arena( arena, ( source_length * 4 + 2 ) / 3 );
 
-  if ( succ != strlen( revision_counter_str ) )
+  if ( offset < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  succ = write( plain_fd, outer_layer_template_2, strlen( outer_layer_template_2 ) );
+  v_base_64_encode( (char*)arena->data + offset, arena->data + source_offset, source_length );
 
-  if ( succ != strlen( outer_layer_template_2 ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+  return 0;
+}
 
-    ret = -1;
-    goto finish;
-  }
+void v_free_hs_desc_arena( HsDescArena* arena )
+{
+  free( arena->data );
+  memset( arena, 0, sizeof( HsDescArena ) );
+}
+
+// moves the outer layer at offset to the front of the arena and hands the
+// arena's buffer to a new descriptor, the arena is left empty
+HsDescriptor* px_finish_hs_descriptor( HsDescArena* arena, int offset )
+{
+  uint8_t* data;
+  HsDescriptor* hs_desc = malloc( sizeof( HsDescriptor ) );
 
-  do
+  if ( hs_desc == NULL )
   {
-    succ = read( cipher_fd, cipher_buff, sizeof( cipher_buff ) );
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate descriptor" );
 
-    if ( succ == 0 )
-    {
-      break;
-    }
+    return NULL;
+  }
 
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read %s", filename );
+  memmove( arena->data, arena->data + offset, arena->length - offset );
 
-      ret = -1;
-      goto finish;
-    }
+  atomic_init( &hs_desc->references, 1 );
+  hs_desc->length = arena->length - offset;
+  hs_desc->data = arena->data;
 
-    // WARNING, cipher buff must be 255 in length
-    // to encode in 4:3 ratio without padding some bits
-    // for example if we used 256 plain buff would be filled
-    // to 342 bytes and would include padding bits which is not
-    // acceptable in the middle of a base64 encoded value,
-    // only on the end. thus the only reason this works is because
-    // only the last read will have non 255 length
-    v_base_64_encode( plain_buff, cipher_buff, succ );
+  // the inner layers are dead, give their space back
+  data = realloc( arena->data, hs_desc->length );
 
-    write_len = succ * 4 / 3;
+  if ( data != NULL )
+  {
+    hs_desc->data = data;
+  }
 
-    if ( succ % 3 != 0 )
-    {
-      write_len++;
-    }
+  memset( arena, 0, sizeof( HsDescArena ) );
 
-    succ = write( plain_fd, plain_buff, write_len );
+  return hs_desc;
+}
 
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+// appends the signed outer document wrapping the encrypted first layer
+// that starts at cipher_offset, returns the offset the document starts at
+int d_generate_outer_descriptor( HsDescArena* arena, int cipher_offset, ed25519_key* descriptor_signing_key, long int valid_after, ed25519_key* blinded_key, int revision_counter )
+{
+  int offset;
+  int cipher_length;
+  unsigned int idx;
+  int wolf_succ;
+  char revision_counter_str[32];
+  unsigned char tmp_signature[64];
+  char tmp_buff[187];
 
-      ret = -1;
-      goto finish;
-    }
-  } while ( succ == sizeof( plain_buff ) );
+  const char* outer_layer_template_0 =
+    "hs-descriptor 3\n"
+    "descriptor-lifetime 180\n"
+    "descriptor-signing-key-cert\n"
+    "-----BEGIN ED25519 CERT-----\n"
+    ;
+  const char* outer_layer_template_1 =
+    "-----END ED25519 CERT-----\n"
+    "revision-counter "
+    ;
+  const char* outer_layer_template_2 =
+    "\nsuperencrypted\n"
+    "-----BEGIN MESSAGE-----\n"
+    ;
+  const char* outer_layer_template_3 =
+    "-----END MESSAGE-----\n"
+    ;
+  const char* outer_layer_template_4 =
+    "signature "
+    ;
 
-  succ = write( plain_fd, outer_layer_template_3, strlen( outer_layer_template_3 ) );
+  sprintf( revision_counter_str, "%d", revision_counter );
 
-  if ( succ != strlen( outer_layer_template_3 ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+  if ( d_generate_packed_crosscert( tmp_buff, descriptor_signing_key->p, blinded_key, 0x08, 1, valid_after ) < 0 ) {
+    MINITOR_LOG( MINITOR_TAG, "Failed to generate the auth_key cross cert" );
 
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  idx = ED25519_SIG_SIZE;
-  wolf_succ = ed25519_sign_msg_custom( plain_fd, tmp_signature, &idx, descriptor_signing_key );
+  cipher_length = arena->length - cipher_offset;
+  offset = arena->length;
 
-  if ( wolf_succ < 0 || idx != ED25519_SIG_SIZE )
+  if (
+    d_append_hs_desc_string( arena, HS_DESC_SIG_PREFIX ) < 0 ||
+    d_append_hs_desc_string( arena, outer_layer_template_0 ) < 0 ||
+    d_append_hs_desc_arena( arena, tmp_buff, 187 ) < 0 ||
+    d_append_hs_desc_string( arena, outer_layer_template_1 ) < 0 ||
+    d_append_hs_desc_string( arena, revision_counter_str ) < 0 ||
+    d_append_hs_desc_string( arena, outer_layer_template_2 ) < 0
+  )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to sign the outer descriptor, error code: %d", wolf_succ );
-
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  v_base_64_encode( tmp_buff, tmp_signature, 64 );
-
-  succ = write( plain_fd, outer_layer_template_4, strlen( outer_layer_template_4 ) );
-
-  if ( succ != strlen( outer_layer_template_4 ) )
+  // the cipher text is still right where the first layer was encrypted
+  if (
+    d_append_hs_desc_base_64( arena, cipher_offset, cipher_length ) < 0 ||
+    d_append_hs_desc_string( arena, outer_layer_template_3 ) < 0
+  )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  succ = write( plain_fd, tmp_buff, 86 );
+  // the signature covers the prefix and everything up to here
+  idx = ED25519_SIG_SIZE;
+  wolf_succ = wc_ed25519_sign_msg( arena->data + offset, arena->length - offset, tmp_signature, &idx, descriptor_signing_key );
 
-  if ( succ != 86 )
+  if ( wolf_succ < 0 || idx != ED25519_SIG_SIZE )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
+    MINITOR_LOG( MINITOR_TAG, "Failed to sign the outer descriptor, error code: %d", wolf_succ );
 
-    ret = -1;
+    return -1;
   }
 
-finish:
-  close( plain_fd );
-  close( cipher_fd );
+  v_base_64_encode( tmp_buff, tmp_signature, 64 );
 
-  if ( ret >= 0 )
+  if (
+    d_append_hs_desc_string( arena, outer_layer_template_4 ) < 0 ||
+    d_append_hs_desc_arena( arena, tmp_buff, 86 ) < 0
+  )
   {
-    succ = unlink( filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink %s, errno: %d", filename, errno );
-
-      return -1;
-    }
-
-    succ = rename( plain_file, filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename first plaintext" );
-
-      return -1;
-    }
+    return -1;
   }
 
-  return ret;
+  return offset;
 }
 
-int d_generate_first_plaintext( char* filename )
+// appends the first layer plaintext wrapping the encrypted second layer
+// that starts at cipher_offset, returns the offset the layer starts at
+int d_generate_first_plaintext( HsDescArena* arena, int cipher_offset )
 {
-  int ret = 0;
-  int succ;
-  int write_len;
-  int cipher_fd;
-  uint8_t cipher_buff[255];
-  int plain_fd;
-  char plain_buff[340];
-  char plain_file[60];
+  int ret;
   int i;
   wc_Sha3 reusable_sha3;
   unsigned char reusable_sha3_sum[WC_SHA3_256_DIGEST_SIZE];
@@ -1332,36 +1689,12 @@ int d_generate_first_plaintext( char* filename )
     "-----END MESSAGE-----"
     ;
 
-  sprintf( plain_file, "%s_plain", filename );
-
-  plain_fd = open( plain_file, O_CREAT | O_WRONLY | O_TRUNC, 0600 );
-
-  if ( plain_fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", plain_file );
-
-    return -1;
-  }
-
-  cipher_fd = open( filename, O_RDONLY );
-
-  if ( cipher_fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", filename );
-
-    close( plain_fd );
-
-    return -1;
-  }
+  ret = arena->length;
 
   wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
 
-  succ = write( plain_fd, first_layer_template, strlen( first_layer_template ) );
-
-  if ( succ != strlen( first_layer_template ) )
+  if ( d_append_hs_desc_string( arena, first_layer_template ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
     ret = -1;
     goto finish;
   }
@@ -1372,28 +1705,14 @@ int d_generate_first_plaintext( char* filename )
   v_base_64_encode( tmp_buff, reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
   tmp_buff[43] = '\n';
 
-  succ = write( plain_fd, tmp_buff, 44 );
-
-  if ( succ != 44 )
+  if ( d_append_hs_desc_arena( arena, tmp_buff, 44 ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
     ret = -1;
     goto finish;
   }
 
   for ( i = 0; i < 16; i++ )
   {
-    succ = write( plain_fd, auth_client_template, strlen( auth_client_template ) );
-
-    if ( succ != strlen( auth_client_template ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-      ret = -1;
-      goto finish;
-    }
-
     MINITOR_FILL_RANDOM( reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
     wc_Sha3_256_Update( &reusable_sha3, reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
     wc_Sha3_256_Final( &reusable_sha3, reusable_sha3_sum );
@@ -1412,154 +1731,68 @@ int d_generate_first_plaintext( char* filename )
     v_base_64_encode( tmp_buff + 35, reusable_sha3_sum, 16 );
     tmp_buff[57] = '\n';
 
-    succ = write( plain_fd, tmp_buff, sizeof( tmp_buff ) );
-
-    if ( succ != sizeof( tmp_buff ) )
+    if (
+      d_append_hs_desc_string( arena, auth_client_template ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, sizeof( tmp_buff ) ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
       ret = -1;
       goto finish;
     }
   }
 
-  succ = write( plain_fd, begin_encrypted, strlen( begin_encrypted ) );
-
-  if ( succ != strlen( begin_encrypted ) )
+  if ( d_append_hs_desc_string( arena, begin_encrypted ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
     ret = -1;
     goto finish;
   }
 
-  do
+  // encode straight out of the second layer's cipher text, it sits between
+  // cipher_offset and where this layer started
+  if (
+    d_append_hs_desc_base_64( arena, cipher_offset, ret - cipher_offset ) < 0 ||
+    d_append_hs_desc_string( arena, end_encrypted ) < 0
+  )
   {
-    succ = read( cipher_fd, cipher_buff, sizeof( cipher_buff ) );
-
-    if ( succ == 0 )
-    {
-      break;
-    }
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
+    ret = -1;
+  }
 
-    // WARNING, cipher buff must be 255 in length
-    // to encode in 4:3 ratio without padding some bits
-    // for example if we used 256 plain buff would be filled
-    // to 342 bytes and would include padding bits which is not
-    // acceptable in the middle of a base64 encoded value,
-    // only on the end. thus the only reason this works is because
-    // only the last read will have non 255 length
-    v_base_64_encode( plain_buff, cipher_buff, succ );
+finish:
+  wc_Sha3_256_Free( &reusable_sha3 );
 
-    write_len = succ * 4 / 3;
+  return ret;
+}
 
-    if ( succ % 3 != 0 )
-    {
-      write_len++;
-    }
-
-    succ = write( plain_fd, plain_buff, write_len );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-      ret = -1;
-      goto finish;
-    }
-  } while ( succ == sizeof( plain_buff ) );
-
-  succ = write( plain_fd, end_encrypted, strlen( end_encrypted ) );
-
-  if ( succ != strlen( end_encrypted ) )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", plain_file );
-
-    ret = -1;
-  }
-
-finish:
-  close( plain_fd );
-  close( cipher_fd );
-
-  if ( ret >= 0 )
-  {
-    succ = unlink( filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink %s, errno: %d", filename, errno );
-
-      return -1;
-    }
-
-    succ = rename( plain_file, filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename first plaintext" );
-
-      return -1;
-    }
-  }
-
-  wc_Sha3_256_Free( &reusable_sha3 );
-
-  return ret;
-}
-
-int d_encrypt_descriptor_plaintext( char* filename, unsigned char* secret_data, int secret_data_length, const char* string_constant, int string_constant_length, unsigned char* sub_credential, int64_t revision_counter )
+// encrypts the layer from offset to the end of the arena in place, the salt
+// goes in front of it and the mac after it
+int d_encrypt_descriptor_plaintext( HsDescArena* arena, int offset, unsigned char* secret_data, int secret_data_length, const char* string_constant, int string_constant_length, unsigned char* sub_credential, int64_t revision_counter )
 {
   int ret = 0;
-  int cipher_fd;
-  uint8_t cipher_buff[256];
-  int plain_fd;
-  char plain_buff[256];
-  int succ;
+  int plain_length;
   int wolf_succ;
   int64_t reusable_length;
   unsigned char reusable_length_buffer[8];
   unsigned char salt[16];
   unsigned char* secret_input = malloc( sizeof( unsigned char ) * ( secret_data_length + WC_SHA3_256_DIGEST_SIZE + sizeof( int64_t ) ) );
+  uint8_t* layer;
   wc_Sha3 reusable_sha3;
   wc_Shake reusable_shake;
   unsigned char reusable_sha3_sum[WC_SHA3_256_DIGEST_SIZE];
   unsigned char keys[AES_256_KEY_SIZE + AES_IV_SIZE + WC_SHA3_256_DIGEST_SIZE];
   Aes reusable_aes_key;
-  char cipher_file[60];
-
-  sprintf( cipher_file, "%s_cipher", filename );
 
-  cipher_fd = open( cipher_file, O_CREAT | O_WRONLY | O_TRUNC, 0600 );
+  plain_length = arena->length - offset;
 
-  if ( cipher_fd < 0 )
+  // room for the salt and mac, then slide the plaintext past the salt
+  if ( d_reserve_hs_desc_arena( arena, 16 + WC_SHA3_256_DIGEST_SIZE ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", cipher_file );
-
     free( secret_input );
 
     return -1;
   }
 
-  plain_fd = open( filename, O_RDONLY );
-
-  if ( plain_fd < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", filename );
-
-    free( secret_input );
-    close( cipher_fd );
-
-    return -1;
-  }
+  layer = arena->data + offset;
+  memmove( layer + 16, layer, plain_length );
 
   wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
   wc_InitShake256( &reusable_shake, NULL, INVALID_DEVID );
@@ -1587,15 +1820,7 @@ int d_encrypt_descriptor_plaintext( char* filename, unsigned char* secret_data,
   wc_Shake256_Update( &reusable_shake, (unsigned char*)string_constant, string_constant_length );
   wc_Shake256_Final( &reusable_shake, keys, sizeof( keys ) );
 
-  succ = write( cipher_fd, salt, 16 );
-
-  if ( succ != 16 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", cipher_file );
-
-    ret = -1;
-    goto finish;
-  }
+  memcpy( layer, salt, 16 );
 
   reusable_length = WC_SHA256_DIGEST_SIZE;
   reusable_length_buffer[0] = (unsigned char)( reusable_length >> 56 );
@@ -1625,58 +1850,20 @@ int d_encrypt_descriptor_plaintext( char* filename, unsigned char* secret_data,
 
   wc_AesSetKeyDirect( &reusable_aes_key, keys, AES_256_KEY_SIZE, keys + AES_256_KEY_SIZE, AES_ENCRYPTION );
 
-  do
-  {
-    succ = read( plain_fd, plain_buff, sizeof( plain_buff ) );
-
-    if ( succ == 0 )
-    {
-      break;
-    }
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
-    wolf_succ = wc_AesCtrEncrypt( &reusable_aes_key, cipher_buff, (uint8_t*)plain_buff, succ );
-
-    if ( wolf_succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to encrypt descriptor plaintext, error code: %d", wolf_succ );
-
-      ret = -1;
-      goto finish;
-    }
-
-    wc_Sha3_256_Update( &reusable_sha3, cipher_buff, succ );
-
-    succ = write( cipher_fd, cipher_buff, succ );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", cipher_file );
-
-      ret = -1;
-      goto finish;
-    }
-  } while ( succ == sizeof( cipher_buff ) );
-
-  wc_Sha3_256_Final( &reusable_sha3, reusable_sha3_sum );
-
-  succ = write( cipher_fd, reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
+  // ctr mode is happy to encrypt in place
+  wolf_succ = wc_AesCtrEncrypt( &reusable_aes_key, layer + 16, layer + 16, plain_length );
 
-  if ( succ != WC_SHA3_256_DIGEST_SIZE )
+  if ( wolf_succ < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", cipher_file );
+    MINITOR_LOG( MINITOR_TAG, "Failed to encrypt descriptor plaintext, error code: %d", wolf_succ );
 
     ret = -1;
     goto finish;
   }
 
+  wc_Sha3_256_Update( &reusable_sha3, layer + 16, plain_length );
+  wc_Sha3_256_Final( &reusable_sha3, layer + 16 + plain_length );
+
 finish:
   wc_Sha3_256_Free( &reusable_sha3 );
   wc_Shake256_Free( &reusable_shake );
@@ -1684,49 +1871,23 @@ finish:
 
   free( secret_input );
 
-  close( cipher_fd );
-  close( plain_fd );
-
-  if ( ret >= 0 )
-  {
-    succ = unlink( filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to unlink %s, errno: %d", filename, errno );
-
-      return -1;
-    }
-
-    succ = rename( cipher_file, filename );
-
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to rename cipher file %s to %s, errno: %d", cipher_file, filename, errno );
-
-      return -1;
-    }
-  }
-
   return ret;
 }
 
-int d_generate_second_plaintext( char* filename, OnionCircuit** intro_circuits, long int valid_after, ed25519_key* descriptor_signing_key )
+// appends the second layer plaintext listing our intro points
+int d_generate_second_plaintext( HsDescArena* arena, OnionCircuit** intro_circuits, int intro_count, bool single_onion, long int valid_after, ed25519_key* descriptor_signing_key )
 {
-  int ret = 0;
-  int fd;
   int i;
   unsigned int idx;
-  int succ;
   int wolf_succ;
   unsigned char packed_link_specifiers[1 + 4 + 6 + ID_LENGTH];
   unsigned char tmp_pub_key[CURVE25519_KEYSIZE];
-  unsigned char* working_second_layer;
   char tmp_buff[187];
 
   const char* formats_s =
     "create2-formats 2\n"
     ;
+  const char* single_onion_s = "single-onion-service\n";
   const char* intro_point_s = "introduction-point ";
   const char* onion_key_s = "onion-key ntor ";
   const char* auth_key_s = "auth-key\n";
@@ -1735,97 +1896,44 @@ int d_generate_second_plaintext( char* filename, OnionCircuit** intro_circuits,
   const char* begin_ed_s = "-----BEGIN ED25519 CERT-----\n";
   const char* end_ed_s = "-----END ED25519 CERT-----\n";
 
-  fd = open( filename, O_CREAT | O_WRONLY | O_TRUNC, 0600 );
-
-  if ( fd < 0 )
+  if ( d_append_hs_desc_string( arena, formats_s ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s", filename );
-
     return -1;
   }
 
-  succ = write( fd, formats_s, strlen( formats_s ) );
-
-  if ( succ != strlen( formats_s ) )
+  if ( single_onion == true && d_append_hs_desc_string( arena, single_onion_s ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  for ( i = 0; i < 3; i++ )
+  for ( i = 0; i < intro_count; i++ )
   {
     // write intro point
-    succ = write( fd, intro_point_s, strlen( intro_point_s ) );
-
-    if ( succ != strlen( intro_point_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
     v_generate_packed_link_specifiers( intro_circuits[i]->relay_list.tail->relay, packed_link_specifiers );
     v_base_64_encode( tmp_buff, packed_link_specifiers, sizeof( packed_link_specifiers ) );
     tmp_buff[42] = '\n';
 
-    succ = write( fd, tmp_buff, 43 );
-
-    if ( succ != 43 )
+    if (
+      d_append_hs_desc_string( arena, intro_point_s ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, 43 ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     // write onion key
-    succ = write( fd, onion_key_s, strlen( onion_key_s ) );
-
-    if ( succ != strlen( onion_key_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
     v_base_64_encode( tmp_buff, intro_circuits[i]->relay_list.tail->relay->ntor_onion_key, H_LENGTH );
     tmp_buff[43] = '\n';
 
-    succ = write( fd, tmp_buff, 44 );
-
-    if ( succ != 44 )
+    if (
+      d_append_hs_desc_string( arena, onion_key_s ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, 44 ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     // write auth key and cert
-    succ = write( fd, auth_key_s, strlen( auth_key_s ) );
-
-    if ( succ != strlen( auth_key_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
-    succ = write( fd, begin_ed_s, strlen( begin_ed_s ) );
-
-    if ( succ != strlen( begin_ed_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
     idx = ED25519_PUB_KEY_SIZE;
     wolf_succ = wc_ed25519_export_public( &intro_circuits[i]->intro_crypto->auth_key, tmp_pub_key, &idx );
 
@@ -1833,49 +1941,27 @@ int d_generate_second_plaintext( char* filename, OnionCircuit** intro_circuits,
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to export intro circuit auth key, error code: %d", wolf_succ );
 
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     if ( d_generate_packed_crosscert( tmp_buff, tmp_pub_key, descriptor_signing_key, 0x09, 1, valid_after ) < 0 )
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to generate the auth_key cross cert" );
 
-      ret = -1;
-      goto finish;
-    }
-
-    succ = write( fd, tmp_buff, 187 );
-
-    if ( succ != 187 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
-    succ = write( fd, end_ed_s, strlen( end_ed_s ) );
-
-    if ( succ != strlen( end_ed_s ) )
+    if (
+      d_append_hs_desc_string( arena, auth_key_s ) < 0 ||
+      d_append_hs_desc_string( arena, begin_ed_s ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, 187 ) < 0 ||
+      d_append_hs_desc_string( arena, end_ed_s ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     // write enc ntor
-    succ = write( fd, enc_ntor_s, strlen( enc_ntor_s ) );
-
-    if ( succ != strlen( enc_ntor_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
     idx = CURVE25519_KEYSIZE;
     wolf_succ = wc_curve25519_export_public_ex( &intro_circuits[i]->intro_crypto->encrypt_key, tmp_pub_key, &idx, EC25519_LITTLE_ENDIAN );
 
@@ -1883,79 +1969,42 @@ int d_generate_second_plaintext( char* filename, OnionCircuit** intro_circuits,
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to export intro encrypt key, error code: %d", wolf_succ );
 
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     v_base_64_encode( tmp_buff, tmp_pub_key, CURVE25519_KEYSIZE );
     tmp_buff[43] = '\n';
 
-    succ = write( fd, tmp_buff, 44 );
-
-    if ( succ != 44 )
+    if (
+      d_append_hs_desc_string( arena, enc_ntor_s ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, 44 ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
     // write enc key and cert
-    succ = write( fd, enc_cert_s, strlen( enc_cert_s ) );
-
-    if ( succ != strlen( enc_cert_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
-    succ = write( fd, begin_ed_s, strlen( begin_ed_s ) );
-
-    if ( succ != strlen( begin_ed_s ) )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
-    }
-
     v_ed_pubkey_from_curve_pubkey( tmp_pub_key, intro_circuits[i]->intro_crypto->encrypt_key.p.point, 0 );
 
     if ( d_generate_packed_crosscert( tmp_buff, tmp_pub_key, descriptor_signing_key, 0x0B, 1, valid_after ) < 0 )
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to generate the enc-key cross cert" );
 
-      ret = -1;
-      goto finish;
-    }
-
-    succ = write( fd, tmp_buff, 187 );
-
-    if ( succ != 187 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
 
-    succ = write( fd, end_ed_s, strlen( end_ed_s ) );
-
-    if ( succ != strlen( end_ed_s ) )
+    if (
+      d_append_hs_desc_string( arena, enc_cert_s ) < 0 ||
+      d_append_hs_desc_string( arena, begin_ed_s ) < 0 ||
+      d_append_hs_desc_arena( arena, tmp_buff, 187 ) < 0 ||
+      d_append_hs_desc_string( arena, end_ed_s ) < 0
+    )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to write %s", filename );
-
-      ret = -1;
-      goto finish;
+      return -1;
     }
   }
 
-finish:
-  close( fd );
-
-  return ret;
+  return 0;
 }
 
 void v_generate_packed_link_specifiers( OnionRelay* relay, unsigned char* packed_link_specifiers )
@@ -2089,6 +2138,9 @@ int d_router_establish_intro( OnionCircuit* circuit, DlConnection* or_connection
   wc_ed25519_make_key( &rng, 32, &circuit->intro_crypto->auth_key );
   wc_curve25519_make_key( &rng, 32, &circuit->intro_crypto->encrypt_key );
 
+  circuit->intro_crypto->state = INTRO_ACTIVE;
+  circuit->intro_crypto->introductions = 0;
+
   wc_FreeRng( &rng );
 
   idx = ED25519_PUB_KEY_SIZE;
@@ -2606,46 +2658,31 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
     "Content-Length: %s"
     "\r\n\r\n"
     ;
-  //int total_tx_length = 0;
-  int tx_limit;
   char content_length[11] = { 0 };
   int http_header_length;
   int descriptor_length;
-  //unsigned char* descriptor_text = publish_circuit->service->hs_descs[publish_circuit->desc_index] + HS_DESC_SIG_PREFIX_LENGTH;
-  int desc_fd;
-  char desc_buff[RELAY_PAYLOAD_LEN];
+  int chunk_length;
+  uint8_t* descriptor_text;
+  HsDescriptor* hs_desc;
   Cell* data_cell;
-  int succ;
 
-  desc_fd = open( publish_circuit->service->hs_descs[publish_circuit->desc_index], O_RDONLY );
+  hs_desc = publish_circuit->service->hs_descs[publish_circuit->desc_index];
 
-  if ( desc_fd < 0 )
+  if ( hs_desc == NULL )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to open %s for onion service, errno: %d", publish_circuit->service->hs_descs[publish_circuit->desc_index], errno );
+    MINITOR_LOG( MINITOR_TAG, "No descriptor %d to post for onion service", publish_circuit->desc_index );
 
     return -1;
   }
 
-  descriptor_length = lseek( desc_fd, 0, SEEK_END ) - HS_DESC_SIG_PREFIX_LENGTH;
-
-  if ( descriptor_length < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to seek %s for onion service, errno: %d", publish_circuit->service->hs_descs[publish_circuit->desc_index], errno );
+  // a republish can replace the service's descriptor while we're sending
+  v_retain_hs_descriptor( hs_desc );
 
-    ret = -1;
-    goto finish;
-  }
+  descriptor_text = hs_desc->data + HS_DESC_SIG_PREFIX_LENGTH;
+  descriptor_length = hs_desc->length - HS_DESC_SIG_PREFIX_LENGTH;
 
   sprintf( content_length, "%d", descriptor_length );
 
-  if ( lseek( desc_fd, HS_DESC_SIG_PREFIX_LENGTH, SEEK_SET ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to seek %s for onion service, errno: %d", publish_circuit->service->hs_descs[publish_circuit->desc_index], errno );
-
-    ret = -1;
-    goto finish;
-  }
-
   ipv4_string = pc_ipv4_to_string( publish_circuit->relay_list.head->relay->address );
 
   REQUEST = malloc( sizeof( char ) * ( strlen( REQUEST_CONST ) + strlen( ipv4_string ) + strlen( content_length ) ) );
@@ -2654,6 +2691,16 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
 
   free( ipv4_string );
 
+  http_header_length = strlen( REQUEST );
+
+  // the first cell carries the http header and the start of the descriptor
+  chunk_length = RELAY_PAYLOAD_LEN - http_header_length;
+
+  if ( chunk_length > descriptor_length )
+  {
+    chunk_length = descriptor_length;
+  }
+
   data_cell = malloc( MINITOR_CELL_LEN );
 
   data_cell->command = RELAY;
@@ -2663,28 +2710,15 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
   data_cell->payload.relay.recognized = 0;
   data_cell->payload.relay.stream_id = 1;
   data_cell->payload.relay.digest = 0;
-  data_cell->payload.relay.length = RELAY_PAYLOAD_LEN;
+  data_cell->payload.relay.length = http_header_length + chunk_length;
 
   data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + data_cell->payload.relay.length;
 
-  memcpy( data_cell->payload.relay.data, REQUEST, strlen( REQUEST ) );
-
-  http_header_length = strlen( REQUEST );
+  memcpy( data_cell->payload.relay.data, REQUEST, http_header_length );
+  memcpy( data_cell->payload.relay.data + http_header_length, descriptor_text, chunk_length );
 
   free( REQUEST );
 
-  succ = read( desc_fd, data_cell->payload.relay.data + http_header_length, RELAY_PAYLOAD_LEN - http_header_length );
-
-  if ( succ != RELAY_PAYLOAD_LEN - http_header_length )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to read %s", publish_circuit->service->hs_descs[publish_circuit->desc_index] );
-
-    free( data_cell );
-
-    ret = -1;
-    goto finish;
-  }
-
   if ( d_send_relay_cell_and_free( or_connection, data_cell, &publish_circuit->relay_list, NULL ) < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to send RELAY_DATA cell" );
@@ -2693,8 +2727,18 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
     goto finish;
   }
 
-  do
+  descriptor_text += chunk_length;
+  descriptor_length -= chunk_length;
+
+  while ( descriptor_length > 0 )
   {
+    chunk_length = descriptor_length;
+
+    if ( chunk_length > RELAY_PAYLOAD_LEN )
+    {
+      chunk_length = RELAY_PAYLOAD_LEN;
+    }
+
     data_cell = malloc( MINITOR_CELL_LEN );
 
     data_cell->command = RELAY;
@@ -2704,29 +2748,11 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
     data_cell->payload.relay.recognized = 0;
     data_cell->payload.relay.stream_id = 1;
     data_cell->payload.relay.digest = 0;
+    data_cell->payload.relay.length = chunk_length;
 
-    succ = read( desc_fd, data_cell->payload.relay.data, RELAY_PAYLOAD_LEN );
+    data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + data_cell->payload.relay.length;
 
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to read %s", publish_circuit->service->hs_descs[publish_circuit->desc_index] );
-
-      free( data_cell );
-
-      ret = -1;
-      goto finish;
-    }
-
-    if ( succ == 0 )
-    {
-      free( data_cell );
-
-      break;
-    }
-
-    data_cell->payload.relay.length = succ;
-
-    data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + data_cell->payload.relay.length;
+    memcpy( data_cell->payload.relay.data, descriptor_text, chunk_length );
 
     if ( d_send_relay_cell_and_free( or_connection, data_cell, &publish_circuit->relay_list, NULL ) < 0 )
     {
@@ -2735,10 +2761,13 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
       ret = -1;
       goto finish;
     }
-  } while ( succ == RELAY_PAYLOAD_LEN );
+
+    descriptor_text += chunk_length;
+    descriptor_length -= chunk_length;
+  }
 
 finish:
-  close( desc_fd );
+  v_release_hs_descriptor( hs_desc );
 
   return ret;
 }
@@ -2766,134 +2795,313 @@ void v_build_hsdir_circuits( OnionService* service, DoublyLinkedOnionRelayList*
   free( start_node );
 }
 
+// the blinded keys for time_period and the period after it, the second
+// descriptor already needs the next key so a rollover only derives one
+static int d_prepare_hs_desc_keys( OnionService* service, int time_period, int hsdir_interval )
+{
+  int i;
+  int first = 0;
+  int wolf_succ;
+  unsigned int idx;
+  WC_RNG rng;
+  HsDescCache* cache = &service->hs_desc_cache;
+
+  if ( cache->keys_ready == true && cache->time_period == time_period )
+  {
+    return 0;
+  }
+
+  if ( cache->keys_ready == true )
+  {
+    wc_ed25519_free( &cache->blinded_keys[0] );
+
+    if ( cache->time_period + 1 == time_period )
+    {
+      memcpy( &cache->blinded_keys[0], &cache->blinded_keys[1], sizeof( ed25519_key ) );
+      memcpy( cache->blinded_pub_keys[0], cache->blinded_pub_keys[1], ED25519_PUB_KEY_SIZE );
+      first = 1;
+    }
+    else
+    {
+      wc_ed25519_free( &cache->blinded_keys[1] );
+    }
+
+    wc_ed25519_free( &cache->descriptor_signing_key );
+  }
+
+  cache->keys_ready = false;
+
+  for ( i = first; i < 2; i++ )
+  {
+    wc_ed25519_init( &cache->blinded_keys[i] );
+    cache->blinded_keys[i].expanded = 1;
+
+    if ( d_derive_blinded_key( &cache->blinded_keys[i], &service->master_key, time_period + i, hsdir_interval, NULL, 0 ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to derive the blinded key" );
+
+      return -1;
+    }
+
+    idx = ED25519_PUB_KEY_SIZE;
+    wolf_succ = wc_ed25519_export_public( &cache->blinded_keys[i], cache->blinded_pub_keys[i], &idx );
+
+    if ( wolf_succ < 0 || idx != ED25519_PUB_KEY_SIZE )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to export blinded public key" );
+
+      return -1;
+    }
+  }
+
+  // one signing key per time period, shared by both descriptors
+  wc_InitRng( &rng );
+  wc_ed25519_init( &cache->descriptor_signing_key );
+  wc_ed25519_make_key( &rng, 32, &cache->descriptor_signing_key );
+  wc_FreeRng( &rng );
+
+  cache->time_period = time_period;
+  cache->keys_ready = true;
+
+  return 0;
+}
+
+// identifies the intro points a descriptor lists
+static void v_hash_intro_set( OnionCircuit** intro_circuits, int intro_count, unsigned char* digest )
+{
+  int i;
+  wc_Sha3 reusable_sha3;
+
+  wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
+
+  for ( i = 0; i < intro_count; i++ )
+  {
+    wc_Sha3_256_Update( &reusable_sha3, intro_circuits[i]->relay_list.tail->relay->identity, ID_LENGTH );
+    wc_Sha3_256_Update( &reusable_sha3, intro_circuits[i]->intro_crypto->auth_key.p, ED25519_PUB_KEY_SIZE );
+  }
+
+  wc_Sha3_256_Final( &reusable_sha3, digest );
+  wc_Sha3_256_Free( &reusable_sha3 );
+}
+
+// remove the hsdirs that already hold the current descriptor from a target list
+static void v_drop_uploaded_hsdirs( DoublyLinkedOnionRelayList* list, uint8_t* uploaded_ids, int uploaded_count )
+{
+  int i;
+  DoublyLinkedOnionRelay* dl_relay;
+  DoublyLinkedOnionRelay* next_relay;
+
+  dl_relay = list->head;
+
+  while ( dl_relay != NULL )
+  {
+    next_relay = dl_relay->next;
+
+    for ( i = 0; i < uploaded_count; i++ )
+    {
+      if ( memcmp( dl_relay->relay->identity, uploaded_ids + i * ID_LENGTH, ID_LENGTH ) == 0 )
+      {
+        break;
+      }
+    }
+
+    if ( i < uploaded_count )
+    {
+      if ( dl_relay->previous != NULL )
+      {
+        dl_relay->previous->next = next_relay;
+      }
+      else
+      {
+        list->head = next_relay;
+      }
+
+      if ( next_relay != NULL )
+      {
+        next_relay->previous = dl_relay->previous;
+      }
+      else
+      {
+        list->tail = dl_relay->previous;
+      }
+
+      list->length--;
+
+      free( dl_relay->relay );
+      free( dl_relay );
+    }
+
+    dl_relay = next_relay;
+  }
+}
+
+static void v_unlist_retiring_intros( OnionService* service )
+{
+  OnionCircuit* tmp_circuit;
+
+  //MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  tmp_circuit = onion_circuits;
+
+  while ( tmp_circuit != NULL )
+  {
+    if ( tmp_circuit->status == CIRCUIT_INTRO_LIVE && tmp_circuit->service == service && tmp_circuit->intro_crypto->state == INTRO_RETIRING )
+    {
+      tmp_circuit->intro_crypto->state = INTRO_UNLISTED;
+      service->intro_retiring--;
+    }
+
+    tmp_circuit = tmp_circuit->next;
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  //MUTEX GIVE
+}
+
 int d_push_hsdir( OnionService* service )
 {
   int ret = 0;
   int i;
-  int wolf_succ;
+  int j;
   int succ;
-  unsigned int idx;
-  int voting_interval;
-  time_t srv_start_time;
-  time_t now;
-  time_t fresh_until;
   time_t valid_after;
   int time_period;
   int revision_counter;
-  WC_RNG rng;
-  ed25519_key blinded_keys[2];
-  ed25519_key descriptor_signing_key;
+  bool reuse;
   wc_Sha3 reusable_sha3;
-  int reusable_text_length;
-  unsigned char* reusable_plaintext;
-  unsigned char* reusable_ciphertext;
   unsigned char reusable_sha3_sum[WC_SHA3_256_DIGEST_SIZE];
-  unsigned char blinded_pub_keys[2][ED25519_PUB_KEY_SIZE];
+  unsigned char intro_digest[WC_SHA3_256_DIGEST_SIZE];
   DoublyLinkedOnionRelay* dl_relay;
-  DoublyLinkedOnionRelay* next_relay;
   OnionCircuit* tmp_circuit;
-  OnionCircuit* intro_circuits[3];
-  OnionRelay* start_relay;
-  char desc_file[50];
+  OnionCircuit* intro_circuits[HS_MAX_INTRO_POINTS];
+  int intro_count;
+  ConsensusSnapshot* snapshot = NULL;
+  HsDescCache* cache = &service->hs_desc_cache;
+  HsDescArena arena;
+  HsDescriptor* hs_desc;
+  int layer;
 
-  if ( service->intro_live_count < 3 )
+  if ( service->intro_live_count < service->intro_count )
   {
     return -1;
   }
 
+  // the upload slots of the running publish are still referenced by circuits,
+  // the intro set it carries may be outdated so push again once it's done
+  if ( service->hsdir_in_flight > 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Descriptor upload already in progress for: %s", service->hostname );
+
+    service->hsdir_stale = true;
+
+    return -1;
+  }
+
+  intro_count = 0;
+
   //MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
   tmp_circuit = onion_circuits;
 
-  for ( i = 0; i < 3; i++ )
+  while ( tmp_circuit != NULL && intro_count < service->intro_count )
   {
-    while ( tmp_circuit != NULL )
+    if ( tmp_circuit->status == CIRCUIT_INTRO_LIVE && tmp_circuit->service == service && tmp_circuit->intro_crypto->state == INTRO_ACTIVE )
     {
-      if ( tmp_circuit->status == CIRCUIT_INTRO_LIVE && tmp_circuit->service == service )
-      {
-        break;
-      }
-
-      tmp_circuit = tmp_circuit->next;
-    }
-
-    if ( tmp_circuit == NULL )
-    {
-      return -1;
+      intro_circuits[intro_count] = tmp_circuit;
+      intro_count++;
     }
 
-    intro_circuits[i] = tmp_circuit;
     tmp_circuit = tmp_circuit->next;
   }
 
   MINITOR_MUTEX_GIVE( circuits_mutex );
   //MUTEX GIVE
 
-  wc_InitRng( &rng );
+  if ( intro_count < service->intro_count )
+  {
+    return -1;
+  }
 
-  wc_ed25519_init( &blinded_keys[0] );
-  wc_ed25519_init( &blinded_keys[1] );
-  blinded_keys[0].expanded = 1;
-  blinded_keys[1].expanded = 1;
+  wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
 
-  wc_ed25519_init( &descriptor_signing_key );
-  wc_ed25519_make_key( &rng, 32, &descriptor_signing_key );
+  memset( &arena, 0, sizeof( HsDescArena ) );
 
-  wc_InitSha3_256( &reusable_sha3, NULL, INVALID_DEVID );
+  snapshot = px_acquire_consensus_snapshot();
 
-  wc_FreeRng( &rng );
+  valid_after = snapshot->consensus.valid_after;
 
-  // BEGIN mutex
-  MINITOR_MUTEX_TAKE_BLOCKING( network_consensus_mutex );
+  time_period = d_get_hs_time_period( snapshot->consensus.fresh_until, snapshot->consensus.valid_after, snapshot->consensus.hsdir_interval );
 
-  valid_after = network_consensus.valid_after;
-  fresh_until = network_consensus.fresh_until;
+  if ( d_prepare_hs_desc_keys( service, time_period, snapshot->consensus.hsdir_interval ) < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  v_hash_intro_set( intro_circuits, intro_count, intro_digest );
 
-  time_period = d_get_hs_time_period( network_consensus.fresh_until, network_consensus.valid_after, network_consensus.hsdir_interval );
+  // the signed descriptors still describe the service if neither the period
+  // nor the intro points moved, the revision counter feeds the layer keys so
+  // they can only go to hsdirs that don't have them yet
+  reuse =
+    service->hs_descs[0] != NULL &&
+    service->hs_descs[1] != NULL &&
+    cache->built_period == time_period &&
+    MINITOR_GET_TIME() - cache->built_at < HS_DESC_REUSE_SECONDS &&
+    memcmp( cache->intro_digest, intro_digest, WC_SHA3_256_DIGEST_SIZE ) == 0;
 
-  // my stragety is to get all the target relays within a single mutex lock so that we
+  // my stragety is to get all the target relays from a single snapshot so that we
   // can garentee that we use the same consensus in case it tries to update during the
   // long upload process
   for ( i = 0; i < 2; i++ )
   {
-    succ = d_derive_blinded_key( &blinded_keys[i], &service->master_key, time_period + i, network_consensus.hsdir_interval, NULL, 0 );
+    service->target_relays[i] = px_get_target_relays( snapshot->hsdir_ring, snapshot->consensus.hsdir_n_replicas, cache->blinded_pub_keys[i], time_period + i, snapshot->consensus.hsdir_interval, snapshot->consensus.hsdir_spread_store, i );
 
-    if ( succ < 0 )
+    if ( service->target_relays[i] == NULL )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to derive the blinded key" );
+      MINITOR_LOG( MINITOR_TAG, "Failed to get target_relays" );
 
       ret = -1;
       goto finish;
     }
 
-    idx = ED25519_PUB_KEY_SIZE;
-    wolf_succ = wc_ed25519_export_public( &blinded_keys[i], blinded_pub_keys[i], &idx );
-
-    if ( wolf_succ < 0 || idx != ED25519_PUB_KEY_SIZE )
+    if ( reuse == true )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to export blinded public key" );
-
-      ret = -1;
-      goto finish;
+      v_drop_uploaded_hsdirs( service->target_relays[i], cache->uploaded_ids[i], cache->uploaded_counts[i] );
     }
+  }
 
-    service->target_relays[i] = px_get_target_relays( network_consensus.hsdir_n_replicas, blinded_pub_keys[i], time_period + i, network_consensus.hsdir_interval, network_consensus.hsdir_spread_store, i );
+  v_release_consensus_snapshot( snapshot );
+  snapshot = NULL;
 
-    if ( service->target_relays[i] == NULL )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to get target_relays" );
+  if ( reuse == true && service->target_relays[0]->length + service->target_relays[1]->length == 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Descriptors and hsdirs unchanged, skipping upload for: %s", service->hostname );
 
-      ret = -1;
-      goto finish;
-    }
-  }
+    free( service->target_relays[0] );
+    free( service->target_relays[1] );
+    service->target_relays[0] = NULL;
+    service->target_relays[1] = NULL;
 
-  MINITOR_MUTEX_GIVE( network_consensus_mutex );
-  // END mutex
+    v_unlist_retiring_intros( service );
+    v_set_hsdir_timer( service->hsdir_timer );
+
+    goto finish;
+  }
 
   service->hsdir_to_send = service->target_relays[0]->length + service->target_relays[1]->length;
   service->hsdir_sent = 0;
+  service->hsdir_failed = 0;
+  service->hsdir_publish_start = MINITOR_GET_TIME();
+
+  if ( reuse == true )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Descriptors unchanged, uploading to %d new hsdirs", service->hsdir_to_send );
+
+    goto upload;
+  }
 
   revision_counter = d_roll_revision_counter( service->master_key.p );
 
@@ -2908,18 +3116,11 @@ int d_push_hsdir( OnionService* service )
   // i = 0 is first descriptor, 1 is second as per the spec
   for ( i = 0; i < 2; i++ )
   {
-    // null terminated
-    // /sdcard/abcdefghij_desc_0\0
-    memset( desc_file, 0, sizeof( desc_file ) );
-    strcpy( desc_file, FILESYSTEM_PREFIX );
-    memcpy( desc_file + strlen( FILESYSTEM_PREFIX ), service->hostname, 10 );
-    desc_file[strlen( FILESYSTEM_PREFIX ) + 10] = 0;
-    strcat( desc_file, "_desc_" );
-    desc_file[strlen( desc_file ) + 1] = 0;
-    desc_file[strlen( desc_file )] = (char)(48 + i);
+    // every layer is built in the arena, nothing touches the filesystem
+    layer = arena.length;
 
     // generate second layer plaintext
-    succ = d_generate_second_plaintext( desc_file, intro_circuits, valid_after, &descriptor_signing_key );
+    succ = d_generate_second_plaintext( &arena, intro_circuits, intro_count, service->single_onion, valid_after, &cache->descriptor_signing_key );
 
     if ( succ < 0 )
     {
@@ -2935,7 +3136,7 @@ int d_push_hsdir( OnionService* service )
 
     wc_Sha3_256_Update( &reusable_sha3, (unsigned char*)"subcredential", strlen( "subcredential" ) );
     wc_Sha3_256_Update( &reusable_sha3, reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
-    wc_Sha3_256_Update( &reusable_sha3, blinded_pub_keys[i], ED25519_PUB_KEY_SIZE );
+    wc_Sha3_256_Update( &reusable_sha3, cache->blinded_pub_keys[i], ED25519_PUB_KEY_SIZE );
     wc_Sha3_256_Final( &reusable_sha3, reusable_sha3_sum );
 
     if ( i == 0 )
@@ -2949,8 +3150,9 @@ int d_push_hsdir( OnionService* service )
 
     // encrypt second layer plaintext
     succ = d_encrypt_descriptor_plaintext(
-      desc_file,
-      blinded_pub_keys[i],
+      &arena,
+      layer,
+      cache->blinded_pub_keys[i],
       ED25519_PUB_KEY_SIZE,
       "hsdir-encrypted-data",
       strlen( "hsdir-encrypted-data" ),
@@ -2966,9 +3168,9 @@ int d_push_hsdir( OnionService* service )
       goto finish;
     }
 
-    succ = d_generate_first_plaintext( desc_file );
+    layer = d_generate_first_plaintext( &arena, layer );
 
-    if ( succ < 0 )
+    if ( layer < 0 )
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to generate first layer descriptor plaintext" );
 
@@ -2978,8 +3180,9 @@ int d_push_hsdir( OnionService* service )
 
     // encrypt first layer plaintext
     succ = d_encrypt_descriptor_plaintext(
-      desc_file,
-      blinded_pub_keys[i],
+      &arena,
+      layer,
+      cache->blinded_pub_keys[i],
       ED25519_PUB_KEY_SIZE,
       "hsdir-superencrypted-data",
       strlen( "hsdir-superencrypted-data" ),
@@ -2996,15 +3199,16 @@ int d_push_hsdir( OnionService* service )
     }
 
     // create outer descriptor wrapper
-    succ = d_generate_outer_descriptor(
-      desc_file,
-      &descriptor_signing_key,
+    layer = d_generate_outer_descriptor(
+      &arena,
+      layer,
+      &cache->descriptor_signing_key,
       valid_after,
-      &blinded_keys[i],
+      &cache->blinded_keys[i],
       revision_counter
     );
 
-    if ( succ < 0 )
+    if ( layer < 0 )
     {
       MINITOR_LOG( MINITOR_TAG, "Failed to generate outer descriptor" );
 
@@ -3016,64 +3220,246 @@ int d_push_hsdir( OnionService* service )
     //succ = d_build_hsdir_circuits( reusable_plaintext + HS_DESC_SIG_PREFIX_LENGTH, reusable_text_length, target_relays[i] );
     //v_build_hsdir_circuits( service, target_relays[i], i );
 
-    strcpy( service->hs_descs[i], desc_file );
+    hs_desc = px_finish_hs_descriptor( &arena, layer );
+
+    if ( hs_desc == NULL )
+    {
+      ret = -1;
+      goto finish;
+    }
+
+    // uploads of the old descriptor still in flight keep their reference
+    v_release_hs_descriptor( service->hs_descs[i] );
+    service->hs_descs[i] = hs_desc;
+  }
+
+  // no hsdir holds the new descriptors yet
+  cache->built_period = time_period;
+  cache->built_at = MINITOR_GET_TIME();
+  memcpy( cache->intro_digest, intro_digest, WC_SHA3_256_DIGEST_SIZE );
+  cache->uploaded_counts[0] = 0;
+  cache->uploaded_counts[1] = 0;
+
+upload:
+  for ( i = 0; i < 2; i++ )
+  {
+    service->hsdir_uploads[i] = malloc( sizeof( HsDirUpload ) * service->target_relays[i]->length );
+
+    dl_relay = service->target_relays[i]->head;
+
+    for ( j = 0; j < service->target_relays[i]->length; j++ )
+    {
+      service->hsdir_uploads[i][j].relay = dl_relay->relay;
+      memcpy( service->hsdir_uploads[i][j].identity, dl_relay->relay->identity, ID_LENGTH );
+      service->hsdir_uploads[i][j].status = HSDIR_UPLOAD_PENDING;
+      service->hsdir_uploads[i][j].attempts = 0;
+
+      dl_relay = dl_relay->next;
+    }
   }
 
-  start_relay = px_get_random_fast_relay( 1, service->target_relays[0], NULL, NULL );
-  v_send_init_circuit_internal( 3, CIRCUIT_HSDIR_BEGIN_DIR, service, NULL, 0, 0, start_relay, service->target_relays[0]->head->relay, NULL, NULL );
+  // clients fetching the new descriptors won't use the retiring intros, they
+  // are closed once these uploads finish
+  v_unlist_retiring_intros( service );
+  v_start_hsdir_uploads( service );
 
 finish:
+  if ( snapshot != NULL )
+  {
+    v_release_consensus_snapshot( snapshot );
+  }
+
+  v_free_hs_desc_arena( &arena );
   wc_Sha3_256_Free( &reusable_sha3 );
-  wc_ed25519_free( &blinded_keys[0] );
-  wc_ed25519_free( &blinded_keys[1] );
-  wc_ed25519_free( &descriptor_signing_key );
 
   return ret;
 }
 
-void v_cleanup_service_hs_data( OnionService* service, int desc_index )
+// mark the next pending slot in flight, the caller takes its relay when it
+// extends or builds to that hsdir
+HsDirUpload* px_claim_hsdir_upload( OnionService* service, int* desc_index, int* upload_index )
 {
   int i;
-  OnionCircuit* tmp_circuit;
+  int j;
+  HsDirUpload* upload;
+
+  for ( i = 0; i < 2; i++ )
+  {
+    for ( j = 0; j < service->target_relays[i]->length; j++ )
+    {
+      upload = &service->hsdir_uploads[i][j];
+
+      if ( upload->status == HSDIR_UPLOAD_PENDING )
+      {
+        upload->status = HSDIR_UPLOAD_IN_FLIGHT;
+        upload->attempts++;
+        service->hsdir_in_flight++;
+
+        *desc_index = i;
+        *upload_index = j;
+
+        return upload;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// keep up to MINITOR_HSDIR_UPLOAD_PARALLELISM upload circuits building, each
+// one posts the shared descriptor and then moves its stem on to the next hsdir
+void v_start_hsdir_uploads( OnionService* service )
+{
+  int desc_index;
+  int upload_index;
+  OnionRelay* start_relay;
+  HsDirUpload* upload;
+
+  while ( service->hsdir_in_flight < MINITOR_HSDIR_UPLOAD_PARALLELISM )
+  {
+    upload = px_claim_hsdir_upload( service, &desc_index, &upload_index );
+
+    if ( upload == NULL )
+    {
+      return;
+    }
+
+    start_relay = px_get_random_fast_relay( 1, service->target_relays[desc_index], NULL, NULL );
+
+    // the circuit owns the relay from here, a retry hands back a copy
+    v_send_init_circuit_internal(
+      3,
+      CIRCUIT_HSDIR_BEGIN_DIR,
+      service,
+      NULL,
+      desc_index,
+      upload_index,
+      start_relay,
+      upload->relay,
+      NULL,
+      NULL
+    );
+
+    upload->relay = NULL;
+  }
+}
+
+// called once per upload attempt, retry_relay is NULL when the hsdir took the
+// descriptor, otherwise the hsdir to try again. returns true once every slot
+// is done or failed and the publish has been cleaned up
+bool b_finish_hsdir_upload( OnionService* service, int desc_index, int upload_index, OnionRelay* retry_relay )
+{
+  HsDirUpload* upload = &service->hsdir_uploads[desc_index][upload_index];
+
+  service->hsdir_in_flight--;
+
+  if ( retry_relay == NULL )
+  {
+    upload->status = HSDIR_UPLOAD_DONE;
+    service->hsdir_sent++;
+  }
+  else if ( upload->attempts < HSDIR_UPLOAD_MAX_ATTEMPTS )
+  {
+    upload->status = HSDIR_UPLOAD_PENDING;
+    upload->relay = retry_relay;
+  }
+  else
+  {
+    MINITOR_LOG( MINITOR_TAG, "Giving up on hsdir upload %d for descriptor %d after %d attempts", upload_index, desc_index, upload->attempts );
+
+    upload->status = HSDIR_UPLOAD_FAILED;
+    service->hsdir_failed++;
+
+    free( retry_relay );
+  }
+
+  if ( service->hsdir_sent + service->hsdir_failed == service->hsdir_to_send )
+  {
+    v_cleanup_service_hs_data( service );
+
+    return true;
+  }
+
+  return false;
+}
+
+void v_cleanup_service_hs_data( OnionService* service )
+{
+  int i;
+  int j;
+  int desc_sent[2];
+  HsDescCache* cache = &service->hs_desc_cache;
   DoublyLinkedOnionRelay* dl_relay;
   DoublyLinkedOnionRelay* next_relay;
 
-  if ( service->hsdir_sent == service->hsdir_to_send )
+  // remember who holds the descriptors so a republish can skip them
+  for ( i = 0; i < 2; i++ )
   {
-    MINITOR_LOG( MINITOR_TAG, "Hidden service ready at: %s", service->hostname );
+    desc_sent[i] = 0;
 
-    v_set_hsdir_timer( service->hsdir_timer );
+    cache->uploaded_ids[i] = realloc( cache->uploaded_ids[i], ( cache->uploaded_counts[i] + service->target_relays[i]->length ) * ID_LENGTH );
 
-    i = d_get_standby_count();
-
-    for ( ; i < 2; i++ )
-    {
-      // create a standby circuit
-      v_send_init_circuit_internal(
-        1,
-        CIRCUIT_STANDBY,
-        NULL,
-        NULL,
-        0,
-        0,
-        NULL,
-        NULL,
-        NULL,
-        NULL
-      );
+    for ( j = 0; j < service->target_relays[i]->length; j++ )
+    {
+      if ( service->hsdir_uploads[i][j].status == HSDIR_UPLOAD_DONE )
+      {
+        memcpy( cache->uploaded_ids[i] + cache->uploaded_counts[i] * ID_LENGTH, service->hsdir_uploads[i][j].identity, ID_LENGTH );
+        cache->uploaded_counts[i]++;
+        desc_sent[i]++;
+      }
     }
   }
 
-  dl_relay = service->target_relays[desc_index]->head;
+  MINITOR_LOG(
+    MINITOR_TAG,
+    "Descriptor upload finished after %ld seconds, first descriptor %d/%d hsdirs, second descriptor %d/%d hsdirs",
+    (long)( MINITOR_GET_TIME() - service->hsdir_publish_start ),
+    desc_sent[0],
+    service->target_relays[0]->length,
+    desc_sent[1],
+    service->target_relays[1]->length
+  );
 
-  while ( dl_relay != NULL )
+  if ( service->hsdir_sent > 0 )
   {
-    next_relay = dl_relay->next;
-
-    free( dl_relay );
+    MINITOR_LOG( MINITOR_TAG, "Hidden service ready at: %s", service->hostname );
+  }
+  else
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to upload any descriptor for: %s", service->hostname );
+  }
 
-    dl_relay = next_relay;
+  // the intro set changed while we were uploading
+  if ( service->hsdir_stale == true )
+  {
+    service->hsdir_stale = false;
+    MINITOR_TIMER_SET_MS_BLOCKING( service->hsdir_timer, BOOTSTRAP_HSDIR_RETRY_MS );
   }
+  else
+  {
+    v_set_hsdir_timer( service->hsdir_timer );
+  }
+
+  v_fill_rend_pool( service );
+
+  // the relays themselves were owned and freed by the upload circuits
+  for ( i = 0; i < 2; i++ )
+  {
+    dl_relay = service->target_relays[i]->head;
+
+    while ( dl_relay != NULL )
+    {
+      next_relay = dl_relay->next;
+
+      free( dl_relay );
 
-  free( service->target_relays[desc_index] );
+      dl_relay = next_relay;
+    }
+
+    free( service->target_relays[i] );
+    free( service->hsdir_uploads[i] );
+
+    service->target_relays[i] = NULL;
+    service->hsdir_uploads[i] = NULL;
+  }
 }
@@ -3,6 +3,7 @@
 #include "../h/core.h"
 #include "../h/connections.h"
 #include "../h/consensus.h"
+#include "../h/onion_service.h"
 
 const char* PORT_TAG = "PORT";
 
@@ -315,6 +316,51 @@ bool b_create_local_connection_handler( MinitorTask* handle, void* local_connect
   return false;
 }
 
+bool b_create_backend_check_task( MinitorTask* handle, void* service )
+{
+  int ret;
+  pthread_attr_t attr;
+
+  // a new check starts every keepalive and nothing joins the old ones
+  pthread_attr_init( &attr );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+
+  ret = pthread_create(
+    handle,
+    &attr,
+    v_check_service_backends,
+    service
+  );
+
+  pthread_attr_destroy( &attr );
+
+  if ( ret == 0 )
+  {
+    return true;
+  }
+
+  return false;
+}
+
+bool b_create_consensus_task( MinitorTask* handle )
+{
+  int ret;
+
+  ret = pthread_create(
+    handle,
+    NULL,
+    v_handle_consensus_refresh,
+    NULL
+  );
+
+  if ( ret == 0 )
+  {
+    return true;
+  }
+
+  return false;
+}
+
 bool b_create_fetch_task( MinitorTask* handle, void* consensus )
 {
   int ret;
@@ -334,6 +380,25 @@ bool b_create_fetch_task( MinitorTask* handle, void* consensus )
   return false;
 }
 
+bool b_create_hash_task( MinitorTask* handle, void* consensus )
+{
+  int ret;
+
+  ret = pthread_create(
+    handle,
+    NULL,
+    v_handle_relay_hash,
+    consensus
+  );
+
+  if ( ret == 0 )
+  {
+    return true;
+  }
+
+  return false;
+}
+
 bool b_create_insert_task( MinitorTask* handle, void* consensus )
 {
   int ret;
@@ -341,7 +406,7 @@ bool b_create_insert_task( MinitorTask* handle, void* consensus )
   ret = pthread_create(
     handle,
     NULL,
-    v_handle_crypto_and_insert,
+    v_handle_relay_insert,
     consensus
   );
 
@@ -365,11 +430,46 @@ void port_task_delete( MinitorTask task )
   }
 }
 
+// only seed once, reseeding with the time on every call hands back the
+// same value for a whole second
+static void v_port_seed_random()
+{
+  static bool seeded = false;
+
+  if ( seeded == false )
+  {
+    srand( time( NULL ) ^ getpid() );
+    seeded = true;
+  }
+}
+
+int port_core_count()
+{
+  long count = sysconf( _SC_NPROCESSORS_ONLN );
+
+  if ( count < 1 )
+  {
+    return 1;
+  }
+
+  return count;
+}
+
+// monotonic milliseconds for measuring short intervals, wraps after 49 days
+uint32_t port_time_ms()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint32_t)( now.tv_sec * 1000 + now.tv_nsec / 1000000 );
+}
+
 int port_random()
 {
   int r;
 
-  srand( time( NULL ) );
+  v_port_seed_random();
 
   r = rand();
 
@@ -380,7 +480,7 @@ void port_fill_random( uint8_t* dest, int length )
 {
   int i;
 
-  srand( time( NULL ) );
+  v_port_seed_random();
 
   for ( i = 0; i < length; i++ )
   {
@@ -24,8 +24,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 MinitorTimer consensus_timer;
 MinitorTimer consensus_valid_timer;
 
-// shared state must be protected by mutex
-NetworkConsensus network_consensus = {
+// what the first snapshot holds until a consensus is loaded
+const NetworkConsensus default_network_consensus = {
   .method = 0,
   .valid_after = 0,
   .fresh_until = 0,
@@ -41,9 +41,25 @@ NetworkConsensus network_consensus = {
 #else
   .hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT,
 #endif
+  .bandwidth_weights = {
+    .wgg = BANDWIDTH_WEIGHT_SCALE,
+    .wgd = BANDWIDTH_WEIGHT_SCALE,
+    .wmg = BANDWIDTH_WEIGHT_SCALE,
+    .wmm = BANDWIDTH_WEIGHT_SCALE,
+    .wme = BANDWIDTH_WEIGHT_SCALE,
+    .wmd = BANDWIDTH_WEIGHT_SCALE,
+    .wbg = BANDWIDTH_WEIGHT_SCALE,
+    .wbm = BANDWIDTH_WEIGHT_SCALE,
+    .wbe = BANDWIDTH_WEIGHT_SCALE,
+    .wbd = BANDWIDTH_WEIGHT_SCALE,
+  },
 };
 MinitorMutex network_consensus_mutex;
+MinitorMutex snapshot_mutex;
 MinitorMutex crypto_insert_finish;
+MinitorMutex relay_batch_mutex;
+MinitorMutex bootstrap_mutex;
+MinitorQueue bootstrap_queue;
 
 // add a linked onion relay to a doubly linked list of onion relays
 void v_add_relay_to_list( DoublyLinkedOnionRelay* node, DoublyLinkedOnionRelayList* list )
@@ -113,3 +129,18 @@ OnionRelay* px_get_relay_by_index( DoublyLinkedOnionRelayList* list, int index )
 
   return dl_relay->relay;
 }
+
+// with no bandwidth-weights every position is weighted by bandwidth alone
+void v_set_default_bandwidth_weights( BandwidthWeights* weights )
+{
+  weights->wgg = BANDWIDTH_WEIGHT_SCALE;
+  weights->wgd = BANDWIDTH_WEIGHT_SCALE;
+  weights->wmg = BANDWIDTH_WEIGHT_SCALE;
+  weights->wmm = BANDWIDTH_WEIGHT_SCALE;
+  weights->wme = BANDWIDTH_WEIGHT_SCALE;
+  weights->wmd = BANDWIDTH_WEIGHT_SCALE;
+  weights->wbg = BANDWIDTH_WEIGHT_SCALE;
+  weights->wbm = BANDWIDTH_WEIGHT_SCALE;
+  weights->wbe = BANDWIDTH_WEIGHT_SCALE;
+  weights->wbd = BANDWIDTH_WEIGHT_SCALE;
+}
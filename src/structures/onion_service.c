@@ -18,22 +18,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../../h/structures/onion_service.h"
 
-void v_add_rendezvous_cookie_to_list( DoublyLinkedRendezvousCookie* node, DoublyLinkedRendezvousCookieList* list ) {
-  node->next = NULL;
-  node->previous = NULL;
-
-  if ( list->length == 0 ) {
-    list->head = node;
-    list->tail = node;
-  } else {
-    node->previous = list->tail;
-    list->tail->next = node;
-    list->tail = node;
-  }
-
-  list->length++;
-}
-
 void v_add_service_to_list( OnionService* service, OnionService** list )
 {
   service->next = *list;
@@ -0,0 +1,439 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/constants.h"
+#include "../h/tokenizer.h"
+
+// fd >= 0 pulls TOKENIZER_BLOCK_SIZE reads from the fd, fd < 0 expects the
+// caller to push chunks with v_feed_line_tokenizer, lines that straddle two
+// reads or chunks are limited to TOKENIZER_LINE_LIMIT bytes
+int d_init_line_tokenizer( LineTokenizer* tokenizer, int fd )
+{
+  memset( tokenizer, 0, sizeof( LineTokenizer ) );
+
+  tokenizer->fd = fd;
+  tokenizer->carry_capacity = TOKENIZER_LINE_LIMIT;
+  tokenizer->carry = malloc( sizeof( char ) * ( TOKENIZER_LINE_LIMIT + 1 ) );
+
+  if ( tokenizer->carry == NULL )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to allocate tokenizer carry" );
+
+    return -1;
+  }
+
+  if ( fd >= 0 )
+  {
+    tokenizer->block = malloc( sizeof( char ) * TOKENIZER_BLOCK_SIZE );
+
+    if ( tokenizer->block == NULL )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to allocate tokenizer block" );
+
+      free( tokenizer->carry );
+      tokenizer->carry = NULL;
+
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// the whole stream is already in memory, nothing is allocated and nothing
+// needs to be freed
+void v_init_memory_tokenizer( LineTokenizer* tokenizer, const char* data, int length )
+{
+  memset( tokenizer, 0, sizeof( LineTokenizer ) );
+
+  tokenizer->fd = -1;
+  tokenizer->input = data;
+  tokenizer->input_length = length;
+}
+
+// slices from the previous chunk are invalid once the caller reuses it
+void v_feed_line_tokenizer( LineTokenizer* tokenizer, const char* data, int length )
+{
+  tokenizer->input = data;
+  tokenizer->input_length = length;
+  tokenizer->offset = 0;
+}
+
+void v_free_line_tokenizer( LineTokenizer* tokenizer )
+{
+  free( tokenizer->carry );
+  free( tokenizer->block );
+
+  tokenizer->carry = NULL;
+  tokenizer->block = NULL;
+}
+
+static void v_trim_carriage_return( TokenSlice* line )
+{
+  if ( line->length > 0 && line->data[line->length - 1] == '\r' )
+  {
+    line->length--;
+  }
+}
+
+static void v_append_carry( LineTokenizer* tokenizer, const char* data, int length )
+{
+  if ( length > tokenizer->carry_capacity - tokenizer->carry_length )
+  {
+    length = tokenizer->carry_capacity - tokenizer->carry_length;
+    tokenizer->carry_overflow = true;
+  }
+
+  memcpy( tokenizer->carry + tokenizer->carry_length, data, length );
+  tokenizer->carry_length += length;
+  tokenizer->carry[tokenizer->carry_length] = 0;
+}
+
+static int d_return_carry( LineTokenizer* tokenizer, TokenSlice* line )
+{
+  line->data = tokenizer->carry;
+  line->length = tokenizer->carry_length;
+  v_trim_carriage_return( line );
+
+  tokenizer->carry_returned = true;
+
+  return 1;
+}
+
+// 1 if a line was found, 0 if the current input is used up
+static int d_scan_line( LineTokenizer* tokenizer, TokenSlice* line )
+{
+  const char* start;
+  const char* newline;
+  int remaining;
+  int length;
+
+  while ( tokenizer->offset < tokenizer->input_length )
+  {
+    start = tokenizer->input + tokenizer->offset;
+    remaining = tokenizer->input_length - tokenizer->offset;
+    newline = memchr( start, '\n', remaining );
+
+    if ( newline == NULL )
+    {
+      tokenizer->offset = tokenizer->input_length;
+
+      // memory input is the whole stream, the tail is the last line
+      if ( tokenizer->carry == NULL )
+      {
+        line->data = start;
+        line->length = remaining;
+        v_trim_carriage_return( line );
+
+        return 1;
+      }
+
+      v_append_carry( tokenizer, start, remaining );
+
+      return 0;
+    }
+
+    length = newline - start;
+    tokenizer->offset += length + 1;
+
+    if ( tokenizer->carry_length == 0 && tokenizer->carry_overflow == false )
+    {
+      line->data = start;
+      line->length = length;
+      v_trim_carriage_return( line );
+
+      return 1;
+    }
+
+    v_append_carry( tokenizer, start, length );
+
+    // we don't care about lines that are too long to carry, drop them
+    if ( tokenizer->carry_overflow == true )
+    {
+      tokenizer->carry_length = 0;
+      tokenizer->carry_overflow = false;
+
+      continue;
+    }
+
+    return d_return_carry( tokenizer, line );
+  }
+
+  return 0;
+}
+
+// 1 if a line was found, 0 if more input needs to be fed or the fd hit
+// the end, -1 on a read error
+int d_next_line( LineTokenizer* tokenizer, TokenSlice* line )
+{
+  int ret;
+
+  if ( tokenizer->carry_returned == true )
+  {
+    tokenizer->carry_length = 0;
+    tokenizer->carry_overflow = false;
+    tokenizer->carry_returned = false;
+  }
+
+  while ( 1 )
+  {
+    ret = d_scan_line( tokenizer, line );
+
+    if ( ret != 0 || tokenizer->fd < 0 )
+    {
+      return ret;
+    }
+
+    ret = read( tokenizer->fd, tokenizer->block, TOKENIZER_BLOCK_SIZE );
+
+    if ( ret < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+
+      MINITOR_LOG( MINITOR_TAG, "Failed to read tokenizer block, errno: %d", errno );
+
+      return -1;
+    }
+
+    // end of file, whatever is left in carry is the last line
+    if ( ret == 0 )
+    {
+      if ( tokenizer->carry_length > 0 && tokenizer->carry_overflow == false )
+      {
+        return d_return_carry( tokenizer, line );
+      }
+
+      return 0;
+    }
+
+    v_feed_line_tokenizer( tokenizer, tokenizer->block, ret );
+  }
+}
+
+// reads a -----BEGIN----- / -----END----- object, the slice covers the
+// base64 lines in between including their newlines, only memory input
+// keeps the object contiguous so other tokenizers are refused
+int d_next_object( LineTokenizer* tokenizer, TokenSlice* object )
+{
+  TokenSlice line;
+
+  if ( tokenizer->carry != NULL )
+  {
+    return -1;
+  }
+
+  if ( d_next_line( tokenizer, &line ) != 1 || b_token_starts_with( &line, "-----BEGIN " ) == false )
+  {
+    return -1;
+  }
+
+  object->data = tokenizer->input + tokenizer->offset;
+  object->length = 0;
+
+  while ( d_next_line( tokenizer, &line ) == 1 )
+  {
+    if ( b_token_starts_with( &line, "-----END " ) == true )
+    {
+      object->length = line.data - object->data;
+
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+// seeded fnv-1a folded down to a slot
+static int d_keyword_slot( const char* data, int length, uint32_t seed )
+{
+  int i;
+  uint32_t hash = 2166136261u ^ seed;
+
+  for ( i = 0; i < length; i++ )
+  {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
+  }
+
+  return ( hash ^ ( hash >> 16 ) ) & ( KEYWORD_TABLE_SLOTS - 1 );
+}
+
+// keywords must outlive the table, the index of a keyword in the array is
+// what d_match_keyword returns
+int d_init_keyword_table( KeywordTable* table, const char** keywords, int count )
+{
+  int i;
+  int slot;
+  uint32_t seed;
+
+  if ( count > KEYWORD_TABLE_SLOTS )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Too many keywords for keyword table: %d", count );
+
+    return -1;
+  }
+
+  for ( seed = 0; seed < KEYWORD_TABLE_SEED_ATTEMPTS; seed++ )
+  {
+    memset( table->slots, -1, sizeof( table->slots ) );
+
+    for ( i = 0; i < count; i++ )
+    {
+      slot = d_keyword_slot( keywords[i], strlen( keywords[i] ), seed );
+
+      if ( table->slots[slot] != -1 )
+      {
+        break;
+      }
+
+      table->slots[slot] = i;
+    }
+
+    if ( i == count )
+    {
+      table->keywords = keywords;
+      table->count = count;
+      table->seed = seed;
+
+      return 0;
+    }
+  }
+
+  MINITOR_LOG( MINITOR_TAG, "Failed to find a perfect hash seed for %d keywords", count );
+
+  return -1;
+}
+
+// the keyword is the first space delimited token of the line, returns its
+// index or -1, arguments is set to the rest of the line
+int d_match_keyword( KeywordTable* table, TokenSlice* line, TokenSlice* arguments )
+{
+  int index;
+  int keyword_length;
+  const char* space = memchr( line->data, ' ', line->length );
+
+  if ( space == NULL )
+  {
+    keyword_length = line->length;
+  }
+  else
+  {
+    keyword_length = space - line->data;
+  }
+
+  if ( keyword_length == 0 )
+  {
+    return -1;
+  }
+
+  index = table->slots[d_keyword_slot( line->data, keyword_length, table->seed )];
+
+  if (
+    index < 0 ||
+    strlen( table->keywords[index] ) != keyword_length ||
+    memcmp( line->data, table->keywords[index], keyword_length ) != 0
+  )
+  {
+    return -1;
+  }
+
+  if ( arguments != NULL )
+  {
+    if ( space == NULL )
+    {
+      arguments->data = line->data + line->length;
+      arguments->length = 0;
+    }
+    else
+    {
+      arguments->data = space + 1;
+      arguments->length = line->length - keyword_length - 1;
+    }
+  }
+
+  return index;
+}
+
+// pops the next space delimited token off the front of arguments
+bool b_next_token( TokenSlice* arguments, TokenSlice* token )
+{
+  const char* space;
+
+  while ( arguments->length > 0 && arguments->data[0] == ' ' )
+  {
+    arguments->data++;
+    arguments->length--;
+  }
+
+  if ( arguments->length == 0 )
+  {
+    return false;
+  }
+
+  token->data = arguments->data;
+  space = memchr( arguments->data, ' ', arguments->length );
+
+  if ( space == NULL )
+  {
+    token->length = arguments->length;
+  }
+  else
+  {
+    token->length = space - arguments->data;
+  }
+
+  arguments->data += token->length;
+  arguments->length -= token->length;
+
+  return true;
+}
+
+bool b_token_equals( TokenSlice* token, const char* string )
+{
+  return token->length == strlen( string ) && memcmp( token->data, string, token->length ) == 0;
+}
+
+bool b_token_starts_with( TokenSlice* token, const char* prefix )
+{
+  return token->length >= strlen( prefix ) && memcmp( token->data, prefix, strlen( prefix ) ) == 0;
+}
+
+// leading decimal digits of the token, stops at the first non digit
+uint64_t ul_token_to_number( TokenSlice* token )
+{
+  int i;
+  uint64_t number = 0;
+
+  for ( i = 0; i < token->length && token->data[i] >= '0' && token->data[i] <= '9'; i++ )
+  {
+    number = number * 10 + ( token->data[i] - '0' );
+  }
+
+  return number;
+}
@@ -0,0 +1,285 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// round trip checks for the base64 and base32 codecs against a bit at a
+// time reference, exits non zero if any of them mismatch
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../h/encoding.h"
+
+#define RANDOM_ROUNDS 20000
+#define RANDOM_MAX_LENGTH 1024
+#define STREAM_SPLITS 8
+
+static const char* reference_base64_table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char* reference_base32_table = "abcdefghijklmnopqrstuvwxyz234567";
+
+static int failures = 0;
+
+// unpadded, one output character per width bits
+static int d_reference_encode( char* destination, uint8_t* source, int source_length, const char* table, int width )
+{
+  int i;
+  int length = 0;
+  uint32_t bits = 0;
+  int bit_count = 0;
+
+  for ( i = 0; i < source_length; i++ )
+  {
+    bits = ( bits << 8 ) | source[i];
+    bit_count += 8;
+
+    while ( bit_count >= width )
+    {
+      bit_count -= width;
+      destination[length++] = table[( bits >> bit_count ) & ( ( 1 << width ) - 1 )];
+    }
+
+    bits &= ( 1 << bit_count ) - 1;
+  }
+
+  if ( bit_count != 0 )
+  {
+    destination[length++] = table[( bits << ( width - bit_count ) ) & ( ( 1 << width ) - 1 )];
+  }
+
+  return length;
+}
+
+static uint32_t random_u32()
+{
+  return ( (uint32_t)rand() << 16 ) ^ (uint32_t)rand();
+}
+
+static void v_fail( const char* what, int length )
+{
+  if ( failures < 10 )
+  {
+    fprintf( stderr, "FAIL: %s, input length %d\n", what, length );
+  }
+
+  failures++;
+}
+
+// encode with the codec, check it against the reference, then decode it back
+static void v_check_base64( uint8_t* source, int source_length )
+{
+  int length;
+  char encoded[RANDOM_MAX_LENGTH * 2];
+  char expected[RANDOM_MAX_LENGTH * 2];
+  uint8_t decoded[RANDOM_MAX_LENGTH + 8];
+
+  length = d_reference_encode( expected, source, source_length, reference_base64_table, 6 );
+
+  v_base_64_encode( encoded, source, source_length );
+
+  if ( memcmp( encoded, expected, length ) != 0 )
+  {
+    v_fail( "base64 encode", source_length );
+  }
+
+  if ( d_base_64_decode( decoded, encoded, length ) != source_length || memcmp( decoded, source, source_length ) != 0 )
+  {
+    v_fail( "base64 decode", source_length );
+  }
+}
+
+static void v_check_base32( uint8_t* source, int source_length )
+{
+  int length;
+  char encoded[RANDOM_MAX_LENGTH * 2];
+  char expected[RANDOM_MAX_LENGTH * 2];
+  uint8_t decoded[RANDOM_MAX_LENGTH + 8];
+
+  length = d_reference_encode( expected, source, source_length, reference_base32_table, 5 );
+
+  v_base_32_encode( encoded, source, source_length );
+
+  if ( memcmp( encoded, expected, length ) != 0 )
+  {
+    v_fail( "base32 encode", source_length );
+  }
+
+  v_base_32_decode( decoded, encoded, length );
+
+  if ( memcmp( decoded, source, source_length ) != 0 )
+  {
+    v_fail( "base32 decode", source_length );
+  }
+}
+
+// every 1, 2 and 3 byte input
+static void v_test_exhaustive()
+{
+  int length;
+  uint32_t value;
+  uint8_t source[3];
+
+  for ( length = 1; length <= 3; length++ )
+  {
+    for ( value = 0; value < ( 1u << ( 8 * length ) ); value++ )
+    {
+      source[0] = (uint8_t)value;
+      source[1] = (uint8_t)( value >> 8 );
+      source[2] = (uint8_t)( value >> 16 );
+
+      v_check_base64( source, length );
+      v_check_base32( source, length );
+    }
+  }
+}
+
+// copies source with newlines inserted, every 64 characters like a PEM body
+// and at random spots, returns the new length
+static int d_insert_newlines( char* destination, char* source, int source_length )
+{
+  int i;
+  int length = 0;
+
+  for ( i = 0; i < source_length; i++ )
+  {
+    if ( ( i > 0 && i % 64 == 0 ) || random_u32() % 23 == 0 )
+    {
+      destination[length++] = '\n';
+    }
+
+    destination[length++] = source[i];
+  }
+
+  if ( random_u32() % 2 == 0 )
+  {
+    destination[length++] = '\n';
+  }
+
+  return length;
+}
+
+// decode in chunks cut at random points, the decoder carries partial groups
+static int d_stream_decode( uint8_t* destination, char* source, int source_length )
+{
+  int i;
+  int splits[STREAM_SPLITS + 2];
+  int split_count;
+  int j;
+  int tmp;
+  int length = 0;
+  Base64Decoder decoder;
+
+  split_count = random_u32() % ( STREAM_SPLITS + 1 );
+
+  splits[0] = 0;
+
+  for ( i = 1; i <= split_count; i++ )
+  {
+    splits[i] = source_length == 0 ? 0 : random_u32() % ( source_length + 1 );
+  }
+
+  splits[split_count + 1] = source_length;
+
+  // sort the cut points
+  for ( i = 1; i <= split_count; i++ )
+  {
+    for ( j = i; j > 0 && splits[j - 1] > splits[j]; j-- )
+    {
+      tmp = splits[j];
+      splits[j] = splits[j - 1];
+      splits[j - 1] = tmp;
+    }
+  }
+
+  v_init_base_64_decoder( &decoder );
+
+  for ( i = 0; i <= split_count; i++ )
+  {
+    length += d_base_64_decode_update( &decoder, destination + length, source + splits[i], splits[i + 1] - splits[i] );
+  }
+
+  return length;
+}
+
+static void v_test_random()
+{
+  int i;
+  int j;
+  int length;
+  int source_length;
+  int wrapped_length;
+  uint8_t source[RANDOM_MAX_LENGTH];
+  char encoded[RANDOM_MAX_LENGTH * 2];
+  char wrapped[RANDOM_MAX_LENGTH * 3];
+  uint8_t decoded[RANDOM_MAX_LENGTH + 8];
+
+  for ( i = 0; i < RANDOM_ROUNDS; i++ )
+  {
+    source_length = random_u32() % RANDOM_MAX_LENGTH;
+
+    for ( j = 0; j < source_length; j++ )
+    {
+      source[j] = (uint8_t)random_u32();
+    }
+
+    v_check_base64( source, source_length );
+    v_check_base32( source, source_length );
+
+    length = d_reference_encode( encoded, source, source_length, reference_base64_table, 6 );
+    wrapped_length = d_insert_newlines( wrapped, encoded, length );
+
+    if ( d_base_64_decode( decoded, wrapped, wrapped_length ) != source_length || memcmp( decoded, source, source_length ) != 0 )
+    {
+      v_fail( "base64 decode with newlines", source_length );
+    }
+
+    if ( d_stream_decode( decoded, wrapped, wrapped_length ) != source_length || memcmp( decoded, source, source_length ) != 0 )
+    {
+      v_fail( "base64 streamed decode", source_length );
+    }
+
+    length = d_reference_encode( encoded, source, source_length, reference_base32_table, 5 );
+    wrapped_length = d_insert_newlines( wrapped, encoded, length );
+
+    v_base_32_decode( decoded, wrapped, wrapped_length );
+
+    if ( memcmp( decoded, source, source_length ) != 0 )
+    {
+      v_fail( "base32 decode with newlines", source_length );
+    }
+  }
+}
+
+int main( int argc, char** argv )
+{
+  srand( argc > 1 ? atoi( argv[1] ) : 1 );
+
+  v_test_exhaustive();
+  v_test_random();
+
+  if ( failures != 0 )
+  {
+    fprintf( stderr, "%d failures\n", failures );
+
+    return 1;
+  }
+
+  printf( "encoding round trips passed\n" );
+
+  return 0;
+}
@@ -0,0 +1,272 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// time per scan of the mapped column relay table against the same relays as
+// an array of OnionRelay records, built by make check but not run as a test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../h/constants.h"
+#include "../h/models/relay_table.h"
+
+// about the size of the live consensus
+#define BENCH_RELAYS 8000
+#define BENCH_ROUNDS 2000
+
+#define BENCH_ROWS_FILE "relay_table_bench_rows"
+#define BENCH_TABLE_FILE "relay_table_bench_table"
+
+static double now_seconds()
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void v_report( const char* name, double start )
+{
+  double elapsed = now_seconds() - start;
+
+  printf( "%-30s %8.2f us/scan\n", name, elapsed * 1e6 / BENCH_ROUNDS );
+}
+
+static void v_random_bytes( unsigned char* buffer, int length )
+{
+  int i;
+
+  for ( i = 0; i < length; i++ )
+  {
+    buffer[i] = (unsigned char)rand();
+  }
+}
+
+static int d_write_rows( OnionRelay* relays )
+{
+  int i;
+  FILE* file;
+  uint8_t header[RELAY_TABLE_HEADER_SIZE];
+  uint8_t record[RELAY_RECORD_SIZE];
+
+  file = fopen( BENCH_ROWS_FILE, "wb" );
+
+  if ( file == NULL )
+  {
+    return -1;
+  }
+
+  v_pack_relay_table_header( header, RELAY_TABLE_ROWS, 0, time( NULL ) );
+  fwrite( header, 1, RELAY_TABLE_HEADER_SIZE, file );
+
+  for ( i = 0; i < BENCH_RELAYS; i++ )
+  {
+    v_pack_relay_record( record, &relays[i] );
+    fwrite( record, 1, RELAY_RECORD_SIZE, file );
+  }
+
+  return fclose( file );
+}
+
+// the ring walk, first hsdir whose hash is past the target
+static uint32_t ul_scan_records_ring( OnionRelay* relays, const uint8_t* target )
+{
+  uint32_t i;
+  uint32_t found = BENCH_RELAYS;
+
+  for ( i = 0; i < BENCH_RELAYS; i++ )
+  {
+    if (
+      relays[i].hsdir &&
+      memcmp( relays[i].id_hash, target, H_LENGTH ) > 0 &&
+      ( found == BENCH_RELAYS || memcmp( relays[i].id_hash, relays[found].id_hash, H_LENGTH ) < 0 )
+    )
+    {
+      found = i;
+    }
+  }
+
+  return found;
+}
+
+static uint32_t ul_scan_table_ring( RelayTable* table, const uint8_t* target )
+{
+  uint32_t i;
+  uint32_t found = table->count;
+  const uint8_t* hash;
+
+  for ( i = 0; i < table->count; i++ )
+  {
+    hash = table->id_hashes + (size_t)H_LENGTH * i;
+
+    if (
+      b_relay_table_flag( table, RELAY_FLAG_HSDIR, i ) &&
+      memcmp( hash, target, H_LENGTH ) > 0 &&
+      ( found == table->count || memcmp( hash, table->id_hashes + (size_t)H_LENGTH * found, H_LENGTH ) < 0 )
+    )
+    {
+      found = i;
+    }
+  }
+
+  return found;
+}
+
+// the guard selection weight, flag and bandwidth only
+static uint64_t ull_sum_records_guard_bandwidth( OnionRelay* relays )
+{
+  uint32_t i;
+  uint64_t total = 0;
+
+  for ( i = 0; i < BENCH_RELAYS; i++ )
+  {
+    if ( relays[i].can_guard )
+    {
+      total += relays[i].bandwidth;
+    }
+  }
+
+  return total;
+}
+
+static uint64_t ull_sum_table_guard_bandwidth( RelayTable* table )
+{
+  uint32_t i;
+  uint64_t total = 0;
+  const uint8_t* bandwidth;
+
+  for ( i = 0; i < table->count; i++ )
+  {
+    if ( b_relay_table_flag( table, RELAY_FLAG_CAN_GUARD, i ) )
+    {
+      bandwidth = table->bandwidths + (size_t)4 * i;
+      total += ( (uint32_t)bandwidth[0] << 24 ) | ( (uint32_t)bandwidth[1] << 16 ) | ( (uint32_t)bandwidth[2] << 8 ) | bandwidth[3];
+    }
+  }
+
+  return total;
+}
+
+int main()
+{
+  int i;
+  int ret = 0;
+  double start;
+  uint32_t record_found = 0;
+  uint32_t table_found = 0;
+  uint64_t record_total = 0;
+  uint64_t table_total = 0;
+  uint8_t targets[BENCH_ROUNDS][H_LENGTH];
+  OnionRelay* relays = malloc( sizeof( OnionRelay ) * BENCH_RELAYS );
+  RelayTable table;
+
+  memset( &table, 0, sizeof( RelayTable ) );
+
+  for ( i = 0; i < BENCH_RELAYS; i++ )
+  {
+    memset( &relays[i], 0, sizeof( OnionRelay ) );
+    v_random_bytes( relays[i].identity, ID_LENGTH );
+    v_random_bytes( relays[i].digest, ID_LENGTH );
+    v_random_bytes( relays[i].master_key, H_LENGTH );
+    v_random_bytes( relays[i].ntor_onion_key, H_LENGTH );
+    v_random_bytes( relays[i].id_hash, H_LENGTH );
+    v_random_bytes( relays[i].id_hash_previous, H_LENGTH );
+    relays[i].address = (unsigned int)rand();
+    relays[i].or_port = (uint16_t)rand();
+    relays[i].suitable = true;
+    relays[i].hsdir = rand() % 2;
+    relays[i].can_guard = rand() % 4 == 0;
+    relays[i].bandwidth = (uint32_t)rand() % 100000;
+  }
+
+  for ( i = 0; i < BENCH_ROUNDS; i++ )
+  {
+    v_random_bytes( targets[i], H_LENGTH );
+  }
+
+  if (
+    d_write_rows( relays ) < 0 ||
+    d_write_relay_table( BENCH_ROWS_FILE, BENCH_TABLE_FILE ) < 0 ||
+    d_map_relay_table( &table, BENCH_TABLE_FILE ) < 0
+  )
+  {
+    printf( "Failed to build the relay table\n" );
+
+    ret = 1;
+    goto finish;
+  }
+
+  printf( "%d relays, %zu byte records\n", BENCH_RELAYS, sizeof( OnionRelay ) );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_ROUNDS; i++ )
+  {
+    record_found += ul_scan_records_ring( relays, targets[i] );
+  }
+
+  v_report( "ring scan, records", start );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_ROUNDS; i++ )
+  {
+    table_found += ul_scan_table_ring( &table, targets[i] );
+  }
+
+  v_report( "ring scan, table", start );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_ROUNDS; i++ )
+  {
+    record_total += ull_sum_records_guard_bandwidth( relays );
+  }
+
+  v_report( "guard bandwidth, records", start );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_ROUNDS; i++ )
+  {
+    table_total += ull_sum_table_guard_bandwidth( &table );
+  }
+
+  v_report( "guard bandwidth, table", start );
+
+  // both layouts have to agree or the timings mean nothing
+  if ( record_found != table_found || record_total != table_total )
+  {
+    printf( "Table and records disagree\n" );
+
+    ret = 1;
+  }
+
+finish:
+  v_unmap_relay_table( &table );
+  unlink( BENCH_ROWS_FILE );
+  unlink( BENCH_TABLE_FILE );
+  free( relays );
+
+  return ret;
+}
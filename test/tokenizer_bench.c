@@ -0,0 +1,394 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// parse throughput of a generated consensus and hsdesc intro layer through
+// v_init_memory_tokenizer, built by make check but not run as a test
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../h/constants.h"
+#include "../h/encoding.h"
+#include "../h/tokenizer.h"
+#include "../h/consensus_parser.h"
+
+// about the size of the live consensus
+#define BENCH_RELAYS 8000
+#define BENCH_CONSENSUS_ROUNDS 50
+#define BENCH_INTRO_POINTS 20
+#define BENCH_INTRO_ROUNDS 20000
+
+// the intro layer keywords from onion_client.c, that parser verifies certs
+// and decrypts inside the circuit handler so only its tokenizing runs here
+enum
+{
+  INTRO_KEYWORD_INTRODUCTION_POINT,
+  INTRO_KEYWORD_ONION_KEY,
+  INTRO_KEYWORD_AUTH_KEY,
+  INTRO_KEYWORD_ENC_KEY,
+  INTRO_KEYWORD_ENC_KEY_CERT,
+  INTRO_KEYWORD_COUNT,
+};
+
+static const char* intro_keywords[] = {
+  "introduction-point",
+  "onion-key",
+  "auth-key",
+  "enc-key",
+  "enc-key-cert",
+};
+
+static double now_seconds()
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void v_report( const char* name, double start, int length, int rounds, int items, const char* item_name )
+{
+  double elapsed = now_seconds() - start;
+
+  printf( "%-18s %8.1f MB/s %10.0f %s/s\n", name, (double)length * rounds / elapsed / ( 1024 * 1024 ), (double)items * rounds / elapsed, item_name );
+}
+
+static char* pc_append( char* cursor, const char* format, ... )
+{
+  va_list args;
+
+  va_start( args, format );
+  cursor += vsprintf( cursor, format, args );
+  va_end( args );
+
+  return cursor;
+}
+
+// random bytes, unpadded like the consensus and descriptor keys
+static char* pc_append_base_64( char* cursor, int length )
+{
+  int i;
+  unsigned char bytes[128];
+
+  for ( i = 0; i < length; i++ )
+  {
+    bytes[i] = (unsigned char)rand();
+  }
+
+  v_base_64_encode( cursor, bytes, length );
+  cursor += ( length * 8 + 5 ) / 6;
+  *cursor = 0;
+
+  return cursor;
+}
+
+// a 104 byte cert object wrapped at 64 columns like the real ones
+static char* pc_append_cert( char* cursor )
+{
+  int i;
+  int length;
+  char encoded[160];
+
+  length = pc_append_base_64( encoded, 104 ) - encoded;
+  cursor = pc_append( cursor, "-----BEGIN ED25519 CERT-----\n" );
+
+  for ( i = 0; i < length; i += 64 )
+  {
+    cursor = pc_append( cursor, "%.64s\n", encoded + i );
+  }
+
+  return pc_append( cursor, "-----END ED25519 CERT-----\n" );
+}
+
+// same line mix as a current consensus, v and a lines are skipped by the
+// parser but still have to be tokenized
+static int d_generate_consensus( char* consensus, int* hsdir_count )
+{
+  int i;
+  char* cursor = consensus;
+
+  *hsdir_count = 0;
+
+  cursor = pc_append( cursor,
+    "network-status-version 3\n"
+    "vote-status consensus\n"
+    "consensus-method 33\n"
+    "valid-after 2026-10-19 12:00:00\n"
+    "fresh-until 2026-10-19 13:00:00\n"
+    "valid-until 2026-10-19 15:00:00\n"
+    "voting-delay 300 300\n"
+    "known-flags Authority BadExit Exit Fast Guard HSDir MiddleOnly NoEdConsensus Running Stable StaleDesc Sybil V2Dir Valid\n"
+    "params CircuitPriorityHalflifeMsec=30000 DoSCircuitCreationEnabled=1 DoSConnectionEnabled=1 hsdir_spread_store=4\n"
+  );
+
+  cursor = pc_append( cursor, "shared-rand-previous-value 9 " );
+  cursor = pc_append_base_64( cursor, 32 );
+  cursor = pc_append( cursor, "\nshared-rand-current-value 9 " );
+  cursor = pc_append_base_64( cursor, 32 );
+  cursor = pc_append( cursor, "\n" );
+
+  for ( i = 0; i < 9; i++ )
+  {
+    cursor = pc_append( cursor, "dir-source auth%d 0000000000000000000000000000000000000000 10.0.0.%d 10.0.0.%d 80 443\n", i, i, i );
+    cursor = pc_append( cursor, "contact auth%d <auth%d@example.org>\n", i, i );
+    cursor = pc_append( cursor, "vote-digest 0000000000000000000000000000000000000000\n" );
+  }
+
+  for ( i = 0; i < BENCH_RELAYS; i++ )
+  {
+    cursor = pc_append( cursor, "r relay%d ", i );
+    cursor = pc_append_base_64( cursor, ID_LENGTH );
+    cursor = pc_append( cursor, " " );
+    cursor = pc_append_base_64( cursor, ID_LENGTH );
+    cursor = pc_append( cursor, " 2026-10-19 11:%02d:%02d %d.%d.%d.%d 9001 %d\n", i % 60, i % 60, 10 + i % 200, i % 256, ( i / 256 ) % 256, 1 + i % 250, i % 3 == 0 ? 9030 : 0 );
+
+    if ( i % 4 == 0 )
+    {
+      cursor = pc_append( cursor, "a [2001:db8::%x]:9001\n", i );
+    }
+
+    if ( i % 2 == 0 )
+    {
+      cursor = pc_append( cursor, "s Fast Guard HSDir Running Stable V2Dir Valid\n" );
+      ( *hsdir_count )++;
+    }
+    else
+    {
+      cursor = pc_append( cursor, "s Exit Fast Running Stable Valid\n" );
+    }
+
+    cursor = pc_append( cursor,
+      "v Tor 0.4.8.12\n"
+      "pr Conflux=1 Cons=1-2 Desc=1-2 DirCache=2 FlowCtrl=1-2 HSDir=2 HSIntro=4-5 HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Padding=2 Relay=1-4\n"
+      "w Bandwidth=%d\n",
+      1 + rand() % 100000
+    );
+  }
+
+  cursor = pc_append( cursor,
+    "directory-footer\n"
+    "bandwidth-weights Wbd=0 Wbe=0 Wbg=4142 Wbm=10000 Wdb=10000 Web=10000 Wed=10000 Wee=10000 Weg=10000 Wem=10000 Wgb=10000 Wgd=0 Wgg=5858 Wgm=5858 Wmb=10000 Wmd=0 Wme=0 Wmg=4142 Wmm=10000\n"
+    "directory-signature sha256 0000000000000000000000000000000000000000 0000000000000000000000000000000000000000\n"
+  );
+  cursor = pc_append_cert( cursor );
+
+  return cursor - consensus;
+}
+
+static char* pc_generate_intro_layer( int* length )
+{
+  int i;
+  char* layer = malloc( BENCH_INTRO_POINTS * 1024 + 64 );
+  char* cursor = layer;
+
+  cursor = pc_append( cursor, "create2-formats 2\n" );
+
+  for ( i = 0; i < BENCH_INTRO_POINTS; i++ )
+  {
+    cursor = pc_append( cursor, "introduction-point " );
+    cursor = pc_append_base_64( cursor, 67 );
+    cursor = pc_append( cursor, "\nonion-key ntor " );
+    cursor = pc_append_base_64( cursor, 32 );
+    cursor = pc_append( cursor, "\nauth-key\n" );
+    cursor = pc_append_cert( cursor );
+    cursor = pc_append( cursor, "enc-key ntor " );
+    cursor = pc_append_base_64( cursor, 32 );
+    cursor = pc_append( cursor, "\nenc-key-cert\n" );
+    cursor = pc_append_cert( cursor );
+  }
+
+  *length = cursor - layer;
+
+  return layer;
+}
+
+// the consensus download loop minus the relay hand off
+static int d_parse_consensus( KeywordTable* consensus_table, const char* consensus, int length, int* hsdir_count )
+{
+  int keyword;
+  int relay_count = 0;
+  int finished_consensus = 0;
+  LineTokenizer tokenizer;
+  TokenSlice line;
+  TokenSlice arguments;
+  NetworkConsensus network_consensus;
+  OnionRelay parse_relay;
+
+  memset( &network_consensus, 0, sizeof( NetworkConsensus ) );
+  memset( &parse_relay, 0, sizeof( OnionRelay ) );
+  *hsdir_count = 0;
+
+  v_init_memory_tokenizer( &tokenizer, consensus, length );
+
+  while ( d_next_line( &tokenizer, &line ) == 1 )
+  {
+    keyword = d_match_keyword( consensus_table, &line, &arguments );
+
+    if ( finished_consensus == 0 && d_parse_line_to_consensus( &network_consensus, keyword, &arguments ) == 1 )
+    {
+      finished_consensus = 1;
+    }
+    else if ( finished_consensus == 1 && keyword == CONSENSUS_KEYWORD_BANDWIDTH_WEIGHTS )
+    {
+      v_parse_bandwidth_weights( &network_consensus.bandwidth_weights, &arguments );
+    }
+    else if ( finished_consensus == 1 && d_parse_line_to_relay( &parse_relay, keyword, &arguments ) == 1 )
+    {
+      relay_count++;
+
+      if ( parse_relay.hsdir == 1 )
+      {
+        ( *hsdir_count )++;
+      }
+
+      memset( &parse_relay, 0, sizeof( OnionRelay ) );
+    }
+  }
+
+  if ( network_consensus.valid_until == 0 || network_consensus.bandwidth_weights.wgg != 5858 )
+  {
+    return -1;
+  }
+
+  return relay_count;
+}
+
+// the intro layer loop minus the cert checks and key imports, the cert is
+// still base64 decoded since that's where its bytes go
+static int d_parse_intro_layer( KeywordTable* intro_table, const char* layer, int length )
+{
+  int keyword;
+  int intro_count = 0;
+  uint8_t key[H_LENGTH + 2];
+  uint8_t cert[256];
+  LineTokenizer tokenizer;
+  TokenSlice line;
+  TokenSlice arguments;
+  TokenSlice object;
+  TokenSlice key_type;
+  TokenSlice key_token;
+
+  v_init_memory_tokenizer( &tokenizer, layer, length );
+
+  while ( d_next_line( &tokenizer, &line ) == 1 )
+  {
+    keyword = d_match_keyword( intro_table, &line, &arguments );
+
+    switch ( keyword )
+    {
+      case INTRO_KEYWORD_ONION_KEY:
+      case INTRO_KEYWORD_ENC_KEY:
+        if ( b_next_token( &arguments, &key_type ) && b_token_equals( &key_type, "ntor" ) && b_next_token( &arguments, &key_token ) && key_token.length >= 43 )
+        {
+          d_base_64_decode( key, (char*)key_token.data, 43 );
+        }
+
+        break;
+      case INTRO_KEYWORD_AUTH_KEY:
+      case INTRO_KEYWORD_ENC_KEY_CERT:
+        if ( d_next_object( &tokenizer, &object ) < 0 || object.length * 3 / 4 > sizeof( cert ) )
+        {
+          return -1;
+        }
+
+        d_base_64_decode( cert, (char*)object.data, object.length );
+
+        // the enc-key-cert closes out the intro point
+        if ( keyword == INTRO_KEYWORD_ENC_KEY_CERT )
+        {
+          intro_count++;
+        }
+
+        break;
+      default:
+        break;
+    }
+  }
+
+  return intro_count;
+}
+
+int main()
+{
+  int i;
+  int ret = 0;
+  int consensus_length;
+  int intro_length;
+  int expected_hsdirs;
+  int hsdir_count;
+  int relay_count = 0;
+  int intro_count = 0;
+  double start;
+  char* consensus = malloc( BENCH_RELAYS * 512 + 8192 );
+  char* intro_layer;
+  KeywordTable consensus_table;
+  KeywordTable intro_table;
+
+  consensus_length = d_generate_consensus( consensus, &expected_hsdirs );
+  intro_layer = pc_generate_intro_layer( &intro_length );
+
+  if (
+    d_init_consensus_keyword_table( &consensus_table ) < 0 ||
+    d_init_keyword_table( &intro_table, intro_keywords, INTRO_KEYWORD_COUNT ) < 0
+  )
+  {
+    printf( "Failed to build the keyword tables\n" );
+
+    ret = 1;
+    goto finish;
+  }
+
+  printf( "consensus %d bytes, %d relays, intro layer %d bytes\n", consensus_length, BENCH_RELAYS, intro_length );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_CONSENSUS_ROUNDS; i++ )
+  {
+    relay_count = d_parse_consensus( &consensus_table, consensus, consensus_length, &hsdir_count );
+  }
+
+  v_report( "consensus", start, consensus_length, BENCH_CONSENSUS_ROUNDS, BENCH_RELAYS, "relays" );
+
+  start = now_seconds();
+
+  for ( i = 0; i < BENCH_INTRO_ROUNDS; i++ )
+  {
+    intro_count = d_parse_intro_layer( &intro_table, intro_layer, intro_length );
+  }
+
+  v_report( "hsdesc intro layer", start, intro_length, BENCH_INTRO_ROUNDS, BENCH_INTRO_POINTS, "intro points" );
+
+  // a parser that skipped lines would look fast
+  if ( relay_count != BENCH_RELAYS || hsdir_count != expected_hsdirs || intro_count != BENCH_INTRO_POINTS )
+  {
+    printf( "Parsed %d relays, %d hsdirs, %d intro points\n", relay_count, hsdir_count, intro_count );
+
+    ret = 1;
+  }
+
+finish:
+  free( consensus );
+  free( intro_layer );
+
+  return ret;
+}